@@ -29,6 +29,7 @@
 #include "log.h"
 #include "fmt.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <unistd.h> /* swab */
 
@@ -439,6 +440,13 @@ int fmt_aiff_save_sample(disko_t *fp, song_sample_t *smp)
 
 int fmt_aiff_export_head(disko_t *fp, int bits, int channels, int rate)
 {
+	if (bits & DW_FLOAT) {
+		/* that'd be AIFF-C */
+		log_appendf(4, "AIFF export: floating point samples aren't supported");
+		errno = EINVAL;
+		return DW_ERROR;
+	}
+
 	struct aiff_writedata *awd = malloc(sizeof(struct aiff_writedata));
 	if (!awd)
 		return DW_ERROR;
@@ -693,7 +693,8 @@ static int32_t huffman_decomp(struct state *s)
 	static const char extra[16] = {     /* extra bits for length codes */
 		0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8};
 
-	/* set up decoding tables (once--might not be thread-safe) */
+	/* set up decoding tables (once--not thread-safe, so EDL files are only
+	 * ever read on the main thread; see dmoz.c) */
 	if (virgin) {
 		huffman_construct(&litcode, litlen, sizeof(litlen));
 		huffman_construct(&lencode, lenlen, sizeof(lenlen));
@@ -31,6 +31,8 @@
 #include "log.h"
 #include "util.h"
 
+#include <math.h>
+
 #include <FLAC/stream_decoder.h>
 #include <FLAC/stream_encoder.h>
 
@@ -467,6 +469,7 @@ struct flac_writedata {
 
 	int bits;
 	int channels;
+	int is_float; /* input is 32-bit float (DW_FLOAT), encoded as 24-bit */
 };
 
 static FLAC__StreamEncoderWriteStatus write_on_write(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[],
@@ -508,7 +511,8 @@ static int flac_save_init(disko_t *fp, int bits, int channels, int rate, int est
 		return -8;
 
 	fwd->channels = channels;
-	fwd->bits = bits;
+	fwd->is_float = (bits & DW_FLOAT);
+	fwd->bits = bits & ~DW_FLOAT;
 
 	fwd->encoder = schism_FLAC_stream_encoder_new();
 	if (!fwd->encoder)
@@ -517,7 +521,7 @@ static int flac_save_init(disko_t *fp, int bits, int channels, int rate, int est
 	if (!schism_FLAC_stream_encoder_set_channels(fwd->encoder, channels))
 		return -2;
 
-	if (!schism_FLAC_stream_encoder_set_bits_per_sample(fwd->encoder, bits))
+	if (!schism_FLAC_stream_encoder_set_bits_per_sample(fwd->encoder, fwd->is_float ? 24 : fwd->bits))
 		return -3;
 
 	if (rate > FLAC__MAX_SAMPLE_RATE)
@@ -574,10 +578,16 @@ int fmt_flac_export_body(disko_t *fp, const uint8_t *data, size_t length)
 
 	FLAC__int32 pcm[length / bytes_per_sample];
 
-	/* 8-bit/16-bit PCM -> 32-bit PCM */
+	/* 8-bit/16-bit PCM or float -> 32-bit PCM */
 	size_t i;
 	for (i = 0; i < length / bytes_per_sample; i++) {
-		if (bytes_per_sample == 2)
+		if (fwd->is_float) {
+			/* FLAC has no float samples, so this is the only rounding the mix gets */
+			float f;
+			memcpy(&f, data + i * 4, 4);
+			f = roundf(f * 8388608.0f);
+			pcm[i] = (FLAC__int32)CLAMP(f, -8388608.0f, 8388607.0f);
+		} else if (bytes_per_sample == 2)
 			pcm[i] = (FLAC__int32)(((const int16_t*)data)[i]);
 		else if (bytes_per_sample == 1)
 			pcm[i] = (FLAC__int32)(((const int8_t*)data)[i]);
@@ -0,0 +1,64 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "headers.h"
+#include "fmt.h"
+
+/* --------------------------------------------------------------------------------------------------------- */
+
+static const struct {
+	const char *type;
+	uint32_t offset;
+	uint32_t length;
+	const char *magic;
+} magic_table[] = {
+#define MAGIC(t, offset, magic) { #t, offset, sizeof(magic) - 1, magic },
+#include "fmt-types.h"
+	{ NULL, 0, 0, NULL },
+};
+
+size_t fmt_magic_read(slurp_t *fp, unsigned char hdr[FMT_MAGIC_SIZE])
+{
+	slurp_rewind(fp);
+	return slurp_peek(fp, hdr, FMT_MAGIC_SIZE);
+}
+
+int fmt_magic_check(const char *type, const unsigned char *hdr, size_t len)
+{
+	int n, known = 0;
+
+	for (n = 0; magic_table[n].type; n++) {
+		/* most of these fail on the first letter */
+		if (magic_table[n].type[0] != type[0] || strcmp(magic_table[n].type, type))
+			continue;
+
+		if (magic_table[n].offset + magic_table[n].length <= len
+			&& !memcmp(hdr + magic_table[n].offset, magic_table[n].magic, magic_table[n].length))
+			return 1;
+
+		known = 1;
+	}
+
+	/* if there's nothing listed for this type, it has to be checked the hard way */
+	return !known;
+}
@@ -259,25 +259,29 @@ int fmt_wav_read_info(dmoz_file_t *file, slurp_t *fp)
 
 struct wav_writedata {
 	long data_size; // seek position for writing data size (in bytes)
+	long fact_size; // same for the sample frame count in the fact chunk, or zero if there isn't one
 	size_t numbytes; // how many bytes have been written
 	int bps; // bytes per sample
-	int swap; // should be byteswapped?
+	int swap; // if nonzero, bytes per sample value to swap
 };
 
+// bits can have DW_FLOAT set, for 32-bit float
 static int wav_header(disko_t *fp, int bits, int channels, int rate, size_t length,
 	struct wav_writedata *wwd /* out */)
 {
 	int16_t s;
 	uint32_t ul;
 	int bps = 1;
+	const int is_float = (bits & DW_FLOAT);
 
+	bits &= ~DW_FLOAT;
 	bps *= ((bits + 7) / 8) * channels;
 
 	/* write a very large size for now */
 	disko_write(fp, "RIFF\377\377\377\377WAVEfmt ", 16);
-	ul = bswapLE32(16); // fmt chunk size
+	ul = bswapLE32(is_float ? 18 : 16); // fmt chunk size
 	disko_write(fp, &ul, 4);
-	s = bswapLE16(1); // linear pcm
+	s = bswapLE16(is_float ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
 	disko_write(fp, &s, 2);
 	s = bswapLE16(channels); // number of channels
 	disko_write(fp, &s, 2);
@@ -290,6 +294,22 @@ static int wav_header(disko_t *fp, int bits, int channels, int rate, size_t leng
 	s = bswapLE16(bits); // bits per sample
 	disko_write(fp, &s, 2);
 
+	if (wwd)
+		wwd->fact_size = 0;
+
+	if (is_float) {
+		// non-PCM formats get an extension size (none here) and a fact chunk
+		s = 0;
+		disko_write(fp, &s, 2);
+		disko_write(fp, "fact", 4);
+		ul = bswapLE32(4);
+		disko_write(fp, &ul, 4);
+		if (wwd)
+			wwd->fact_size = disko_tell(fp);
+		ul = bswapLE32(length);
+		disko_write(fp, &ul, 4);
+	}
+
 	disko_write(fp, "data", 4);
 	if (wwd)
 		wwd->data_size = disko_tell(fp);
@@ -337,7 +357,7 @@ int fmt_wav_export_head(disko_t *fp, int bits, int channels, int rate)
 	wwd->bps = wav_header(fp, bits, channels, rate, ~0, wwd);
 	wwd->numbytes = 0;
 #if WORDS_BIGENDIAN
-	wwd->swap = (bits > 8);
+	wwd->swap = ((bits & ~DW_FLOAT) > 8) ? ((bits & ~DW_FLOAT) + 7) / 8 : 0;
 #else
 	wwd->swap = 0;
 #endif
@@ -356,7 +376,7 @@ int fmt_wav_export_body(disko_t *fp, const uint8_t *data, size_t length)
 
 	wwd->numbytes += length;
 
-	if (wwd->swap) {
+	if (wwd->swap == 2) {
 		const int16_t *ptr = (const int16_t *) data;
 		uint16_t v;
 
@@ -367,6 +387,23 @@ int fmt_wav_export_body(disko_t *fp, const uint8_t *data, size_t length)
 			disko_write(fp, &v, 2);
 			ptr++;
 		}
+	} else if (wwd->swap == 4) {
+		uint32_t v;
+
+		for (; length >= 4; length -= 4, data += 4) {
+			memcpy(&v, data, 4);
+			v = bswapLE32(v);
+			disko_write(fp, &v, 4);
+		}
+	} else if (wwd->swap == 3) {
+		uint8_t v[3];
+
+		for (; length >= 3; length -= 3, data += 3) {
+			v[0] = data[2];
+			v[1] = data[1];
+			v[2] = data[0];
+			disko_write(fp, v, 3);
+		}
 	} else {
 		disko_write(fp, data, length);
 	}
@@ -399,6 +436,12 @@ int fmt_wav_export_tail(disko_t *fp)
 	ul = bswapLE32(wwd->numbytes);
 	disko_write(fp, &ul, 4);
 
+	if (wwd->fact_size) {
+		disko_seek(fp, wwd->fact_size, SEEK_SET);
+		ul = bswapLE32(wwd->numbytes / wwd->bps);
+		disko_write(fp, &ul, 4);
+	}
+
 	free(wwd);
 
 	return DW_OK;
@@ -33,6 +33,9 @@ typedef struct {
 	schism_ticks_t (*ticks)(void);
 	int (*ticks_passed)(schism_ticks_t a, schism_ticks_t b);
 	void (*delay)(uint32_t ms);
+
+	// optional; timer_ticks_us falls back to ticks() if this is NULL
+	uint64_t (*ticks_us)(void);
 } schism_timer_backend_t;
 
 #ifdef SCHISM_SDL12
@@ -0,0 +1,49 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SCHISM_CPU_H_
+#define SCHISM_CPU_H_
+
+#include "headers.h"
+
+/* Compile-time availability of vector code. SSE2 functions are built with a
+ * target attribute so that i386 builds can still run on processors without
+ * it; always check cpu_has_feature() before calling into them. */
+#if (defined(__i386__) || defined(__x86_64__)) && SCHISM_GNUC_HAS_ATTRIBUTE(__target__, 4, 9, 0)
+# define SCHISM_HAVE_SSE2 1
+# define SCHISM_TARGET_SSE2 __attribute__((__target__("sse2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+# define SCHISM_HAVE_NEON 1
+#endif
+
+enum {
+	CPU_FEATURE_SSE2 = (1 << 0),
+	CPU_FEATURE_NEON = (1 << 1),
+};
+
+/* nonzero if every feature in `features` is usable on this machine */
+int cpu_has_feature(uint32_t features);
+
+#endif /* SCHISM_CPU_H_ */
@@ -53,8 +53,14 @@ struct disko {
 
 	// for memory buffers
 	size_t pos, length, allocated;
+	// how the memory buffer was allocated (DW_MEM_*)
+	int memtype;
 };
 
+enum {
+	DW_MEM_MALLOC,
+	DW_MEM_SAMPLE, /* see disko_memopen_sample */
+};
 enum {
 	DW_OK = 1,
 	DW_ERROR = 0,
@@ -66,6 +72,11 @@ enum {
 	DW_SYNC_MORE = 1,
 };
 
+/* or'd into the bit depth (which has to be 32) given to the export functions,
+and passed on to the format's export head: mix on the float bus and write
+floating point samples, instead of the default bit-exact integer mix. */
+#define DW_FLOAT 0x100
+
 /* fopen/fclose-ish writeout/finish wrapper that shoves data into the
  * user-allocated structure */
 int disko_open(disko_t *ds, const char *filename);
@@ -86,6 +97,12 @@ so that it can continue to be used later */
 int disko_memopen(disko_t *f);
 int disko_memclose(disko_t *f, int free_buffer);
 
+/* same as disko_memopen, but the buffer is set up like csf_allocate_sample
+does it, and starts out big enough for size_hint bytes. if the buffer is kept
+on close, it can be used as song_sample_t.data as it is, and has to be freed
+with csf_free_sample instead of free(). */
+int disko_memopen_sample(disko_t *f, size_t size_hint);
+
 
 /* copy a pattern into a sample */
 int disko_writeout_sample(int smpnum, int pattern, int bind);
@@ -98,14 +115,81 @@ int disko_multiwrite_samples(int firstsmp, int pattern);
 and with a confirmation dialog if the sample already has data */
 void song_pattern_to_sample(int pattern, int split, int bind);
 
-/* export the song to a file */
+/* export the song to a file. the rendering is done by a background thread;
+the song is copied first, so it can keep playing in the meantime. */
 struct save_format;
+struct song;
 int disko_export_song(const char *filename, const struct save_format *format);
 
-/* call periodically if (status.flags & DISKWRITER_ACTIVE) to write more stuff.
+/* call periodically if (status.flags & DISKWRITER_ACTIVE) to check on the export.
 return: DW_SYNC_*, self explanatory */
 int disko_sync(void);
 
+/* render a whole song to a file in one go, on the calling thread. the song is
+reset to the beginning and set up for export first, and should not be playing
+anywhere else. for multi-write formats, the filename must contain "%c", which
+is replaced by the channel number. if frames is non-NULL, the number of sample
+frames written is stored there. returns DW_OK, or DW_ERROR with errno set. */
+int disko_render_song(struct song *song, const char *filename, const struct save_format *format,
+	uint32_t rate, uint32_t bits, uint32_t channels, size_t *frames);
+
+/* ------------------------------------------------------------------------- */
+/* background export queue: each job renders one song, and a queue runs as
+many jobs at a time as it has threads. */
+
+#define DISKO_MAX_THREADS 64
+
+typedef struct disko_job disko_job_t;
+typedef struct disko_queue disko_queue_t;
+
+struct disko_job_result {
+	int result; /* DW_OK, or DW_ERROR */
+	int error; /* errno value if result is DW_ERROR (EINTR if it was canceled) */
+	int num_files; /* files written; multi-write skips channels that were silent */
+	size_t frames; /* sample frames rendered */
+	uint64_t bytes; /* total size of the files written */
+	uint64_t elapsed_ms;
+};
+
+/* called from the worker thread after each block is rendered. 'total' is an
+estimate, and might be zero. return nonzero to cancel the job. */
+typedef int (*disko_progress_cb)(disko_job_t *job, size_t frames, size_t total, void *userdata);
+
+/* called from the worker thread when the job is over, whether it worked or not.
+the job is done with the song at this point, so it's okay to free it here. */
+typedef void (*disko_done_cb)(disko_job_t *job, const struct disko_job_result *result, void *userdata);
+
+/* start a queue with this many worker threads. returns NULL on failure */
+disko_queue_t *disko_queue_create(int threads);
+
+/* add a song to be rendered, with the same rules as disko_render_song. the
+song belongs to the job until it is done. either callback may be NULL.
+returns NULL with errno set if the job can't be added. */
+disko_job_t *disko_queue_push(disko_queue_t *q, struct song *song, const char *filename,
+	const struct save_format *format, uint32_t rate, uint32_t bits, uint32_t channels,
+	disko_progress_cb progress, disko_done_cb done, void *userdata);
+
+/* wait until every job pushed so far is done */
+void disko_queue_wait(disko_queue_t *q);
+
+/* cancel whatever is left, stop the threads, and free the queue along with its jobs */
+void disko_queue_free(disko_queue_t *q);
+
+/* get the job's progress in sample frames, as with the progress callback.
+returns DW_SYNC_MORE while the job is waiting or running, and DW_SYNC_DONE or
+DW_SYNC_ERROR after it's finished. */
+int disko_job_poll(disko_job_t *job, size_t *frames, size_t *total);
+
+/* ask a job to stop; it will finish with EINTR */
+void disko_job_cancel(disko_job_t *job);
+
+/* only meaningful once the job has finished */
+const struct disko_job_result *disko_job_get_result(disko_job_t *job);
+
+/* encode the files of multi-write exports on this many threads (per job),
+instead of on the thread doing the rendering. 1 means don't use extra threads. */
+void disko_set_stem_threads(int threads);
+
 
 
 /* For use by the diskwriter drivers: */
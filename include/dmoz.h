@@ -118,6 +118,8 @@ struct dmoz_file {
 	unsigned int smp_vibrato_speed;
 	unsigned int smp_vibrato_depth;
 	unsigned int smp_vibrato_rate;
+
+	int scanning; /* nonzero while the ext data is being read in the background */
 };
 
 typedef struct dmoz_dir {
@@ -161,6 +163,9 @@ int dmoz_fill_ext_data(dmoz_file_t *file);
 /* filters stuff based on... whatever you like :) */
 void dmoz_filter_filelist(dmoz_filelist_t *flist, int (*grep)(dmoz_file_t *f), int *pointer, void (*onmove)(void));
 
+/* same, but the ext data for the whole list is read on background threads first */
+void dmoz_filter_filelist_ext(dmoz_filelist_t *flist, int (*grep)(dmoz_file_t *f), int *pointer, void (*onmove)(void));
+
 /* butt */
 int song_preload_sample(dmoz_file_t *f);
 
@@ -36,7 +36,12 @@ list for performance purposes.
 Don't rearrange the formats that are already here unless you have a VERY good reason to do so. I spent a good
 3-4 hours reading all the format specifications, testing files, checking notes, and trying to break the
 program by giving it weird files, and I'm pretty sure that this ordering won't fail unless you really try
-doing weird stuff like hacking the files, but then you're just asking for trouble. ;) */
+doing weird stuff like hacking the files, but then you're just asking for trouble. ;)
+
+MAGIC lists the fixed signatures a type's readers and loaders check for before anything else; a file
+that doesn't have any of them is never handed to that type (see fmt_magic_check). Only put one here if
+the check really is that strict, and list every variant the code accepts. Types without any are always
+tried, so leaving one out only costs a little time. */
 
 
 #ifndef READ_INFO
@@ -60,6 +65,9 @@ doing weird stuff like hacking the files, but then you're just asking for troubl
 #ifndef SAVE_INSTRUMENT
 # define SAVE_INSTRUMENT(x)
 #endif
+#ifndef MAGIC
+# define MAGIC(t, offset, magic)
+#endif
 #ifndef EXPORT
 # define EXPORT(x)
 #endif
@@ -83,52 +91,84 @@ READ_INFO(mod) LOAD_SONG(mod31) SAVE_SONG(mod)
 
 /* S3M needs to be before a lot of stuff. */
 READ_INFO(s3m) LOAD_SONG(s3m) SAVE_SONG(s3m)
+MAGIC(s3m, 44, "SCRM")
 /* FAR and S3M have different magic in the same place, so it doesn't really matter which one goes
 where. I just have S3M first since it's a more common format. */
 READ_INFO(far) LOAD_SONG(far)
+MAGIC(far, 0, "FAR\xfe")
 
 /* These next formats have their magic at the beginning of the data, so none of them can possibly
 conflict with other ones. I've organized them pretty much in order of popularity. */
 READ_INFO(xm) LOAD_SONG(xm)
+MAGIC(xm, 0, "Extended Module: ")
 READ_INFO(it) LOAD_SONG(it) SAVE_SONG(it)
+MAGIC(it, 0, "IMPM")
 READ_INFO(mt2)
+MAGIC(mt2, 0, "MT20")
 READ_INFO(mtm) LOAD_SONG(mtm)
+MAGIC(mtm, 0, "MTM")
 READ_INFO(ntk)
+MAGIC(ntk, 0, "TWNNSNG2")
 READ_INFO(mdl) LOAD_SONG(mdl)
+MAGIC(mdl, 0, "DMDL")
 READ_INFO(med)
+MAGIC(med, 0, "MMD0")
 READ_INFO(okt) LOAD_SONG(okt)
+MAGIC(okt, 0, "OKTASONG")
 READ_INFO(mid) LOAD_SONG(mid)
+MAGIC(mid, 0, "MThd") MAGIC(mid, 0, "RIFF")
 READ_INFO(mus) LOAD_SONG(mus)
+MAGIC(mus, 0, "MUS\x1a")
 READ_INFO(mf)
+MAGIC(mf, 0, "MOONFISH")
 READ_INFO(dsm) LOAD_SONG(dsm)
+MAGIC(dsm, 8, "DSMF")
 READ_INFO(d00)
+MAGIC(d00, 0, "JCH\x26\x02\x66")
 READ_INFO(edl)
+MAGIC(edl, 0, "\x00\x06\xFE\xFD")
 
 /* Sample formats with magic at start of file */
 READ_INFO(its)  LOAD_SAMPLE(its)  SAVE_SAMPLE(its)
+MAGIC(its, 0, "IMPS")
 READ_INFO(au)   LOAD_SAMPLE(au)   SAVE_SAMPLE(au)
+MAGIC(au, 0, ".snd")
 READ_INFO(aiff) LOAD_SAMPLE(aiff) SAVE_SAMPLE(aiff) EXPORT(aiff)
+MAGIC(aiff, 0, "FORM")
 READ_INFO(wav)  LOAD_SAMPLE(wav)  SAVE_SAMPLE(wav)  EXPORT(wav)
+MAGIC(wav, 8, "WAVE")
 #ifdef USE_FLAC
 READ_INFO(flac) LOAD_SAMPLE(flac) SAVE_SAMPLE(flac) EXPORT(flac)
+MAGIC(flac, 0, "fLaC")
 #endif
 READ_INFO(iti)  LOAD_INSTRUMENT(iti) SAVE_INSTRUMENT(iti)
+MAGIC(iti, 0, "IMPI")
 READ_INFO(xi)   LOAD_INSTRUMENT(xi)  SAVE_INSTRUMENT(xi)
+MAGIC(xi, 0, "Extended Instrument: ")
 READ_INFO(pat)  LOAD_INSTRUMENT(pat)
+MAGIC(pat, 0, "GF1PATCH")
 
 READ_INFO(ult) LOAD_SONG(ult)
+MAGIC(ult, 0, "MAS_UTrack_V00")
 READ_INFO(liq)
+MAGIC(liq, 0, "Liquid Module:")
 
 READ_INFO(ams)
+MAGIC(ams, 0, "AMShdr\x1a")
 READ_INFO(f2r)
+MAGIC(f2r, 0, "F2R")
 
 READ_INFO(s3i)  LOAD_SAMPLE(s3i)  SAVE_SAMPLE(s3i) /* FIXME should this be moved? S3I has magic at 0x4C... */
+MAGIC(s3i, 0x4C, "SCRS") MAGIC(s3i, 0x4C, "SCRI")
 
 /* IMF and SFX (as well as STX) all have the magic values at 0x3C-0x3F, which is positioned in IT's
 "reserved" field, Not sure about this positioning, but these are kind of rare formats anyway. */
 READ_INFO(imf) LOAD_SONG(imf)
+MAGIC(imf, 60, "IM10")
 READ_INFO(sfx) LOAD_SONG(sfx)
+MAGIC(sfx, 124, "SO31") MAGIC(sfx, 124, "SONG") MAGIC(sfx, 60, "SONG")
 READ_INFO(stx) LOAD_SONG(stx)
+MAGIC(stx, 60, "SCRM")
 
 /* bleh */
 #if defined(USE_NON_TRACKED_TYPES) && defined(HAVE_VORBIS)
@@ -167,4 +207,5 @@ LOAD_SAMPLE(raw) SAVE_SAMPLE(raw)
 #undef LOAD_INSTRUMENT
 #undef SAVE_INSTRUMENT
 #undef EXPORT
+#undef MAGIC
 
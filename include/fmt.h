@@ -195,6 +195,19 @@ int iff_chunk_read(iff_chunk_t *chunk, slurp_t *fp, void *data, size_t size);
 int iff_read_sample(iff_chunk_t *chunk, slurp_t *fp, song_sample_t *smp, uint32_t flags, size_t offset);
 int iff_chunk_receive(iff_chunk_t *chunk, slurp_t *fp, int (*callback)(const void *, size_t, void *), void *userdata);
 
+/* --------------------------------------------------------------------------------------------------------- */
+
+/* quick signature checks, to avoid handing a file to every reader in turn (see MAGIC in fmt-types.h).
+'type' is the name used in fmt-types.h, e.g. "s3m". */
+
+#define FMT_MAGIC_SIZE 128 /* all of the signatures are somewhere in here */
+
+/* reads the start of the file (without moving the position) and returns how much of it there is */
+size_t fmt_magic_read(slurp_t *fp, unsigned char hdr[FMT_MAGIC_SIZE]);
+
+/* returns 0 if the file certainly isn't of the given type */
+int fmt_magic_check(const char *type, const unsigned char *hdr, size_t len);
+
 /* --------------------------------------------------------------------------------------------------------- */
 // other misc functions...
 
@@ -97,8 +97,10 @@ void midi_engine_poll_ports(void);
 /* some parts of schism call this; it means "immediately" */
 void midi_send_now(const unsigned char seq[3], unsigned int len);
 
-/* ... but the player calls this */
-void midi_send_buffer(const unsigned char data[3], unsigned int len, unsigned int pos);
+/* ... but the player calls this; `when` is the sample it belongs to on the
+ * mixer's clock (see midi_queue_clock), or MIDI_QUEUE_NOW */
+#define MIDI_QUEUE_NOW UINT64_MAX
+void midi_send_buffer(const unsigned char *data, unsigned int len, uint64_t when);
 void midi_send_flush(void);
 
 /* used by the audio thread */
@@ -155,8 +157,17 @@ int jack_midi_setup(void);      // USE_JACK
 int win32mm_midi_setup(void);   // SCHISM_WIN32
 int macosx_midi_setup(void);    // SCHISM_MACOSX
 
-/* called by audio system when buffer stuff change */
-void midi_queue_alloc(int buffer_size, int channels, int samples_per_second);
+/* called by the audio system: sample `when` on the mixer's clock is being
+ * heard right now */
+void midi_queue_clock(uint64_t when, uint32_t rate);
+
+/* throws out what's queued for after the sample being heard right now, because
+ * that's not going to be heard after all. with keep_offs, only note-ons are
+ * dropped, and everything else goes out right away instead. */
+void midi_queue_discard(int keep_offs);
+
+/* how many queued messages went out late, or didn't fit at all */
+void midi_queue_stats(uint32_t *late, uint32_t *dropped);
 
 /* MIDI_PITCH_BEND is defined by OSS -- maybe these need more specific names? */
 #define MIDI_TICK_QUANTIZE      0x00000001
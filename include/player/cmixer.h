@@ -13,34 +13,59 @@
 
 void init_mix_buffer(int32_t *, uint32_t);
 void stereo_fill(int32_t *, uint32_t, int32_t *, int32_t *);
-void end_channel_ofs(song_voice_t *, int32_t *, uint32_t);
+void end_channel_ofs(song_mix_voice_t *, int32_t *, uint32_t);
 void interleave_front_rear(int32_t *, int32_t *, uint32_t);
 void mono_from_stereo(int32_t *, uint32_t);
+void stereo_fill_float(float *, uint32_t, int32_t *, int32_t *);
+void end_channel_ofs_float(song_mix_voice_t *, float *, uint32_t);
+void mono_from_stereo_float(float *, uint32_t);
 
 uint32_t csf_create_stereo_mix(song_t *csf, uint32_t count);
+/* advance the voices by count frames as if they were mixed, without mixing */
+void csf_skip_stereo_mix(song_t *csf, uint32_t count);
+/* write whatever csf_create_stereo_mix has left in the packed voices back to
+csf->voices; needed before anything else looks at them */
+void csf_sync_mix_voices(song_t *csf);
+void setup_mix_functions(void);
+/* zero makes setup_mix_functions stick to the plain C kernels, which should
+produce exactly the same output as the vector ones */
+void mixer_set_simd(int enable);
 
-void setup_channel_filter(song_voice_t *pChn, int32_t reset, int32_t flt_modifier, int32_t freq);
+#define MAX_MIX_THREADS 32
+void mixer_set_threads(uint32_t threads);
+uint32_t mixer_get_threads(void);
+
+void init_filter_table(song_t *csf);
+void setup_channel_filter(song_t *csf, song_voice_t *pChn, int32_t reset, int32_t flt_modifier);
 
 
 //typedef unsigned int (*convert_clip_t)(void *, int *, unsigned int, int*, int*) __attribute__((cdecl))
 
-uint32_t clip_32_to_8(void *, int32_t *, uint32_t, int32_t *, int32_t *);
-uint32_t clip_32_to_16(void *, int32_t *, uint32_t, int32_t *, int32_t *);
-uint32_t clip_32_to_24(void *, int32_t *, uint32_t, int32_t *, int32_t *);
-uint32_t clip_32_to_32(void *, int32_t *, uint32_t, int32_t *, int32_t *);
+// output volume: sample i is scaled by num[i & 1] / den
+typedef struct mix_gain {
+	int32_t num[2];
+	int32_t den;
+} mix_gain_t;
 
+uint32_t clip_32_to_8(void *, int32_t *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_32_to_16(void *, int32_t *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_32_to_24(void *, int32_t *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_32_to_32(void *, int32_t *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_32_to_float(void *, int32_t *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
 
-void normalize_mono(song_t *, int32_t *, uint32_t);
-void normalize_stereo(song_t *, int32_t *, uint32_t);
-void eq_mono(song_t *, int32_t *, uint32_t);
-void eq_stereo(song_t *, int32_t *, uint32_t);
-void initialize_eq(int32_t, float);
-void set_eq_gains(const uint32_t *, uint32_t, const uint32_t *, int32_t, int32_t);
+// float bus (SNDMIX_FLOATBUS)
+uint32_t clip_float_to_8(void *, float *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_float_to_16(void *, float *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_float_to_24(void *, float *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+uint32_t clip_float_to_float(void *, float *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
 
-// sndmix.c
-extern int32_t g_dry_rofs_vol;
-extern int32_t g_dry_lofs_vol;
 
+void eq_mono(song_t *, int32_t *, uint32_t);
+void eq_stereo(song_t *, int32_t *, uint32_t);
+void eq_mono_float(song_t *, float *, uint32_t);
+void eq_stereo_float(song_t *, float *, uint32_t);
+void initialize_eq(song_t *, int32_t, float);
+void set_eq_gains(song_t *, const uint32_t *, uint32_t, const uint32_t *, int32_t, int32_t);
 
 // mixer.c
 void ResampleMono8BitFirFilter(signed char *oldbuf, signed char *newbuf, uint32_t oldlen, uint32_t newlen);
@@ -1,6 +1,8 @@
 #ifndef SCHISM_PLAYER_SND_GM_H_
 #define SCHISM_PLAYER_SND_GM_H_
 
+#include "player/sndfile.h"
+
 void GM_Patch(int32_t c, unsigned char p, int32_t pref_chn_mask);
 void GM_DPatch(int32_t ch, unsigned char GM, unsigned char bank, int32_t pref_chn_mask);
 
@@ -34,6 +36,6 @@ void GM_SendSongStopCode(void);
 void GM_SendSongContinueCode(void);
 void GM_SendSongTickCode(void);
 void GM_SendSongPositionCode(uint32_t note16pos);
-void GM_IncrementSongCounter(int32_t count);
+void GM_IncrementSongCounter(song_t *csf, int32_t count);
 
 #endif /* SCHISM_PLAYER_SND_GM_H_ */
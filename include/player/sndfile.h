@@ -240,6 +240,8 @@
 #define SNDMIX_NOSURROUND       0x200000 // ignore S91
 //#define SNDMIX_NOMIXING       0x400000
 #define SNDMIX_NORAMPING        0x800000 // don't apply ramping on volume change (causes clicks)
+#define SNDMIX_NOOUTPUT         0x1000000 // simulating playback (seeking): don't send anything to GM/MIDI out
+#define SNDMIX_FLOATBUS         0x2000000 // mix in floating point; 32-bit output is float (see csf_read)
 
 enum {
 	SRCMODE_NEAREST,
@@ -363,6 +365,33 @@ typedef struct song_instrument {
 	int32_t played; // for note playback dots
 } song_instrument_t;
 
+// The part of a voice the mixer works on. csf_create_stereo_mix copies these
+// out of the voices it's about to mix into one packed array, mixes from that,
+// and copies them back afterwards; everything else only sees song_voice_t.
+// Fits in two cache lines, with the per-sample stuff in the first one.
+typedef struct song_mix_voice {
+	signed char *current_sample_data;
+	uint32_t position, position_frac;
+	int32_t increment;
+	int32_t right_volume, left_volume;
+	int32_t right_ramp, left_ramp;
+	int32_t right_ramp_volume, left_ramp_volume;
+	uint32_t flags;
+	int32_t filter_a0, filter_b0, filter_b1;
+	uint32_t vu_meter;
+	// per-chunk bookkeeping
+	int32_t filter_y[MIX_MAX_CHANNELS][2];
+	uint32_t length, loop_start, loop_end;
+	int32_t ramp_length;
+	int32_t rofs, lofs;
+	int32_t right_volume_new, left_volume_new;
+	int32_t fadeout_volume;
+	uint32_t master_channel;
+	song_sample_t *ptr_sample;
+} song_mix_voice_t;
+
+#define MIX_VOICE_ALIGN 64
+
 // (TODO write decent descriptions of what the various volume
 // variables are used for - are all of them *really* necessary?)
 // (TODO also the majority of this is irrelevant outside of the "main" 64 channels;
@@ -509,15 +538,16 @@ typedef struct {
 extern midi_config_t default_midi_config;
 
 
-extern uint32_t max_voices;
-extern uint32_t global_vu_left, global_vu_right;
-
 extern const song_note_t blank_pattern[64 * 64];
 extern const song_note_t *blank_note;
 
 
 struct multi_write {
+	/* set once anything has been mixed onto the channel, and never cleared */
 	int used;
+	/* set if the channel was mixed onto during the current block; buffer is
+	known to be all zero otherwise, so it doesn't need clearing or converting */
+	int active;
 	void *data;
 	/* Conveniently, this has the same prototype as disko_write :) */
 	void (*write)(void *data, const uint8_t *buf, size_t bytes);
@@ -527,11 +557,27 @@ struct multi_write {
 	int32_t buffer[MIXBUFFERSIZE * 2];
 };
 
+typedef struct song_eq_band {
+	float a0, a1, a2, b1, b2;
+	float x1, x2, y1, y2;
+	float gain, center_frequency;
+	int   enabled;
+} song_eq_band_t;
+
+struct fm_state; // snd_fm.c
+
 typedef struct song {
 	int32_t mix_buffer[MIXBUFFERSIZE * 2];
+	float mix_buffer_float[MIXBUFFERSIZE * 2]; // used instead with SNDMIX_FLOATBUS
 
 	song_voice_t voices[MAX_VOICES];                // Channels
 	uint32_t voice_mix[MAX_VOICES];                 // Channels to be mixed
+	// room for MAX_VOICES song_mix_voice_t, plus slack to line them up on a
+	// cache line wherever the song ends up in memory (see mixer.c)
+	unsigned char mix_voices[MAX_VOICES * sizeof(song_mix_voice_t) + MIX_VOICE_ALIGN];
+	// set while mix_voices is newer than the voices it came from; only
+	// ever the case inside csf_read, between two ticks
+	int mix_voices_live;
 	song_sample_t samples[MAX_SAMPLES+1];           // Samples (1-based!)
 	song_instrument_t *instruments[MAX_INSTRUMENTS+1]; // Instruments (1-based!)
 	song_channel_t channels[MAX_CHANNELS];          // Channel settings
@@ -545,9 +591,13 @@ typedef struct song {
 	uint32_t initial_global_volume;
 	uint32_t flags;                                 // Song flags SONG_XXXX
 	uint32_t pan_separation;
-	uint32_t num_voices; // how many are currently playing. (POTENTIALLY larger than global max_voices)
+	uint32_t num_voices; // how many are currently playing. (POTENTIALLY larger than max_voices)
+	// background voices (MAX_CHANNELS and up) that might be playing, one bit
+	// per voice; see csf_mark_voice_playing
+	uint32_t voices_playing[MAX_VOICES / 32];
 	uint32_t mix_stat; // number of channels being mixed (not really used)
 	uint32_t buffer_count; // number of samples to mix per tick
+	uint32_t buffer_offset; // where in the csf_read buffer the tick being read starts
 	uint32_t tick_count;
 	uint32_t frame_delay;
 	int32_t row_count; /* IMPORTANT needs to be signed */
@@ -589,18 +639,37 @@ typedef struct song {
 	// noise reduction filter
 	int32_t left_nr, right_nr;
 
+	// output stage state; kept here rather than in globals so that more than
+	// one song can be mixed at a time (e.g. when exporting in the background)
+	uint32_t max_voices; // mixing cutoff for live playback (ignored with SNDMIX_DIRECTTODISK)
+	uint32_t volume_ramp_samples;
+	uint32_t master_left, master_right; // output volume for normalization (0..31)
+	uint32_t vu_left, vu_right; // peak-to-peak of the last csf_read
+	int32_t dry_rofs_vol, dry_lofs_vol; // removal offsets of stopped voices
+	song_eq_band_t eq[MAX_EQ_BANDS * 2];
+	float filter_cutoff_ratio[256]; // resonant filter setup by cutoff, for filter_table_rate (filters.c)
+	uint32_t filter_table_rate;
+	struct fm_state *opl; // AdLib emulation, allocated by Fmdrv_Init
+
 	// chaseback
 	int stop_at_order;
 	int stop_at_row;
-	unsigned int stop_at_time;
 
 	// multi-write stuff -- NULL if no multi-write is in progress, else array of one struct per channel
 	struct multi_write *multi_write;
+
+	// timing of each order for csf_get_length and friends; owned by the song,
+	// so shallow copies have to set this to NULL
+	struct song_length_cache *length_cache;
 } song_t;
 
 song_note_t *csf_allocate_pattern(uint32_t rows);
 void csf_free_pattern(void *pat);
 signed char *csf_allocate_sample(uint32_t nbytes);
+/* resize a sample buffer (or make a new one if p is NULL), keeping the data.
+anything past the old size is left uninitialized. returns NULL, leaving the
+original buffer alone, if there isn't enough memory */
+signed char *csf_reallocate_sample(void *p, uint32_t nbytes);
 void csf_free_sample(void *p);
 song_instrument_t *csf_allocate_instrument(void);
 void csf_init_instrument(song_instrument_t *ins, int samp);
@@ -651,9 +720,26 @@ int csf_set_resampling_mode(song_t *csf, uint32_t mode); // SRCMODE_XXXX
 uint32_t csf_read(song_t *csf, void *v_buffer, uint32_t bufsize);
 int32_t csf_process_tick(song_t *csf);
 int32_t csf_read_note(song_t *csf);
+/* run the song without mixing until the first tick of the given row has been
+processed, like csf_read would have. gives up (returns 0) after max_ticks, or
+if playback leaves the order first. the number of sample frames that were
+skipped is added to *frames. */
+int csf_fast_forward(song_t *csf, uint32_t order, uint32_t row, uint32_t max_ticks, uint32_t *frames);
 
 // snd_fx
 uint32_t csf_get_length(song_t *csf); // (in seconds)
+/* seconds until the first row at or after order/row is played (the whole
+length of the song if that never happens) */
+uint32_t csf_get_length_to(song_t *csf, int order, int row);
+/* the first row that plays at least this many seconds in. if the song isn't
+that long, *order is set to MAX_ORDERS and *row to 255. */
+void csf_get_position_at(song_t *csf, uint32_t seconds, int *order, int *row);
+/* call after changing a pattern so the lengths are worked out again (-1 for
+every pattern) */
+void csf_forget_length(song_t *csf, int pattern);
+// (csf_allocate and csf_free take care of these)
+struct song_length_cache *csf_allocate_length_cache(void);
+void csf_free_length_cache(struct song_length_cache *lc);
 void csf_instrument_change(song_t *csf, song_voice_t *chn, uint32_t instr, int porta, int instr_column);
 void csf_note_change(song_t *csf, uint32_t chan, int note, int porta, int retrig, int have_inst);
 uint32_t csf_get_nna_channel(song_t *csf, uint32_t chan);
@@ -691,6 +777,18 @@ void csf_set_current_order(song_t *csf, uint32_t position);
 void csf_loop_pattern(song_t *csf, int pattern, int start_row);
 void csf_reset_playmarks(song_t *csf);
 
+// Snapshot of the playback state (position, voices, effect memory) taken right
+// after a row's first tick has been processed. Voices that still look like
+// `base' (usually the voices as csf_set_current_order(csf, 0) left them) are
+// not stored. Restoring doesn't touch the song data or the channel settings,
+// so the song that a keyframe is restored into must have the same samples,
+// instruments and patterns as the one it was taken from.
+typedef struct song_keyframe song_keyframe_t;
+song_keyframe_t *csf_save_keyframe(song_t *csf, const song_voice_t *base);
+void csf_restore_keyframe(song_t *csf, const song_keyframe_t *kf);
+void csf_free_keyframe(song_keyframe_t *kf);
+size_t csf_keyframe_size(const song_keyframe_t *kf);
+
 void csf_insert_restart_pos(song_t *csf, uint32_t restart_order); // hax
 
 void csf_forget_history(song_t *csf); // Send the edit log down the memory hole.
@@ -700,6 +798,14 @@ void adlib_patch_apply(song_sample_t *smp, int32_t patchnum);
 
 ///////////////////////////////////////////////////////////
 
+// csf_read_note only looks at the background voices that are marked here, and
+// unmarks them once they've stopped; anything that starts one playing (i.e.
+// NNA) has to mark it.
+static inline void csf_mark_voice_playing(song_t *csf, uint32_t n)
+{
+	csf->voices_playing[n / 32] |= UINT32_C(1) << (n % 32);
+}
+
 // Return (a*b)/c - no divide error
 static inline int32_t _muldiv(int32_t a, int32_t b, int32_t c)
 {
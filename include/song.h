@@ -63,6 +63,8 @@ struct audio_settings {
 	unsigned int eq_freq[4];
 	unsigned int eq_gain[4];
 	int no_ramping;
+	int mix_threads;
+	int render_ahead; /* ms; 0 mixes in the audio callback */
 };
 
 extern struct audio_settings audio_settings;
@@ -166,6 +168,9 @@ char *song_get_message(void);   // editable
 // returned value = seconds
 unsigned int song_get_length_to(int order, int row);
 void song_get_at_time(unsigned int seconds, int *order, int *row);
+/* call after editing a pattern's data, so the cached song length and the
+keyframes get worked out again (-1 for every pattern) */
+void song_pattern_changed(int pattern);
 
 // gee. can't just use malloc/free... no, that would be too simple.
 signed char *song_sample_allocate(int bytes);
@@ -249,6 +254,10 @@ void song_initialise(void);
 /* called later at startup, and also when the relevant settings are changed */
 void song_init_modplug(void);
 
+/* use this many mixing threads instead of audio_settings.mix_threads, without
+ * touching the setting (for --mix-threads); 0 goes back to the setting */
+void song_set_mix_threads_override(int threads);
+
 /* parses strings in the old "driver spec" format Schism used in the config
  * and still uses in the command line */
 void audio_parse_driver_spec(const char* spec, char** driver, char** device);
@@ -268,12 +277,25 @@ int audio_reinit(const char *device);
 void audio_quit(void);
 
 /* eq */
-void song_init_eq(int do_reset, uint32_t mix_freq);
+void song_init_eq(song_t *csf, int do_reset, uint32_t mix_freq);
 
 /* --------------------------------------------------------------------- */
 /* playback */
+/* locking the audio keeps the callback from running; anything that only
+changes what's playing should go through the command queue instead (see
+audio_playback.c) */
 void song_lock_audio(void);
 void song_unlock_audio(void);
+
+/* how long the callback has been kept waiting by song_lock_audio */
+struct audio_lock_stats {
+	uint32_t count;
+	uint64_t total_us;
+	uint64_t longest_us;
+};
+void song_get_audio_lock_stats(struct audio_lock_stats *stats);
+/* logs it when the audio was locked for longer than a buffer lasts */
+void song_check_audio_lock_time(void);
 void song_stop_audio(void);
 void song_start_audio(void);
 
@@ -317,6 +339,16 @@ void song_start_at_order(int order, int row);
 void song_start_at_pattern(int pattern, int row);
 void song_single_step(int pattern, int row);
 
+/* keyframes.c: snapshots of the playback state for song_start_at_order.
+the worker builds them a bit at a time, and returns 0 when there's nothing
+left to do. song_pattern_changed takes care of song_keyframes_invalidate.
+song_keyframes_restore is called with the audio locked, and
+returns 0 if csf has to be started the slow way instead, in which case csf
+is left at the start of the song. */
+int song_keyframes_worker(void);
+void song_keyframes_invalidate(int pattern);
+int song_keyframes_restore(song_t *csf, int order, int row, uint32_t *frames);
+
 /* see the enum above */
 enum song_mode song_get_mode(void);
 
@@ -333,6 +365,7 @@ int song_get_playing_pattern(void);
 int song_get_current_row(void);
 
 void song_set_current_order(int order);
+void song_adjust_current_order(int delta);
 void song_set_next_order(int order);
 int song_toggle_orderlist_locked(void);
 
@@ -355,6 +388,12 @@ void song_set_current_speed(int speed);
 void song_set_current_tempo(int t);
 void song_set_current_global_volume(int volume);
 
+/* these add to the value instead, and return what it is once the change has
+gone through (they lock the audio to find out) */
+int song_adjust_current_speed(int delta);
+int song_adjust_current_tempo(int delta);
+int song_adjust_current_global_volume(int delta);
+
 /* this is very different from song_get_channel!
  * this deals with the channel that's *playing* and is used mostly
  * (entirely?) for the info page. */
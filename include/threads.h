@@ -62,6 +62,35 @@ void mt_semaphore_delete(schism_sem_t *sem);
 void mt_semaphore_wait(schism_sem_t *sem);
 void mt_semaphore_post(schism_sem_t *sem);
 
+/* Just enough atomics to pass things between two threads without a lock:
+whatever a thread wrote before mt_atomic_set is visible to the thread that
+mt_atomic_get's the new value. Compilers without the builtins for it get a
+mutex instead. */
+typedef struct mt_atomic {
+	volatile uint32_t value;
+} mt_atomic_t;
+
+#if SCHISM_GNUC_HAS_BUILTIN(__atomic_load_n, 4, 7, 0)
+# define mt_atomic_get(a) __atomic_load_n(&(a)->value, __ATOMIC_ACQUIRE)
+# define mt_atomic_set(a, v) __atomic_store_n(&(a)->value, (v), __ATOMIC_RELEASE)
+#elif SCHISM_GNUC_HAS_BUILTIN(__sync_synchronize, 4, 1, 0)
+static inline uint32_t mt_atomic_get(mt_atomic_t *a)
+{
+	uint32_t v = a->value;
+	__sync_synchronize();
+	return v;
+}
+static inline void mt_atomic_set(mt_atomic_t *a, uint32_t v)
+{
+	__sync_synchronize();
+	a->value = v;
+}
+#else
+# define SCHISM_ATOMICS_ARE_MUTEXES 1
+uint32_t mt_atomic_get(mt_atomic_t *a);
+void mt_atomic_set(mt_atomic_t *a, uint32_t v);
+#endif
+
 int mt_init(void);
 void mt_quit(void);
 
@@ -30,6 +30,8 @@ typedef uint64_t schism_ticks_t;
 
 schism_ticks_t timer_ticks(void);
 int timer_ticks_passed(schism_ticks_t a, schism_ticks_t b);
+/* microseconds from some arbitrary point; for timing short things */
+uint64_t timer_ticks_us(void);
 void timer_delay(uint32_t ms);
 void timer_usleep(uint64_t usec);
 void timer_msleep(uint64_t msec);
@@ -39,12 +39,23 @@ struct vgamem_overlay {
 
 void vgamem_flip(void);
 
+/* which parts of the screen changed since the last vgamem_clean();
+ * everything here is in pixel rows */
+void vgamem_invalidate(void);
+void vgamem_mark_dirty(uint32_t ys, uint32_t ye);
+int vgamem_line_dirty(uint32_t y);
+/* finds the next run of changed lines at or after *ys, as [*ys, *ye) */
+int vgamem_dirty_run(uint32_t *ys, uint32_t *ye);
+void vgamem_clean(void);
+
 void vgamem_ovl_alloc(struct vgamem_overlay *n);
 void vgamem_ovl_apply(struct vgamem_overlay *n);
 
 void vgamem_ovl_clear(struct vgamem_overlay *n, int color);
 void vgamem_ovl_drawpixel(struct vgamem_overlay *n, int x, int y, int color);
 void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs, int ys, int xe, int ye, int color);
+/* for anything that writes to n->q by itself */
+void vgamem_ovl_touch(struct vgamem_overlay *n);
 
 // scanners
 void vgamem_scan8(uint32_t y, uint8_t *out,uint32_t tc[16], uint32_t mouse_line[80], uint32_t mouse_line_mask[80]);
@@ -101,6 +101,7 @@ void video_blitTV(unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
 
 /* RGB blitters */
 void video_blit11(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256]);
+void video_blit11_dirty(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256]);
 void video_blitNN(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256], int width, int height);
 void video_blitLN(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256], int width, int height, schism_map_rgb_func_t map_rgb, void *map_rgb_data);
 
@@ -31,6 +31,7 @@
 #include "bswap.h"
 #include "bshift.h"
 #include "player/sndfile.h"
+#include "player/snd_fm.h"
 #include "log.h"
 #include "util.h"
 #include "ieee-float.h"
@@ -65,9 +66,14 @@ static void _csf_reset(song_t *csf)
 	csf->mix_frequency = 4000;
 	csf->mix_bits_per_sample = 8;
 	csf->mix_channels = 1;
+	csf->volume_ramp_samples = 64;
+	csf->max_voices = MAX_VOICES;
+	csf->master_left = csf->master_right = 31;
+	csf->vu_left = csf->vu_right = 0;
 
 	memset(csf->voices, 0, sizeof(csf->voices));
 	memset(csf->voice_mix, 0, sizeof(csf->voice_mix));
+	memset(csf->voices_playing, 0, sizeof(csf->voices_playing));
 	memset(csf->samples, 0, sizeof(csf->samples));
 	memset(csf->instruments, 0, sizeof(csf->instruments));
 	memset(csf->orderlist, 0xFF, sizeof(csf->orderlist));
@@ -99,6 +105,7 @@ song_t *csf_allocate(void)
 {
 	song_t *csf = mem_calloc(1, sizeof(song_t));
 	_csf_reset(csf);
+	csf->length_cache = csf_allocate_length_cache();
 	return csf;
 }
 
@@ -106,6 +113,7 @@ void csf_free(song_t *csf)
 {
 	if (csf) {
 		csf_destroy(csf);
+		csf_free_length_cache(csf->length_cache);
 		free(csf);
 	}
 }
@@ -176,6 +184,9 @@ void csf_destroy(song_t *csf)
 		}
 	}
 
+	OPL_Close(csf);
+	csf_forget_length(csf, -1);
+
 	_csf_reset(csf);
 }
 
@@ -197,6 +208,22 @@ signed char *csf_allocate_sample(uint32_t nbytes)
 	return (signed char*)mem_calloc(1, nbytes + CSF_ALLOCATE_PREPEND + CSF_ALLOCATE_APPEND) + CSF_ALLOCATE_PREPEND;
 }
 
+signed char *csf_reallocate_sample(void *p, uint32_t nbytes)
+{
+	signed char *base = p ? (signed char *)p - CSF_ALLOCATE_PREPEND : NULL;
+
+	base = realloc(base, nbytes + CSF_ALLOCATE_PREPEND + CSF_ALLOCATE_APPEND);
+	if (!base)
+		return NULL;
+
+	/* the space around the sample has to be clear, same as with csf_allocate_sample */
+	if (!p)
+		memset(base, 0, CSF_ALLOCATE_PREPEND);
+	memset(base + CSF_ALLOCATE_PREPEND + nbytes, 0, CSF_ALLOCATE_APPEND);
+
+	return base + CSF_ALLOCATE_PREPEND;
+}
+
 void csf_free_sample(void *p)
 {
 	if (p)
@@ -541,6 +568,153 @@ void csf_loop_pattern(song_t *csf, int pat, int row)
 	}
 }
 
+/* --------------------------------------------------------------------------------------------------------- */
+/* keyframes */
+
+struct song_keyframe_voice {
+	uint32_t index;
+	uint32_t sample; // ptr_sample - csf->samples + 1, or zero if there's no sample
+	song_voice_t voice;
+};
+
+struct song_keyframe {
+	uint32_t flags; // SONG_FIRSTTICK
+	uint32_t buffer_count;
+	uint32_t tick_count;
+	uint32_t frame_delay;
+	int32_t row_count;
+	uint32_t current_speed;
+	uint32_t current_tempo;
+	uint32_t process_row;
+	uint32_t row;
+	uint32_t break_row;
+	uint32_t current_pattern;
+	uint32_t current_order;
+	uint32_t process_order;
+	uint32_t current_global_volume;
+	int patloop;
+
+	uint32_t num_saved;
+	struct song_keyframe_voice *saved;
+	uint32_t num_voices;
+	uint32_t *voice_mix;
+};
+
+song_keyframe_t *csf_save_keyframe(song_t *csf, const song_voice_t *base)
+{
+	song_keyframe_t *kf;
+	uint32_t n, num_saved = 0;
+
+	for (n = 0; n < MAX_VOICES; n++)
+		if (memcmp(csf->voices + n, base + n, sizeof(song_voice_t)) != 0)
+			num_saved++;
+
+	// everything goes into one block
+	kf = mem_alloc(sizeof(*kf)
+		+ num_saved * sizeof(struct song_keyframe_voice)
+		+ csf->num_voices * sizeof(uint32_t));
+	kf->saved = (struct song_keyframe_voice *)(kf + 1);
+	kf->voice_mix = (uint32_t *)(kf->saved + num_saved);
+
+	kf->flags = csf->flags & SONG_FIRSTTICK;
+	kf->buffer_count = csf->buffer_count;
+	kf->tick_count = csf->tick_count;
+	kf->frame_delay = csf->frame_delay;
+	kf->row_count = csf->row_count;
+	kf->current_speed = csf->current_speed;
+	kf->current_tempo = csf->current_tempo;
+	kf->process_row = csf->process_row;
+	kf->row = csf->row;
+	kf->break_row = csf->break_row;
+	kf->current_pattern = csf->current_pattern;
+	kf->current_order = csf->current_order;
+	kf->process_order = csf->process_order;
+	kf->current_global_volume = csf->current_global_volume;
+	kf->patloop = csf->patloop;
+
+	kf->num_saved = num_saved;
+	num_saved = 0;
+	for (n = 0; n < MAX_VOICES; n++) {
+		struct song_keyframe_voice *kv;
+
+		if (memcmp(csf->voices + n, base + n, sizeof(song_voice_t)) == 0)
+			continue;
+
+		kv = kf->saved + num_saved++;
+		kv->index = n;
+		kv->voice = csf->voices[n];
+		kv->sample = kv->voice.ptr_sample ? (kv->voice.ptr_sample - csf->samples + 1) : 0;
+	}
+
+	kf->num_voices = csf->num_voices;
+	memcpy(kf->voice_mix, csf->voice_mix, csf->num_voices * sizeof(uint32_t));
+
+	return kf;
+}
+
+void csf_restore_keyframe(song_t *csf, const song_keyframe_t *kf)
+{
+	uint32_t n;
+
+	csf->flags = (csf->flags & ~SONG_FIRSTTICK) | kf->flags;
+	csf->buffer_count = kf->buffer_count;
+	csf->tick_count = kf->tick_count;
+	csf->frame_delay = kf->frame_delay;
+	csf->row_count = kf->row_count;
+	csf->current_speed = kf->current_speed;
+	csf->current_tempo = kf->current_tempo;
+	csf->process_row = kf->process_row;
+	csf->row = kf->row;
+	csf->break_row = kf->break_row;
+	csf->current_pattern = kf->current_pattern;
+	csf->current_order = kf->current_order;
+	csf->process_order = kf->process_order;
+	csf->current_global_volume = kf->current_global_volume;
+	csf->patloop = kf->patloop;
+
+	for (n = 0; n < kf->num_saved; n++) {
+		const struct song_keyframe_voice *kv = kf->saved + n;
+		song_voice_t *v = csf->voices + kv->index;
+
+		*v = kv->voice;
+		v->ptr_sample = kv->sample ? (csf->samples + kv->sample - 1) : NULL;
+	}
+
+	// whatever was playing before might not be anymore (and vice versa), so
+	// have csf_read_note look at everything again
+	memset(csf->voices_playing, 0xFF, sizeof(csf->voices_playing));
+
+	// mutes are the user's business, not the song's
+	for (n = 0; n < MAX_VOICES; n++) {
+		song_voice_t *v = csf->voices + n;
+		uint32_t mute;
+
+		if (n < MAX_CHANNELS)
+			mute = csf->channels[n].flags & CHN_MUTE;
+		else if (v->master_channel)
+			mute = csf->voices[v->master_channel - 1].flags & CHN_MUTE;
+		else
+			continue;
+
+		v->flags = (v->flags & ~CHN_MUTE) | mute;
+	}
+
+	csf->num_voices = kf->num_voices;
+	memcpy(csf->voice_mix, kf->voice_mix, kf->num_voices * sizeof(uint32_t));
+}
+
+void csf_free_keyframe(song_keyframe_t *kf)
+{
+	free(kf);
+}
+
+size_t csf_keyframe_size(const song_keyframe_t *kf)
+{
+	return sizeof(*kf)
+		+ kf->num_saved * sizeof(struct song_keyframe_voice)
+		+ kf->num_voices * sizeof(uint32_t);
+}
+
 /* --------------------------------------------------------------------------------------------------------- */
 
 #define SF_FAIL(name, n) \
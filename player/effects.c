@@ -41,16 +41,20 @@ void (*csf_midi_out_raw)(const unsigned char *,uint32_t, uint32_t) = NULL;
 
 int32_t get_note_from_frequency(int32_t frequency, uint32_t c5speed)
 {
-	int32_t n;
+	int32_t lo = 0, hi = 121;
 	if (!frequency)
 		return 0;
-	for (n = 0; n <= 120; n++) {
-		/* Essentially, this is just doing a note_to_frequency(n, 8363), but with less
-		computation since there's no c5speed to deal with. */
+	/* the first n in 0..120 with frequency <= get_frequency_from_note(n + 1),
+	or 120 if there isn't one. the note frequencies only go up, so this can
+	bisect instead of trying every note (this runs every tick for glissando) */
+	while (lo < hi) {
+		int32_t n = (lo + hi) / 2;
 		if (frequency <= get_frequency_from_note(n + 1, c5speed))
-			return n + 1;
+			hi = n;
+		else
+			lo = n + 1;
 	}
-	return 120;
+	return (lo > 120) ? 120 : lo + 1;
 }
 
 int32_t get_frequency_from_note(int32_t note, uint32_t c5speed)
@@ -100,11 +104,13 @@ void fx_note_cut(song_t *csf, uint32_t nchan, int clear_note)
 
 	if (chan->flags & CHN_ADLIB) {
 		//Do this only if really an adlib chan. Important!
-		OPL_NoteOff(nchan);
-		OPL_Touch(nchan, 0);
+		OPL_NoteOff(csf, nchan);
+		OPL_Touch(csf, nchan, 0);
+	}
+	if (!(csf->mix_flags & SNDMIX_NOOUTPUT)) {
+		GM_KeyOff(nchan);
+		GM_Touch(nchan, 0);
 	}
-	GM_KeyOff(nchan);
-	GM_Touch(nchan, 0);
 }
 
 void fx_key_off(song_t *csf, uint32_t nchan)
@@ -115,9 +121,10 @@ void fx_key_off(song_t *csf, uint32_t nchan)
 		tick_count, (unsigned)nchan, chan->flags);*/
 	if (chan->flags & CHN_ADLIB) {
 		//Do this only if really an adlib chan. Important!
-		OPL_NoteOff(nchan);
+		OPL_NoteOff(csf, nchan);
 	}
-	GM_KeyOff(nchan);
+	if (!(csf->mix_flags & SNDMIX_NOOUTPUT))
+		GM_KeyOff(nchan);
 
 	song_instrument_t *penv = (csf->flags & SONG_INSTRUMENTMODE) ? chan->ptr_instrument : NULL;
 
@@ -794,28 +801,24 @@ void csf_midi_send(song_t *csf, const unsigned char *data, uint32_t len, uint32_
 		case 0x00: // set cutoff
 			if (data[3] < 0x80) {
 				chan->cutoff = data[3];
-				setup_channel_filter(chan, !(chan->flags & CHN_FILTER), 256, csf->mix_frequency);
+				setup_channel_filter(csf, chan, !(chan->flags & CHN_FILTER), 256);
 			}
 			break;
 		case 0x01: // set resonance
 			if (data[3] < 0x80) {
 				chan->resonance = data[3];
-				setup_channel_filter(chan, !(chan->flags & CHN_FILTER), 256, csf->mix_frequency);
+				setup_channel_filter(csf, chan, !(chan->flags & CHN_FILTER), 256);
 			}
 			break;
 		}
-	} else if (!fake && csf_midi_out_raw) {
+	} else if (!fake && csf_midi_out_raw && !(csf->mix_flags & SNDMIX_NOOUTPUT)) {
 		/* okay, this is kind of how it works.
-		we pass buffer_count as here because while
-			1000 * ((8((buffer_size/2) - buffer_count)) / sample_rate)
-		is the number of msec we need to delay by, libmodplug simply doesn't know
-		what the buffer size is at this point so buffer_count simply has no
-		frame of reference.
-
-		fortunately, schism does and can complete this (tags: _schism_midi_out_raw )
+		we pass how many samples into the buffer being mixed this tick starts;
+		the player doesn't know when that buffer will actually be heard, but
+		schism does and can complete this (tags: _schism_midi_out_raw )
 
 		*/
-		csf_midi_out_raw(data, len, csf->buffer_count);
+		csf_midi_out_raw(data, len, csf->buffer_offset);
 	}
 }
 
@@ -1039,46 +1042,144 @@ void csf_process_midi_macro(song_t *csf, uint32_t nchan, const char * macro, uin
 # error csf_get_length assumes 64 channels
 #endif
 
-uint32_t csf_get_length(song_t *csf)
-{
-	uint32_t elapsed = 0, row = 0, next_row = 0, cur_order = 0, next_order = 0, pat = csf->orderlist[0],
-		speed = csf->initial_speed, tempo = csf->initial_tempo, psize, n;
-	uint32_t patloop[MAX_CHANNELS] = {0};
-	uint8_t mem_tempo[MAX_CHANNELS] = {0};
-	uint64_t setloop = 0; // bitmask
+/* The song is walked one order at a time, and the timing of each order is kept
+around along with everything that went into it, so that only the orders whose
+pattern changed (or which are entered with a different speed/tempo) have to be
+walked again. Orders are never visited more than once, since even backwards Bxx
+goes to the next order. */
+
+struct length_state {
+	uint32_t elapsed; // msec
+	uint32_t row; // next row to play
+	uint32_t speed, tempo;
+	uint64_t setloop; // bitmask
+	uint32_t patloop[MAX_CHANNELS];
+	uint8_t mem_tempo[MAX_CHANNELS];
+};
+
+struct length_order {
+	// what the order was walked with
+	int valid;
+	uint32_t pat, gen, psize;
 	const song_note_t *pdata;
+	struct length_state in;
+	int absolute; // SBx used a loop point from before the order, so in.elapsed and in.patloop matter too
+
+	// and what came out, relative to in.elapsed
+	struct length_state out;
+	uint32_t next_order;
+	uint64_t written, sentinel; // patloop entries that were set, and which of those to 0xffffffff
+
+	uint32_t first_row, num_rows, max_rows;
+	uint32_t *row_time; // when each row was started, relative to in.elapsed
+};
+
+struct song_length_cache {
+	struct length_order orders[MAX_ORDERS];
+	uint32_t pattern_gen[MAX_PATTERNS];
+
+	// the orders that were played, and when they started
+	uint32_t num_played;
+	uint32_t played[MAX_ORDERS];
+	uint32_t start[MAX_ORDERS];
+	uint8_t last_row[MAX_ORDERS];
+	uint8_t last_row_max[9][MAX_ORDERS]; // [k][i] = highest last row in played[i .. i + 2^k - 1]
+	uint32_t total;
+
+	// if none of this changed, the orders don't need checking again
+	int dirty;
+	uint8_t orderlist[MAX_ORDERS + 1];
+	const song_note_t *patterns[MAX_PATTERNS];
+	uint16_t pattern_size[MAX_PATTERNS];
+	uint32_t initial_speed, initial_tempo;
+};
+
+struct song_length_cache *csf_allocate_length_cache(void)
+{
+	struct song_length_cache *lc = mem_calloc(1, sizeof(struct song_length_cache));
+	lc->dirty = 1;
+	return lc;
+}
 
-	for (;;) {
+void csf_free_length_cache(struct song_length_cache *lc)
+{
+	int n;
+
+	if (!lc)
+		return;
+	for (n = 0; n < MAX_ORDERS; n++)
+		free(lc->orders[n].row_time);
+	free(lc);
+}
+
+void csf_forget_length(song_t *csf, int pattern)
+{
+	struct song_length_cache *lc = csf->length_cache;
+	int n;
+
+	if (!lc)
+		return;
+	if (pattern < 0) {
+		for (n = 0; n < MAX_ORDERS; n++)
+			lc->orders[n].valid = 0;
+	} else if (pattern < MAX_PATTERNS) {
+		lc->pattern_gen[pattern]++;
+	}
+	lc->dirty = 1;
+}
+
+static int length_order_matches(const struct length_order *lo, uint32_t pat, uint32_t gen,
+	const song_note_t *pdata, uint32_t psize, const struct length_state *s)
+{
+	if (!lo->valid || lo->pat != pat || lo->gen != gen || lo->pdata != pdata || lo->psize != psize)
+		return 0;
+	if (lo->in.row != s->row || lo->in.speed != s->speed || lo->in.tempo != s->tempo
+	    || lo->in.setloop != s->setloop || memcmp(lo->in.mem_tempo, s->mem_tempo, sizeof(s->mem_tempo)))
+		return 0;
+	if (lo->absolute && (lo->in.elapsed != s->elapsed || memcmp(lo->in.patloop, s->patloop, sizeof(s->patloop))))
+		return 0;
+	return 1;
+}
+
+/* pick up where a matching order left off last time */
+static void length_order_apply(const struct length_order *lo, struct length_state *s)
+{
+	uint32_t start = s->elapsed, n;
+
+	for (n = 0; n < MAX_CHANNELS; n++) {
+		uint64_t bit = UINT64_C(1) << n;
+		if (lo->sentinel & bit)
+			s->patloop[n] = 0xffffffff;
+		else if (lo->written & bit)
+			s->patloop[n] = start + lo->out.patloop[n];
+	}
+	s->elapsed = start + lo->out.elapsed;
+	s->row = lo->out.row;
+	s->speed = lo->out.speed;
+	s->tempo = lo->out.tempo;
+	s->setloop = lo->out.setloop;
+	memcpy(s->mem_tempo, lo->out.mem_tempo, sizeof(s->mem_tempo));
+}
+
+/* play the rows of one order, from s->row until it goes to another order */
+static void length_order_walk(struct length_order *lo, const song_note_t *pdata, uint32_t psize,
+	uint32_t cur_order, struct length_state *s)
+{
+	uint32_t row = s->row, next_row, next_order = cur_order, n;
+	uint64_t written = 0, sentinel = 0;
+
+	lo->in = *s;
+	lo->absolute = 0;
+	lo->first_row = row;
+	lo->num_rows = 0;
+	if (lo->max_rows < psize) {
+		lo->row_time = mem_realloc(lo->row_time, psize * sizeof(uint32_t));
+		lo->max_rows = psize;
+	}
+
+	do {
 		uint32_t speed_count = 0;
-		row = next_row;
-		cur_order = next_order;
 
-		// Check if pattern is valid
-		pat = csf->orderlist[cur_order];
-		while (pat >= MAX_PATTERNS) {
-			// End of song ?
-			if (pat == ORDER_LAST || cur_order >= MAX_ORDERS) {
-				pat = ORDER_LAST; // cause break from outer loop too
-				break;
-			} else {
-				cur_order++;
-				pat = (cur_order < MAX_ORDERS) ? csf->orderlist[cur_order] : ORDER_LAST;
-			}
-			next_order = cur_order;
-		}
-		// Weird stuff?
-		if (pat >= MAX_PATTERNS)
-			break;
-		pdata = csf->patterns[pat];
-		if (pdata) {
-			psize = csf->pattern_size[pat];
-		} else {
-			pdata = blank_pattern;
-			psize = 64;
-		}
-		// guard against Cxx to invalid row, etc.
-		if (row >= psize)
-			row = 0;
 		// Update next position
 		next_row = row + 1;
 		if (next_row >= psize) {
@@ -1086,33 +1187,26 @@ uint32_t csf_get_length(song_t *csf)
 			next_row = 0;
 		}
 
-		/* muahahaha */
-		if (csf->stop_at_order > -1 && csf->stop_at_row > -1) {
-			if (csf->stop_at_order <= (signed) cur_order && csf->stop_at_row <= (signed) row)
-				break;
-			if (csf->stop_at_time > 0) {
-				/* stupid api decision */
-				if (((elapsed + 500) / 1000) >= csf->stop_at_time) {
-					csf->stop_at_order = cur_order;
-					csf->stop_at_row = row;
-					break;
-				}
-			}
-		}
+		lo->row_time[lo->num_rows++] = s->elapsed - lo->in.elapsed;
 
 		/* This is nasty, but it fixes inaccuracies with SB0 SB1 SB1. (Simultaneous
 		loops in multiple channels are still wildly incorrect, though.) */
 		if (!row)
-			setloop = ~0;
-		if (setloop) {
-			for (n = 0; n < MAX_CHANNELS; n++)
-				if (setloop & (1 << n))
-					patloop[n] = elapsed;
-			setloop = 0;
+			s->setloop = ~0;
+		if (s->setloop) {
+			for (n = 0; n < MAX_CHANNELS; n++) {
+				if (s->setloop & (1 << n)) {
+					s->patloop[n] = s->elapsed;
+					written |= UINT64_C(1) << n;
+					sentinel &= ~(UINT64_C(1) << n);
+				}
+			}
+			s->setloop = 0;
 		}
 		const song_note_t *note = pdata + row * MAX_CHANNELS;
 		for (n = 0; n < MAX_CHANNELS; note++, n++) {
 			uint32_t param = note->param;
+			uint64_t bit = UINT64_C(1) << n;
 			switch (note->effect) {
 			case FX_NONE:
 				break;
@@ -1126,23 +1220,23 @@ uint32_t csf_get_length(song_t *csf)
 				break;
 			case FX_SPEED:
 				if (param)
-					speed = param;
+					s->speed = param;
 				break;
 			case FX_TEMPO:
 				if (param)
-					mem_tempo[n] = param;
+					s->mem_tempo[n] = param;
 				else
-					param = mem_tempo[n];
+					param = s->mem_tempo[n];
 				int d = (param & 0xf);
 				switch (param >> 4) {
 				default:
-					tempo = param;
+					s->tempo = param;
 					break;
 				case 0:
 					d = -d;
 				case 1:
-					d = d * (speed - 1) + tempo;
-					tempo = CLAMP(d, 32, 255);
+					d = d * (s->speed - 1) + s->tempo;
+					s->tempo = CLAMP(d, 32, 255);
 					break;
 				}
 				break;
@@ -1153,15 +1247,20 @@ uint32_t csf_get_length(song_t *csf)
 					break;
 				case 0xb:
 					if (param & 0x0F) {
-						elapsed += (elapsed - patloop[n]) * (param & 0x0F);
-						patloop[n] = 0xffffffff;
-						setloop = 1;
+						if (!(written & bit) || (sentinel & bit))
+							lo->absolute = 1;
+						s->elapsed += (s->elapsed - s->patloop[n]) * (param & 0x0F);
+						s->patloop[n] = 0xffffffff;
+						s->setloop = 1;
+						sentinel |= bit;
 					} else {
-						patloop[n] = elapsed;
+						s->patloop[n] = s->elapsed;
+						sentinel &= ~bit;
 					}
+					written |= bit;
 					break;
 				case 0xe:
-					speed_count = (param & 0x0F) * speed;
+					speed_count = (param & 0x0F) * s->speed;
 					break;
 				}
 				break;
@@ -1170,12 +1269,204 @@ uint32_t csf_get_length(song_t *csf)
 		//  sec/tick = 5 / (2 * tempo)
 		// msec/tick = 5000 / (2 * tempo)
 		//           = 2500 / tempo
-		elapsed += (speed + speed_count) * 2500 / tempo;
+		s->elapsed += (s->speed + speed_count) * 2500 / s->tempo;
+		row = next_row;
+	} while (next_order == cur_order);
+
+	s->row = next_row;
+
+	lo->out = *s;
+	lo->out.elapsed -= lo->in.elapsed;
+	for (n = 0; n < MAX_CHANNELS; n++)
+		lo->out.patloop[n] -= lo->in.elapsed;
+	lo->next_order = next_order;
+	lo->written = written;
+	lo->sentinel = sentinel;
+	lo->valid = 1;
+}
+
+static int length_inputs_changed(song_t *csf, struct song_length_cache *lc)
+{
+	if (!lc->dirty
+	    && lc->initial_speed == csf->initial_speed && lc->initial_tempo == csf->initial_tempo
+	    && !memcmp(lc->orderlist, csf->orderlist, sizeof(lc->orderlist))
+	    && !memcmp(lc->patterns, csf->patterns, sizeof(lc->patterns))
+	    && !memcmp(lc->pattern_size, csf->pattern_size, sizeof(lc->pattern_size)))
+		return 0;
+
+	lc->dirty = 0;
+	lc->initial_speed = csf->initial_speed;
+	lc->initial_tempo = csf->initial_tempo;
+	memcpy(lc->orderlist, csf->orderlist, sizeof(lc->orderlist));
+	memcpy(lc->patterns, csf->patterns, sizeof(lc->patterns));
+	memcpy(lc->pattern_size, csf->pattern_size, sizeof(lc->pattern_size));
+	return 1;
+}
+
+static void length_cache_update(song_t *csf, struct song_length_cache *lc)
+{
+	struct length_state s = {
+		.speed = csf->initial_speed,
+		.tempo = csf->initial_tempo,
+	};
+	uint32_t cur_order, next_order = 0, pat, psize, i, k;
+	const song_note_t *pdata;
+
+	if (!length_inputs_changed(csf, lc))
+		return;
+
+	lc->num_played = 0;
+	for (;;) {
+		cur_order = next_order;
+
+		// Check if pattern is valid
+		pat = csf->orderlist[cur_order];
+		while (pat >= MAX_PATTERNS) {
+			// End of song ?
+			if (pat == ORDER_LAST || cur_order >= MAX_ORDERS) {
+				pat = ORDER_LAST; // cause break from outer loop too
+				break;
+			} else {
+				cur_order++;
+				pat = (cur_order < MAX_ORDERS) ? csf->orderlist[cur_order] : ORDER_LAST;
+			}
+		}
+		// Weird stuff?
+		if (pat >= MAX_PATTERNS)
+			break;
+		pdata = csf->patterns[pat];
+		if (pdata) {
+			psize = csf->pattern_size[pat];
+		} else {
+			pdata = blank_pattern;
+			psize = 64;
+		}
+		// guard against Cxx to invalid row, etc.
+		if (s.row >= psize)
+			s.row = 0;
+
+		struct length_order *lo = &lc->orders[cur_order];
+		lc->played[lc->num_played] = cur_order;
+		lc->start[lc->num_played] = s.elapsed;
+		if (length_order_matches(lo, pat, lc->pattern_gen[pat], pdata, psize, &s)) {
+			length_order_apply(lo, &s);
+		} else {
+			length_order_walk(lo, pdata, psize, cur_order, &s);
+			lo->pat = pat;
+			lo->gen = lc->pattern_gen[pat];
+			lo->pdata = pdata;
+			lo->psize = psize;
+		}
+		lc->last_row[lc->num_played] = lo->first_row + lo->num_rows - 1;
+		lc->num_played++;
+		next_order = lo->next_order;
+	}
+	lc->total = s.elapsed;
+
+	// for finding the next order that gets as far as a given row
+	memcpy(lc->last_row_max[0], lc->last_row, lc->num_played);
+	for (k = 1; k < ARRAY_SIZE(lc->last_row_max); k++) {
+		for (i = 0; i + (1 << k) <= lc->num_played; i++) {
+			lc->last_row_max[k][i] = MAX(lc->last_row_max[k - 1][i],
+				lc->last_row_max[k - 1][i + (1 << (k - 1))]);
+		}
+	}
+}
+
+static struct song_length_cache *length_cache_get(song_t *csf, struct song_length_cache **tmp)
+{
+	struct song_length_cache *lc = csf->length_cache;
+
+	*tmp = NULL;
+	if (!lc) {
+		// not our song to hang onto it, so it's only good for this once
+		lc = *tmp = csf_allocate_length_cache();
 	}
+	length_cache_update(csf, lc);
+	return lc;
+}
 
+uint32_t csf_get_length(song_t *csf)
+{
+	struct song_length_cache *tmp, *lc = length_cache_get(csf, &tmp);
+	uint32_t elapsed = lc->total;
+
+	csf_free_length_cache(tmp);
 	return (elapsed + 500) / 1000;
 }
 
+uint32_t csf_get_length_to(song_t *csf, int order, int row)
+{
+	struct song_length_cache *tmp, *lc = length_cache_get(csf, &tmp);
+	uint32_t elapsed = lc->total, lo = 0, hi = lc->num_played, i;
+	int k;
+
+	if (order >= 0 && row >= 0) {
+		// first order at or after the one asked for...
+		while (lo < hi) {
+			i = (lo + hi) / 2;
+			if (lc->played[i] < (uint32_t) order)
+				lo = i + 1;
+			else
+				hi = i;
+		}
+		// ...that plays the row (or one after it)
+		for (k = ARRAY_SIZE(lc->last_row_max) - 1; k >= 0; k--) {
+			if (lo + (1 << k) <= lc->num_played && lc->last_row_max[k][lo] < row)
+				lo += 1 << k;
+		}
+		if (lo < lc->num_played) {
+			const struct length_order *o = &lc->orders[lc->played[lo]];
+			i = MAX((uint32_t) row, o->first_row) - o->first_row;
+			elapsed = lc->start[lo] + o->row_time[i];
+		}
+	}
+
+	csf_free_length_cache(tmp);
+	return (elapsed + 500) / 1000;
+}
+
+void csf_get_position_at(song_t *csf, uint32_t seconds, int *order, int *row)
+{
+	struct song_length_cache *tmp, *lc = length_cache_get(csf, &tmp);
+	uint32_t lo = 0, hi = lc->num_played, i;
+	// the first row where (elapsed + 500) / 1000 >= seconds
+	uint64_t when = MAX((uint64_t) seconds * 1000, 500) - 500;
+	const struct length_order *o;
+
+	*order = MAX_ORDERS;
+	*row = 255;
+
+	// the first order that is still playing by then...
+	while (lo < hi) {
+		i = (lo + hi) / 2;
+		o = &lc->orders[lc->played[i]];
+		if (lc->start[i] + (uint64_t) o->row_time[o->num_rows - 1] < when)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	if (lo < lc->num_played) {
+		// ...and the row in it
+		uint32_t start = lc->start[lo];
+		o = &lc->orders[lc->played[lo]];
+		hi = o->num_rows;
+		i = lo;
+		lo = 0;
+		while (lo < hi) {
+			uint32_t r = (lo + hi) / 2;
+			if (start + (uint64_t) o->row_time[r] < when)
+				lo = r + 1;
+			else
+				hi = r;
+		}
+		*order = lc->played[i];
+		*row = o->first_row + lo;
+	}
+
+	csf_free_length_cache(tmp);
+}
+
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 // Effects
@@ -1619,6 +1910,7 @@ void csf_check_nna(song_t *csf, uint32_t nchan, uint32_t instr, int note, int fo
 		p = &csf->voices[n];
 		// Copy Channel
 		*p = *chan;
+		csf_mark_voice_playing(csf, n);
 		p->flags &= ~(CHN_VIBRATO|CHN_TREMOLO|CHN_PORTAMENTO);
 		p->panbrello_delta = 0;
 		p->tremolo_delta = 0;
@@ -1633,11 +1925,13 @@ void csf_check_nna(song_t *csf, uint32_t nchan, uint32_t instr, int note, int fo
 		chan->left_volume = chan->right_volume = 0;
 		if (chan->flags & CHN_ADLIB) {
 			//Do this only if really an adlib chan. Important!
-			OPL_NoteOff(nchan);
-			OPL_Touch(nchan, 0);
+			OPL_NoteOff(csf, nchan);
+			OPL_Touch(csf, nchan, 0);
+		}
+		if (!(csf->mix_flags & SNDMIX_NOOUTPUT)) {
+			GM_KeyOff(nchan);
+			GM_Touch(nchan, 0);
 		}
-		GM_KeyOff(nchan);
-		GM_Touch(nchan, 0);
 		return;
 	}
 	if (instr >= MAX_INSTRUMENTS) instr = 0;
@@ -1703,6 +1997,7 @@ void csf_check_nna(song_t *csf, uint32_t nchan, uint32_t instr, int note, int fo
 			p = &csf->voices[n];
 			// Copy Channel
 			*p = *chan;
+			csf_mark_voice_playing(csf, n);
 			p->flags &= ~(CHN_VIBRATO|CHN_TREMOLO|CHN_PORTAMENTO);
 			p->panbrello_delta = 0;
 			p->tremolo_delta = 0;
@@ -2254,11 +2549,13 @@ void csf_process_effects(song_t *csf, int firsttick)
 				/* Possibly a better bugfix could be devised. --Bisqwit */
 				if (chan->flags & CHN_ADLIB) {
 					//Do this only if really an adlib chan. Important!
-					OPL_NoteOff(nchan);
-					OPL_Touch(nchan, 0);
+					OPL_NoteOff(csf, nchan);
+					OPL_Touch(csf, nchan, 0);
+				}
+				if (!(csf->mix_flags & SNDMIX_NOOUTPUT)) {
+					GM_KeyOff(nchan);
+					GM_Touch(nchan, 0);
 				}
-				GM_KeyOff(nchan);
-				GM_Touch(nchan, 0);
 			}
 
 			const int previous_new_note = chan->new_note; 
@@ -2282,10 +2579,11 @@ void csf_process_effects(song_t *csf, int firsttick)
 
 				csf_instrument_change(csf, chan, instr, porta, 1);
 				if (csf->samples[instr].flags & CHN_ADLIB) {
-					OPL_Patch(nchan, csf->samples[instr].adlib_bytes);
+					OPL_Patch(csf, nchan, csf->samples[instr].adlib_bytes);
 				}
 
-				if((csf->flags & SONG_INSTRUMENTMODE) && csf->instruments[instr])
+				if ((csf->flags & SONG_INSTRUMENTMODE) && csf->instruments[instr]
+				    && !(csf->mix_flags & SNDMIX_NOOUTPUT))
 					GM_DPatch(nchan, csf->instruments[instr]->midi_program,
 						csf->instruments[instr]->midi_bank,
 						csf->instruments[instr]->midi_channel_mask);
@@ -2309,11 +2607,12 @@ void csf_process_effects(song_t *csf, int firsttick)
 					    && chan->new_instrument < MAX_INSTRUMENTS
 					    && csf->instruments[chan->new_instrument]) {
 						if (csf->samples[chan->new_instrument].flags & CHN_ADLIB) {
-							OPL_Patch(nchan, csf->samples[chan->new_instrument].adlib_bytes);
+							OPL_Patch(csf, nchan, csf->samples[chan->new_instrument].adlib_bytes);
 						}
-						GM_DPatch(nchan, csf->instruments[chan->new_instrument]->midi_program,
-							csf->instruments[chan->new_instrument]->midi_bank,
-							csf->instruments[chan->new_instrument]->midi_channel_mask);
+						if (!(csf->mix_flags & SNDMIX_NOOUTPUT))
+							GM_DPatch(nchan, csf->instruments[chan->new_instrument]->midi_program,
+								csf->instruments[chan->new_instrument]->midi_bank,
+								csf->instruments[chan->new_instrument]->midi_channel_mask);
 					}
 					chan->new_instrument = 0;
 				}
@@ -23,47 +23,32 @@
 
 #include "player/sndfile.h"
 #include "player/cmixer.h"
-#include "song.h"
+#include "cpu.h"
 #include <math.h>
 
+#ifdef SCHISM_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
 
 #define EQ_BANDWIDTH    2.0
 #define EQ_ZERO         0.000001
 
-typedef struct {
-    float a0, a1, a2, b1, b2;
-    float x1, x2, y1, y2;
-    float gain, center_frequency;
-    int   enabled;
-} eq_band;
-
-
-
 //static REAL f2ic = (REAL)(1 << 28);
 //static REAL i2fc = (REAL)(1.0 / (1 << 28));
 
-static eq_band eq[MAX_EQ_BANDS * 2] =
+// The band state lives in song_t (csf->eq), so songs that are rendered at
+// the same time don't run through each other's filter history.
+
+// bands that wouldn't change anything are skipped
+static inline int eq_band_active(const song_eq_band_t *pbs)
 {
-    // Default: Flat EQ
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   120, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   600, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  1200, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  3000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  6000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 10000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   120, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,   600, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  1200, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  3000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  6000, 0},
-    {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 10000, 0},
-};
-
-
-static void eq_filter(eq_band *pbs, int32_t *buffer, uint32_t count)
+	return pbs->enabled && pbs->gain != 1.0f;
+}
+
+static void eq_filter(song_eq_band_t *pbs, int32_t *buffer, uint32_t count, uint32_t stride)
 {
-	int32_t amt = (!!(audio_settings.channels-1)+1); // if 1, amt is 1, else 2
-	for (uint32_t i = 0; i < count; i+=amt) {
+	for (uint32_t i = 0; i < count; i += stride) {
 		float x = buffer[i];
 		float y = pbs->a1 * pbs->x1 +
 			  pbs->a2 * pbs->x2 +
@@ -79,51 +64,177 @@ static void eq_filter(eq_band *pbs, int32_t *buffer, uint32_t count)
 	}
 }
 
-void normalize_mono(song_t *csf, int32_t *buffer, uint32_t count)
+void eq_mono(song_t *csf, int32_t *buffer, uint32_t count)
 {
-	for (uint32_t b = 0; b < count; b++)
-		buffer[b] = _muldiv(buffer[b], audio_settings.master.left + audio_settings.master.right, 62);
+	song_eq_band_t *eq = csf->eq;
+
+	for (uint32_t b = 0; b < MAX_EQ_BANDS; b++)
+		if (eq_band_active(&eq[b]))
+			eq_filter(&eq[b], buffer, count, 1);
 }
 
-void normalize_stereo(song_t *csf, int32_t *buffer, uint32_t count)
+#ifdef SCHISM_HAVE_SSE2
+// Runs both channels through their bands together, lane 0 being the left
+// band and lane 1 the right one, and a whole frame through every band before
+// moving on so the bands' feedback chains can overlap. The arithmetic and
+// the rounding to an integer between bands are the same as in eq_filter; a
+// lane whose band is off passes its input through.
+typedef struct eq_pair_sse2 {
+	__m128 a0, a1, a2, b1, b2;
+	__m128 x1, x2, y1, y2;
+	__m128i bypass;
+	uint32_t band;
+} eq_pair_sse2_t;
+
+static SCHISM_TARGET_SSE2 void eq_stereo_sse2(song_eq_band_t *eq, int32_t *buffer, uint32_t count)
 {
-	uint32_t b = 0;
+	eq_pair_sse2_t pairs[MAX_EQ_BANDS];
+	uint32_t npairs = 0;
+
+	for (uint32_t b = 0; b < MAX_EQ_BANDS; b++) {
+		song_eq_band_t *l = &eq[b], *r = &eq[b + MAX_EQ_BANDS];
+		int on_l = eq_band_active(l), on_r = eq_band_active(r);
+		eq_pair_sse2_t *p;
+
+		if (!on_l && !on_r)
+			continue;
 
-	while (b < count) {
-		buffer[b] = _muldiv(buffer[b], audio_settings.master.left, 31);
-		b++;
-		buffer[b] = _muldiv(buffer[b], audio_settings.master.right, 31);
-		b++;
+		p = &pairs[npairs++];
+		p->a0 = _mm_setr_ps(l->a0, r->a0, 0.0f, 0.0f);
+		p->a1 = _mm_setr_ps(l->a1, r->a1, 0.0f, 0.0f);
+		p->a2 = _mm_setr_ps(l->a2, r->a2, 0.0f, 0.0f);
+		p->b1 = _mm_setr_ps(l->b1, r->b1, 0.0f, 0.0f);
+		p->b2 = _mm_setr_ps(l->b2, r->b2, 0.0f, 0.0f);
+		p->x1 = _mm_setr_ps(l->x1, r->x1, 0.0f, 0.0f);
+		p->x2 = _mm_setr_ps(l->x2, r->x2, 0.0f, 0.0f);
+		p->y1 = _mm_setr_ps(l->y1, r->y1, 0.0f, 0.0f);
+		p->y2 = _mm_setr_ps(l->y2, r->y2, 0.0f, 0.0f);
+		p->bypass = _mm_setr_epi32(on_l ? 0 : -1, on_r ? 0 : -1, -1, -1);
+		p->band = b;
 	}
-}
 
+	if (!npairs)
+		return;
 
-void eq_mono(song_t *csf, int32_t *buffer, uint32_t count)
-{
-	for (uint32_t b = 0; b < MAX_EQ_BANDS; b++)
-		if (eq[b].enabled && eq[b].gain != 1.0f)
-			eq_filter(&eq[b], buffer, count);
+	for (uint32_t i = 0; i < count; i++) {
+		__m128i in = _mm_loadl_epi64((const __m128i *) (buffer + 2 * i));
+
+		for (uint32_t k = 0; k < npairs; k++) {
+			eq_pair_sse2_t *p = &pairs[k];
+			__m128 x = _mm_cvtepi32_ps(in);
+			__m128 y = _mm_mul_ps(p->a1, p->x1);
+
+			y = _mm_add_ps(y, _mm_mul_ps(p->a2, p->x2));
+			y = _mm_add_ps(y, _mm_mul_ps(p->a0, x));
+			y = _mm_add_ps(y, _mm_mul_ps(p->b1, p->y1));
+			y = _mm_add_ps(y, _mm_mul_ps(p->b2, p->y2));
+
+			p->x2 = p->x1;
+			p->y2 = p->y1;
+			p->x1 = x;
+			p->y1 = y;
+
+			in = _mm_or_si128(_mm_and_si128(p->bypass, in),
+				_mm_andnot_si128(p->bypass, _mm_cvttps_epi32(y)));
+		}
+
+		_mm_storel_epi64((__m128i *) (buffer + 2 * i), in);
+	}
+
+	for (uint32_t k = 0; k < npairs; k++) {
+		float x1[4], x2[4], y1[4], y2[4];
+
+		_mm_storeu_ps(x1, pairs[k].x1);
+		_mm_storeu_ps(x2, pairs[k].x2);
+		_mm_storeu_ps(y1, pairs[k].y1);
+		_mm_storeu_ps(y2, pairs[k].y2);
+
+		for (uint32_t c = 0; c < 2; c++) {
+			song_eq_band_t *pbs = &eq[pairs[k].band + c * MAX_EQ_BANDS];
+
+			if (!eq_band_active(pbs))
+				continue;
+
+			pbs->x1 = x1[c];
+			pbs->x2 = x2[c];
+			pbs->y1 = y1[c];
+			pbs->y2 = y2[c];
+		}
+	}
 }
+#endif /* SCHISM_HAVE_SSE2 */
 
 // XXX: I rolled the two loops into one. Make sure this works.
 void eq_stereo(song_t *csf, int32_t *buffer, uint32_t count)
 {
+	song_eq_band_t *eq = csf->eq;
+
+#ifdef SCHISM_HAVE_SSE2
+	if (cpu_has_feature(CPU_FEATURE_SSE2)) {
+		eq_stereo_sse2(eq, buffer, count);
+		return;
+	}
+#endif
+
 	for (uint32_t b = 0; b < MAX_EQ_BANDS; b++) {
 		int32_t br = b + MAX_EQ_BANDS;
 
 		// Left band
-		if (eq[b].enabled && eq[b].gain != 1.0f)
-			eq_filter(&eq[b], buffer, count << 1);
+		if (eq_band_active(&eq[b]))
+			eq_filter(&eq[b], buffer, count << 1, 2);
 
 		// Right band
-		if (eq[br].enabled && eq[br].gain != 1.0f)
-			eq_filter(&eq[br], buffer + 1, count << 1);
+		if (eq_band_active(&eq[br]))
+			eq_filter(&eq[br], buffer + 1, count << 1, 2);
+	}
+}
+
+// Float bus: no rounding between the bands.
+static void eq_filter_float(song_eq_band_t *pbs, float *buffer, uint32_t count, uint32_t stride)
+{
+	for (uint32_t i = 0; i < count; i += stride) {
+		float x = buffer[i];
+		float y = pbs->a1 * pbs->x1 +
+			  pbs->a2 * pbs->x2 +
+			  pbs->a0 * x +
+			  pbs->b1 * pbs->y1 +
+			  pbs->b2 * pbs->y2;
+
+		pbs->x2 = pbs->x1;
+		pbs->y2 = pbs->y1;
+		pbs->x1 = x;
+		buffer[i] = y;
+		pbs->y1 = y;
+	}
+}
+
+void eq_mono_float(song_t *csf, float *buffer, uint32_t count)
+{
+	song_eq_band_t *eq = csf->eq;
+
+	for (uint32_t b = 0; b < MAX_EQ_BANDS; b++)
+		if (eq_band_active(&eq[b]))
+			eq_filter_float(&eq[b], buffer, count, 1);
+}
+
+void eq_stereo_float(song_t *csf, float *buffer, uint32_t count)
+{
+	song_eq_band_t *eq = csf->eq;
+
+	for (uint32_t b = 0; b < MAX_EQ_BANDS; b++) {
+		if (eq_band_active(&eq[b]))
+			eq_filter_float(&eq[b], buffer, count << 1, 2);
+
+		if (eq_band_active(&eq[b + MAX_EQ_BANDS]))
+			eq_filter_float(&eq[b + MAX_EQ_BANDS], buffer + 1, count << 1, 2);
 	}
 }
 
 
-void initialize_eq(int32_t reset, float freq)
+void initialize_eq(song_t *csf, int32_t reset, float freq)
 {
+	song_eq_band_t *eq = csf->eq;
+
 	//float fMixingFreq = (REAL)mix_frequency;
 
 	// Gain = 0.5 (-6dB) .. 2 (+6dB)
@@ -219,8 +330,10 @@ void initialize_eq(int32_t reset, float freq)
 }
 
 
-void set_eq_gains(const uint32_t *gainbuff, uint32_t gains, const uint32_t *freqs, int32_t reset, int32_t mix_freq)
+void set_eq_gains(song_t *csf, const uint32_t *gainbuff, uint32_t gains, const uint32_t *freqs, int32_t reset, int32_t mix_freq)
 {
+	song_eq_band_t *eq = csf->eq;
+
 	for (uint32_t i = 0; i < MAX_EQ_BANDS; i++) {
 		float g, f = 0;
 
@@ -256,6 +369,6 @@ void set_eq_gains(const uint32_t *gainbuff, uint32_t gains, const uint32_t *freq
 		}
 	}
 
-	initialize_eq(reset, mix_freq);
+	initialize_eq(csf, reset, mix_freq);
 }
 
@@ -63,16 +63,35 @@ static const float resonance_table[128] = {
 };
 
 
-// Simple 2-poles resonant filter
-//
-// XXX freq WAS unused but is now mix_frequency!
-//
 #define FREQ_PARAM_MULT (128.0 / (24.0 * 256.0))
-void setup_channel_filter(song_voice_t *chan, int32_t reset, int32_t flt_modifier, int32_t freq)
+
+// r = mix rate / (2 * pi * cutoff frequency)
+static float filter_cutoff_ratio(int32_t cutoff, int32_t freq)
+{
+	float frequency;
+
+	// 2 ^ (i / 24 * 256)
+	frequency = 110.0 * powf(2.0, (float)cutoff * FREQ_PARAM_MULT + 0.25);
+	if (frequency > freq / 2.0)
+		frequency = freq / 2.0;
+	return freq / (2.0 * M_PI * frequency);
+}
+
+// Called by csf_init_player whenever the mix rate might have changed.
+void init_filter_table(song_t *csf)
+{
+	for (int32_t i = 0; i < 256; i++)
+		csf->filter_cutoff_ratio[i] = filter_cutoff_ratio(i, csf->mix_frequency);
+	csf->filter_table_rate = csf->mix_frequency;
+}
+
+
+// Simple 2-poles resonant filter
+void setup_channel_filter(song_t *csf, song_voice_t *chan, int32_t reset, int32_t flt_modifier)
 {
 	int32_t cutoff = chan->cutoff;
 	int32_t resonance = chan->resonance;
-	float frequency, r, d, e, fg, fb0, fb1;
+	float r, d, e, fg, fb0, fb1;
 
 	cutoff = cutoff * (flt_modifier + 256) / 256;
 
@@ -94,11 +113,11 @@ void setup_channel_filter(song_voice_t *chan, int32_t reset, int32_t flt_modifie
 	}
 	chan->flags |= CHN_FILTER;
 
-	// 2 ^ (i / 24 * 256)
-	frequency = 110.0 * powf(2.0, (float)cutoff * FREQ_PARAM_MULT + 0.25);
-	if (frequency > freq / 2.0)
-		frequency = freq / 2.0;
-	r = freq / (2.0 * M_PI * frequency);
+	// the table is only out of date if the mix rate was changed behind our back
+	if (cutoff >= 0 && csf->filter_table_rate == csf->mix_frequency)
+		r = csf->filter_cutoff_ratio[cutoff];
+	else
+		r = filter_cutoff_ratio(cutoff, csf->mix_frequency);
 
 	d = resonance_table[resonance] * r + resonance_table[resonance] - 1.0;
 	e = r * r;
@@ -29,8 +29,17 @@
 #include "player/snd_gm.h"
 #include "player/cmixer.h"
 #include "bshift.h"
+#include "cpu.h"
+#include "threads.h"
 #include "util.h"   // for CLAMP
 
+#ifdef SCHISM_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+#ifdef SCHISM_HAVE_NEON
+# include <arm_neon.h>
+#endif
+
 // For pingpong loops that work like most of Impulse Tracker's drivers
 // (including SB16, SBPro, and the disk writer) -- as well as XMPlay, use 1
 // To make them sound like the GUS driver, use 0.
@@ -103,12 +112,16 @@
 // MIXING MACROS
 // ----------------------------------------------------------------------------
 
+// The kernels read from a private copy of the mix voice: nothing can be
+// writing to it behind their back, so it can all live in registers instead
+// of being read again after every store to the mix buffer.
 #define SNDMIX_BEGINSAMPLELOOP(bits) \
-	register song_voice_t * const chan = channel; \
+	const song_mix_voice_t voice = *channel; \
+	const song_mix_voice_t *const chan = &voice; \
 	position = chan->position_frac; \
 	const int##bits##_t *p = (int##bits##_t *)(chan->current_sample_data) + chan->position; \
 	if (chan->flags & CHN_STEREO) p += chan->position; \
-	int32_t *pvol = pbuffer; \
+	MIX_BUFFER_TYPE *pvol = pbuffer; \
 	uint32_t max = 0; \
 	do {
 
@@ -116,9 +129,9 @@
 #define SNDMIX_ENDSAMPLELOOP \
 		position += chan->increment; \
 	} while (pvol < pbufmax); \
-	chan->vu_meter = max >> 16; \
-	chan->position  += position >> 16; \
-	chan->position_frac = position & 0xFFFF;
+	channel->vu_meter = max >> 16; \
+	channel->position  += position >> 16; \
+	channel->position_frac = position & 0xFFFF;
 
 //////////////////////////////////////////////////////////////////////////////
 // Mono
@@ -232,6 +245,253 @@
 			, 1), \
 		WFIR_##bits##SHIFT - 1);
 
+/////////////////////////////////////////////////////////////////////////////
+// Vectorized interpolation
+//
+// These compute exactly the same sums as the macros above (the products are
+// all 16x16->32 bit and integer addition doesn't care about ordering), so
+// the output is bit-identical to the plain C kernels. Only the spline and
+// FIR interpolators are worth it; the rest are a couple of multiplies.
+
+#ifdef SCHISM_HAVE_SSE2
+
+static inline SCHISM_TARGET_SSE2 __m128i sse2_load4_8(const int8_t *p)
+{
+	int32_t x;
+	memcpy(&x, p, sizeof(x));
+	__m128i v = _mm_cvtsi32_si128(x);
+	return _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+}
+
+static inline SCHISM_TARGET_SSE2 __m128i sse2_load4_16(const int16_t *p)
+{
+	return _mm_loadl_epi64((const __m128i *)p);
+}
+
+static inline SCHISM_TARGET_SSE2 __m128i sse2_load8_8(const int8_t *p)
+{
+	__m128i v = _mm_loadl_epi64((const __m128i *)p);
+	return _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+}
+
+static inline SCHISM_TARGET_SSE2 __m128i sse2_load8_16(const int16_t *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+// loads 16 samples into two vectors of 8
+static inline SCHISM_TARGET_SSE2 void sse2_load16_8(const int8_t *p, __m128i *lo, __m128i *hi)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	*lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+	*hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+}
+
+static inline SCHISM_TARGET_SSE2 void sse2_load16_16(const int16_t *p, __m128i *lo, __m128i *hi)
+{
+	*lo = _mm_loadu_si128((const __m128i *)p);
+	*hi = _mm_loadu_si128((const __m128i *)(p + 8));
+}
+
+// (lut[0..3] . smp[0..3]); smp is four samples in the low half
+static inline SCHISM_TARGET_SSE2 int32_t sse2_spline_mono(const int16_t *lut, __m128i smp)
+{
+	__m128i v = _mm_madd_epi16(_mm_loadl_epi64((const __m128i *)lut), smp);
+	v = _mm_add_epi32(v, _mm_srli_si128(v, 4));
+	return _mm_cvtsi128_si32(v);
+}
+
+// smp is four interleaved stereo frames
+static inline SCHISM_TARGET_SSE2 void sse2_spline_stereo(const int16_t *lut, __m128i smp, int32_t *vol_l, int32_t *vol_r)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_loadl_epi64((const __m128i *)lut);
+
+	// c0 0 c1 0 ... picks out the left samples, 0 c0 0 c1 ... the right
+	__m128i l = _mm_madd_epi16(smp, _mm_unpacklo_epi16(c, zero));
+	__m128i r = _mm_madd_epi16(smp, _mm_unpacklo_epi16(zero, c));
+
+	__m128i t = _mm_add_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r));
+	t = _mm_add_epi32(t, _mm_unpackhi_epi64(t, t));
+
+	*vol_l = _mm_cvtsi128_si32(t);
+	*vol_r = _mm_cvtsi128_si32(_mm_srli_si128(t, 4));
+}
+
+// the FIR sums each half of the window separately and halves it, to
+// keep from overflowing
+static inline SCHISM_TARGET_SSE2 int32_t sse2_fir_mono(const int16_t *lut, __m128i smp)
+{
+	__m128i v = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)lut), smp);
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_srai_epi32(v, 1);
+	return _mm_cvtsi128_si32(v) + _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+
+// lo/hi are the first and last four interleaved stereo frames
+static inline SCHISM_TARGET_SSE2 void sse2_fir_stereo(const int16_t *lut, __m128i lo, __m128i hi, int32_t *vol_l, int32_t *vol_r)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_loadu_si128((const __m128i *)lut);
+
+	__m128i la = _mm_madd_epi16(lo, _mm_unpacklo_epi16(c, zero));
+	__m128i ra = _mm_madd_epi16(lo, _mm_unpacklo_epi16(zero, c));
+	__m128i lb = _mm_madd_epi16(hi, _mm_unpackhi_epi16(c, zero));
+	__m128i rb = _mm_madd_epi16(hi, _mm_unpackhi_epi16(zero, c));
+
+	__m128i a = _mm_add_epi32(_mm_unpacklo_epi32(la, ra), _mm_unpackhi_epi32(la, ra));
+	__m128i b = _mm_add_epi32(_mm_unpacklo_epi32(lb, rb), _mm_unpackhi_epi32(lb, rb));
+
+	// left-a right-a left-b right-b
+	__m128i t = _mm_add_epi32(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+	t = _mm_srai_epi32(t, 1);
+	t = _mm_add_epi32(t, _mm_unpackhi_epi64(t, t));
+
+	*vol_l = _mm_cvtsi128_si32(t);
+	*vol_r = _mm_cvtsi128_si32(_mm_srli_si128(t, 4));
+}
+
+#define SNDMIX_GETMONOVOLSPLINE_SSE2(bits) \
+	int32_t poshi = position >> 16; \
+	int32_t poslo = rshift_signed(position, SPLINE_FRACSHIFT) & SPLINE_FRACMASK; \
+	int32_t vol   = rshift_signed(sse2_spline_mono(cubic_spline_lut + poslo, \
+		sse2_load4_##bits(p + poshi - 1)), SPLINE_##bits##SHIFT);
+
+#define SNDMIX_GETMONOVOLFIRFILTER_SSE2(bits) \
+	int32_t poshi  = position >> 16; \
+	int32_t poslo  = (position & 0xFFFF); \
+	int32_t firidx = rshift_signed(poslo + WFIR_FRACHALVE, WFIR_FRACSHIFT) & WFIR_FRACMASK; \
+	int32_t vol    = rshift_signed(sse2_fir_mono(windowed_fir_lut + firidx, \
+		sse2_load8_##bits(p + poshi - 3)), WFIR_##bits##SHIFT - 1);
+
+#define SNDMIX_GETSTEREOVOLSPLINE_SSE2(bits) \
+	int32_t poshi = position >> 16; \
+	int32_t poslo = (position >> SPLINE_FRACSHIFT) & SPLINE_FRACMASK; \
+	int32_t vol_l, vol_r; \
+	sse2_spline_stereo(cubic_spline_lut + poslo, sse2_load8_##bits(p + (poshi - 1) * 2), &vol_l, &vol_r); \
+	vol_l = rshift_signed(vol_l, SPLINE_##bits##SHIFT); \
+	vol_r = rshift_signed(vol_r, SPLINE_##bits##SHIFT);
+
+#define SNDMIX_GETSTEREOVOLFIRFILTER_SSE2(bits) \
+	int32_t poshi  = position >> 16; \
+	int32_t poslo  = (position & 0xFFFF); \
+	int32_t firidx = rshift_signed(poslo + WFIR_FRACHALVE, WFIR_FRACSHIFT) & WFIR_FRACMASK; \
+	int32_t vol_l, vol_r; \
+	__m128i smp_lo, smp_hi; \
+	sse2_load16_##bits(p + (poshi - 3) * 2, &smp_lo, &smp_hi); \
+	sse2_fir_stereo(windowed_fir_lut + firidx, smp_lo, smp_hi, &vol_l, &vol_r); \
+	vol_l = rshift_signed(vol_l, WFIR_##bits##SHIFT - 1); \
+	vol_r = rshift_signed(vol_r, WFIR_##bits##SHIFT - 1);
+
+#endif /* SCHISM_HAVE_SSE2 */
+
+#ifdef SCHISM_HAVE_NEON
+
+static inline int16x4_t neon_load4_8(const int8_t *p)
+{
+	int32_t x;
+	memcpy(&x, p, sizeof(x));
+	return vget_low_s16(vmovl_s8(vreinterpret_s8_s32(vdup_n_s32(x))));
+}
+
+static inline int16x4_t neon_load4_16(const int16_t *p)
+{
+	return vld1_s16(p);
+}
+
+static inline int16x8_t neon_load8_8(const int8_t *p)
+{
+	return vmovl_s8(vld1_s8(p));
+}
+
+static inline int16x8_t neon_load8_16(const int16_t *p)
+{
+	return vld1q_s16(p);
+}
+
+// deinterleaves four stereo frames
+static inline int16x4x2_t neon_load4x2_8(const int8_t *p)
+{
+	int16x8x2_t u;
+	int16x4x2_t r;
+	int16x8_t v = vmovl_s8(vld1_s8(p));
+
+	u = vuzpq_s16(v, v);
+	r.val[0] = vget_low_s16(u.val[0]);
+	r.val[1] = vget_low_s16(u.val[1]);
+	return r;
+}
+
+static inline int16x4x2_t neon_load4x2_16(const int16_t *p)
+{
+	return vld2_s16(p);
+}
+
+// deinterleaves eight stereo frames
+static inline int16x8x2_t neon_load8x2_8(const int8_t *p)
+{
+	int8x8x2_t v = vld2_s8(p);
+	int16x8x2_t r;
+
+	r.val[0] = vmovl_s8(v.val[0]);
+	r.val[1] = vmovl_s8(v.val[1]);
+	return r;
+}
+
+static inline int16x8x2_t neon_load8x2_16(const int16_t *p)
+{
+	return vld2q_s16(p);
+}
+
+static inline int32_t neon_hsum(int32x4_t v)
+{
+	int32x2_t s = vadd_s32(vget_low_s32(v), vget_high_s32(v));
+	return vget_lane_s32(vpadd_s32(s, s), 0);
+}
+
+static inline int32_t neon_spline(const int16_t *lut, int16x4_t smp)
+{
+	return neon_hsum(vmull_s16(vld1_s16(lut), smp));
+}
+
+static inline int32_t neon_fir(const int16_t *lut, int16x8_t smp)
+{
+	int16x8_t c = vld1q_s16(lut);
+
+	return rshift_signed(neon_hsum(vmull_s16(vget_low_s16(c), vget_low_s16(smp))), 1)
+		+ rshift_signed(neon_hsum(vmull_s16(vget_high_s16(c), vget_high_s16(smp))), 1);
+}
+
+#define SNDMIX_GETMONOVOLSPLINE_NEON(bits) \
+	int32_t poshi = position >> 16; \
+	int32_t poslo = rshift_signed(position, SPLINE_FRACSHIFT) & SPLINE_FRACMASK; \
+	int32_t vol   = rshift_signed(neon_spline(cubic_spline_lut + poslo, \
+		neon_load4_##bits(p + poshi - 1)), SPLINE_##bits##SHIFT);
+
+#define SNDMIX_GETMONOVOLFIRFILTER_NEON(bits) \
+	int32_t poshi  = position >> 16; \
+	int32_t poslo  = (position & 0xFFFF); \
+	int32_t firidx = rshift_signed(poslo + WFIR_FRACHALVE, WFIR_FRACSHIFT) & WFIR_FRACMASK; \
+	int32_t vol    = rshift_signed(neon_fir(windowed_fir_lut + firidx, \
+		neon_load8_##bits(p + poshi - 3)), WFIR_##bits##SHIFT - 1);
+
+#define SNDMIX_GETSTEREOVOLSPLINE_NEON(bits) \
+	int32_t poshi = position >> 16; \
+	int32_t poslo = (position >> SPLINE_FRACSHIFT) & SPLINE_FRACMASK; \
+	int16x4x2_t smp = neon_load4x2_##bits(p + (poshi - 1) * 2); \
+	int32_t vol_l = rshift_signed(neon_spline(cubic_spline_lut + poslo, smp.val[0]), SPLINE_##bits##SHIFT); \
+	int32_t vol_r = rshift_signed(neon_spline(cubic_spline_lut + poslo, smp.val[1]), SPLINE_##bits##SHIFT);
+
+#define SNDMIX_GETSTEREOVOLFIRFILTER_NEON(bits) \
+	int32_t poshi  = position >> 16; \
+	int32_t poslo  = (position & 0xFFFF); \
+	int32_t firidx = rshift_signed(poslo + WFIR_FRACHALVE, WFIR_FRACSHIFT) & WFIR_FRACMASK; \
+	int16x8x2_t smp = neon_load8x2_##bits(p + (poshi - 3) * 2); \
+	int32_t vol_l = rshift_signed(neon_fir(windowed_fir_lut + firidx, smp.val[0]), WFIR_##bits##SHIFT - 1); \
+	int32_t vol_r = rshift_signed(neon_fir(windowed_fir_lut + firidx, smp.val[1]), WFIR_##bits##SHIFT - 1);
+
+#endif /* SCHISM_HAVE_NEON */
+
 // FIXME why are these backwards? what?
 #define SNDMIX_STOREMONOVOL \
 	int32_t vol_lx = vol * chan->right_volume; \
@@ -240,7 +500,7 @@
 	pvol[1] += vol_rx; \
 	int32_t vol_avg = rshift_signed(vol_lx, 1) + rshift_signed(vol_rx, 1); \
 	vol_avg = (vol_avg < 0) ? -vol_avg : vol_avg; \
-	if (vol_avg > max) max = vol_avg; \
+	if ((uint32_t)vol_avg > max) max = vol_avg; \
 	pvol += 2;
 
 #define SNDMIX_STORESTEREOVOL \
@@ -250,7 +510,7 @@
 	pvol[1] += vol_rx; \
 	int32_t vol_avg = rshift_signed(vol_lx, 1) + rshift_signed(vol_rx, 1); \
 	vol_avg = (vol_avg < 0) ? -vol_avg : vol_avg; \
-	if (vol_avg > max) max = vol_avg; \
+	if ((uint32_t)vol_avg > max) max = vol_avg; \
 	pvol += 2;
 
 #define SNDMIX_STOREFASTMONOVOL \
@@ -258,7 +518,7 @@
 	pvol[0] += v; \
 	pvol[1] += v; \
 	v = (v < 0) ? -v : v; \
-	if (v > max) max = v; \
+	if ((uint32_t)v > max) max = v; \
 	pvol += 2;
 
 #define SNDMIX_RAMPMONOVOL \
@@ -270,7 +530,7 @@
 	pvol[1] += vol_rx; \
 	int32_t vol_avg = rshift_signed(vol_lx, 1) + rshift_signed(vol_rx, 1); \
 	vol_avg = (vol_avg < 0) ? -vol_avg : vol_avg; \
-	if (vol_avg > max) max = vol_avg; \
+	if ((uint32_t)vol_avg > max) max = vol_avg; \
 	pvol += 2;
 
 #define SNDMIX_RAMPFASTMONOVOL \
@@ -279,7 +539,7 @@
 	pvol[0] += fastvol; \
 	pvol[1] += fastvol; \
 	fastvol = (fastvol < 0) ? -fastvol : fastvol; \
-	if (fastvol > max) max = fastvol; \
+	if ((uint32_t)fastvol > max) max = fastvol; \
 	pvol += 2;
 
 #define SNDMIX_RAMPSTEREOVOL \
@@ -291,7 +551,7 @@
 	pvol[1] += vol_rx; \
 	int32_t vol_avg = rshift_signed(vol_lx, 1) + rshift_signed(vol_rx, 1); \
 	vol_avg = (vol_avg < 0) ? -vol_avg : vol_avg; \
-	if (vol_avg > max) max = vol_avg; \
+	if ((uint32_t)vol_avg > max) max = vol_avg; \
 	pvol += 2;
 
 ///////////////////////////////////////////////////
@@ -330,11 +590,18 @@
 //////////////////////////////////////////////////////////
 // Interfaces
 
-typedef void(* mix_interface_t)(song_voice_t *, int32_t *, int32_t *);
+typedef void(* mix_interface_t)(song_mix_voice_t *, int32_t *, int32_t *);
+typedef void(* mix_interface_float_t)(song_mix_voice_t *, float *, float *);
 
+// redefined around the vectorized kernels
+#define MIX_INTERFACE_ATTR
+
+// redefined around the float bus kernels
+#define MIX_BUFFER_TYPE int32_t
+#define MIX_INTERFACE_NAME(func) func
 
 #define BEGIN_MIX_INTERFACE(func) \
-	static void func(song_voice_t *channel, int32_t *pbuffer, int32_t *pbufmax) \
+	static MIX_INTERFACE_ATTR void MIX_INTERFACE_NAME(func)(song_mix_voice_t *channel, MIX_BUFFER_TYPE *pbuffer, MIX_BUFFER_TYPE *pbufmax) \
 	{ \
 		int_fast32_t position;
 
@@ -500,6 +767,65 @@ DEFINE_MIX_INTERFACE_FAST(16)
 DEFINE_MIX_INTERFACE(8)
 DEFINE_MIX_INTERFACE(16)
 
+/* vectorized variants; only the spline and FIR interpolators */
+#define DEFINE_MIX_INTERFACE_SIMD_RESAMPLING(bits, chns, chnsupper, filter, fltnam, fltint, fast, fastupper, simd, SIMD) \
+	DEFINE_MIX_INTERFACE_RAMP(bits, chns, chnsupper, filter, fltnam, fltint, fast, fastupper, Spline##simd,    SPLINE_##SIMD) \
+	DEFINE_MIX_INTERFACE_RAMP(bits, chns, chnsupper, filter, fltnam, fltint, fast, fastupper, FirFilter##simd, FIRFILTER_##SIMD)
+
+#define DEFINE_MIX_INTERFACE_SIMD(bits, simd, SIMD) \
+	DEFINE_MIX_INTERFACE_SIMD_RESAMPLING(bits, Mono,   MONO,   /* none */, /* none */, /* none */, Fast, FAST, simd, SIMD) \
+	DEFINE_MIX_INTERFACE_SIMD_RESAMPLING(bits, Mono,   MONO,   /* none */, /* none */, /* none */, /* none */, /* none */, simd, SIMD) \
+	DEFINE_MIX_INTERFACE_SIMD_RESAMPLING(bits, Mono,   MONO,   SNDMIX_PROCESSMONOFILTER,   Filter, MONO_FLT_, /* none */, /* none */, simd, SIMD) \
+	DEFINE_MIX_INTERFACE_SIMD_RESAMPLING(bits, Stereo, STEREO, /* none */, /* none */, /* none */, /* none */, /* none */, simd, SIMD) \
+	DEFINE_MIX_INTERFACE_SIMD_RESAMPLING(bits, Stereo, STEREO, SNDMIX_PROCESSSTEREOFILTER, Filter, STEREO_FLT_, /* none */, /* none */, simd, SIMD)
+
+#ifdef SCHISM_HAVE_SSE2
+# undef MIX_INTERFACE_ATTR
+# define MIX_INTERFACE_ATTR SCHISM_TARGET_SSE2
+DEFINE_MIX_INTERFACE_SIMD(8, SSE2, SSE2)
+DEFINE_MIX_INTERFACE_SIMD(16, SSE2, SSE2)
+# undef MIX_INTERFACE_ATTR
+# define MIX_INTERFACE_ATTR
+#endif
+
+#ifdef SCHISM_HAVE_NEON
+DEFINE_MIX_INTERFACE_SIMD(8, NEON, NEON)
+DEFINE_MIX_INTERFACE_SIMD(16, NEON, NEON)
+#endif
+
+// All of the above again for the float bus (SNDMIX_FLOATBUS). Everything up
+// to the store is the same, but the buffer is float, so however many voices
+// pile up the sum can't wrap around.
+#undef MIX_BUFFER_TYPE
+#define MIX_BUFFER_TYPE float
+#undef MIX_INTERFACE_NAME
+#define MIX_INTERFACE_NAME(func) func##Float
+
+DEFINE_MIX_INTERFACE_FAST(8)
+DEFINE_MIX_INTERFACE_FAST(16)
+
+DEFINE_MIX_INTERFACE(8)
+DEFINE_MIX_INTERFACE(16)
+
+#ifdef SCHISM_HAVE_SSE2
+# undef MIX_INTERFACE_ATTR
+# define MIX_INTERFACE_ATTR SCHISM_TARGET_SSE2
+DEFINE_MIX_INTERFACE_SIMD(8, SSE2, SSE2)
+DEFINE_MIX_INTERFACE_SIMD(16, SSE2, SSE2)
+# undef MIX_INTERFACE_ATTR
+# define MIX_INTERFACE_ATTR
+#endif
+
+#ifdef SCHISM_HAVE_NEON
+DEFINE_MIX_INTERFACE_SIMD(8, NEON, NEON)
+DEFINE_MIX_INTERFACE_SIMD(16, NEON, NEON)
+#endif
+
+#undef MIX_BUFFER_TYPE
+#define MIX_BUFFER_TYPE int32_t
+#undef MIX_INTERFACE_NAME
+#define MIX_INTERFACE_NAME(func) func
+
 // Public Resampling Methods
 #define DEFINE_MONO_RESAMPLE_INTERFACE(bits) \
 	BEGIN_RESAMPLE_INTERFACE(ResampleMono##bits##BitFirFilter, int##bits##_t, 1) \
@@ -543,10 +869,10 @@ DEFINE_STEREO_RESAMPLE_INTERFACE(16)
 #define MIXNDX_FIRSRC       0x30
 
 #define BUILD_MIX_FUNCTION_TABLE_RAMP(fast, resampling, filter, ramp) \
-	fast##filter##Mono8Bit##resampling##ramp##Mix, \
-	fast##filter##Mono16Bit##resampling##ramp##Mix, \
-	filter##Stereo8Bit##resampling##ramp##Mix, \
-	filter##Stereo16Bit##resampling##ramp##Mix,
+	MIX_INTERFACE_NAME(fast##filter##Mono8Bit##resampling##ramp##Mix), \
+	MIX_INTERFACE_NAME(fast##filter##Mono16Bit##resampling##ramp##Mix), \
+	MIX_INTERFACE_NAME(filter##Stereo8Bit##resampling##ramp##Mix), \
+	MIX_INTERFACE_NAME(filter##Stereo16Bit##resampling##ramp##Mix),
 
 #define BUILD_MIX_FUNCTION_TABLE_FILTER(fast, resampling, filter) \
 	BUILD_MIX_FUNCTION_TABLE_RAMP(fast, resampling, filter, /* none */) \
@@ -578,18 +904,153 @@ static const mix_interface_t fastmix_functions[2 * 2 * 16] = {
 	BUILD_MIX_FUNCTION_TABLE_FAST(FirFilter)
 };
 
-static inline int32_t buffer_length_to_samples(int32_t mix_buf_cnt, song_voice_t *chan)
+#ifdef SCHISM_HAVE_SSE2
+static const mix_interface_t mix_functions_sse2[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE(/* none */)
+	BUILD_MIX_FUNCTION_TABLE(Linear)
+	BUILD_MIX_FUNCTION_TABLE(SplineSSE2)
+	BUILD_MIX_FUNCTION_TABLE(FirFilterSSE2)
+};
+
+static const mix_interface_t fastmix_functions_sse2[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE_FAST(/* none */)
+	BUILD_MIX_FUNCTION_TABLE_FAST(Linear)
+	BUILD_MIX_FUNCTION_TABLE_FAST(SplineSSE2)
+	BUILD_MIX_FUNCTION_TABLE_FAST(FirFilterSSE2)
+};
+#endif
+
+#ifdef SCHISM_HAVE_NEON
+static const mix_interface_t mix_functions_neon[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE(/* none */)
+	BUILD_MIX_FUNCTION_TABLE(Linear)
+	BUILD_MIX_FUNCTION_TABLE(SplineNEON)
+	BUILD_MIX_FUNCTION_TABLE(FirFilterNEON)
+};
+
+static const mix_interface_t fastmix_functions_neon[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE_FAST(/* none */)
+	BUILD_MIX_FUNCTION_TABLE_FAST(Linear)
+	BUILD_MIX_FUNCTION_TABLE_FAST(SplineNEON)
+	BUILD_MIX_FUNCTION_TABLE_FAST(FirFilterNEON)
+};
+#endif
+
+// float bus
+#undef MIX_INTERFACE_NAME
+#define MIX_INTERFACE_NAME(func) func##Float
+
+static const mix_interface_float_t mix_functions_float[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE(/* none */)
+	BUILD_MIX_FUNCTION_TABLE(Linear)
+	BUILD_MIX_FUNCTION_TABLE(Spline)
+	BUILD_MIX_FUNCTION_TABLE(FirFilter)
+};
+
+static const mix_interface_float_t fastmix_functions_float[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE_FAST(/* none */)
+	BUILD_MIX_FUNCTION_TABLE_FAST(Linear)
+	BUILD_MIX_FUNCTION_TABLE_FAST(Spline)
+	BUILD_MIX_FUNCTION_TABLE_FAST(FirFilter)
+};
+
+#ifdef SCHISM_HAVE_SSE2
+static const mix_interface_float_t mix_functions_float_sse2[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE(/* none */)
+	BUILD_MIX_FUNCTION_TABLE(Linear)
+	BUILD_MIX_FUNCTION_TABLE(SplineSSE2)
+	BUILD_MIX_FUNCTION_TABLE(FirFilterSSE2)
+};
+
+static const mix_interface_float_t fastmix_functions_float_sse2[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE_FAST(/* none */)
+	BUILD_MIX_FUNCTION_TABLE_FAST(Linear)
+	BUILD_MIX_FUNCTION_TABLE_FAST(SplineSSE2)
+	BUILD_MIX_FUNCTION_TABLE_FAST(FirFilterSSE2)
+};
+#endif
+
+#ifdef SCHISM_HAVE_NEON
+static const mix_interface_float_t mix_functions_float_neon[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE(/* none */)
+	BUILD_MIX_FUNCTION_TABLE(Linear)
+	BUILD_MIX_FUNCTION_TABLE(SplineNEON)
+	BUILD_MIX_FUNCTION_TABLE(FirFilterNEON)
+};
+
+static const mix_interface_float_t fastmix_functions_float_neon[2 * 2 * 16] = {
+	BUILD_MIX_FUNCTION_TABLE_FAST(/* none */)
+	BUILD_MIX_FUNCTION_TABLE_FAST(Linear)
+	BUILD_MIX_FUNCTION_TABLE_FAST(SplineNEON)
+	BUILD_MIX_FUNCTION_TABLE_FAST(FirFilterNEON)
+};
+#endif
+
+#undef MIX_INTERFACE_NAME
+#define MIX_INTERFACE_NAME(func) func
+
+// set by setup_mix_functions
+static const mix_interface_t *active_mix_functions = mix_functions;
+static const mix_interface_t *active_fastmix_functions = fastmix_functions;
+static const mix_interface_float_t *active_mix_functions_float = mix_functions_float;
+static const mix_interface_float_t *active_fastmix_functions_float = fastmix_functions_float;
+static int use_simd = 1;
+
+void setup_mix_functions(void)
+{
+	const mix_interface_t *mixfn = mix_functions;
+	const mix_interface_t *fastmixfn = fastmix_functions;
+	const mix_interface_float_t *mixfnf = mix_functions_float;
+	const mix_interface_float_t *fastmixfnf = fastmix_functions_float;
+
+#ifdef SCHISM_HAVE_SSE2
+	if (use_simd && cpu_has_feature(CPU_FEATURE_SSE2)) {
+		mixfn = mix_functions_sse2;
+		fastmixfn = fastmix_functions_sse2;
+		mixfnf = mix_functions_float_sse2;
+		fastmixfnf = fastmix_functions_float_sse2;
+	}
+#endif
+
+#ifdef SCHISM_HAVE_NEON
+	if (use_simd && cpu_has_feature(CPU_FEATURE_NEON)) {
+		mixfn = mix_functions_neon;
+		fastmixfn = fastmix_functions_neon;
+		mixfnf = mix_functions_float_neon;
+		fastmixfnf = fastmix_functions_float_neon;
+	}
+#endif
+
+	// this gets called whenever any song is set up, possibly while other
+	// songs are being mixed; don't write to the pointers unless they change
+	if (active_mix_functions != mixfn)
+		active_mix_functions = mixfn;
+	if (active_fastmix_functions != fastmixfn)
+		active_fastmix_functions = fastmixfn;
+	if (active_mix_functions_float != mixfnf)
+		active_mix_functions_float = mixfnf;
+	if (active_fastmix_functions_float != fastmixfnf)
+		active_fastmix_functions_float = fastmixfnf;
+}
+
+void mixer_set_simd(int enable)
+{
+	use_simd = !!enable;
+	setup_mix_functions();
+}
+
+static inline int32_t buffer_length_to_samples(int32_t mix_buf_cnt, song_mix_voice_t *chan)
 {
 	return (chan->increment * (int32_t)mix_buf_cnt) + (int32_t)chan->position_frac;
 }
 
-static inline int32_t samples_to_buffer_length(int32_t samples, song_voice_t *chan)
+static inline int32_t samples_to_buffer_length(int32_t samples, song_mix_voice_t *chan)
 {
 	int32_t x = (lshift_signed(samples, 16)) / abs(chan->increment);
 	return MAX(1, x);
 }
 
-static int32_t get_sample_count(song_voice_t *chan, int32_t samples)
+static int32_t get_sample_count(song_mix_voice_t *chan, int32_t samples)
 {
 	int32_t loop_start = (chan->flags & CHN_LOOP) ? chan->loop_start : 0;
 	int32_t increment = chan->increment;
@@ -735,235 +1196,621 @@ static int32_t get_sample_count(song_voice_t *chan, int32_t samples)
 }
 
 
-uint32_t csf_create_stereo_mix(song_t *csf, uint32_t count)
+// Per-thread bookkeeping for a mixing pass. rofs/lofs collect the click
+// removal offsets of voices that stopped, to be added to csf->dry_*ofs_vol.
+// If skip is set, voices are only advanced and nothing is written anywhere.
+struct mix_state {
+	uint32_t nchused, nchmixed;
+	int32_t rofs, lofs;
+	int skip;
+};
+
+SCHISM_STATIC_ASSERT(sizeof(song_mix_voice_t) <= 2 * MIX_VOICE_ALIGN, "mix voices should fit in two cache lines");
+
+static inline song_mix_voice_t *get_mix_voices(song_t *csf)
 {
-	int32_t* ofsl, *ofsr;
-	unsigned int nchused, nchmixed;
+	uintptr_t p = (uintptr_t)csf->mix_voices;
 
-	if (!count)
-		return 0;
+	p = (p + MIX_VOICE_ALIGN - 1) & ~(uintptr_t)(MIX_VOICE_ALIGN - 1);
+	return (song_mix_voice_t *)p;
+}
 
-	nchused = nchmixed = 0;
+// Gathers the voices in voice_mix into the packed array, in mixing order.
+static void mix_voices_load(song_t *csf)
+{
+	song_mix_voice_t *mv = get_mix_voices(csf);
+	uint32_t nchan;
+
+	for (nchan = 0; nchan < csf->num_voices; nchan++, mv++) {
+		const song_voice_t *v = &csf->voices[csf->voice_mix[nchan]];
+
+		mv->current_sample_data = v->current_sample_data;
+		mv->position = v->position;
+		mv->position_frac = v->position_frac;
+		mv->increment = v->increment;
+		mv->right_volume = v->right_volume;
+		mv->left_volume = v->left_volume;
+		mv->right_ramp = v->right_ramp;
+		mv->left_ramp = v->left_ramp;
+		mv->right_ramp_volume = v->right_ramp_volume;
+		mv->left_ramp_volume = v->left_ramp_volume;
+		mv->flags = v->flags;
+		mv->filter_a0 = v->filter_a0;
+		mv->filter_b0 = v->filter_b0;
+		mv->filter_b1 = v->filter_b1;
+		mv->vu_meter = v->vu_meter;
+		memcpy(mv->filter_y, v->filter_y, sizeof(mv->filter_y));
+		mv->length = v->length;
+		mv->loop_start = v->loop_start;
+		mv->loop_end = v->loop_end;
+		mv->ramp_length = v->ramp_length;
+		mv->rofs = v->rofs;
+		mv->lofs = v->lofs;
+		mv->right_volume_new = v->right_volume_new;
+		mv->left_volume_new = v->left_volume_new;
+		mv->fadeout_volume = v->fadeout_volume;
+		mv->master_channel = v->master_channel;
+		mv->ptr_sample = v->ptr_sample;
+	}
+}
 
-	// yuck
-	if (csf->multi_write)
-		for (uint32_t nchan = 0; nchan < MAX_CHANNELS; nchan++)
-			memset(csf->multi_write[nchan].buffer, 0, sizeof(csf->multi_write[nchan].buffer));
+// Puts back whatever the mixer may have changed.
+static void mix_voices_store(song_t *csf)
+{
+	const song_mix_voice_t *mv = get_mix_voices(csf);
+	uint32_t nchan;
+
+	for (nchan = 0; nchan < csf->num_voices; nchan++, mv++) {
+		song_voice_t *v = &csf->voices[csf->voice_mix[nchan]];
+
+		v->current_sample_data = mv->current_sample_data;
+		v->position = mv->position;
+		v->position_frac = mv->position_frac;
+		v->increment = mv->increment;
+		v->right_volume = mv->right_volume;
+		v->left_volume = mv->left_volume;
+		v->right_ramp = mv->right_ramp;
+		v->left_ramp = mv->left_ramp;
+		v->right_ramp_volume = mv->right_ramp_volume;
+		v->left_ramp_volume = mv->left_ramp_volume;
+		v->flags = mv->flags;
+		v->vu_meter = mv->vu_meter;
+		memcpy(v->filter_y, mv->filter_y, sizeof(v->filter_y));
+		v->length = mv->length;
+		v->ramp_length = mv->ramp_length;
+		v->rofs = mv->rofs;
+		v->lofs = mv->lofs;
+	}
+}
 
-	for (uint32_t nchan = 0; nchan < csf->num_voices; nchan++) {
-		const mix_interface_t *mix_func_table;
-		song_voice_t *const channel = &csf->voices[csf->voice_mix[nchan]];
-		uint32_t flags;
-		uint32_t nrampsamples;
-		int32_t smpcount;
-		int32_t nsamples;
-		int32_t *pbuffer;
+// If mix_buffer_float is non-NULL the voice goes there instead of mix_buffer.
+static void mix_voice(song_t *csf, uint32_t nchan, uint32_t count, int32_t *mix_buffer,
+	float *mix_buffer_float, struct mix_state *st)
+{
+	const mix_interface_t *mix_func_table;
+	const mix_interface_float_t *mix_func_table_float;
+	song_mix_voice_t *const channel = get_mix_voices(csf) + nchan;
+	uint32_t flags;
+	uint32_t nrampsamples;
+	int32_t smpcount;
+	int32_t nsamples;
+	int32_t *pbuffer;
+	float *pbuffer_float = mix_buffer_float;
+
+	if (!channel->current_sample_data)
+		return;
+
+	flags = 0;
+
+	if (channel->flags & CHN_16BIT)
+		flags |= MIXNDX_16BIT;
+
+	if (channel->flags & CHN_STEREO)
+		flags |= MIXNDX_STEREO;
+
+	if (channel->flags & CHN_FILTER)
+		flags |= MIXNDX_FILTER;
+
+	if (!(channel->flags & CHN_NOIDO) &&
+		!(csf->mix_flags & SNDMIX_NORESAMPLING)) {
+		// use hq-fir mixer?
+		if ((csf->mix_flags & (SNDMIX_HQRESAMPLER | SNDMIX_ULTRAHQSRCMODE))
+					== (SNDMIX_HQRESAMPLER | SNDMIX_ULTRAHQSRCMODE))
+			flags |= MIXNDX_FIRSRC;
+		else if (csf->mix_flags & SNDMIX_HQRESAMPLER)
+			flags |= MIXNDX_SPLINESRC;
+		else
+			flags |= MIXNDX_LINEARSRC;    // use
+	}
 
-		if (!channel->current_sample_data)
-			continue;
+	if ((flags < 0x40) &&
+		(channel->left_volume == channel->right_volume) &&
+		((!channel->ramp_length) ||
+		(channel->left_ramp == channel->right_ramp))) {
+		mix_func_table = active_fastmix_functions;
+		mix_func_table_float = active_fastmix_functions_float;
+	} else {
+		mix_func_table = active_mix_functions;
+		mix_func_table_float = active_mix_functions_float;
+	}
 
-		ofsr = &g_dry_rofs_vol;
-		ofsl = &g_dry_lofs_vol;
-		flags = 0;
+	nsamples = count;
 
-		if (channel->flags & CHN_16BIT)
-			flags |= MIXNDX_16BIT;
+	if (csf->multi_write && !st->skip) {
+		int32_t master = (csf->voice_mix[nchan] < MAX_CHANNELS)
+			? csf->voice_mix[nchan]
+			: (channel->master_channel - 1);
+		pbuffer = csf->multi_write[master].buffer;
+		csf->multi_write[master].used = 1;
+		csf->multi_write[master].active = 1;
+	} else {
+		pbuffer = mix_buffer;
+	}
 
-		if (channel->flags & CHN_STEREO)
-			flags |= MIXNDX_STEREO;
+	st->nchused++;
+
+	// Our loop lookahead buffer is basically the exact same as OpenMPT's.
+	// (in essence, it is mostly just a backport)
+	//
+	// This means that it has the same bugs that are notated in OpenMPT's
+	// `soundlib/Fastmix.cpp' file, which are the following:
+	//
+	// - Playing samples backwards should reverse interpolation LUTs for interpolation modes
+	//   with more than two taps since they're not symmetric. We might need separate LUTs
+	//   because otherwise we will add tons of branches.
+	// - Loop wraparound works pretty well in general, but not at the start of bidi samples.
+	// - The loop lookahead stuff might still fail for samples with backward loops.
+	int8_t *const smp_ptr = (int8_t *const)(channel->ptr_sample->data);
+	int8_t *lookahead_ptr = NULL;
+	const uint32_t lookahead_start = (channel->loop_end < MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE) ? channel->loop_start : MAX(channel->loop_start, channel->loop_end - MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE);
+	// This shouldn't be necessary with interpolation disabled but with that conditional
+	// it causes weird precision loss within the sample, hence why I've removed it. This
+	// shouldn't be that heavy anyway :p
+	if (channel->flags & CHN_LOOP) {
+		song_sample_t *pins = channel->ptr_sample;
+
+		uint32_t lookahead_offset = 3 * MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE + pins->length - channel->loop_end;
+		if (channel->flags & CHN_SUSTAINLOOP)
+			lookahead_offset += 4 * MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE;
+
+		lookahead_ptr = smp_ptr + lookahead_offset * ((pins->flags & CHN_STEREO) ? 2 : 1) * ((pins->flags & CHN_16BIT) ? 2 : 1);
+	}
 
-		if (channel->flags & CHN_FILTER)
-			flags |= MIXNDX_FILTER;
+	////////////////////////////////////////////////////
+	uint32_t naddmix = 0;
 
-		if (!(channel->flags & CHN_NOIDO) &&
-			!(csf->mix_flags & SNDMIX_NORESAMPLING)) {
-			// use hq-fir mixer?
-			if ((csf->mix_flags & (SNDMIX_HQRESAMPLER | SNDMIX_ULTRAHQSRCMODE))
-						== (SNDMIX_HQRESAMPLER | SNDMIX_ULTRAHQSRCMODE))
-				flags |= MIXNDX_FIRSRC;
-			else if (csf->mix_flags & SNDMIX_HQRESAMPLER)
-				flags |= MIXNDX_SPLINESRC;
-			else
-				flags |= MIXNDX_LINEARSRC;    // use
-		}
+	do {
+		nrampsamples = nsamples;
 
-		if ((flags < 0x40) &&
-			(channel->left_volume == channel->right_volume) &&
-			((!channel->ramp_length) ||
-			(channel->left_ramp == channel->right_ramp))) {
-			mix_func_table = fastmix_functions;
-		} else {
-			mix_func_table = mix_functions;
+		if (channel->ramp_length > 0) {
+			if ((int32_t)nrampsamples > channel->ramp_length)
+				nrampsamples = channel->ramp_length;
 		}
 
-		nsamples = count;
+		smpcount = 1;
 
-		if (csf->multi_write) {
-			int32_t master = (csf->voice_mix[nchan] < MAX_CHANNELS)
-				? csf->voice_mix[nchan]
-				: (channel->master_channel - 1);
-			pbuffer = csf->multi_write[master].buffer;
-			csf->multi_write[master].used = 1;
-		} else {
-			pbuffer = csf->mix_buffer;
+		/* Figure out the number of remaining samples,
+		 * unless we're in AdLib or MIDI mode (to prevent
+		 * artificial KeyOffs)
+		 */
+		if (!(channel->flags & CHN_ADLIB)) {
+			smpcount = get_sample_count(channel, nrampsamples);
 		}
 
-		nchused++;
-
-		// Our loop lookahead buffer is basically the exact same as OpenMPT's.
-		// (in essence, it is mostly just a backport)
-		//
-		// This means that it has the same bugs that are notated in OpenMPT's
-		// `soundlib/Fastmix.cpp' file, which are the following:
-		//
-		// - Playing samples backwards should reverse interpolation LUTs for interpolation modes
-		//   with more than two taps since they're not symmetric. We might need separate LUTs
-		//   because otherwise we will add tons of branches.
-		// - Loop wraparound works pretty well in general, but not at the start of bidi samples.
-		// - The loop lookahead stuff might still fail for samples with backward loops.
-		int8_t *const smp_ptr = (int8_t *const)(channel->ptr_sample->data);
-		int8_t *lookahead_ptr = NULL;
-		const uint32_t lookahead_start = (channel->loop_end < MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE) ? channel->loop_start : MAX(channel->loop_start, channel->loop_end - MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE);
-		// This shouldn't be necessary with interpolation disabled but with that conditional
-		// it causes weird precision loss within the sample, hence why I've removed it. This
-		// shouldn't be that heavy anyway :p
-		if (channel->flags & CHN_LOOP) {
-			song_sample_t *pins = channel->ptr_sample;
-
-			uint32_t lookahead_offset = 3 * MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE + pins->length - channel->loop_end;
-			if (channel->flags & CHN_SUSTAINLOOP)
-				lookahead_offset += 4 * MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE;
-
-			lookahead_ptr = smp_ptr + lookahead_offset * ((pins->flags & CHN_STEREO) ? 2 : 1) * ((pins->flags & CHN_16BIT) ? 2 : 1);
+		if (smpcount <= 0) {
+			// Stopping the channel
+			channel->current_sample_data = NULL;
+			channel->length = 0;
+			channel->position = 0;
+			channel->position_frac = 0;
+			channel->ramp_length = 0;
+			if (st->skip)
+				;
+			else if (pbuffer_float)
+				end_channel_ofs_float(channel, pbuffer_float, nsamples);
+			else
+				end_channel_ofs(channel, pbuffer, nsamples);
+			st->rofs += channel->rofs;
+			st->lofs += channel->lofs;
+			channel->rofs = channel->lofs = 0;
+			channel->flags &= ~CHN_PINGPONGFLAG;
+			break;
 		}
 
-		////////////////////////////////////////////////////
-		uint32_t naddmix = 0;
-
-		do {
-			nrampsamples = nsamples;
-
-			if (channel->ramp_length > 0) {
-				if ((int32_t)nrampsamples > channel->ramp_length)
-					nrampsamples = channel->ramp_length;
-			}
-
-			smpcount = 1;
+		// Should we mix this channel ?
+
+		if (st->skip
+			|| (st->nchmixed >= csf->max_voices && !(csf->mix_flags & SNDMIX_DIRECTTODISK))
+			|| (!channel->ramp_length && !(channel->left_volume | channel->right_volume))) {
+			int32_t delta = buffer_length_to_samples(smpcount, channel);
+			channel->position_frac = delta & 0xFFFF;
+			channel->position += (delta >> 16);
+			channel->rofs = channel->lofs = 0;
+			pbuffer += smpcount * 2;
+			if (pbuffer_float)
+				pbuffer_float += smpcount * 2;
+		} else if (!(channel->flags & CHN_ADLIB)) {
+			// Mix the stream, unless we're in AdLib mode
+
+			// Choose function for mixing
+			const uint32_t idx = channel->ramp_length ? (flags | MIXNDX_RAMP) : flags;
+
+			// Loop wrap-around magic
+			if (lookahead_ptr) {
+				const int32_t oldcount = smpcount;
+				const int32_t read_length = rshift_signed(buffer_length_to_samples(smpcount - 1, channel), 16);
+				const int at_loop_start = (channel->position >= channel->loop_start && channel->position < channel->loop_start + MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE);
+				if (!at_loop_start)
+					channel->flags &= ~CHN_LOOP_WRAPPED;
+
+				channel->current_sample_data = smp_ptr;
+				if (channel->position >= lookahead_start) {
+					int32_t samples_to_read = (channel->increment < 0)
+						? (channel->position - lookahead_start)
+						: (channel->loop_end - channel->position);
+					// this line causes sample 8 in BUTTERFL.XM to play incorrectly
+					//samples_to_read = MAX(samples_to_read, channel->loop_end - channel->loop_start);
+					smpcount = samples_to_buffer_length(samples_to_read, channel);
+
+					channel->current_sample_data = lookahead_ptr;
+				// This code keeps causing clicks with bidi loops, so I'm just gonna comment it out
+				// for now.
+				//} else if ((channel->flags & (CHN_LOOP | CHN_LOOP_WRAPPED)) && at_loop_start) {
+				//	// Interpolate properly after looping
+				//	smpcount = samples_to_buffer_length((channel->loop_start + MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE) - channel->position, channel);
+				//	channel->current_sample_data = lookahead_ptr + (channel->loop_end - channel->loop_start) * ((channel->ptr_sample->flags & CHN_STEREO) ? 2 : 1) * ((channel->ptr_sample->flags & CHN_16BIT) ? 2 : 1);
+				} else if (channel->increment > 0 && channel->position + read_length >= lookahead_start && smpcount > 1) {
+					smpcount = samples_to_buffer_length(lookahead_start - channel->position, channel);
+				}
 
-			/* Figure out the number of remaining samples,
-			 * unless we're in AdLib or MIDI mode (to prevent
-			 * artificial KeyOffs)
-			 */
-			if (!(channel->flags & CHN_ADLIB)) {
-				smpcount = get_sample_count(channel, nrampsamples);
+				smpcount = CLAMP(smpcount, 1, oldcount);
 			}
 
-			if (smpcount <= 0) {
-				// Stopping the channel
-				channel->current_sample_data = NULL;
-				channel->length = 0;
-				channel->position = 0;
-				channel->position_frac = 0;
-				channel->ramp_length = 0;
-				end_channel_ofs(channel, pbuffer, nsamples);
-				*ofsr += channel->rofs;
-				*ofsl += channel->lofs;
-				channel->rofs = channel->lofs = 0;
-				channel->flags &= ~CHN_PINGPONGFLAG;
-				break;
-			}
+			int32_t *pbufmax = pbuffer + (smpcount * 2);
 
-			// Should we mix this channel ?
-
-			if ((nchmixed >= max_voices && !(csf->mix_flags & SNDMIX_DIRECTTODISK))
-				|| (!channel->ramp_length && !(channel->left_volume | channel->right_volume))) {
-				int32_t delta = buffer_length_to_samples(smpcount, channel);
-				channel->position_frac = delta & 0xFFFF;
-				channel->position += (delta >> 16);
-				channel->rofs = channel->lofs = 0;
-				pbuffer += smpcount * 2;
-			} else if (!(channel->flags & CHN_ADLIB)) {
-				// Mix the stream, unless we're in AdLib mode
-
-				// Choose function for mixing
-				mix_interface_t mix_func;
-				mix_func = channel->ramp_length
-					? mix_func_table[flags | MIXNDX_RAMP]
-					: mix_func_table[flags];
-
-				// Loop wrap-around magic
-				if (lookahead_ptr) {
-					const int32_t oldcount = smpcount;
-					const int32_t read_length = rshift_signed(buffer_length_to_samples(smpcount - 1, channel), 16);
-					const int at_loop_start = (channel->position >= channel->loop_start && channel->position < channel->loop_start + MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE);
-					if (!at_loop_start)
-						channel->flags &= ~CHN_LOOP_WRAPPED;
-
-					channel->current_sample_data = smp_ptr;
-					if (channel->position >= lookahead_start) {
-						int32_t samples_to_read = (channel->increment < 0)
-							? (channel->position - lookahead_start)
-							: (channel->loop_end - channel->position);
-						// this line causes sample 8 in BUTTERFL.XM to play incorrectly
-						//samples_to_read = MAX(samples_to_read, channel->loop_end - channel->loop_start);
-						smpcount = samples_to_buffer_length(samples_to_read, channel);
-
-						channel->current_sample_data = lookahead_ptr;
-					// This code keeps causing clicks with bidi loops, so I'm just gonna comment it out
-					// for now.
-					//} else if ((channel->flags & (CHN_LOOP | CHN_LOOP_WRAPPED)) && at_loop_start) {
-					//	// Interpolate properly after looping
-					//	smpcount = samples_to_buffer_length((channel->loop_start + MAX_INTERPOLATION_LOOKAHEAD_BUFFER_SIZE) - channel->position, channel);
-					//	channel->current_sample_data = lookahead_ptr + (channel->loop_end - channel->loop_start) * ((channel->ptr_sample->flags & CHN_STEREO) ? 2 : 1) * ((channel->ptr_sample->flags & CHN_16BIT) ? 2 : 1);
-					} else if (channel->increment > 0 && channel->position + read_length >= lookahead_start && smpcount > 1) {
-						smpcount = samples_to_buffer_length(lookahead_start - channel->position, channel);
-					}
-
-					smpcount = CLAMP(smpcount, 1, oldcount);
-				}
+			if (pbuffer_float) {
+				float *pbufmax_float = pbuffer_float + (smpcount * 2);
+				const float r = *(pbufmax_float - 2);
+				const float l = *(pbufmax_float - 1);
 
-				int32_t *pbufmax = pbuffer + (smpcount * 2);
+				mix_func_table_float[idx](channel, pbuffer_float, pbufmax_float);
+				channel->rofs = (int32_t)(*(pbufmax_float - 2) - r);
+				channel->lofs = (int32_t)(*(pbufmax_float - 1) - l);
+				pbuffer_float = pbufmax_float;
+			} else {
 				channel->rofs = -*(pbufmax - 2);
 				channel->lofs = -*(pbufmax - 1);
 
-				mix_func(channel, pbuffer, pbufmax);
+				mix_func_table[idx](channel, pbuffer, pbufmax);
 				channel->rofs += *(pbufmax - 2);
 				channel->lofs += *(pbufmax - 1);
-				pbuffer = pbufmax;
-				naddmix = 1;
 			}
+			pbuffer = pbufmax;
+			naddmix = 1;
+		}
+
+		nsamples -= smpcount;
 
-			nsamples -= smpcount;
-
-			if (channel->ramp_length) {
-				channel->ramp_length -= smpcount;
-				if (channel->ramp_length <= 0) {
-					channel->ramp_length = 0;
-					channel->right_volume = channel->right_volume_new;
-					channel->left_volume = channel->left_volume_new;
-					channel->right_ramp = channel->left_ramp = 0;
-
-					if ((channel->flags & CHN_NOTEFADE)
-						&& (!(channel->fadeout_volume))) {
-						channel->length = 0;
-						channel->current_sample_data = NULL;
-					}
+		if (channel->ramp_length) {
+			channel->ramp_length -= smpcount;
+			if (channel->ramp_length <= 0) {
+				channel->ramp_length = 0;
+				channel->right_volume = channel->right_volume_new;
+				channel->left_volume = channel->left_volume_new;
+				channel->right_ramp = channel->left_ramp = 0;
+
+				if ((channel->flags & CHN_NOTEFADE)
+					&& (!(channel->fadeout_volume))) {
+					channel->length = 0;
+					channel->current_sample_data = NULL;
 				}
 			}
+		}
+
+	} while (nsamples > 0);
+
+	st->nchmixed += naddmix;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Worker pool
+//
+// Every voice is mixed into a private accumulator by exactly one thread,
+// and the accumulators are summed into the mix buffer in thread order.
+// Since every kernel only ever adds into the buffer, the result is the same
+// as mixing everything on one thread. The calling thread takes the first
+// share itself.
+
+// don't bother waking anyone up for less than this
+#define MIX_THREAD_MIN_VOICES 8
+
+struct mix_worker {
+	schism_thread_t *thread;
+	schism_sem_t *start;
+
+	// set up by the calling thread before posting `start'
+	song_t *csf;
+	uint32_t count;
+	uint32_t first, stride;
+
+	struct mix_state st;
+	int32_t buffer[MIXBUFFERSIZE * 2];
+	float buffer_float[MIXBUFFERSIZE * 2];
+};
+
+static struct {
+	struct mix_worker *workers; // [0] is the calling thread
+	uint32_t num_workers;
+	int quit;
+	int busy;
+	schism_sem_t *done;
+	schism_mutex_t *mutex;
+} mix_pool = {0};
 
-		} while (nsamples > 0);
+static void mix_worker_run(struct mix_worker *w)
+{
+	float *buffer_float = NULL;
+	uint32_t nchan;
 
-		nchmixed += naddmix;
+	memset(&w->st, 0, sizeof(w->st));
+	if (w->csf->mix_flags & SNDMIX_FLOATBUS) {
+		buffer_float = w->buffer_float;
+		memset(buffer_float, 0, w->count * 2 * sizeof(float));
+	} else {
+		memset(w->buffer, 0, w->count * 2 * sizeof(int32_t));
 	}
 
-	GM_IncrementSongCounter(count);
+	for (nchan = w->first; nchan < w->csf->num_voices; nchan += w->stride)
+		mix_voice(w->csf, nchan, w->count, w->buffer, buffer_float, &w->st);
+}
+
+static int mix_worker_thread(void *userdata)
+{
+	struct mix_worker *w = userdata;
+
+	mt_thread_set_priority(BE_THREAD_PRIORITY_TIME_CRITICAL);
+
+	for (;;) {
+		mt_semaphore_wait(w->start);
+		if (mix_pool.quit)
+			break;
+
+		mix_worker_run(w);
+		mt_semaphore_post(mix_pool.done);
+	}
+
+	return 0;
+}
+
+static void mix_pool_stop(void)
+{
+	uint32_t i;
+
+	mix_pool.quit = 1;
+	for (i = 1; i < mix_pool.num_workers; i++) {
+		if (!mix_pool.workers[i].thread)
+			continue;
+
+		mt_semaphore_post(mix_pool.workers[i].start);
+		mt_thread_wait(mix_pool.workers[i].thread, NULL);
+	}
+
+	for (i = 1; i < mix_pool.num_workers; i++)
+		if (mix_pool.workers[i].start)
+			mt_semaphore_delete(mix_pool.workers[i].start);
+
+	if (mix_pool.done)
+		mt_semaphore_delete(mix_pool.done);
+	if (mix_pool.mutex)
+		mt_mutex_delete(mix_pool.mutex);
+
+	free(mix_pool.workers);
+	memset(&mix_pool, 0, sizeof(mix_pool));
+}
+
+// This must not be called while the mixer is running (i.e. hold the audio lock).
+// Passing zero or one turns the pool off.
+void mixer_set_threads(uint32_t threads)
+{
+	uint32_t i;
+
+	threads = MIN(threads, MAX_MIX_THREADS);
+	if (threads == MAX(mix_pool.num_workers, 1))
+		return;
+
+	mix_pool_stop();
+
+	if (threads < 2)
+		return;
+
+	mix_pool.workers = calloc(threads, sizeof(struct mix_worker));
+	mix_pool.done = mt_semaphore_create(0);
+	mix_pool.mutex = mt_mutex_create();
+	if (!mix_pool.workers || !mix_pool.done || !mix_pool.mutex) {
+		mix_pool_stop();
+		return;
+	}
+
+	mix_pool.num_workers = threads;
+	for (i = 1; i < threads; i++) {
+		struct mix_worker *w = mix_pool.workers + i;
+
+		w->start = mt_semaphore_create(0);
+		if (w->start)
+			w->thread = mt_thread_create(mix_worker_thread, "Mixer", w);
+
+		if (!w->thread) {
+			// run with what we've got
+			if (w->start)
+				mt_semaphore_delete(w->start);
+			w->start = NULL;
+			mix_pool.num_workers = i;
+			break;
+		}
+	}
+
+	if (mix_pool.num_workers < 2)
+		mix_pool_stop();
+}
+
+uint32_t mixer_get_threads(void)
+{
+	return MAX(mix_pool.num_workers, 1);
+}
+
+// Grabs the pool if nobody else (e.g. a disk writer running alongside
+// the audio thread) is using it.
+static int mix_pool_acquire(void)
+{
+	int ok;
+
+	mt_mutex_lock(mix_pool.mutex);
+	ok = !mix_pool.busy;
+	mix_pool.busy = 1;
+	mt_mutex_unlock(mix_pool.mutex);
+
+	return ok;
+}
+
+static void mix_pool_release(void)
+{
+	mt_mutex_lock(mix_pool.mutex);
+	mix_pool.busy = 0;
+	mt_mutex_unlock(mix_pool.mutex);
+}
+
+static int mix_voices_threaded(song_t *csf, uint32_t count, struct mix_state *st)
+{
+	uint32_t i, j, n;
+
+	// Multi-write sends NNA voices to their master channel's buffer, and
+	// the max_voices cutoff depends on how many voices were mixed before,
+	// so both of those have to stay serial.
+	if (mix_pool.num_workers < 2
+		|| csf->multi_write
+		|| csf->num_voices < MIX_THREAD_MIN_VOICES
+		|| (csf->num_voices > csf->max_voices && !(csf->mix_flags & SNDMIX_DIRECTTODISK)))
+		return 0;
+
+	if (!mix_pool_acquire())
+		return 0;
+
+	n = MIN(mix_pool.num_workers, csf->num_voices);
+
+	for (i = 0; i < n; i++) {
+		struct mix_worker *w = mix_pool.workers + i;
+
+		w->csf = csf;
+		w->count = count;
+		w->first = i;
+		w->stride = n;
+	}
+
+	for (i = 1; i < n; i++)
+		mt_semaphore_post(mix_pool.workers[i].start);
+
+	mix_worker_run(mix_pool.workers);
+
+	for (i = 1; i < n; i++)
+		mt_semaphore_wait(mix_pool.done);
+
+	for (i = 0; i < n; i++) {
+		const struct mix_worker *w = mix_pool.workers + i;
+
+		if (csf->mix_flags & SNDMIX_FLOATBUS) {
+			for (j = 0; j < count * 2; j++)
+				csf->mix_buffer_float[j] += w->buffer_float[j];
+		} else {
+			for (j = 0; j < count * 2; j++)
+				csf->mix_buffer[j] += w->buffer[j];
+		}
+
+		st->nchused += w->st.nchused;
+		st->nchmixed += w->st.nchmixed;
+		st->rofs += w->st.rofs;
+		st->lofs += w->st.lofs;
+	}
+
+	mix_pool_release();
+
+	return 1;
+}
+
+uint32_t csf_create_stereo_mix(song_t *csf, uint32_t count)
+{
+	struct mix_state st = {0};
+	float *mix_buffer_float = NULL;
+	uint32_t i;
+
+	if (!count)
+		return 0;
+
+	// multi-write always mixes into the integer channel buffers
+	if ((csf->mix_flags & SNDMIX_FLOATBUS) && !csf->multi_write)
+		mix_buffer_float = csf->mix_buffer_float;
+
+	// only the channels that got something last time need to be cleared
+	if (csf->multi_write) {
+		for (uint32_t nchan = 0; nchan < MAX_CHANNELS; nchan++) {
+			if (csf->multi_write[nchan].active) {
+				memset(csf->multi_write[nchan].buffer, 0, sizeof(csf->multi_write[nchan].buffer));
+				csf->multi_write[nchan].active = 0;
+			}
+		}
+	}
+
+	// the voices only change on a tick, so a tick that's split up into
+	// several buffers gathers them once and keeps mixing from the packed copy
+	if (!csf->mix_voices_live) {
+		mix_voices_load(csf);
+		csf->mix_voices_live = 1;
+	}
+	if (!mix_voices_threaded(csf, count, &st))
+		for (uint32_t nchan = 0; nchan < csf->num_voices; nchan++)
+			mix_voice(csf, nchan, count, csf->mix_buffer, mix_buffer_float, &st);
+
+	csf->dry_rofs_vol += st.rofs;
+	csf->dry_lofs_vol += st.lofs;
+
+	if (!(csf->mix_flags & SNDMIX_NOOUTPUT))
+		GM_IncrementSongCounter(csf, count);
 
 	if (csf->multi_write) {
 		/* mix all adlib onto track one */
-		Fmdrv_MixTo(csf->multi_write[0].buffer, count);
+		if (csf->opl)
+			csf->multi_write[0].active = 1;
+		Fmdrv_MixTo(csf, csf->multi_write[0].buffer, count);
+	} else if (mix_buffer_float) {
+		if (csf->opl) {
+			memset(csf->mix_buffer, 0, count * 2 * sizeof(int32_t));
+			Fmdrv_MixTo(csf, csf->mix_buffer, count);
+			for (i = 0; i < count * 2; i++)
+				mix_buffer_float[i] += csf->mix_buffer[i];
+		}
 	} else {
-		Fmdrv_MixTo(csf->mix_buffer, count);
+		Fmdrv_MixTo(csf, csf->mix_buffer, count);
 	}
 
-	return nchused;
+	return st.nchused;
+}
+
+void csf_skip_stereo_mix(song_t *csf, uint32_t count)
+{
+	struct mix_state st = {0};
+
+	st.skip = 1;
+	if (!csf->mix_voices_live)
+		mix_voices_load(csf);
+	for (uint32_t nchan = 0; nchan < csf->num_voices; nchan++)
+		mix_voice(csf, nchan, count, csf->mix_buffer, NULL, &st);
+	mix_voices_store(csf);
+	csf->mix_voices_live = 0;
+}
+
+void csf_sync_mix_voices(song_t *csf)
+{
+	if (csf->mix_voices_live) {
+		mix_voices_store(csf);
+		csf->mix_voices_live = 0;
+	}
 }
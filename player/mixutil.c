@@ -25,9 +25,15 @@
 #include "bshift.h"
 #include "util.h"
 
+#include "cpu.h"
+
 #include "player/sndfile.h"
 #include "player/cmixer.h"
 
+#ifdef SCHISM_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
 #define OFSDECAYSHIFT 8
 #define OFSDECAYMASK  0xFF
 
@@ -63,7 +69,7 @@ void stereo_fill(int32_t *buffer, uint32_t samples, int32_t* profs, int32_t *plo
 }
 
 
-void end_channel_ofs(song_voice_t *channel, int32_t *buffer, uint32_t samples)
+void end_channel_ofs(song_mix_voice_t *channel, int32_t *buffer, uint32_t samples)
 {
 	int32_t rofs = channel->rofs;
 	int32_t lofs = channel->lofs;
@@ -94,6 +100,65 @@ void mono_from_stereo(int32_t *mix_buf, uint32_t samples)
 	}
 }
 
+// Same as above, for the float bus. The click removal offsets stay integer
+// so that they decay exactly like they do on the integer bus.
+
+void stereo_fill_float(float *buffer, uint32_t samples, int32_t *profs, int32_t *plofs)
+{
+	int32_t rofs = *profs;
+	int32_t lofs = *plofs;
+
+	if (!rofs && !lofs) {
+		memset(buffer, 0, samples * 2 * sizeof(float));
+		return;
+	}
+
+	for (uint32_t i = 0; i < samples; i++) {
+		int32_t x_r = rshift_signed(rofs + (rshift_signed(-rofs, 31) & OFSDECAYMASK), OFSDECAYSHIFT);
+		int32_t x_l = rshift_signed(lofs + (rshift_signed(-lofs, 31) & OFSDECAYMASK), OFSDECAYSHIFT);
+
+		rofs -= x_r;
+		lofs -= x_l;
+		buffer[i * 2]     = x_r;
+		buffer[i * 2 + 1] = x_l;
+	}
+
+	*profs = rofs;
+	*plofs = lofs;
+}
+
+
+void end_channel_ofs_float(song_mix_voice_t *channel, float *buffer, uint32_t samples)
+{
+	int32_t rofs = channel->rofs;
+	int32_t lofs = channel->lofs;
+
+	if (!rofs && !lofs)
+		return;
+
+	for (uint32_t i = 0; i < samples; i++) {
+		int32_t x_r = rshift_signed(rofs + (rshift_signed(-rofs, 31) & OFSDECAYMASK), OFSDECAYSHIFT);
+		int32_t x_l = rshift_signed(lofs + (rshift_signed(-lofs, 31) & OFSDECAYMASK), OFSDECAYSHIFT);
+
+		rofs -= x_r;
+		lofs -= x_l;
+		buffer[i * 2]     += x_r;
+		buffer[i * 2 + 1] += x_l;
+	}
+
+	channel->rofs = rofs;
+	channel->lofs = lofs;
+}
+
+
+void mono_from_stereo_float(float *mix_buf, uint32_t samples)
+{
+	for (uint32_t j, i = 0; i < samples; i++) {
+		j = i << 1;
+		mix_buf[i] = (mix_buf[j] + mix_buf[j + 1]) * 0.5f;
+	}
+}
+
 // ----------------------------------------------------------------------------
 // Clip and convert functions
 // ----------------------------------------------------------------------------
@@ -102,92 +167,239 @@ void mono_from_stereo(int32_t *mix_buf, uint32_t samples)
 // The original C version was written by Rani Assaf <rani@magic.metawire.com>
 
 
-// Clip and convert to 8 bit. mins and maxs returned in 27bits: [MIXING_CLIPMIN..MIXING_CLIPMAX]. mins[0] left, mins[1] right.
-uint32_t clip_32_to_8(void *ptr, int32_t *buffer, uint32_t samples, int32_t *mins, int32_t *maxs)
+static inline int32_t clip_sample(int32_t n, uint32_t i, const mix_gain_t *gain, int32_t *mins, int32_t *maxs)
 {
-	unsigned char *p = (unsigned char *) ptr;
-
-    for (uint32_t i = 0; i < samples; i++) {
-		int32_t n = CLAMP(buffer[i], MIXING_CLIPMIN, MIXING_CLIPMAX);
+	if (gain)
+		n = _muldiv(n, gain->num[i & 1], gain->den);
 
-		if (n < mins[i & 1])
-		    mins[i & 1] = n;
-		else if (n > maxs[i & 1])
-		    maxs[i & 1] = n;
+	n = CLAMP(n, MIXING_CLIPMIN, MIXING_CLIPMAX);
 
-		// 8-bit unsigned
-		p[i] = rshift_signed(n, 24 - MIXING_ATTENUATION) ^ 0x80;
-    }
+	if (n < mins[i & 1])
+		mins[i & 1] = n;
+	if (n > maxs[i & 1])
+		maxs[i & 1] = n;
 
-	return samples;
+	return n;
 }
 
+// 8-bit unsigned
+#define CLIP_STORE_8(p, i, n) \
+	((unsigned char *) (p))[i] = rshift_signed(n, 24 - MIXING_ATTENUATION) ^ 0x80
 
-// Clip and convert to 16 bit. mins and maxs returned in 27bits: [MIXING_CLIPMIN..MIXING_CLIPMAX]. mins[0] left, mins[1] right.
-uint32_t clip_32_to_16(void *ptr, int32_t *buffer, uint32_t samples, int32_t *mins, int32_t *maxs)
+// 16-bit signed
+#define CLIP_STORE_16(p, i, n) \
+	((int16_t *) (p))[i] = rshift_signed(n, 16 - MIXING_ATTENUATION)
+
+// 24-bit signed
+// Note, this is 24bit, not 24-in-32bits. The former is used in .wav. The latter is used in audio IO
+/* the inventor of 24bit anything should be shot */
+/* err, assume same endian */
+#define CLIP_STORE_24(p, i, n) do { \
+	int32_t n24_ = rshift_signed(n, 8 - MIXING_ATTENUATION); \
+	memcpy((unsigned char *) (p) + (i) * 3, &n24_, 3); \
+} while (0)
+
+// 32-bit signed
+#define CLIP_STORE_32(p, i, n) \
+	((int32_t *) (p))[i] = lshift_signed(n, MIXING_ATTENUATION)
+
+#ifdef SCHISM_HAVE_SSE2
+// Four samples at a time; lanes 0 and 2 are (i & 1) == 0, lanes 1 and 3 the
+// other channel, so the length has to be a multiple of four. The gain is done
+// in double precision, which comes out the same as _muldiv: the product is
+// exact, and with a divisor this small the quotient can't round across an
+// integer.
+
+static inline SCHISM_TARGET_SSE2 __m128i sse2_gain(__m128i v, __m128d num, __m128d den)
 {
-    int16_t *p = (int16_t *) ptr;
+	__m128d lo = _mm_cvtepi32_pd(v);
+	__m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(3, 2, 3, 2)));
 
-    for (uint32_t i = 0; i < samples; i++) {
-		int32_t n = CLAMP(buffer[i], MIXING_CLIPMIN, MIXING_CLIPMAX);
+	lo = _mm_div_pd(_mm_mul_pd(lo, num), den);
+	hi = _mm_div_pd(_mm_mul_pd(hi, num), den);
 
-		if (n < mins[i & 1])
-		    mins[i & 1] = n;
-		else if (n > maxs[i & 1])
-		    maxs[i & 1] = n;
+	return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
 
-		// 16-bit signed
-		p[i] = rshift_signed(n, 16 - MIXING_ATTENUATION);
-    }
+// no pminsd/pmaxsd before SSE4.1
+static inline SCHISM_TARGET_SSE2 __m128i sse2_min(__m128i a, __m128i b)
+{
+	__m128i gt = _mm_cmpgt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
 
-	return samples * 2;
+static inline SCHISM_TARGET_SSE2 __m128i sse2_max(__m128i a, __m128i b)
+{
+	__m128i gt = _mm_cmpgt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
 }
 
+#define CLIP_STORE_SSE2_8(p, i, v) do { \
+	__m128i s8_ = _mm_srai_epi32(v, 24 - MIXING_ATTENUATION); \
+	int32_t w8_; \
+	s8_ = _mm_packs_epi32(s8_, s8_); \
+	s8_ = _mm_packs_epi16(s8_, s8_); \
+	w8_ = _mm_cvtsi128_si32(_mm_xor_si128(s8_, _mm_set1_epi8((char) 0x80))); \
+	memcpy((unsigned char *) (p) + (i), &w8_, 4); \
+} while (0)
+
+#define CLIP_STORE_SSE2_16(p, i, v) do { \
+	__m128i s16_ = _mm_srai_epi32(v, 16 - MIXING_ATTENUATION); \
+	_mm_storel_epi64((__m128i *) ((int16_t *) (p) + (i)), _mm_packs_epi32(s16_, s16_)); \
+} while (0)
+
+#define CLIP_STORE_SSE2_24(p, i, v) do { \
+	int32_t s24_[4]; \
+	_mm_storeu_si128((__m128i *) s24_, _mm_srai_epi32(v, 8 - MIXING_ATTENUATION)); \
+	memcpy((unsigned char *) (p) + (i) * 3, &s24_[0], 3); \
+	memcpy((unsigned char *) (p) + (i) * 3 + 3, &s24_[1], 3); \
+	memcpy((unsigned char *) (p) + (i) * 3 + 6, &s24_[2], 3); \
+	memcpy((unsigned char *) (p) + (i) * 3 + 9, &s24_[3], 3); \
+} while (0)
+
+#define CLIP_STORE_SSE2_32(p, i, v) \
+	_mm_storeu_si128((__m128i *) ((int32_t *) (p) + (i)), _mm_slli_epi32(v, MIXING_ATTENUATION))
+
+#define DEFINE_CLIP_FUNCTION_SSE2(bits) \
+	static SCHISM_TARGET_SSE2 uint32_t clip_32_to_##bits##_sse2(void *ptr, const int32_t *buffer, uint32_t samples, \
+		const mix_gain_t *gain, int32_t *mins, int32_t *maxs) \
+	{ \
+		const __m128i lo = _mm_set1_epi32(MIXING_CLIPMIN), hi = _mm_set1_epi32(MIXING_CLIPMAX); \
+		__m128i vmin = _mm_set_epi32(mins[1], mins[0], mins[1], mins[0]); \
+		__m128i vmax = _mm_set_epi32(maxs[1], maxs[0], maxs[1], maxs[0]); \
+		__m128d num = _mm_set1_pd(1.0), den = _mm_set1_pd(1.0); \
+		int32_t vu[8]; \
+		uint32_t i; \
+	\
+		if (gain) { \
+			num = _mm_set_pd(gain->num[1], gain->num[0]); \
+			den = _mm_set1_pd(gain->den); \
+		} \
+	\
+		for (i = 0; i + 4 <= samples; i += 4) { \
+			__m128i v = _mm_loadu_si128((const __m128i *) (buffer + i)); \
+	\
+			if (gain) \
+				v = sse2_gain(v, num, den); \
+	\
+			v = sse2_max(sse2_min(v, hi), lo); \
+			vmin = sse2_min(vmin, v); \
+			vmax = sse2_max(vmax, v); \
+	\
+			CLIP_STORE_SSE2_##bits(ptr, i, v); \
+		} \
+	\
+		_mm_storeu_si128((__m128i *) vu, vmin); \
+		_mm_storeu_si128((__m128i *) (vu + 4), vmax); \
+		mins[0] = MIN(vu[0], vu[2]); \
+		mins[1] = MIN(vu[1], vu[3]); \
+		maxs[0] = MAX(vu[4], vu[6]); \
+		maxs[1] = MAX(vu[5], vu[7]); \
+	\
+		return i; \
+	}
 
-// Clip and convert to 24 bit. mins and maxs returned in 27bits: [MIXING_CLIPMIN..MIXING_CLIPMAX]. mins[0] left, mins[1] right.
-// Note, this is 24bit, not 24-in-32bits. The former is used in .wav. The latter is used in audio IO
-uint32_t clip_32_to_24(void *ptr, int32_t *buffer, uint32_t samples, int32_t *mins, int32_t *maxs)
-{
-	/* the inventor of 24bit anything should be shot */
-	unsigned char *p = (unsigned char *) ptr;
+DEFINE_CLIP_FUNCTION_SSE2(8)
+DEFINE_CLIP_FUNCTION_SSE2(16)
+DEFINE_CLIP_FUNCTION_SSE2(24)
+DEFINE_CLIP_FUNCTION_SSE2(32)
+
+# define CLIP_SSE2(bits) \
+	if (cpu_has_feature(CPU_FEATURE_SSE2)) \
+		i = clip_32_to_##bits##_sse2(ptr, buffer, samples, gain, mins, maxs);
+#else
+# define CLIP_SSE2(bits)
+#endif /* SCHISM_HAVE_SSE2 */
+
+// Clip and convert to (bits) bit. mins and maxs returned in 27bits: [MIXING_CLIPMIN..MIXING_CLIPMAX]. mins[0] left, mins[1] right.
+// The output volume (gain, NULL for none) is applied first; it's the last
+// thing done to the samples, so it might as well happen in the same pass.
+#define DEFINE_CLIP_FUNCTION(bits) \
+	uint32_t clip_32_to_##bits(void *ptr, int32_t *buffer, uint32_t samples, const mix_gain_t *gain, int32_t *mins, int32_t *maxs) \
+	{ \
+		uint32_t i = 0; \
+	\
+		CLIP_SSE2(bits) \
+	\
+		for (; i < samples; i++) { \
+			int32_t n = clip_sample(buffer[i], i, gain, mins, maxs); \
+			CLIP_STORE_##bits(ptr, i, n); \
+		} \
+	\
+		return samples * ((bits) / 8); \
+	}
 
-    for (uint32_t i = 0; i < samples; i++) {
-		int32_t n = CLAMP(buffer[i], MIXING_CLIPMIN, MIXING_CLIPMAX);
+DEFINE_CLIP_FUNCTION(8)
+DEFINE_CLIP_FUNCTION(16)
+DEFINE_CLIP_FUNCTION(24)
+DEFINE_CLIP_FUNCTION(32)
 
-		if (n < mins[i & 1])
-		    mins[i & 1] = n;
-		else if (n > maxs[i & 1])
-		    maxs[i & 1] = n;
+// ----------------------------------------------------------------------------
+// Float bus
+//
+// Same scale as the integer bus, so [MIXING_CLIPMIN..MIXING_CLIPMAX] is full
+// scale. Integer output is clipped and truncated once, right before the
+// store; float output isn't clipped at all, only the VU meter is.
 
-		// 24-bit signed
-		n = rshift_signed(n, 8 - MIXING_ATTENUATION);
+// 1.0f at full scale for float output
+#define MIXING_FLOATSCALE (1.0f / (float)(MIXING_CLIPMAX + 1))
 
-		/* err, assume same endian */
-		memcpy(p, &n, 3);
-		p += 3;
-    }
+static inline float gain_sample_float(float n, uint32_t i, const mix_gain_t *gain, int32_t *mins, int32_t *maxs)
+{
+	int32_t vu;
 
-	return samples * 3;
-}
+	if (gain)
+		n = n * gain->num[i & 1] / gain->den;
+
+	vu = (n <= MIXING_CLIPMIN) ? MIXING_CLIPMIN
+		: (n >= MIXING_CLIPMAX) ? MIXING_CLIPMAX
+		: (int32_t)n;
 
+	if (vu < mins[i & 1])
+		mins[i & 1] = vu;
+	if (vu > maxs[i & 1])
+		maxs[i & 1] = vu;
 
-// Clip and convert to 32 bit(int). mins and maxs returned in 27bits: [MIXING_CLIPMIN..MIXING_CLIPMAX]. mins[0] left, mins[1] right.
-uint32_t clip_32_to_32(void *ptr, int32_t *buffer, uint32_t samples, int32_t *mins, int32_t *maxs)
+	return n;
+}
+
+static inline int32_t clip_sample_float(float n, uint32_t i, const mix_gain_t *gain, int32_t *mins, int32_t *maxs)
 {
-    int32_t *p = (int32_t *) ptr;
+	n = gain_sample_float(n, i, gain, mins, maxs);
 
-    for (uint32_t i = 0; i < samples; i++) {
-		int32_t n = CLAMP(buffer[i], MIXING_CLIPMIN, MIXING_CLIPMAX);
+	return (n <= MIXING_CLIPMIN) ? MIXING_CLIPMIN
+		: (n >= MIXING_CLIPMAX) ? MIXING_CLIPMAX
+		: (int32_t)n;
+}
+
+#define DEFINE_CLIP_FLOAT_FUNCTION(bits) \
+	uint32_t clip_float_to_##bits(void *ptr, float *buffer, uint32_t samples, const mix_gain_t *gain, int32_t *mins, int32_t *maxs) \
+	{ \
+		for (uint32_t i = 0; i < samples; i++) { \
+			int32_t n = clip_sample_float(buffer[i], i, gain, mins, maxs); \
+			CLIP_STORE_##bits(ptr, i, n); \
+		} \
+	\
+		return samples * ((bits) / 8); \
+	}
 
-		if (n < mins[i & 1])
-		    mins[i & 1] = n;
-		else if (n > maxs[i & 1])
-		    maxs[i & 1] = n;
+DEFINE_CLIP_FLOAT_FUNCTION(8)
+DEFINE_CLIP_FLOAT_FUNCTION(16)
+DEFINE_CLIP_FLOAT_FUNCTION(24)
 
-		// 32-bit signed
-		p[i] = lshift_signed(n, MIXING_ATTENUATION);
-    }
+uint32_t clip_float_to_float(void *ptr, float *buffer, uint32_t samples, const mix_gain_t *gain, int32_t *mins, int32_t *maxs)
+{
+	for (uint32_t i = 0; i < samples; i++)
+		((float *) ptr)[i] = gain_sample_float(buffer[i], i, gain, mins, maxs) * MIXING_FLOATSCALE;
 
-	return samples * 4;
+	return samples * sizeof(float);
 }
 
+// for float output from the integer bus (multi-write)
+uint32_t clip_32_to_float(void *ptr, int32_t *buffer, uint32_t samples, const mix_gain_t *gain, int32_t *mins, int32_t *maxs)
+{
+	for (uint32_t i = 0; i < samples; i++)
+		((float *) ptr)[i] = gain_sample_float(buffer[i], i, gain, mins, maxs) * MIXING_FLOATSCALE;
+
+	return samples * sizeof(float);
+}
@@ -122,7 +122,7 @@ static int32_t resetting = 0; // boolean
 
 static void MPU_SendCommand(const unsigned char* buf, uint32_t nbytes, int32_t c)
 {
-	if (!nbytes)
+	if (!nbytes || !current_song)
 		return;
 
 	csf_midi_send(current_song, buf, nbytes, c, 0); // FIXME we should not know about 'current_song' here!
@@ -705,7 +705,7 @@ void GM_SendSongPositionCode(uint32_t note16pos)
 }
 
 
-void GM_IncrementSongCounter(int32_t count)
+void GM_IncrementSongCounter(song_t *csf, int32_t count)
 {
 	/* We assume that one schism tick = one midi tick (24ppq).
 	 *
@@ -717,8 +717,8 @@ void GM_IncrementSongCounter(int32_t count)
 	 * where cmdT = last FX_TEMPO = current_tempo
 	 */
 
-	int32_t TickLengthInSamplesHi = 5 * current_song->mix_frequency;
-	int32_t TickLengthInSamplesLo = 2 * current_song->current_tempo;
+	int32_t TickLengthInSamplesHi = 5 * csf->mix_frequency;
+	int32_t TickLengthInSamplesLo = 2 * csf->current_tempo;
 
 	double TickLengthInSamples = TickLengthInSamplesHi / (double) TickLengthInSamplesLo;
 
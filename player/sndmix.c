@@ -36,17 +36,8 @@
 // VU meter
 #define VUMETER_DECAY 16
 
-// SNDMIX: These are global flags for playback control
-uint32_t max_voices = 32; // ITT it is 1994
-
-// Mixing data initialized in
-static uint32_t volume_ramp_samples = 64;
-uint32_t global_vu_left = 0;
-uint32_t global_vu_right = 0;
-int32_t g_dry_rofs_vol = 0;
-int32_t g_dry_lofs_vol = 0;
-
-typedef uint32_t (* convert_t)(void *, int32_t *, uint32_t, int32_t *, int32_t *);
+typedef uint32_t (* convert_t)(void *, int32_t *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
+typedef uint32_t (* convert_float_t)(void *, float *, uint32_t, const mix_gain_t *, int32_t *, int32_t *);
 
 
 // see also csf_midi_out_raw in effects.c
@@ -507,7 +498,8 @@ static inline int32_t rn_update_sample(song_t *csf, song_voice_t *chan, int32_t
 
 		if ((csf->flags & SONG_INSTRUMENTMODE)
 		    && chan->ptr_instrument
-		    && chan->ptr_instrument->midi_channel_mask > 0)
+		    && chan->ptr_instrument->midi_channel_mask > 0
+		    && !(csf->mix_flags & SNDMIX_NOOUTPUT))
 			GM_Pan(nchan, pan);
 
 		pan += 128;
@@ -563,7 +555,7 @@ static inline int32_t rn_update_sample(song_t *csf, song_voice_t *chan, int32_t
 	    (chan->right_volume != chan->right_volume_new ||
 	     chan->left_volume  != chan->left_volume_new)) {
 		// Setting up volume ramp
-		int32_t ramp_length = volume_ramp_samples;
+		int32_t ramp_length = csf->volume_ramp_samples;
 		int32_t right_delta = ((chan->right_volume_new - chan->right_volume) << VOLUMERAMPPRECISION);
 		int32_t left_delta  = ((chan->left_volume_new  - chan->left_volume)  << VOLUMERAMPPRECISION);
 
@@ -574,7 +566,7 @@ static inline int32_t rn_update_sample(song_t *csf, song_voice_t *chan, int32_t
 				ramp_length = csf->buffer_count;
 
 				int32_t l = (1 << (VOLUMERAMPPRECISION - 1));
-				int32_t r =(int32_t) volume_ramp_samples;
+				int32_t r =(int32_t) csf->volume_ramp_samples;
 
 				ramp_length = CLAMP(ramp_length, l, r);
 			}
@@ -624,7 +616,8 @@ static inline void rn_gen_key(song_t *csf, song_voice_t *chan, int32_t chan_num,
 		return;
 	} else if (csf->flags & SONG_INSTRUMENTMODE &&
 	    chan->ptr_instrument &&
-	    chan->ptr_instrument->midi_channel_mask > 0) {
+	    chan->ptr_instrument->midi_channel_mask > 0 &&
+	    !(csf->mix_flags & SNDMIX_NOOUTPUT)) {
 		MidiBendMode BendMode = MIDI_BEND_NORMAL;
 		/* TODO: If we're expecting a large bend exclusively
 		 * in either direction, update BendMode to indicate so.
@@ -650,17 +643,17 @@ static inline void rn_gen_key(song_t *csf, song_voice_t *chan, int32_t chan_num,
 
 		// OPL_Patch is called in csf_process_effects, from csf_read_note or csf_process_tick, before calling this method.
 		int32_t oplmilliHertz = (int64_t)freq*261625L/8363L;
-		OPL_HertzTouch(chan_num, oplmilliHertz, chan->flags & CHN_KEYOFF);
+		OPL_HertzTouch(csf, chan_num, oplmilliHertz, chan->flags & CHN_KEYOFF);
 
 		// ST32 ignores global & master volume in adlib mode, guess we should do the same -Bisqwit
 		// This gives a value in the range 0..63.
 		// log_appendf(2,"vol: %d, voiceinsvol: %d", vol , chan->instrument_volume);
-		OPL_Touch(chan_num, vol * chan->instrument_volume * 63 / (1 << 20));
+		OPL_Touch(csf, chan_num, vol * chan->instrument_volume * 63 / (1 << 20));
 		if (csf->flags&SONG_NOSTEREO) {
-			OPL_Pan(chan_num, 128);
+			OPL_Pan(csf, chan_num, 128);
 		}
 		else {
-			OPL_Pan(chan_num, chan->final_panning);
+			OPL_Pan(csf, chan_num, chan->final_panning);
 		}
 	}
 }
@@ -692,32 +685,37 @@ static inline void update_vu_meter(song_voice_t *chan)
 
 int32_t csf_init_player(song_t *csf, int reset)
 {
-	if (max_voices > MAX_VOICES)
-		max_voices = MAX_VOICES;
+	if (csf->max_voices > MAX_VOICES)
+		csf->max_voices = MAX_VOICES;
 
 	csf->mix_frequency = CLAMP(csf->mix_frequency, 4000, MAX_SAMPLE_RATE);
-	volume_ramp_samples = (csf->mix_frequency * VOLUMERAMPLEN) / 100000;
+	csf->volume_ramp_samples = (csf->mix_frequency * VOLUMERAMPLEN) / 100000;
 
-	if (volume_ramp_samples < 8)
-		volume_ramp_samples = 8;
+	if (csf->volume_ramp_samples < 8)
+		csf->volume_ramp_samples = 8;
 
 	if (csf->mix_flags & SNDMIX_NORAMPING)
-		volume_ramp_samples = 2;
+		csf->volume_ramp_samples = 2;
+
+	csf->dry_rofs_vol = csf->dry_lofs_vol = 0;
 
-	g_dry_rofs_vol = g_dry_lofs_vol = 0;
+	setup_mix_functions();
 
 	if (reset) {
-		global_vu_left  = 0;
-		global_vu_right = 0;
+		csf->vu_left  = 0;
+		csf->vu_right = 0;
 	}
 
-	song_init_eq(reset, csf->mix_frequency);
+	song_init_eq(csf, reset, csf->mix_frequency);
+
+	if (csf->filter_table_rate != csf->mix_frequency)
+		init_filter_table(csf);
 
 	// I don't know why, but this "if" makes it work at the desired sample rate instead of 4000.
 	// the "4000Hz" value comes from csf_reset, but I don't yet understand why the opl keeps that value, if
 	// each call to Fmdrv_Init generates a new opl.
 	if (csf->mix_frequency != 4000) {
-		Fmdrv_Init(csf->mix_frequency);
+		Fmdrv_Init(csf, csf->mix_frequency);
 	}
 	GM_Reset(0);
 	return 1;
@@ -728,9 +726,14 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 {
 	uint8_t * buffer = (uint8_t *)v_buffer;
 	convert_t convert_func = clip_32_to_8;
+	convert_float_t convert_float_func = clip_float_to_8;
 	int32_t vu_min[2];
 	int32_t vu_max[2];
+	mix_gain_t gain, *pgain = NULL;
 	uint32_t bufleft, max, sample_size, count, smpcount, mix_stat=0;
+	int note_ok;
+	// multi-write stays on the integer bus (see csf_create_stereo_mix)
+	const int float_bus = (csf->mix_flags & SNDMIX_FLOATBUS) && !csf->multi_write;
 
 	vu_min[0] = vu_min[1] = 0x7FFFFFFF;
 	vu_max[0] = vu_max[1] = -0x7FFFFFFF;
@@ -740,15 +743,33 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 	sample_size = csf->mix_channels;
 
 	switch (csf->mix_bits_per_sample) {
-	case 16: sample_size *= 2; convert_func = clip_32_to_16; break;
-	case 24: sample_size *= 3; convert_func = clip_32_to_24; break;
-	case 32: sample_size *= 4; convert_func = clip_32_to_32; break;
+	case 16: sample_size *= 2; convert_func = clip_32_to_16; convert_float_func = clip_float_to_16; break;
+	case 24: sample_size *= 3; convert_func = clip_32_to_24; convert_float_func = clip_float_to_24; break;
+	case 32:
+		// with the float bus, 32-bit output is float
+		sample_size *= 4;
+		convert_func = (csf->mix_flags & SNDMIX_FLOATBUS) ? clip_32_to_float : clip_32_to_32;
+		convert_float_func = clip_float_to_float;
+		break;
 	}
 
 	max = bufsize / sample_size;
 	if (!max || !buffer)
 		return 0;
 
+	// live playback goes out at the configured volume, exports as they are
+	if (!(csf->mix_flags & SNDMIX_DIRECTTODISK) && (csf->master_left != 31 || csf->master_right != 31)) {
+		if (csf->mix_channels >= 2) {
+			gain.num[0] = csf->master_left;
+			gain.num[1] = csf->master_right;
+			gain.den = 31;
+		} else {
+			gain.num[0] = gain.num[1] = csf->master_left + csf->master_right;
+			gain.den = 62;
+		}
+		pgain = &gain;
+	}
+
 	bufleft = max;
 
 	if (csf->flags & SONG_ENDREACHED)
@@ -761,7 +782,12 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 			if (!(csf->mix_flags & SNDMIX_DIRECTTODISK))
 				csf->buffer_count = bufleft;
 
-			if (!csf_read_note(csf)) {
+			// so MIDI out knows when in the buffer this tick happens
+			csf->buffer_offset = max - bufleft;
+			note_ok = csf_read_note(csf);
+			csf->buffer_offset = 0;
+
+			if (!note_ok) {
 				csf->flags |= SONG_ENDREACHED;
 
 				if (csf->stop_at_order > -1)
@@ -791,8 +817,30 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 
 		smpcount = count;
 
+		if (float_bus) {
+			stereo_fill_float(csf->mix_buffer_float, smpcount, &csf->dry_rofs_vol, &csf->dry_lofs_vol);
+
+			csf->mix_stat += csf_create_stereo_mix(csf, count);
+
+			if (csf->mix_channels >= 2) {
+				smpcount *= 2;
+				eq_stereo_float(csf, csf->mix_buffer_float, count);
+			} else {
+				mono_from_stereo_float(csf->mix_buffer_float, count);
+				eq_mono_float(csf, csf->mix_buffer_float, count);
+			}
+
+			mix_stat++;
+
+			buffer += convert_float_func(buffer, csf->mix_buffer_float, smpcount, pgain, vu_min, vu_max);
+
+			bufleft -= count;
+			csf->buffer_count -= count;
+			continue;
+		}
+
 		// Resetting sound buffer
-		stereo_fill(csf->mix_buffer, smpcount, &g_dry_rofs_vol, &g_dry_lofs_vol);
+		stereo_fill(csf->mix_buffer, smpcount, &csf->dry_rofs_vol, &csf->dry_lofs_vol);
 
 		if (csf->mix_channels >= 2) {
 			smpcount *= 2;
@@ -803,35 +851,37 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 		}
 
 		// Handle eq
-		if (csf->mix_channels >= 2) {
+		if (csf->mix_channels >= 2)
 			eq_stereo(csf, csf->mix_buffer, count);
-			// FIXME: disable this when we're writing WAVs
-			if (!(csf->mix_flags & SNDMIX_DIRECTTODISK)) normalize_stereo(csf, csf->mix_buffer, count << 1);
-		} else {
+		else
 			eq_mono(csf, csf->mix_buffer, count);
-			if (!(csf->mix_flags & SNDMIX_DIRECTTODISK)) normalize_mono(csf, csf->mix_buffer, count);
-		}
 
 		mix_stat++;
 
 		if (csf->multi_write) {
 			/* multi doesn't actually write meaningful data into 'buffer', so we can use that
 			as temp space for converting */
+			uint32_t bytes = smpcount * ((csf->mix_bits_per_sample + 7) / 8);
+
 			for (uint32_t n = 0; n < 64; n++) {
-				if (csf->multi_write[n].used) {
+				if (!csf->multi_write[n].used) {
+					csf->multi_write[n].silence(csf->multi_write[n].data, bytes);
+					continue;
+				}
+
+				if (csf->multi_write[n].active) {
 					if (csf->mix_channels < 2)
 						mono_from_stereo(csf->multi_write[n].buffer, count);
-					uint32_t bytes = convert_func(buffer, csf->multi_write[n].buffer,
-						smpcount, vu_min, vu_max);
-					csf->multi_write[n].write(csf->multi_write[n].data, buffer, bytes);
+					convert_func(buffer, csf->multi_write[n].buffer, smpcount, NULL, vu_min, vu_max);
 				} else {
-					csf->multi_write[n].silence(csf->multi_write[n].data,
-						smpcount * ((csf->mix_bits_per_sample + 7) / 8));
+					/* nothing playing; this is what converting the (zeroed) buffer would give */
+					memset(buffer, (csf->mix_bits_per_sample == 8) ? 0x80 : 0, bytes);
 				}
+				csf->multi_write[n].write(csf->multi_write[n].data, buffer, bytes);
 			}
 		} else {
-			// Perform clipping + VU-Meter
-			buffer += convert_func(buffer, csf->mix_buffer, smpcount, vu_min, vu_max);
+			// Perform volume + clipping + VU-Meter
+			buffer += convert_func(buffer, csf->mix_buffer, smpcount, pgain, vu_min, vu_max);
 		}
 
 		// Buffer ready
@@ -839,6 +889,9 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 		csf->buffer_count -= count;
 	}
 
+	// nobody outside of here knows about the packed voices
+	csf_sync_mix_voices(csf);
+
 	if (bufleft)
 		memset(buffer, (csf->mix_bits_per_sample == 8) ? 0x80 : 0, bufleft * sample_size);
 
@@ -855,8 +908,8 @@ uint32_t csf_read(song_t *csf, void * v_buffer, uint32_t bufsize)
 	if (vu_max[1] < vu_min[1])
 		vu_max[1] = vu_min[1];
 
-	global_vu_left = (uint32_t)(vu_max[0] - vu_min[0]);
-	global_vu_right = (uint32_t)(vu_max[1] - vu_min[1]);
+	csf->vu_left = (uint32_t)(vu_max[0] - vu_min[0]);
+	csf->vu_right = (uint32_t)(vu_max[1] - vu_min[1]);
 
 	if (mix_stat) {
 		csf->mix_stat += mix_stat - 1;
@@ -992,7 +1045,7 @@ int32_t csf_process_tick(song_t *csf)
 			// commands... ALL WE DO is dump raw midi data to
 			// our super-secret "midi buffer"
 			// -mrsb
-			if (csf_midi_out_note)
+			if (csf_midi_out_note && !(csf->mix_flags & SNDMIX_NOOUTPUT))
 				csf_midi_out_note(nchan, m);
 
 			chan->row_note = m->note;
@@ -1017,7 +1070,7 @@ int32_t csf_process_tick(song_t *csf)
 		/* [-- No --] */
 		/* [Update effects for each channel as required.] */
 
-		if (csf_midi_out_note) {
+		if (csf_midi_out_note && !(csf->mix_flags & SNDMIX_NOOUTPUT)) {
 			song_note_t *m = csf->patterns[csf->current_pattern] + csf->row * MAX_CHANNELS;
 
 			for (uint32_t nchan=0; nchan<MAX_CHANNELS; nchan++, m++) {
@@ -1040,6 +1093,50 @@ int32_t csf_process_tick(song_t *csf)
 	return 1;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////
+// Voice bookkeeping
+
+static inline uint32_t lowest_bit(uint32_t x)
+{
+#if SCHISM_GNUC_HAS_BUILTIN(__builtin_ctz, 3, 4, 0)
+	return __builtin_ctz(x);
+#else
+	uint32_t n = 0;
+
+	while (!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+// The voice after `n' that csf_read_note has to process: all of the pattern
+// channels, then only the background voices that are marked as playing.
+static inline uint32_t next_voice(song_t *csf, uint32_t n)
+{
+	uint32_t w, bits;
+
+	if (++n < MAX_CHANNELS)
+		return n;
+
+	w = n / 32;
+	bits = csf->voices_playing[w] & (UINT32_MAX << (n % 32));
+	while (!bits) {
+		if (++w >= MAX_VOICES / 32)
+			return MAX_VOICES;
+		bits = csf->voices_playing[w];
+	}
+
+	return w * 32 + lowest_bit(bits);
+}
+
+static inline void voice_stopped(song_t *csf, uint32_t n)
+{
+	if (n >= MAX_CHANNELS)
+		csf->voices_playing[n / 32] &= ~(UINT32_C(1) << (n % 32));
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////
 // Handles envelopes & mixer setup
 
@@ -1049,6 +1146,8 @@ int32_t csf_read_note(song_t *csf)
 	uint32_t cn;
 	int firsttick = 0;
 
+	csf_sync_mix_voices(csf);
+
 	// Checking end of row ?
 	if (csf->flags & SONG_PAUSED) {
 		if (!csf->current_speed)
@@ -1109,7 +1208,8 @@ int32_t csf_read_note(song_t *csf)
 
 	csf->num_voices = 0;
 
-	for (cn = 0, chan = csf->voices; cn < MAX_VOICES; cn++, chan++) {
+	for (cn = 0; cn < MAX_VOICES; cn = next_voice(csf, cn)) {
+		chan = csf->voices + cn;
 		/*if(cn == 0 || cn == 1)
 		fprintf(stderr, "considering channel %d (per %d, pos %d/%d, flags %X)\n",
 			(int32_t)cn, chan->frequency, chan->position, chan->length, chan->flags);*/
@@ -1119,13 +1219,17 @@ int32_t csf_read_note(song_t *csf)
 			chan->length = 0;
 			chan->rofs =
 			chan->lofs = 0;
+			voice_stopped(csf, cn);
 			continue;
 		}
 
 		// Check for unused channel
-		if (cn >= MAX_CHANNELS)
-			if (!chan->length && !(chan->flags & CHN_ADLIB))
+		if (cn >= MAX_CHANNELS) {
+			if (!chan->length && !(chan->flags & CHN_ADLIB)) {
+				voice_stopped(csf, cn);
 				continue;
+			}
+		}
 
 		// Reset channel data
 		chan->increment = 0;
@@ -1215,13 +1319,12 @@ int32_t csf_read_note(song_t *csf)
 				rn_gen_key(csf, chan, cn, frequency, vol);
 
 			if (chan->flags & CHN_NEWNOTE) {
-				setup_channel_filter(chan, 1, 256, csf->mix_frequency);
+				setup_channel_filter(csf, chan, 1, 256);
 			}
 
 			// Filter Envelope: controls cutoff frequency
 			if (chan && chan->ptr_instrument && chan->ptr_instrument->flags & ENV_FILTER) {
-				setup_channel_filter(chan,
-					!(chan->flags & CHN_FILTER), envpitch, csf->mix_frequency);
+				setup_channel_filter(csf, chan, !(chan->flags & CHN_FILTER), envpitch);
 			}
 
 			chan->sample_freq = frequency;
@@ -1276,7 +1379,7 @@ int32_t csf_read_note(song_t *csf)
 	}
 
 	// Checking Max Mix Channels reached: ordering by volume
-	if (csf->num_voices >= max_voices && (!(csf->mix_flags & SNDMIX_DIRECTTODISK))) {
+	if (csf->num_voices >= csf->max_voices && (!(csf->mix_flags & SNDMIX_DIRECTTODISK))) {
 		for (uint32_t i = 0; i < csf->num_voices; i++) {
 			uint32_t j = i;
 
@@ -1295,3 +1398,39 @@ int32_t csf_read_note(song_t *csf)
 	return 1;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Seeking
+
+int csf_fast_forward(song_t *csf, uint32_t order, uint32_t row, uint32_t max_ticks, uint32_t *frames)
+{
+	uint32_t old_flags = csf->mix_flags;
+	int ret = 0;
+
+	csf->mix_flags |= SNDMIX_NOOUTPUT;
+
+	for (;;) {
+		if (csf->current_order == order && csf->row == row && (csf->flags & SONG_FIRSTTICK)) {
+			ret = 1;
+			break;
+		}
+
+		if (!max_ticks--)
+			break;
+
+		// finish the tick we're on, then go to the next one
+		while (csf->buffer_count) {
+			uint32_t count = MIN(csf->buffer_count, MIXBUFFERSIZE);
+
+			csf_skip_stereo_mix(csf, count);
+			csf->buffer_count -= count;
+			*frames += count;
+		}
+
+		if (!csf_read_note(csf) || csf->current_order != order)
+			break;
+	}
+
+	csf->mix_flags = (csf->mix_flags & ~SNDMIX_NOOUTPUT) | (old_flags & SNDMIX_NOOUTPUT);
+	return ret;
+}
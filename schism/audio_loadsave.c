@@ -176,6 +176,13 @@ static fmt_load_song_func load_song_funcs[] = {
 	NULL,
 };
 
+/* names for the signature checks; same order as above */
+#define LOAD_SONG(x) #x,
+static const char *const load_song_types[] = {
+#include "fmt-types.h"
+	NULL,
+};
+
 
 const char *fmt_strerror(int n)
 {
@@ -204,14 +211,19 @@ song_t *song_create_load(const char *file)
 	slurp_t s;
 	fmt_load_song_func *func;
 	int ok = 0, err = 0;
+	unsigned char hdr[FMT_MAGIC_SIZE];
+	size_t hdrlen;
 
 	if (slurp(&s, file, NULL, 0) < 0)
 		return NULL;
 
+	hdrlen = fmt_magic_read(&s, hdr);
+
 	song_t *newsong = csf_allocate();
 
 	if (current_song) {
 		newsong->mix_flags = current_song->mix_flags;
+		newsong->max_voices = current_song->max_voices;
 		csf_set_wave_config(newsong,
 			current_song->mix_frequency,
 			current_song->mix_bits_per_sample,
@@ -224,6 +236,8 @@ song_t *song_create_load(const char *file)
 	}
 
 	for (func = load_song_funcs; *func && !ok; func++) {
+		if (!fmt_magic_check(load_song_types[func - load_song_funcs], hdr, hdrlen))
+			continue;
 		slurp_rewind(&s);
 		switch ((*func)(newsong, &s, 0)) {
 		case LOAD_SUCCESS:
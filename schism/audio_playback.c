@@ -32,6 +32,8 @@
 #include "disko.h"
 #include "backend/audio.h"
 #include "events.h"
+#include "threads.h"
+#include "timer.h"
 
 #include <assert.h>
 
@@ -58,6 +60,12 @@
 #define DEF_CHANNEL_LIMIT 128
 
 static int midi_playing;
+
+/* every frame that's been mixed, counted up forever; MIDI out is stamped with
+where on this it belongs (see midi_queue_clock) */
+static uint64_t mix_clock = 0;
+static uint64_t mix_block_clock = 0; // start of the block being mixed
+static int mix_reading = 0; // csf_read is running, so the stamps mean something
 // ------------------------------------------------------------------------
 
 #define SMP_INIT (UINT_MAX - 1) /* for a click noise on init */
@@ -79,6 +87,7 @@ struct audio_settings audio_settings = {0};
 
 static void _schism_midi_out_note(int chan, const song_note_t *m);
 static void _schism_midi_out_raw(const unsigned char *data, uint32_t len, uint32_t delay);
+static void audio_run_commands(void);
 
 /* Audio driver related stuff */
 /* XXX how much of this is really needed now? */
@@ -104,18 +113,16 @@ static const schism_audio_backend_t *backend = NULL;
 // playback
 
 extern int midi_bend_hit[64], midi_last_bend_hit[64];
-extern void vis_work_32s(short *in, int inlen);
-extern void vis_work_32m(short *in, int inlen);
+extern void vis_work_32s(int32_t *in, int inlen);
+extern void vis_work_32m(int32_t *in, int inlen);
 extern void vis_work_16s(short *in, int inlen);
 extern void vis_work_16m(short *in, int inlen);
 extern void vis_work_8s(char *in, int inlen);
 extern void vis_work_8m(char *in, int inlen);
 
-// this gets called from the backend
-static void audio_callback(uint8_t *stream, int len)
+// mixes the next block; returns zero if the UI doesn't need to hear about it
+static int audio_mix_block(uint8_t *stream, int len)
 {
-	unsigned int wasrow = current_song->row;
-	unsigned int waspat = current_song->current_order;
 	int i, n;
 
 	memset(stream, 0, len);
@@ -125,26 +132,36 @@ static void audio_callback(uint8_t *stream, int len)
 			vis_work_8m(NULL, 0);
 		}
 		song_stop_unlocked(0);
-		goto POST_EVENT;
+		return 1;
 	}
 
+	audio_run_commands();
+
+	mix_block_clock = mix_clock;
+	mix_clock += len / audio_sample_size;
+
 	if (samples_played >= SMP_INIT) {
 		memset(stream, 0x80, len);
 		samples_played++; // will loop back to 0
-		return;
+		return 0;
 	}
 
 	if (current_song->flags & SONG_ENDREACHED) {
 		n = 0;
 	} else {
+		/* the song does its own normalization, so hand it the output volume */
+		current_song->master_left = audio_settings.master.left;
+		current_song->master_right = audio_settings.master.right;
+		mix_reading = 1;
 		n = csf_read(current_song, stream, len);
+		mix_reading = 0;
 		if (!n) {
 			if (status.current_page == PAGE_WATERFALL
 			|| status.vis_style == VIS_FFT) {
 				vis_work_8m(NULL, 0);
 			}
 			song_stop_unlocked(0);
-			goto POST_EVENT;
+			return 1;
 		}
 		samples_played += n;
 	}
@@ -169,7 +186,13 @@ static void audio_callback(uint8_t *stream, int len)
 		}
 	} else if (status.current_page == PAGE_WATERFALL
 				|| status.vis_style == VIS_FFT) {
-		if (audio_output_channels == 2) {
+		if (audio_output_bits == 32) {
+			if (audio_output_channels == 2) {
+				vis_work_32s((int32_t*)stream, n);
+			} else {
+				vis_work_32m((int32_t*)stream, n);
+			}
+		} else if (audio_output_channels == 2) {
 			vis_work_16s((short*)stream, n);
 		} else {
 			vis_work_16m((short*)stream, n);
@@ -177,12 +200,17 @@ static void audio_callback(uint8_t *stream, int len)
 	}
 
 	if (current_song->num_voices > max_channels_used)
-		max_channels_used = MIN(current_song->num_voices, max_voices);
-POST_EVENT:
+		max_channels_used = MIN(current_song->num_voices, current_song->max_voices);
+
+	return 1;
+}
+
+static void audio_post_playback_event(int waspat, int wasrow)
+{
 	audio_writeout_count++;
 	if (audio_writeout_count > audio_buffers_per_second) {
 		audio_writeout_count = 0;
-	} else if (waspat == current_song->current_order && wasrow == current_song->row
+	} else if (waspat == song_get_current_order() && wasrow == song_get_current_row()
 			&& !midi_need_flush()) {
 		/* skip it */
 		return;
@@ -196,6 +224,235 @@ POST_EVENT:
 	events_push_event(&e);
 }
 
+// ------------------------------------------------------------------------
+// render-ahead
+
+/* With render_ahead set, the mixer runs on a thread of its own and keeps a
+ring of mixed blocks that many milliseconds ahead of the device, so all the
+callback has to do is copy. Locking the audio holds off the render thread
+instead of the device, which keeps playing whatever is already in the ring.
+Every block is tagged with where the song was when it was mixed, and the
+getters below report the tag of the block that's being heard. */
+
+struct render_pos {
+	uint32_t epoch;
+	int order, pattern, row, tick;
+	int speed, tempo, global_volume;
+	int vu_left, vu_right, voices;
+	unsigned int samples_played;
+	uint64_t clock; // mix_clock at the start of the block
+};
+
+static struct {
+	schism_thread_t *thread;
+	schism_mutex_t *mutex; // this is the audio lock while the thread runs
+	schism_sem_t *wake;
+	int quit;
+	int mixing; // the render thread holds the lock
+
+	uint8_t *blocks;
+	struct render_pos *pos;
+	uint32_t num_blocks, block_size; // block_size is in bytes
+
+	mt_atomic_t read, write; // only ever go up
+	uint32_t read_offset; // bytes already played from the block at read
+	mt_atomic_t epoch; // blocks tagged with an older one are thrown away
+
+	// the callback's copy of the tag it last played from
+	struct render_pos audible[2];
+	mt_atomic_t audible_index;
+} render = {0};
+
+static const struct render_pos *render_audible(void)
+{
+	return render.thread ? &render.audible[mt_atomic_get(&render.audible_index) & 1] : NULL;
+}
+
+static void render_tag(struct render_pos *pos)
+{
+	pos->epoch = mt_atomic_get(&render.epoch);
+	pos->order = current_song->current_order;
+	pos->pattern = current_song->current_pattern;
+	pos->row = current_song->row;
+	pos->tick = current_song->tick_count % current_song->current_speed;
+	pos->speed = current_song->current_speed;
+	pos->tempo = current_song->current_tempo;
+	pos->global_volume = current_song->current_global_volume;
+	pos->vu_left = current_song->vu_left;
+	pos->vu_right = current_song->vu_right;
+	pos->voices = MIN(current_song->num_voices, current_song->max_voices);
+	pos->samples_played = samples_played;
+}
+
+/* called with the audio locked; drops whatever was mixed before a jump so it
+doesn't have to be listened to first */
+static void render_flush(void)
+{
+	if (render.thread && !render.mixing) {
+		mt_atomic_set(&render.epoch, mt_atomic_get(&render.epoch) + 1);
+		/* the MIDI out that went with it, too */
+		midi_queue_discard(1);
+	}
+}
+
+static void render_fill(void)
+{
+	uint32_t w = mt_atomic_get(&render.write);
+
+	while (!render.quit && w - mt_atomic_get(&render.read) < render.num_blocks) {
+		uint32_t slot = w % render.num_blocks;
+
+		mt_mutex_lock(render.mutex);
+		render.mixing = 1;
+		audio_mix_block(render.blocks + slot * render.block_size, render.block_size);
+		render_tag(render.pos + slot);
+		render.pos[slot].clock = mix_block_clock;
+		render.mixing = 0;
+		mt_mutex_unlock(render.mutex);
+
+		mt_atomic_set(&render.write, ++w);
+	}
+}
+
+static int render_thread(SCHISM_UNUSED void *userdata)
+{
+	mt_thread_set_priority(BE_THREAD_PRIORITY_TIME_CRITICAL);
+
+	for (;;) {
+		mt_semaphore_wait(render.wake);
+		if (render.quit)
+			break;
+
+		render_fill();
+	}
+
+	return 0;
+}
+
+// this is the callback when the render thread is running
+static void render_read(uint8_t *stream, int len)
+{
+	const uint32_t epoch = mt_atomic_get(&render.epoch);
+	const uint32_t w = mt_atomic_get(&render.write);
+	uint32_t r = mt_atomic_get(&render.read);
+	const struct render_pos *played = NULL;
+	uint64_t clock = 0;
+
+	while (len > 0) {
+		const uint32_t slot = r % render.num_blocks;
+		uint32_t n;
+
+		if (r == w) {
+			/* underrun */
+			memset(stream, (audio_output_bits == 8) ? 0x80 : 0, len);
+			break;
+		}
+
+		if (render.pos[slot].epoch != epoch) {
+			r++;
+			render.read_offset = 0;
+			continue;
+		}
+
+		if (!played)
+			clock = render.pos[slot].clock + render.read_offset / audio_sample_size;
+
+		n = MIN((uint32_t)len, render.block_size - render.read_offset);
+		memcpy(stream, render.blocks + slot * render.block_size + render.read_offset, n);
+		stream += n;
+		len -= n;
+		played = render.pos + slot;
+
+		render.read_offset += n;
+		if (render.read_offset == render.block_size) {
+			r++;
+			render.read_offset = 0;
+		}
+	}
+
+	if (played) {
+		// copy it before the slot can be mixed into again
+		uint32_t i = (mt_atomic_get(&render.audible_index) + 1) & 1;
+		render.audible[i] = *played;
+		mt_atomic_set(&render.audible_index, i);
+
+		midi_queue_clock(clock, current_song->mix_frequency);
+	}
+
+	mt_atomic_set(&render.read, r);
+	mt_semaphore_post(render.wake);
+}
+
+// must be called with the device paused or closed, and the audio unlocked
+static void render_stop(void)
+{
+	if (render.thread) {
+		render.quit = 1;
+		mt_semaphore_post(render.wake);
+		mt_thread_wait(render.thread, NULL);
+	}
+
+	if (render.wake)
+		mt_semaphore_delete(render.wake);
+	if (render.mutex)
+		mt_mutex_delete(render.mutex);
+	free(render.blocks);
+	free(render.pos);
+	memset(&render, 0, sizeof(render));
+}
+
+// same as above
+static void render_start(void)
+{
+	uint32_t frames;
+
+	render_stop();
+
+	if (audio_settings.render_ahead <= 0 || !current_audio_device || !audio_buffer_samples)
+		return;
+
+	frames = (uint64_t)audio_settings.render_ahead * current_song->mix_frequency / 1000;
+	render.num_blocks = MAX(2, (frames + audio_buffer_samples - 1) / audio_buffer_samples);
+	render.block_size = audio_buffer_samples * audio_sample_size;
+	render.blocks = calloc(render.num_blocks, render.block_size);
+	render.pos = calloc(render.num_blocks, sizeof(struct render_pos));
+	render.mutex = mt_mutex_create();
+	render.wake = mt_semaphore_create(1); // fill it right away
+
+	render_tag(&render.audible[0]);
+
+	if (render.blocks && render.pos && render.mutex && render.wake)
+		render.thread = mt_thread_create(render_thread, "Render", NULL);
+
+	if (!render.thread) {
+		log_appendf(4, "Couldn't start the render thread; mixing in the audio callback");
+		render_stop();
+	}
+}
+
+// this gets called from the backend
+static void audio_callback(uint8_t *stream, int len)
+{
+	int wasrow, waspat;
+
+	if (render.thread) {
+		const struct render_pos *was = render_audible();
+
+		wasrow = was->row;
+		waspat = was->order;
+		render_read(stream, len);
+		audio_post_playback_event(waspat, wasrow);
+		return;
+	}
+
+	wasrow = current_song->row;
+	waspat = current_song->current_order;
+	// whatever gets mixed now is heard right after
+	midi_queue_clock(mix_clock, current_song->mix_frequency);
+	if (audio_mix_block(stream, len))
+		audio_post_playback_event(waspat, wasrow);
+}
+
 // ------------------------------------------------------------------------------------------------------------
 // audio device list
 
@@ -293,6 +550,85 @@ int song_is_multichannel_mode(void)
 	return multichannel_mode;
 }
 
+// ------------------------------------------------------------------------
+// commands for the audio thread
+
+/* Changes that only affect what's playing are queued here instead of being
+made with the audio locked, and the audio callback carries them out before it
+mixes the next block. Only the main thread posts commands. Whoever locks the
+audio runs what's left in the queue first, so nothing done under the lock can
+see the song as it was before a command that was posted earlier. */
+
+enum {
+	AUDIO_CMD_KEYDOWN,
+	AUDIO_CMD_SET_TEMPO,
+	AUDIO_CMD_SET_SPEED,
+	AUDIO_CMD_SET_GLOBAL_VOLUME,
+	AUDIO_CMD_SET_ORDER,
+	AUDIO_CMD_SET_NEXT_ORDER,
+	AUDIO_CMD_ADJUST_TEMPO,
+	AUDIO_CMD_ADJUST_SPEED,
+	AUDIO_CMD_ADJUST_GLOBAL_VOLUME,
+	AUDIO_CMD_ADJUST_ORDER,
+	AUDIO_CMD_UPDATE_INSTRUMENT,
+	AUDIO_CMD_UPDATE_SAMPLE,
+};
+
+struct audio_cmd {
+	int type;
+	int arg[7];
+};
+
+#define AUDIO_CMD_QUEUE_SIZE 256 /* must be a power of two */
+
+static struct audio_cmd audio_cmd_queue[AUDIO_CMD_QUEUE_SIZE];
+static mt_atomic_t audio_cmd_read, audio_cmd_write; /* only ever go up */
+
+static void audio_run_command(const struct audio_cmd *cmd);
+
+/* called from the audio callback, or with the audio locked */
+static void audio_run_commands(void)
+{
+	uint32_t r = mt_atomic_get(&audio_cmd_read);
+	uint32_t w = mt_atomic_get(&audio_cmd_write);
+
+	if (r == w)
+		return;
+	for (; r != w; r++)
+		audio_run_command(&audio_cmd_queue[r & (AUDIO_CMD_QUEUE_SIZE - 1)]);
+	mt_atomic_set(&audio_cmd_read, r);
+}
+
+static void audio_post(const struct audio_cmd *cmd)
+{
+	uint32_t w = mt_atomic_get(&audio_cmd_write);
+
+	if (!current_audio_device || w - mt_atomic_get(&audio_cmd_read) >= AUDIO_CMD_QUEUE_SIZE) {
+		/* there's no callback to run it, or it isn't keeping up */
+		song_lock_audio();
+		audio_run_command(cmd);
+		song_unlock_audio();
+		return;
+	}
+
+	audio_cmd_queue[w & (AUDIO_CMD_QUEUE_SIZE - 1)] = *cmd;
+	mt_atomic_set(&audio_cmd_write, w + 1);
+}
+
+/* Relative changes (the [ ] keys and such) are posted as a delta, and clamped
+when they're run, so pressing a key several times before the callback gets to
+it still adds up. */
+static void audio_post_adjust(int type, int delta)
+{
+	struct audio_cmd cmd = {
+		.type = type,
+		.arg = {delta},
+	};
+	audio_post(&cmd);
+}
+
+// ------------------------------------------------------------------------
+
 /* Channel corresponding to each note played.
 That is, keyjazz_note_to_chan[66] will indicate in which channel F-5 was played most recently.
 This will break if the same note was keydown'd twice without a keyup, but I think that's a
@@ -301,8 +637,8 @@ static int keyjazz_note_to_chan[NOTE_LAST + 1] = {0};
 /* last note played by channel tracking */
 static int keyjazz_chan_to_note[MAX_CHANNELS + 1] = {0};
 
-/* **** chan ranges from 1 to MAX_CHANNELS   */
-static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int effect, int param)
+/* the part of song_keydown_ex that touches what's playing */
+static void keydown_apply(int samp, int ins, int note, int vol, int chan_internal, int effect, int param)
 {
 	int ins_mode;
 	int midi_note = note; /* note gets overwritten, possibly NOTE_NONE */
@@ -310,48 +646,11 @@ static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int e
 	song_sample_t *s = NULL;
 	song_instrument_t *i = NULL;
 
-	switch (chan) {
-	case KEYJAZZ_CHAN_CURRENT:
-		chan = current_play_channel;
-		if (multichannel_mode)
-			song_change_current_play_channel(1, 1);
-		break;
-	case KEYJAZZ_CHAN_AUTO:
-		if (multichannel_mode) {
-			chan = current_play_channel;
-			song_change_current_play_channel(1, 1);
-		} else {
-			for (chan = 1; chan < MAX_CHANNELS; chan++)
-				if (!keyjazz_chan_to_note[chan])
-					break;
-		}
-		break;
-	default:
-		break;
-	}
-
-	// back to the internal range
-	int chan_internal = chan - 1;
-
-	// hm
-	assert(chan_internal < MAX_CHANNELS);
-
-	song_lock_audio();
-
 	c = current_song->voices + chan_internal;
 
 	ins_mode = song_is_instrument_mode();
 
 	if (NOTE_IS_NOTE(note)) {
-		// keep track of what channel this note was played in so we can note-off properly later
-		if (keyjazz_chan_to_note[chan]) {
-			// reset note-off pending state for last note in channel
-			keyjazz_note_to_chan[keyjazz_chan_to_note[chan]] = 0;
-		}
-
-		keyjazz_note_to_chan[note] = chan;
-		keyjazz_chan_to_note[chan] = note;
-
 		// handle blank instrument values and "fake" sample #0 (used by sample loader)
 		if (samp == 0)
 			samp = c->last_instrument;
@@ -367,7 +666,7 @@ static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int e
 
 		// give the channel a sample, and maybe an instrument
 		s = (samp == KEYJAZZ_NOINST) ? NULL : current_song->samples + samp;
-		i = (ins == KEYJAZZ_NOINST) ? NULL : song_get_instrument(ins); // blah
+		i = (ins == KEYJAZZ_NOINST || ins >= MAX_INSTRUMENTS) ? NULL : current_song->instruments[ins];
 
 		if (i && samp == KEYJAZZ_NOINST) {
 			// we're playing an instrument and don't know what sample! WHAT WILL WE EVER DO?!
@@ -403,8 +702,8 @@ static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int e
 		csf_check_nna(current_song, chan_internal, ins, note, 0);
 	if (s) {
 		if (c->flags & CHN_ADLIB) {
-			OPL_NoteOff(chan_internal);
-			OPL_Patch(chan_internal, s->adlib_bytes);
+			OPL_NoteOff(current_song, chan_internal);
+			OPL_Patch(current_song, chan_internal, s->adlib_bytes);
 		}
 
 		c->flags = (s->flags & CHN_SAMPLE_FLAGS) | (c->flags & CHN_MUTE);
@@ -514,7 +813,65 @@ static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int e
 		current_song->tick_count = -1;
 	}
 
-	song_unlock_audio();
+}
+
+
+/* **** chan ranges from 1 to MAX_CHANNELS   */
+static int song_keydown_ex(int samp, int ins, int note, int vol, int chan, int effect, int param)
+{
+	switch (chan) {
+	case KEYJAZZ_CHAN_CURRENT:
+		chan = current_play_channel;
+		if (multichannel_mode)
+			song_change_current_play_channel(1, 1);
+		break;
+	case KEYJAZZ_CHAN_AUTO:
+		if (multichannel_mode) {
+			chan = current_play_channel;
+			song_change_current_play_channel(1, 1);
+		} else {
+			for (chan = 1; chan < MAX_CHANNELS; chan++)
+				if (!keyjazz_chan_to_note[chan])
+					break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	// back to the internal range
+	int chan_internal = chan - 1;
+
+	// hm
+	assert(chan_internal < MAX_CHANNELS);
+
+	if (NOTE_IS_NOTE(note)) {
+		// keep track of what channel this note was played in so we can note-off properly later
+		if (keyjazz_chan_to_note[chan]) {
+			// reset note-off pending state for last note in channel
+			keyjazz_note_to_chan[keyjazz_chan_to_note[chan]] = 0;
+		}
+
+		keyjazz_note_to_chan[note] = chan;
+		keyjazz_chan_to_note[chan] = note;
+
+		// song_get_instrument makes a new instrument if it has to, which
+		// is better done here than on the audio thread
+		if (ins != KEYJAZZ_NOINST) {
+			int n = ins;
+			if (n == 0)
+				n = current_song->voices[chan_internal].last_instrument;
+			else if (n == KEYJAZZ_INST_FAKE)
+				n = 0;
+			song_get_instrument(n);
+		}
+	}
+
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_KEYDOWN,
+		.arg = {samp, ins, note, vol, chan_internal, effect, param},
+	};
+	audio_post(&cmd);
 
 	return chan;
 }
@@ -578,7 +935,7 @@ static void song_reset_play_state(void)
 	// turn this crap off
 	current_song->mix_flags &= ~(SNDMIX_NOBACKWARDJUMPS | SNDMIX_DIRECTTODISK);
 
-	OPL_Reset(); /* gruh? */
+	OPL_Reset(current_song); /* gruh? */
 
 	csf_set_current_order(current_song, 0);
 
@@ -589,6 +946,8 @@ static void song_reset_play_state(void)
 	current_song->stop_at_order = -1;
 	current_song->stop_at_row = -1;
 	samples_played = 0;
+
+	render_flush();
 }
 
 void song_start_once(void)
@@ -654,6 +1013,9 @@ void song_stop_unlocked(int quitting)
 {
 	if (!current_song) return;
 
+	/* everything gets turned off below anyway */
+	midi_queue_discard(0);
+
 	if (midi_playing) {
 		unsigned char moff[4];
 
@@ -693,7 +1055,7 @@ void song_stop_unlocked(int quitting)
 		midi_playing = 0;
 	}
 
-	OPL_Reset(); /* Also stop all OPL sounds */
+	OPL_Reset(current_song); /* Also stop all OPL sounds */
 	GM_Reset(quitting);
 	GM_SendSongStopCode();
 
@@ -713,8 +1075,8 @@ void song_stop_unlocked(int quitting)
 	// Modplug doesn't actually have a "stop" mode, but if SONG_ENDREACHED is set, current_song->Read just returns.
 	current_song->flags |= SONG_PAUSED | SONG_ENDREACHED;
 
-	global_vu_left = 0;
-	global_vu_right = 0;
+	current_song->vu_left = 0;
+	current_song->vu_right = 0;
 	memset(audio_buffer, 0, audio_buffer_samples * audio_sample_size);
 }
 
@@ -740,12 +1102,18 @@ void song_loop_pattern(int pattern, int row)
 
 void song_start_at_order(int order, int row)
 {
+	uint32_t frames = 0;
+
 	song_lock_audio();
 
 	song_reset_play_state();
 
-	csf_set_current_order(current_song, order);
-	current_song->break_row = row;
+	if (song_keyframes_restore(current_song, order, row, &frames)) {
+		samples_played = frames;
+	} else {
+		csf_set_current_order(current_song, order);
+		current_song->break_row = row;
+	}
 	max_channels_used = 0;
 
 	GM_SendSongStartCode();
@@ -788,52 +1156,82 @@ enum song_mode song_get_mode(void)
 // returned value is in seconds
 unsigned int song_get_current_time(void)
 {
-	return samples_played / current_song->mix_frequency;
+	const struct render_pos *pos = render_audible();
+
+	return (pos ? pos->samples_played : samples_played) / current_song->mix_frequency;
 }
 
 int song_get_current_tick(void)
 {
-	return current_song->tick_count % current_song->current_speed;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->tick : (int)(current_song->tick_count % current_song->current_speed);
 }
 int song_get_current_speed(void)
 {
-	return current_song->current_speed;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->speed : (int)current_song->current_speed;
 }
 
 void song_set_current_tempo(int new_tempo)
 {
-	song_lock_audio();
-	current_song->current_tempo = CLAMP(new_tempo, 31, 255);
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_SET_TEMPO,
+		.arg = {CLAMP(new_tempo, 31, 255)},
+	};
+	audio_post(&cmd);
+}
+int song_adjust_current_tempo(int delta)
+{
+	int tempo;
+
+	audio_post_adjust(AUDIO_CMD_ADJUST_TEMPO, delta);
+	song_lock_audio(); /* runs it */
+	tempo = current_song->current_tempo;
 	song_unlock_audio();
+	return tempo;
 }
 int song_get_current_tempo(void)
 {
-	return current_song->current_tempo;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->tempo : (int)current_song->current_tempo;
 }
 
 int song_get_current_global_volume(void)
 {
-	return current_song->current_global_volume;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->global_volume : (int)current_song->current_global_volume;
 }
 
 int song_get_current_order(void)
 {
-	return current_song->current_order;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->order : (int)current_song->current_order;
 }
 
 int song_get_playing_pattern(void)
 {
-	return current_song->current_pattern;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->pattern : (int)current_song->current_pattern;
 }
 
 int song_get_current_row(void)
 {
-	return current_song->row;
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->row : (int)current_song->row;
 }
 
 int song_get_playing_channels(void)
 {
-	return MIN(current_song->num_voices, max_voices);
+	const struct render_pos *pos = render_audible();
+
+	return pos ? pos->voices : (int)MIN(current_song->num_voices, current_song->max_voices);
 }
 
 int song_get_max_channels(void)
@@ -843,17 +1241,18 @@ int song_get_max_channels(void)
 // Returns the max value in dBs, scaled as 0 = -40dB and 128 = 0dB.
 void song_get_vu_meter(int *left, int *right)
 {
-	*left = dB_s(40, global_vu_left/256.f, 0.f);
-	*right = dB_s(40, global_vu_right/256.f, 0.f);
+	const struct render_pos *pos = render_audible();
+
+	*left = dB_s(40, (pos ? pos->vu_left : (int)current_song->vu_left)/256.f, 0.f);
+	*right = dB_s(40, (pos ? pos->vu_right : (int)current_song->vu_right)/256.f, 0.f);
 }
 
-void song_update_playing_instrument(int i_changed)
+static void update_playing_instrument(int i_changed)
 {
 	song_voice_t *channel;
 	song_instrument_t *inst;
 
-	song_lock_audio();
-	int n = MIN(current_song->num_voices, max_voices);
+	int n = MIN(current_song->num_voices, current_song->max_voices);
 	while (n--) {
 		channel = current_song->voices + current_song->voice_mix[n];
 		if (channel->ptr_instrument && channel->ptr_instrument == current_song->instruments[i_changed]) {
@@ -871,11 +1270,11 @@ void song_update_playing_instrument(int i_changed)
 			}
 			if (inst->ifc & 0x80) {
 				channel->cutoff = inst->ifc & 0x7F;
-				setup_channel_filter(channel, 0, 256, current_song->mix_frequency);
+				setup_channel_filter(current_song, channel, 0, 256);
 			} else {
 				channel->cutoff = 0x7F;
 				if (inst->ifr & 0x80) {
-					setup_channel_filter(channel, 0, 256, current_song->mix_frequency);
+					setup_channel_filter(current_song, channel, 0, 256);
 				}
 			}
 
@@ -883,16 +1282,23 @@ void song_update_playing_instrument(int i_changed)
 			channel->flags &= (~CHN_PINGPONGFLAG);
 		}
 	}
-	song_unlock_audio();
 }
 
-void song_update_playing_sample(int s_changed)
+void song_update_playing_instrument(int i_changed)
+{
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_UPDATE_INSTRUMENT,
+		.arg = {i_changed},
+	};
+	audio_post(&cmd);
+}
+
+static void update_playing_sample(int s_changed)
 {
 	song_voice_t *channel;
 	song_sample_t *inst;
 
-	song_lock_audio();
-	int n = MIN(current_song->num_voices, max_voices);
+	int n = MIN(current_song->num_voices, current_song->max_voices);
 	while (n--) {
 		channel = current_song->voices + current_song->voice_mix[n];
 		if (channel->ptr_sample && channel->current_sample_data) {
@@ -931,7 +1337,15 @@ void song_update_playing_sample(int s_changed)
 			channel->instrument_volume = inst->global_volume;
 		}
 	}
-	song_unlock_audio();
+}
+
+void song_update_playing_sample(int s_changed)
+{
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_UPDATE_SAMPLE,
+		.arg = {s_changed},
+	};
+	audio_post(&cmd);
 }
 
 void song_get_playing_samples(int samples[])
@@ -941,7 +1355,7 @@ void song_get_playing_samples(int samples[])
 	memset(samples, 0, MAX_SAMPLES * sizeof(int));
 
 	song_lock_audio();
-	int n = MIN(current_song->num_voices, max_voices);
+	int n = MIN(current_song->num_voices, current_song->max_voices);
 	while (n--) {
 		channel = current_song->voices + current_song->voice_mix[n];
 		if (channel->ptr_sample && channel->current_sample_data) {
@@ -964,7 +1378,7 @@ void song_get_playing_instruments(int instruments[])
 	memset(instruments, 0, MAX_INSTRUMENTS * sizeof(int));
 
 	song_lock_audio();
-	int n = MIN(current_song->num_voices, max_voices);
+	int n = MIN(current_song->num_voices, current_song->max_voices);
 	while (n--) {
 		channel = current_song->voices + current_song->voice_mix[n];
 		int ins = song_get_instrument_number((song_instrument_t *) channel->ptr_instrument);
@@ -983,9 +1397,22 @@ void song_set_current_speed(int speed)
 	if (speed < 1 || speed > 255)
 		return;
 
-	song_lock_audio();
-	current_song->current_speed = speed;
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_SET_SPEED,
+		.arg = {speed},
+	};
+	audio_post(&cmd);
+}
+
+int song_adjust_current_speed(int delta)
+{
+	int speed;
+
+	audio_post_adjust(AUDIO_CMD_ADJUST_SPEED, delta);
+	song_lock_audio(); /* runs it */
+	speed = current_song->current_speed;
 	song_unlock_audio();
+	return speed;
 }
 
 void song_set_current_global_volume(int volume)
@@ -993,24 +1420,92 @@ void song_set_current_global_volume(int volume)
 	if (volume < 0 || volume > 128)
 		return;
 
-	song_lock_audio();
-	current_song->current_global_volume = volume;
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_SET_GLOBAL_VOLUME,
+		.arg = {volume},
+	};
+	audio_post(&cmd);
+}
+
+int song_adjust_current_global_volume(int delta)
+{
+	int volume;
+
+	audio_post_adjust(AUDIO_CMD_ADJUST_GLOBAL_VOLUME, delta);
+	song_lock_audio(); /* runs it */
+	volume = current_song->current_global_volume;
 	song_unlock_audio();
+	return volume;
 }
 
 void song_set_current_order(int order)
 {
-	song_lock_audio();
-	csf_set_current_order(current_song, order);
-	song_unlock_audio();
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_SET_ORDER,
+		.arg = {order},
+	};
+	audio_post(&cmd);
+}
+
+void song_adjust_current_order(int delta)
+{
+	audio_post_adjust(AUDIO_CMD_ADJUST_ORDER, delta);
 }
 
 // Ctrl-F7
 void song_set_next_order(int order)
 {
-	song_lock_audio();
-	current_song->process_order = order - 1;
-	song_unlock_audio();
+	struct audio_cmd cmd = {
+		.type = AUDIO_CMD_SET_NEXT_ORDER,
+		.arg = {order},
+	};
+	audio_post(&cmd);
+}
+
+static void audio_run_command(const struct audio_cmd *cmd)
+{
+	const int *a = cmd->arg;
+
+	switch (cmd->type) {
+	case AUDIO_CMD_KEYDOWN:
+		keydown_apply(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+		break;
+	case AUDIO_CMD_SET_TEMPO:
+		current_song->current_tempo = a[0];
+		break;
+	case AUDIO_CMD_SET_SPEED:
+		current_song->current_speed = a[0];
+		break;
+	case AUDIO_CMD_SET_GLOBAL_VOLUME:
+		current_song->current_global_volume = a[0];
+		break;
+	case AUDIO_CMD_SET_ORDER:
+		csf_set_current_order(current_song, a[0]);
+		break;
+	case AUDIO_CMD_SET_NEXT_ORDER:
+		current_song->process_order = a[0] - 1;
+		break;
+	case AUDIO_CMD_ADJUST_TEMPO:
+		current_song->current_tempo = CLAMP((int)current_song->current_tempo + a[0], 31, 255);
+		break;
+	case AUDIO_CMD_ADJUST_SPEED:
+		current_song->current_speed = CLAMP((int)current_song->current_speed + a[0], 1, 255);
+		break;
+	case AUDIO_CMD_ADJUST_GLOBAL_VOLUME:
+		current_song->current_global_volume = CLAMP((int)current_song->current_global_volume + a[0], 0, 128);
+		break;
+	case AUDIO_CMD_ADJUST_ORDER:
+		/* if the order was just changed, current_order doesn't know it yet */
+		csf_set_current_order(current_song, a[0] + ((current_song->process_row == PROCESS_NEXT_ORDER)
+			? (int)current_song->process_order + 1 : (int)current_song->current_order));
+		break;
+	case AUDIO_CMD_UPDATE_INSTRUMENT:
+		update_playing_instrument(a[0]);
+		break;
+	case AUDIO_CMD_UPDATE_SAMPLE:
+		update_playing_sample(a[0]);
+		break;
+	}
 }
 
 // Alt-F11
@@ -1065,6 +1560,7 @@ void cfg_load_audio(cfg_file_t *cfg)
 	CFG_GET_A(buffer_size, DEF_BUFFER_SIZE);
 	CFG_GET_A(master.left, 31);
 	CFG_GET_A(master.right, 31);
+	CFG_GET_A(render_ahead, 0);
 
 	cfg_get_string(cfg, "Audio", "driver", cfg_audio_driver, 255, NULL);
 	if (!cfg_get_string(cfg, "Audio", "device", cfg_audio_device, 255, NULL)) {
@@ -1082,6 +1578,7 @@ void cfg_load_audio(cfg_file_t *cfg)
 	CFG_GET_M(interpolation_mode, SRCMODE_LINEAR);
 	CFG_GET_M(no_ramping, 0);
 	CFG_GET_M(surround_effect, 1);
+	CFG_GET_M(mix_threads, 1);
 
 	switch (audio_settings.channels) {
 	case 1:
@@ -1098,6 +1595,8 @@ void cfg_load_audio(cfg_file_t *cfg)
 
 	audio_settings.channel_limit = CLAMP(audio_settings.channel_limit, 4, MAX_VOICES);
 	audio_settings.interpolation_mode = CLAMP(audio_settings.interpolation_mode, 0, 3);
+	audio_settings.mix_threads = CLAMP(audio_settings.mix_threads, 1, MAX_MIX_THREADS);
+	audio_settings.render_ahead = CLAMP(audio_settings.render_ahead, 0, 1000);
 
 	audio_settings.eq_freq[0] = cfg_get_number(cfg, "EQ Low Band", "freq", 0);
 	audio_settings.eq_freq[1] = cfg_get_number(cfg, "EQ Med Low Band", "freq", 16);
@@ -1126,10 +1625,12 @@ void cfg_atexit_save_audio(cfg_file_t *cfg)
 	CFG_SET_A(buffer_size);
 	CFG_SET_A(master.left);
 	CFG_SET_A(master.right);
+	CFG_SET_A(render_ahead);
 
 	CFG_SET_M(channel_limit);
 	CFG_SET_M(interpolation_mode);
 	CFG_SET_M(no_ramping);
+	CFG_SET_M(mix_threads);
 
 	// Say, what happened to the switch for this in the gui?
 	CFG_SET_M(surround_effect);
@@ -1333,20 +1834,80 @@ static void _schism_midi_out_raw(const unsigned char *data, uint32_t len, uint32
 #endif
 
 	if (!_disko_writemidi(data,len,pos))
-		midi_send_buffer(data,len,pos);
+		midi_send_buffer(data, len, mix_reading ? (mix_block_clock + pos) : MIDI_QUEUE_NOW);
 }
 
 
 
 // ------------------------------------------------------------------------------------------------------------
 
+/* how long the audio callback has been kept waiting; only touched with the
+audio locked */
+static struct {
+	int depth;
+	uint64_t since;
+	struct audio_lock_stats stats;
+} audio_lock_time;
+
+static uint64_t audio_lock_worst_reported = 0;
+
 void song_lock_audio(void)
 {
-	if (backend) backend->lock_device(current_audio_device);
+	if (backend) {
+		if (render.thread)
+			mt_mutex_lock(render.mutex);
+		else
+			backend->lock_device(current_audio_device);
+		if (!audio_lock_time.depth++)
+			audio_lock_time.since = timer_ticks_us();
+	}
+	audio_run_commands();
 }
 void song_unlock_audio(void)
 {
-	if (backend) backend->unlock_device(current_audio_device);
+	if (!backend)
+		return;
+
+	if (audio_lock_time.depth && !--audio_lock_time.depth) {
+		uint64_t held = timer_ticks_us() - audio_lock_time.since;
+
+		audio_lock_time.stats.count++;
+		audio_lock_time.stats.total_us += held;
+		audio_lock_time.stats.longest_us = MAX(audio_lock_time.stats.longest_us, held);
+	}
+	if (render.thread)
+		mt_mutex_unlock(render.mutex);
+	else
+		backend->unlock_device(current_audio_device);
+}
+
+void song_get_audio_lock_stats(struct audio_lock_stats *stats)
+{
+	song_lock_audio();
+	*stats = audio_lock_time.stats;
+	song_unlock_audio();
+}
+
+/* anything that keeps the audio locked for longer than a buffer (or the
+render-ahead ring) lasts can make it drop out, so say so in the log (but only
+when it's worse than anything that was reported before) */
+void song_check_audio_lock_time(void)
+{
+	struct audio_lock_stats stats;
+	uint64_t buffer_us;
+
+	if (!current_audio_device || !current_song || !current_song->mix_frequency)
+		return;
+
+	song_get_audio_lock_stats(&stats);
+	buffer_us = (uint64_t)audio_buffer_samples * MAX(render.num_blocks, 1) * 1000000
+		/ current_song->mix_frequency;
+	if (stats.longest_us <= MAX(buffer_us, audio_lock_worst_reported))
+		return;
+
+	audio_lock_worst_reported = stats.longest_us;
+	log_appendf(4, "Audio was locked for %u ms (a buffer is %u ms)",
+		(unsigned int)(stats.longest_us / 1000), (unsigned int)(buffer_us / 1000));
 }
 void song_start_audio(void)
 {
@@ -1379,6 +1940,7 @@ static void _cleanup_audio_device(void)
 		if (backend)
 			backend->close_device(current_audio_device);
 		current_audio_device = NULL;
+		render_stop();
 		free(device_name);
 		device_name = NULL;
 	}
@@ -1564,6 +2126,7 @@ static void _audio_init_tail(void)
 	samples_played = (status.flags & CLASSIC_MODE) ? SMP_INIT : 0;
 
 	song_unlock_audio();
+	render_start();
 	song_start_audio();
 }
 
@@ -1639,6 +2202,8 @@ void audio_quit(void)
 {
 	_audio_quit();
 
+	mixer_set_threads(1);
+
 	if (backend) {
 		backend->quit();
 		backend = NULL;
@@ -1647,7 +2212,7 @@ void audio_quit(void)
 
 /* --------------------------------------------------------------------------------------------------------- */
 
-void song_init_eq(int do_reset, uint32_t mix_freq)
+void song_init_eq(song_t *csf, int do_reset, uint32_t mix_freq)
 {
 	uint32_t pg[4];
 	uint32_t pf[4];
@@ -1659,15 +2224,24 @@ void song_init_eq(int do_reset, uint32_t mix_freq)
 			* (mix_freq / 128) / 1024);
 	}
 
-	set_eq_gains(pg, 4, pf, do_reset, mix_freq);
+	set_eq_gains(csf, pg, 4, pf, do_reset, mix_freq);
 }
 
 
+/* from the command line; never saved */
+static int mix_threads_override = 0;
+
+void song_set_mix_threads_override(int threads)
+{
+	mix_threads_override = threads;
+}
+
 void song_init_modplug(void)
 {
 	song_lock_audio();
 
-	max_voices = audio_settings.channel_limit;
+	current_song->max_voices = audio_settings.channel_limit;
+	mixer_set_threads(mix_threads_override ? mix_threads_override : audio_settings.mix_threads);
 	csf_set_resampling_mode(current_song, audio_settings.interpolation_mode);
 	if (audio_settings.no_ramping)
 		current_song->mix_flags |= SNDMIX_NORAMPING;
@@ -1678,9 +2252,6 @@ void song_init_modplug(void)
 	// just sounds better with one woofer.)
 	song_set_surround(audio_settings.surround_effect);
 
-	// update midi queue configuration
-	midi_queue_alloc(audio_buffer_samples, audio_sample_size, current_song->mix_frequency);
-
 	// timelimit the playback_update() calls when midi isn't actively going on
 	audio_buffers_per_second = (current_song->mix_frequency / (audio_buffer_samples * 8 * audio_sample_size));
 	if (audio_buffers_per_second > 1) audio_buffers_per_second--;
@@ -0,0 +1,62 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "headers.h"
+
+#include "cpu.h"
+
+static uint32_t cpu_detect(void)
+{
+	uint32_t features = 0;
+
+#ifdef SCHISM_HAVE_SSE2
+# ifdef __x86_64__
+	/* part of the base amd64 instruction set */
+	features |= CPU_FEATURE_SSE2;
+# elif SCHISM_GNUC_HAS_BUILTIN(__builtin_cpu_supports, 4, 8, 0)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		features |= CPU_FEATURE_SSE2;
+# endif
+#endif
+
+#ifdef SCHISM_HAVE_NEON
+	/* if the compiler was allowed to emit NEON, the machine has it */
+	features |= CPU_FEATURE_NEON;
+#endif
+
+	return features;
+}
+
+int cpu_has_feature(uint32_t features)
+{
+	static int detected = 0;
+	static uint32_t available = 0;
+
+	if (!detected) {
+		available = cpu_detect();
+		detected = 1;
+	}
+
+	return (available & features) == features;
+}
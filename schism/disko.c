@@ -30,13 +30,15 @@
 #include "it.h"
 #include "page.h"
 #include "song.h"
-#include "song.h"
+#include "threads.h"
+#include "timer.h"
 #include "util.h"
 #include "vgamem.h"
 #include "osdefs.h"
 
 #include "player/sndfile.h"
 #include "player/cmixer.h"
+#include "player/snd_fm.h"
 
 #include <sys/stat.h>
 
@@ -52,12 +54,14 @@
 static unsigned int disko_output_rate = 44100;
 static unsigned int disko_output_bits = 16;
 static unsigned int disko_output_channels = 2;
+static int stem_threads = 1;
 
 void cfg_load_disko(cfg_file_t *cfg)
 {
 	disko_output_rate = cfg_get_number(cfg, "Diskwriter", "rate", 44100);
 	disko_output_bits = cfg_get_number(cfg, "Diskwriter", "bits", 16);
 	disko_output_channels = cfg_get_number(cfg, "Diskwriter", "channels", 2);
+	disko_set_stem_threads(cfg_get_number(cfg, "Diskwriter", "stem_threads", 1));
 }
 
 void cfg_save_disko(cfg_file_t *cfg)
@@ -65,6 +69,7 @@ void cfg_save_disko(cfg_file_t *cfg)
 	cfg_set_number(cfg, "Diskwriter", "rate", disko_output_rate);
 	cfg_set_number(cfg, "Diskwriter", "bits", disko_output_bits);
 	cfg_set_number(cfg, "Diskwriter", "channels", disko_output_channels);
+	cfg_set_number(cfg, "Diskwriter", "stem_threads", stem_threads);
 }
 
 // ---------------------------------------------------------------------------
@@ -134,28 +139,61 @@ static int64_t _dw_stdio_tell(disko_t *ds)
 // ---------------------------------------------------------------------------
 // memory backend
 
+static void _dw_mem_free(disko_t *ds)
+{
+	if (ds->memtype == DW_MEM_SAMPLE)
+		csf_free_sample(ds->data);
+	else
+		free(ds->data);
+	ds->data = NULL;
+	ds->allocated = 0;
+	ds->memtype = DW_MEM_MALLOC;
+}
+
+/* make room for at least 'size' bytes. the buffer grows by half again each
+time, so writing a long render costs about the same as one big copy */
+static int _dw_mem_grow(disko_t *ds, size_t size)
+{
+	size_t newsize = MAX(size, ds->allocated + ds->allocated / 2);
+	uint8_t *new;
+
+	/* round up to whole blocks */
+	newsize = (newsize + DW_BUFFER_SIZE - 1) / DW_BUFFER_SIZE * DW_BUFFER_SIZE;
+
+	if (ds->memtype == DW_MEM_SAMPLE) {
+		new = (newsize <= UINT32_MAX / 2) ? (uint8_t *)csf_reallocate_sample(ds->data, newsize) : NULL;
+	} else {
+		new = realloc(ds->data, newsize);
+	}
+
+	if (!new) {
+		// Eek
+		_dw_mem_free(ds);
+		disko_seterror(ds, errno ? errno : ENOMEM);
+		return 0;
+	}
+
+	ds->data = new;
+	ds->allocated = newsize;
+	return 1;
+}
+
 // 0 => memory error, abandon ship
 static int _dw_bufcheck(disko_t *ds, size_t extend)
 {
-	if (ds->pos + extend <= ds->length)
+	size_t end = ds->pos + extend;
+
+	if (end <= ds->length)
 		return 1;
 
-	ds->length = MAX(ds->length, ds->pos + extend);
-
-	if (ds->length >= ds->allocated) {
-		size_t newsize = MAX(ds->allocated + DW_BUFFER_SIZE, ds->length);
-		uint8_t *new = realloc(ds->data, newsize);
-		if (!new) {
-			// Eek
-			free(ds->data);
-			ds->data = NULL;
-			disko_seterror(ds, errno);
-			return 0;
-		}
-		memset(new + ds->allocated, 0, newsize - ds->allocated);
-		ds->data = new;
-		ds->allocated = newsize;
-	}
+	if (end > ds->allocated && !_dw_mem_grow(ds, end))
+		return 0;
+
+	/* if we seeked past the end, fill in the gap */
+	if (ds->pos > ds->length)
+		memset(ds->data + ds->length, 0, ds->pos - ds->length);
+
+	ds->length = end;
 	return 1;
 }
 
@@ -218,11 +256,13 @@ void disko_seek(disko_t *ds, int64_t pos, int whence)
 		ds->_seek(ds, pos, whence);
 }
 
+#ifndef SCHISM_HEADLESS
 /* used by multi-write */
 static void disko_seekcur(disko_t *ds, int64_t pos)
 {
 	disko_seek(ds, pos, SEEK_CUR);
 }
+#endif
 
 int64_t disko_tell(disko_t *ds)
 {
@@ -331,7 +371,7 @@ int disko_memopen(disko_t *ds)
 
 	*ds = (disko_t){0};
 
-	ds->data = calloc(DW_BUFFER_SIZE, sizeof(uint8_t));
+	ds->data = malloc(DW_BUFFER_SIZE);
 	if (!ds->data)
 		return -1;
 
@@ -344,11 +384,48 @@ int disko_memopen(disko_t *ds)
 	return 0;
 }
 
+int disko_memopen_sample(disko_t *ds, size_t size_hint)
+{
+	if (!ds)
+		return -1;
+
+	*ds = (disko_t){0};
+
+	ds->allocated = CLAMP(size_hint, DW_BUFFER_SIZE, UINT32_MAX / 2);
+	ds->data = (uint8_t *)csf_reallocate_sample(NULL, ds->allocated);
+	if (!ds->data && ds->allocated > DW_BUFFER_SIZE) {
+		ds->allocated = DW_BUFFER_SIZE;
+		ds->data = (uint8_t *)csf_reallocate_sample(NULL, ds->allocated);
+	}
+	if (!ds->data)
+		return -1;
+
+	ds->memtype = DW_MEM_SAMPLE;
+	ds->_write = _dw_mem_write;
+	ds->_seek = _dw_mem_seek;
+	ds->_tell = _dw_mem_tell;
+
+	return 0;
+}
+
 int disko_memclose(disko_t *ds, int keep_buffer)
 {
 	int err = ds->error;
+
+	if (keep_buffer && !err && ds->memtype == DW_MEM_SAMPLE) {
+		/* give back the extra space */
+		uint8_t *trimmed = (uint8_t *)csf_reallocate_sample(ds->data, ds->length);
+		if (trimmed) {
+			ds->data = trimmed;
+			ds->allocated = ds->length;
+		} else {
+			disko_seterror(ds, ENOMEM);
+			err = ds->error;
+		}
+	}
+
 	if (!keep_buffer || err)
-		free(ds->data);
+		_dw_mem_free(ds);
 
 	if (err) {
 		errno = err;
@@ -359,21 +436,307 @@ int disko_memclose(disko_t *ds, int keep_buffer)
 }
 
 // ---------------------------------------------------------------------------
+// stem encoding
+//
+// With the multi-write formats, the mixer converts each channel that has
+// anything on it and hands the block to the format's body function. When
+// there is more than one stem thread, the blocks go through a small queue per
+// thread instead, so the encoding (which is the slow part with FLAC) happens
+// off the rendering thread. A channel always goes to the same thread, which
+// keeps its blocks in order.
+
+#define STEM_QUEUE_DEPTH 32
+
+void disko_set_stem_threads(int threads)
+{
+	stem_threads = CLAMP(threads, 1, DISKO_MAX_THREADS);
+}
 
-static void _export_setup(song_t *dwsong, int *bps)
+struct stem_block {
+	int n; /* channel */
+	long silence; /* if nonzero, this many bytes of silence instead of data */
+	size_t bytes;
+	uint8_t data[MIXBUFFERSIZE * 2 * 4];
+};
+
+struct stem_worker {
+	schism_mutex_t *mutex;
+	schism_cond_t *work; /* signaled when a block is queued, or when quitting */
+	schism_cond_t *space; /* signaled when a block has been written */
+	schism_thread_t *thread;
+
+	const struct save_format *format;
+	disko_t *ds;
+
+	/* these are guarded by the mutex */
+	struct stem_block blocks[STEM_QUEUE_DEPTH];
+	int head, count;
+	int error; /* first error from any of this thread's files */
+	int quit;
+};
+
+/* this is what the mixer gets as the multi_write data */
+struct stem_channel {
+	struct stem_worker *worker;
+	int n;
+	long silence; /* held back until the channel gets some data */
+};
+
+struct stem_writer {
+	struct stem_worker *workers;
+	int num_workers;
+	struct stem_channel channels[MAX_CHANNELS];
+};
+
+static int stem_worker_thread(void *userdata)
 {
-	song_lock_audio();
+	struct stem_worker *w = userdata;
+	struct stem_block *b;
+	disko_t *ds;
+
+	for (;;) {
+		mt_mutex_lock(w->mutex);
+		while (!w->count && !w->quit)
+			mt_cond_wait(w->work, w->mutex);
+		if (!w->count) {
+			/* quitting, and everything has been written */
+			mt_mutex_unlock(w->mutex);
+			break;
+		}
+		b = &w->blocks[w->head];
+		mt_mutex_unlock(w->mutex);
 
-	/* install our own */
-	memcpy(dwsong, current_song, sizeof(song_t)); /* shadow it */
+		ds = &w->ds[b->n];
+		if (b->silence)
+			w->format->f.export.silence(ds, b->silence);
+		else
+			w->format->f.export.body(ds, b->data, b->bytes);
+
+		mt_mutex_lock(w->mutex);
+		if (ds->error && !w->error)
+			w->error = ds->error;
+		w->head = (w->head + 1) % STEM_QUEUE_DEPTH;
+		w->count--;
+		mt_cond_signal(w->space);
+		mt_mutex_unlock(w->mutex);
+	}
+
+	return 0;
+}
+
+/* the block at the end of the queue isn't seen by the worker until it's
+committed, so it can be filled in without holding the lock */
+static struct stem_block *stem_reserve(struct stem_worker *w)
+{
+	struct stem_block *b;
+
+	mt_mutex_lock(w->mutex);
+	while (w->count == STEM_QUEUE_DEPTH)
+		mt_cond_wait(w->space, w->mutex);
+	b = &w->blocks[(w->head + w->count) % STEM_QUEUE_DEPTH];
+	mt_mutex_unlock(w->mutex);
+
+	return b;
+}
+
+static void stem_commit(struct stem_worker *w)
+{
+	mt_mutex_lock(w->mutex);
+	w->count++;
+	mt_cond_signal(w->work);
+	mt_mutex_unlock(w->mutex);
+}
+
+static void stem_silence(struct stem_channel *ch, long bytes)
+{
+	/* channels that never get anything are thrown away at the end, so
+	there's no point in sending this along until there's data after it */
+	ch->silence += bytes;
+}
+
+static void stem_write(struct stem_channel *ch, const uint8_t *buf, size_t bytes)
+{
+	struct stem_block *b;
+
+	if (ch->silence) {
+		b = stem_reserve(ch->worker);
+		b->n = ch->n;
+		b->silence = ch->silence;
+		b->bytes = 0;
+		stem_commit(ch->worker);
+		ch->silence = 0;
+	}
+
+	while (bytes) {
+		b = stem_reserve(ch->worker);
+		b->n = ch->n;
+		b->silence = 0;
+		b->bytes = MIN(bytes, sizeof(b->data));
+		memcpy(b->data, buf, b->bytes);
+		stem_commit(ch->worker);
+		buf += b->bytes;
+		bytes -= b->bytes;
+	}
+}
+
+static int stem_writer_error(struct stem_writer *sw)
+{
+	int n, err = 0;
+
+	for (n = 0; !err && n < sw->num_workers; n++) {
+		mt_mutex_lock(sw->workers[n].mutex);
+		err = sw->workers[n].error;
+		mt_mutex_unlock(sw->workers[n].mutex);
+	}
+
+	return err;
+}
+
+/* waits for everything queued to be written */
+static void stem_writer_free(struct stem_writer *sw)
+{
+	struct stem_worker *w;
+	int n;
+
+	for (n = 0; n < sw->num_workers; n++) {
+		w = &sw->workers[n];
+		if (w->thread) {
+			mt_mutex_lock(w->mutex);
+			w->quit = 1;
+			mt_cond_signal(w->work);
+			mt_mutex_unlock(w->mutex);
+			mt_thread_wait(w->thread, NULL);
+		}
+		if (w->space)
+			mt_cond_delete(w->space);
+		if (w->work)
+			mt_cond_delete(w->work);
+		if (w->mutex)
+			mt_mutex_delete(w->mutex);
+	}
 
+	free(sw->workers);
+	free(sw);
+}
+
+/* returns NULL if the threads can't be started, in which case the blocks
+should just be written directly */
+static struct stem_writer *stem_writer_create(const struct save_format *format, disko_t *ds, int numfiles, int threads)
+{
+	struct stem_writer *sw;
+	struct stem_worker *w;
+	int n;
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return NULL;
+
+	sw->workers = calloc(threads, sizeof(*sw->workers));
+	if (!sw->workers) {
+		free(sw);
+		return NULL;
+	}
+
+	for (n = 0; n < threads; n++) {
+		w = &sw->workers[n];
+		w->format = format;
+		w->ds = ds;
+		w->mutex = mt_mutex_create();
+		w->work = mt_cond_create();
+		w->space = mt_cond_create();
+		sw->num_workers++;
+		if (!w->mutex || !w->work || !w->space)
+			break;
+		w->thread = mt_thread_create(stem_worker_thread, "Stem encoder", w);
+		if (!w->thread)
+			break;
+	}
+
+	if (n < threads) {
+		stem_writer_free(sw);
+		return NULL;
+	}
+
+	for (n = 0; n < numfiles && n < MAX_CHANNELS; n++) {
+		sw->channels[n].worker = &sw->workers[n % threads];
+		sw->channels[n].n = n;
+	}
+
+	return sw;
+}
+
+// ---------------------------------------------------------------------------
+// export jobs
+//
+// A job renders one song to one file (or one file per channel, for the
+// multi-write formats). Everything a job needs lives in the job and in its
+// song, so the queue can run as many of them at once as it has threads.
+
+struct disko_job {
+	song_t *song;
+	char *filename;
+	const struct save_format *format;
+	uint32_t rate, bits, channels;
+
+	disko_progress_cb progress;
+	disko_done_cb done;
+	void *userdata;
+
+	disko_queue_t *queue; /* NULL if run directly by disko_render_song */
+
+	/* these are guarded by the queue's mutex */
+	size_t frames, est_frames;
+	int state;
+	int cancel;
+
+	struct disko_job_result result;
+
+	disko_job_t *next; /* next pending job */
+	disko_job_t *next_all; /* every job in the queue, for freeing them */
+};
+
+enum {
+	DISKO_JOB_PENDING,
+	DISKO_JOB_RUNNING,
+	DISKO_JOB_FINISHED,
+};
+
+struct disko_queue {
+	schism_mutex_t *mutex;
+	schism_cond_t *work; /* signaled when a job is pushed, or when quitting */
+	schism_cond_t *idle; /* signaled when a job finishes */
+
+	schism_thread_t *threads[DISKO_MAX_THREADS];
+	int num_threads;
+
+	disko_job_t *pending, *pending_tail;
+	disko_job_t *jobs;
+	int unfinished;
+	int quit;
+};
+
+/* Setting up a song for playback creates its OPL chip, and the emulator's
+shared tables aren't safe to build from two threads at once. This is created
+along with the first queue and is left around afterwards. */
+static schism_mutex_t *prepare_mutex = NULL;
+
+static void _export_prepare(song_t *dwsong, uint32_t rate, uint32_t bits, uint32_t channels, int *bps)
+{
 	dwsong->multi_write = NULL; /* should be null already, but to be sure... */
 
+	if (prepare_mutex)
+		mt_mutex_lock(prepare_mutex);
 	csf_set_current_order(dwsong, 0); /* rather indirect way of resetting playback variables */
-	csf_set_wave_config(dwsong, disko_output_rate, disko_output_bits,
-		(dwsong->flags & SONG_NOSTEREO) ? 1 : disko_output_channels);
+	csf_set_wave_config(dwsong, rate, bits & ~DW_FLOAT, (dwsong->flags & SONG_NOSTEREO) ? 1 : channels);
+	if (prepare_mutex)
+		mt_mutex_unlock(prepare_mutex);
 
-	dwsong->mix_flags |= SNDMIX_DIRECTTODISK | SNDMIX_NOBACKWARDJUMPS;
+	/* exports can run alongside live playback, so keep them off the MIDI device */
+	dwsong->mix_flags |= SNDMIX_DIRECTTODISK | SNDMIX_NOBACKWARDJUMPS | SNDMIX_NOOUTPUT;
+	if ((bits & DW_FLOAT) && dwsong->mix_bits_per_sample == 32)
+		dwsong->mix_flags |= SNDMIX_FLOATBUS;
+	else
+		dwsong->mix_flags &= ~SNDMIX_FLOATBUS;
 
 	dwsong->repeat_count = -1; // FIXME do this right
 	dwsong->buffer_count = 0;
@@ -382,37 +745,469 @@ static void _export_setup(song_t *dwsong, int *bps)
 	dwsong->stop_at_row = -1;
 
 	*bps = dwsong->mix_channels * ((dwsong->mix_bits_per_sample + 7) / 8);
+}
+
+static void _export_release(song_t *dwsong)
+{
+	/* the chip is only needed while rendering; the next csf_set_wave_config makes a new one */
+	if (prepare_mutex)
+		mt_mutex_lock(prepare_mutex);
+	OPL_Close(dwsong);
+	if (prepare_mutex)
+		mt_mutex_unlock(prepare_mutex);
+}
+
+static char *get_filename(const char *template, int n)
+{
+	char *s, *sub, buf[4];
+
+	s = strdup(template);
+	if (!s)
+		return NULL;
+	sub = strcasestr(s, "%c");
+	if (!sub) {
+		errno = EINVAL;
+		free(s);
+		return NULL;
+	}
+	str_from_num99(n, buf);
+	sub[0] = buf[0];
+	sub[1] = buf[1];
+	return s;
+}
+
+/* returns nonzero if the job should stop */
+static int _job_update(disko_job_t *job, size_t frames, size_t est_frames)
+{
+	int cancel;
+
+	if (job->queue)
+		mt_mutex_lock(job->queue->mutex);
+	job->frames = frames;
+	job->est_frames = est_frames;
+	cancel = job->cancel;
+	if (job->queue)
+		mt_mutex_unlock(job->queue->mutex);
+
+	if (job->progress && job->progress(job, frames, est_frames, job->userdata))
+		cancel = 1;
+
+	return cancel;
+}
+
+static void _job_run(disko_job_t *job)
+{
+	song_t *song = job->song;
+	const struct save_format *format = job->format;
+	struct disko_job_result *res = &job->result;
+	const schism_ticks_t start = timer_ticks();
+	uint8_t buf[DW_BUFFER_SIZE];
+	disko_t *ds;
+	struct stem_writer *stems = NULL;
+	size_t frames = 0, est_frames;
+	int numfiles, opened = 0, n, bps, err = 0, tmp;
+
+	numfiles = format->f.export.multi ? MAX_CHANNELS : 1;
+
+	ds = calloc(numfiles, sizeof(disko_t));
+	if (!ds) {
+		res->result = DW_ERROR;
+		res->error = errno ? errno : ENOMEM;
+		return;
+	}
+
+	_export_prepare(song, job->rate, job->bits, job->channels, &bps);
+	est_frames = (size_t)csf_get_length(song) * song->mix_frequency;
+	if (_job_update(job, 0, est_frames))
+		err = EINTR;
+
+	if (numfiles > 1) {
+		song->multi_write = calloc(numfiles, sizeof(struct multi_write));
+		if (!song->multi_write)
+			err = errno ? errno : ENOMEM;
+	}
+
+	for (n = 0; !err && n < numfiles; n++) {
+		char *name = (numfiles > 1) ? get_filename(job->filename, n + 1) : job->filename;
+
+		if (!name || disko_open(&ds[n], name) < 0) {
+			err = errno ? errno : EINVAL;
+		} else {
+			opened++;
+			if (format->f.export.head(&ds[n], song->mix_bits_per_sample
+					| ((song->mix_flags & SNDMIX_FLOATBUS) ? DW_FLOAT : 0),
+					song->mix_channels, song->mix_frequency) != DW_OK)
+				err = errno ? errno : EINVAL;
+		}
+
+		if (numfiles > 1)
+			free(name);
+	}
+
+	if (!err && numfiles > 1) {
+		if (stem_threads > 1)
+			stems = stem_writer_create(format, ds, numfiles, MIN(stem_threads, numfiles));
+
+		for (n = 0; n < numfiles; n++) {
+			if (stems) {
+				song->multi_write[n].data = &stems->channels[n];
+				song->multi_write[n].write = (void(*)(void*, const uint8_t*, size_t))stem_write;
+				song->multi_write[n].silence = (void(*)(void*, long))stem_silence;
+			} else {
+				song->multi_write[n].data = &ds[n];
+				/* Dumb casts, again */
+				song->multi_write[n].write = (void(*)(void*, const uint8_t*, size_t))format->f.export.body;
+				song->multi_write[n].silence = (void(*)(void*, long))format->f.export.silence;
+			}
+		}
+	}
+
+	while (!err && !(song->flags & SONG_ENDREACHED)) {
+		size_t count = csf_read(song, buf, sizeof(buf));
+
+		if (!song->multi_write)
+			format->f.export.body(&ds[0], buf, count * bps);
+		frames += count;
+
+		/* always check if something died, multi-write or not */
+		if (stems) {
+			err = stem_writer_error(stems);
+		} else {
+			for (n = 0; n < numfiles; n++) {
+				if (ds[n].error) {
+					err = ds[n].error;
+					break;
+				}
+			}
+		}
+
+		if (!err && _job_update(job, frames, est_frames))
+			err = EINTR;
+	}
+
+	if (stems) {
+		/* let the encoders catch up before closing anything */
+		stem_writer_free(stems);
+		for (n = 0; !err && n < numfiles; n++)
+			err = ds[n].error;
+	}
+
+	res->result = DW_OK;
+	for (n = 0; n < opened; n++) {
+		if (err) {
+			disko_seterror(&ds[n], err); /* keep from writing a bunch of useless files */
+			disko_close(&ds[n], 0);
+		} else if (song->multi_write && !song->multi_write[n].used) {
+			/* this channel was completely empty - don't bother with it */
+			disko_seterror(&ds[n], EINVAL); /* kludge */
+			disko_close(&ds[n], 0);
+		} else {
+			/* there was noise on this channel */
+			res->num_files++;
+			if (format->f.export.tail(&ds[n]) != DW_OK) {
+				disko_seterror(&ds[n], errno);
+			} else {
+				disko_seek(&ds[n], 0, SEEK_END);
+				res->bytes += disko_tell(&ds[n]);
+			}
+			tmp = disko_close(&ds[n], 0);
+			if (tmp != DW_OK && res->result == DW_OK) {
+				res->result = tmp;
+				res->error = errno;
+			}
+		}
+	}
+	if (err) {
+		res->result = DW_ERROR;
+		res->error = err;
+	}
+
+	free(song->multi_write);
+	song->multi_write = NULL;
+	free(ds);
+
+	_export_release(song);
+
+	res->frames = frames;
+	res->elapsed_ms = timer_ticks() - start;
+}
+
+int disko_render_song(song_t *song, const char *filename, const struct save_format *format,
+	uint32_t rate, uint32_t bits, uint32_t channels, size_t *frames)
+{
+	disko_job_t job = {
+		.song = song,
+		.filename = (char *)filename,
+		.format = format,
+		.rate = rate,
+		.bits = bits,
+		.channels = channels,
+	};
+
+	_job_run(&job);
+
+	if (frames)
+		*frames = job.result.frames;
+
+	errno = job.result.error;
+	return job.result.result;
+}
+
+// ---------------------------------------------------------------------------
+
+static int disko_queue_worker(void *userdata)
+{
+	disko_queue_t *q = userdata;
+	disko_job_t *job;
+	int cancel;
+
+	mt_mutex_lock(q->mutex);
+	for (;;) {
+		while (!q->pending && !q->quit)
+			mt_cond_wait(q->work, q->mutex);
+
+		job = q->pending;
+		if (!job)
+			break;
+
+		q->pending = job->next;
+		if (!q->pending)
+			q->pending_tail = NULL;
+		job->state = DISKO_JOB_RUNNING;
+		cancel = job->cancel;
+		mt_mutex_unlock(q->mutex);
+
+		if (cancel) {
+			/* disko_queue_free got here first; don't even start */
+			job->result.result = DW_ERROR;
+			job->result.error = EINTR;
+		} else {
+			_job_run(job);
+		}
+
+		if (job->done)
+			job->done(job, &job->result, job->userdata);
+
+		mt_mutex_lock(q->mutex);
+		job->state = DISKO_JOB_FINISHED;
+		q->unfinished--;
+		mt_cond_signal(q->idle);
+	}
+	mt_mutex_unlock(q->mutex);
+
+	return 0;
+}
+
+disko_queue_t *disko_queue_create(int threads)
+{
+	disko_queue_t *q;
+
+	if (!prepare_mutex) {
+		prepare_mutex = mt_mutex_create();
+		if (!prepare_mutex)
+			return NULL;
+	}
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->mutex = mt_mutex_create();
+	q->work = mt_cond_create();
+	q->idle = mt_cond_create();
+	if (!q->mutex || !q->work || !q->idle) {
+		disko_queue_free(q);
+		return NULL;
+	}
+
+	threads = CLAMP(threads, 1, DISKO_MAX_THREADS);
+	for (q->num_threads = 0; q->num_threads < threads; q->num_threads++) {
+		q->threads[q->num_threads] = mt_thread_create(disko_queue_worker, "Export", q);
+		if (!q->threads[q->num_threads])
+			break;
+	}
+
+	if (!q->num_threads) {
+		disko_queue_free(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+disko_job_t *disko_queue_push(disko_queue_t *q, song_t *song, const char *filename,
+	const struct save_format *format, uint32_t rate, uint32_t bits, uint32_t channels,
+	disko_progress_cb progress, disko_done_cb done, void *userdata)
+{
+	disko_job_t *job;
+
+	if (format->f.export.multi && !strcasestr(filename, "%c")) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->filename = str_dup(filename);
+	job->song = song;
+	job->format = format;
+	job->rate = rate;
+	job->bits = bits;
+	job->channels = channels;
+	job->progress = progress;
+	job->done = done;
+	job->userdata = userdata;
+	job->queue = q;
+	job->state = DISKO_JOB_PENDING;
+
+	mt_mutex_lock(q->mutex);
+	job->next_all = q->jobs;
+	q->jobs = job;
+	if (q->pending_tail)
+		q->pending_tail->next = job;
+	else
+		q->pending = job;
+	q->pending_tail = job;
+	q->unfinished++;
+	mt_cond_signal(q->work);
+	mt_mutex_unlock(q->mutex);
+
+	return job;
+}
+
+void disko_queue_wait(disko_queue_t *q)
+{
+	mt_mutex_lock(q->mutex);
+	while (q->unfinished)
+		mt_cond_wait(q->idle, q->mutex);
+	mt_mutex_unlock(q->mutex);
+}
+
+void disko_queue_free(disko_queue_t *q)
+{
+	disko_job_t *job, *next;
+	int n;
+
+	if (!q)
+		return;
+
+	if (q->num_threads) {
+		mt_mutex_lock(q->mutex);
+		for (job = q->jobs; job; job = job->next_all)
+			job->cancel = 1;
+		q->quit = 1;
+		for (n = 0; n < q->num_threads; n++)
+			mt_cond_signal(q->work);
+		mt_mutex_unlock(q->mutex);
+
+		for (n = 0; n < q->num_threads; n++)
+			mt_thread_wait(q->threads[n], NULL);
+	}
+
+	for (job = q->jobs; job; job = next) {
+		next = job->next_all;
+		free(job->filename);
+		free(job);
+	}
+
+	if (q->idle)
+		mt_cond_delete(q->idle);
+	if (q->work)
+		mt_cond_delete(q->work);
+	if (q->mutex)
+		mt_mutex_delete(q->mutex);
+	free(q);
+}
+
+int disko_job_poll(disko_job_t *job, size_t *frames, size_t *total)
+{
+	int ret;
+
+	mt_mutex_lock(job->queue->mutex);
+	if (frames)
+		*frames = job->frames;
+	if (total)
+		*total = job->est_frames;
+	if (job->state != DISKO_JOB_FINISHED)
+		ret = DW_SYNC_MORE;
+	else if (job->result.result == DW_OK)
+		ret = DW_SYNC_DONE;
+	else
+		ret = DW_SYNC_ERROR;
+	mt_mutex_unlock(job->queue->mutex);
+
+	return ret;
+}
+
+void disko_job_cancel(disko_job_t *job)
+{
+	mt_mutex_lock(job->queue->mutex);
+	job->cancel = 1;
+	mt_mutex_unlock(job->queue->mutex);
+}
+
+const struct disko_job_result *disko_job_get_result(disko_job_t *job)
+{
+	return &job->result;
+}
+
+// ---------------------------------------------------------------------------
+// Everything below here works on current_song and/or talks to the user, so
+// the headless renderer leaves it out.
+
+#ifndef SCHISM_HEADLESS
+
+/* call with the audio locked */
+static void _export_shadow(song_t *dwsong)
+{
+	/* install our own */
+	memcpy(dwsong, current_song, sizeof(song_t)); /* shadow it */
+	dwsong->opl = NULL; /* the player is still using that one */
+	dwsong->length_cache = NULL;
+}
+
+static void _export_setup(song_t *dwsong, int *bps)
+{
+	song_lock_audio();
+
+	_export_shadow(dwsong);
+	_export_prepare(dwsong, disko_output_rate, disko_output_bits, disko_output_channels, bps);
 
 	song_unlock_audio();
 }
 
-static void _export_teardown(void)
+static void _export_teardown(song_t *dwsong)
 {
-	global_vu_left = global_vu_right = 0;
+	_export_release(dwsong);
 }
 
 // ---------------------------------------------------------------------------
 
-static int close_and_bind(song_t *dwsong, disko_t *ds, song_sample_t *sample, int bps)
+/* a rough guess at how many frames one pass through a pattern will take, going
+by the current speed and tempo. good enough for sizing a buffer */
+static size_t _pattern_frames(song_t *dwsong, int pattern)
 {
-	disko_t dsshadow = *ds;
-	int8_t *newdata;
+	size_t rows = (pattern >= 0 && pattern < MAX_PATTERNS && dwsong->patterns[pattern])
+		? dwsong->pattern_size[pattern] : 64;
+	size_t tick = (dwsong->mix_frequency * 5 * dwsong->tempo_factor) / (MAX(dwsong->current_tempo, 1) << 8);
+
+	return MIN(rows * dwsong->current_speed * tick, MAX_SAMPLE_LENGTH);
+}
 
+/* hands the buffer over to the sample, and closes ds either way.
+ds has to have been opened with disko_memopen_sample */
+static int close_and_bind(song_t *dwsong, disko_t *ds, song_sample_t *sample, int bps)
+{
 	if (disko_memclose(ds, 1) == DW_ERROR)
 		return DW_ERROR;
 
-	free(ds);
-
-	newdata = csf_allocate_sample(dsshadow.length);
-	if (!newdata)
-		return DW_ERROR;
 	csf_stop_sample(current_song, sample);
 	if (sample->data)
 		csf_free_sample(sample->data);
-	sample->data = newdata;
-
-	memcpy(newdata, dsshadow.data, dsshadow.length);
-	sample->length = dsshadow.length / bps;
+	sample->data = (signed char *)ds->data;
+	sample->length = ds->length / bps;
 	sample->flags &= ~(CHN_16BIT | CHN_STEREO | CHN_ADLIB);
 	if (dwsong->mix_channels > 1)
 		sample->flags |= CHN_STEREO;
@@ -436,13 +1231,15 @@ int disko_writeout_sample(int smpnum, int pattern, int dobind)
 	if (smpnum < 1 || smpnum >= MAX_SAMPLES)
 		return DW_ERROR;
 
-	if (disko_memopen(&ds) < 0)
-		return DW_ERROR;
-
 	_export_setup(&dwsong, &bps);
 	dwsong.repeat_count = -1; // FIXME do this right
 	csf_loop_pattern(&dwsong, pattern, 0);
 
+	if (disko_memopen_sample(&ds, _pattern_frames(&dwsong, pattern) * bps) < 0) {
+		_export_teardown(&dwsong);
+		return DW_ERROR;
+	}
+
 	do {
 		disko_write(&ds, buf, csf_read(&dwsong, buf, sizeof(buf)) * bps);
 		if (ds.length >= (size_t) (MAX_SAMPLE_LENGTH * bps)) {
@@ -465,7 +1262,7 @@ int disko_writeout_sample(int smpnum, int pattern, int dobind)
 		ret = DW_ERROR;
 	}
 
-	_export_teardown();
+	_export_teardown(&dwsong);
 
 	return ret;
 }
@@ -491,7 +1288,8 @@ int disko_multiwrite_samples(int firstsmp, int pattern)
 
 	if (!err) {
 		for (n = 0; n < MAX_CHANNELS; n++) {
-			if (disko_memopen(ds[n]) < 0) {
+			ds[n] = malloc(sizeof(disko_t));
+			if (!ds[n] || disko_memopen_sample(ds[n], _pattern_frames(&dwsong, pattern) * bps) < 0) {
 				err = errno ? errno : EINVAL;
 				break;
 			}
@@ -501,11 +1299,12 @@ int disko_multiwrite_samples(int firstsmp, int pattern)
 	if (err) {
 		/* you might think this code is insane, and you might be correct ;)
 		but it's structured like this to keep all the early-termination handling HERE. */
-		_export_teardown();
+		_export_teardown(&dwsong);
 		err = err ? err : errno;
 		free(dwsong.multi_write);
 		for (n = 0; n < MAX_CHANNELS; n++) {
-			disko_memclose(ds[n], 0);
+			if (ds[n])
+				disko_memclose(ds[n], 0);
 			free(ds[n]);
 		}
 		errno = err;
@@ -560,6 +1359,7 @@ int disko_multiwrite_samples(int firstsmp, int pattern)
 			/* Balls. Something died. */
 			err = errno;
 		}
+		free(ds[n]);
 	}
 
 	for (; n < MAX_CHANNELS; n++) {
@@ -569,7 +1369,7 @@ int disko_multiwrite_samples(int firstsmp, int pattern)
 		free(ds[n]);
 	}
 
-	_export_teardown();
+	_export_teardown(&dwsong);
 	free(dwsong.multi_write);
 
 	if (err) {
@@ -582,14 +1382,12 @@ int disko_multiwrite_samples(int firstsmp, int pattern)
 
 // ---------------------------------------------------------------------------
 
-static song_t export_dwsong;
-static int export_bps;
-static disko_t *export_ds[MAX_CHANNELS + 1]; /* only [0] is used unless multichannel */
-static const struct save_format *export_format = NULL; /* NULL == not running */
+static song_t *export_dwsong = NULL;
+static disko_queue_t *export_queue = NULL;
+static disko_job_t *export_job = NULL; /* NULL == not running */
+static uint32_t export_rate;
 static struct widget diskodlg_widgets[1];
-static size_t est_len;
 static int prgh;
-static schism_ticks_t export_start_time;
 static int canceled = 0; /* this sucks, but so do I */
 
 static int disko_finish(void);
@@ -598,16 +1396,18 @@ static void diskodlg_draw(void)
 {
 	int sec, pos;
 	char buf[32];
+	size_t frames, total;
 
-	if (!export_ds[0]) {
+	if (!export_job) {
 		/* what are we doing here?! */
 		dialog_destroy_all();
 		log_appendf(4, "disk export dialog was eaten by a grue!");
 		return;
 	}
 
-	sec = export_ds[0]->length / export_dwsong.mix_frequency;
-	pos = export_ds[0]->length * 64 / est_len;
+	disko_job_poll(export_job, &frames, &total);
+	sec = frames / export_rate;
+	pos = total ? frames * 64 / total : 0;
 	snprintf(buf, 32, "Exporting song...%6d:%02d", sec / 60, sec % 60);
 	buf[31] = '\0';
 	draw_text(buf, 27, 27, 0, 2);
@@ -619,30 +1419,28 @@ static void diskodlg_draw(void)
 static void diskodlg_cancel(SCHISM_UNUSED void *ignored)
 {
 	canceled = 1;
-	export_dwsong.flags |= SONG_ENDREACHED;
-	if (!export_ds[0]) {
+	if (!export_job) {
 		log_appendf(4, "export was already dead on the inside");
 		return;
 	}
-	for (int n = 0; export_ds[n]; n++)
-		disko_seterror(export_ds[n], EINTR);
+	disko_job_cancel(export_job);
 
-	/* The next disko_sync will notice the (artifical) error status and call disko_finish,
-	which will clean up all the files.
+	/* The export thread will notice and stop, and the next disko_sync will call
+	disko_finish, which will clean up all the files.
 	'canceled' prevents disko_finish from making a second call to dialog_destroy (since
 	this function is already being called in response to the dialog being canceled) and
 	also affects the message it prints at the end. */
 }
 
-static void disko_dialog_setup(size_t len);
+static void disko_dialog_setup(void);
 
 // this needs to be done to work around stupid inconsistent key-up code
 static void diskodlg_reset(SCHISM_UNUSED void *ignored)
 {
-	disko_dialog_setup(est_len);
+	disko_dialog_setup();
 }
 
-static void disko_dialog_setup(size_t len)
+static void disko_dialog_setup(void)
 {
 	struct dialog *d = dialog_create_custom(22, 25, 36, 8, diskodlg_widgets, 0, 0, diskodlg_draw, NULL);
 	d->action_yes = diskodlg_reset;
@@ -651,7 +1449,6 @@ static void disko_dialog_setup(size_t len)
 
 	canceled = 0; /* stupid */
 
-	est_len = len;
 	uint32_t r = (rand() >> 8) & 63;
 	if (r <= 7) {
 		prgh = 6;
@@ -666,145 +1463,81 @@ static void disko_dialog_setup(size_t len)
 
 // ---------------------------------------------------------------------------
 
-static char *get_filename(const char *template, int n)
-{
-	char *s, *sub, buf[4];
-
-	s = strdup(template);
-	if (!s)
-		return NULL;
-	sub = strcasestr(s, "%c");
-	if (!sub) {
-		errno = EINVAL;
-		free(s);
-		return NULL;
-	}
-	str_from_num99(n, buf);
-	sub[0] = buf[0];
-	sub[1] = buf[1];
-	return s;
-}
-
 int disko_export_song(const char *filename, const struct save_format *format)
 {
-	int err = 0;
-	int numfiles, n;
-
-	if (export_format) {
+	if (export_job) {
 		log_appendf(4, "Another export is already active");
 		errno = EAGAIN;
 		return DW_ERROR;
 	}
 
-	export_start_time = timer_ticks();
-
-	numfiles = format->f.export.multi ? MAX_CHANNELS : 1;
-
-	_export_setup(&export_dwsong, &export_bps);
-	if (numfiles > 1) {
-		export_dwsong.multi_write = calloc(numfiles, sizeof(struct multi_write));
-		if (!export_dwsong.multi_write)
-			err = errno ? errno : ENOMEM;
+	export_dwsong = mem_alloc(sizeof(song_t));
+	export_queue = disko_queue_create(1);
+	if (!export_queue) {
+		free(export_dwsong);
+		export_dwsong = NULL;
+		log_perror(filename);
+		return DW_ERROR;
 	}
 
-	memset(export_ds, 0, sizeof(export_ds));
-	for (n = 0; n < numfiles; n++) {
-		if (numfiles > 1) {
-			char *tmp = get_filename(filename, n + 1);
-			if (tmp) {
-				export_ds[n] = calloc(1, sizeof(*export_ds[n]));
-				disko_open(export_ds[n], tmp);
-				free(tmp);
-			}
-		} else {
-			export_ds[n] = calloc(1, sizeof(*export_ds[n]));
-			disko_open(export_ds[n], filename);
-		}
-		if (!(export_ds[n] && format->f.export.head(export_ds[n], export_dwsong.mix_bits_per_sample,
-				export_dwsong.mix_channels, export_dwsong.mix_frequency) == DW_OK)) {
-			err = errno ? errno : EINVAL;
-			break;
-		}
-	}
+	song_lock_audio();
+	_export_shadow(export_dwsong);
+	song_unlock_audio();
 
-	if (err) {
-		_export_teardown();
-		free(export_dwsong.multi_write);
-		for (n = 0; export_ds[n]; n++) {
-			disko_seterror(export_ds[n], err); /* keep from writing a bunch of useless files */
-			disko_close(export_ds[n], 0);
-		}
-		errno = err ? err : EINVAL;
+	log_appendf(5, " %u Hz, %u bit, %s",
+		disko_output_rate, disko_output_bits,
+		(disko_output_channels == 1 || (export_dwsong->flags & SONG_NOSTEREO)) ? "mono" : "stereo");
+
+	export_rate = disko_output_rate;
+	export_job = disko_queue_push(export_queue, export_dwsong, filename, format,
+		disko_output_rate, disko_output_bits, disko_output_channels, NULL, NULL, NULL);
+	if (!export_job) {
 		log_perror(filename);
+		disko_queue_free(export_queue);
+		export_queue = NULL;
+		free(export_dwsong);
+		export_dwsong = NULL;
 		return DW_ERROR;
 	}
 
-	if (numfiles > 1) {
-		for (n = 0; n < numfiles; n++) {
-			export_dwsong.multi_write[n].data = export_ds[n];
-			/* Dumb casts, again */
-			export_dwsong.multi_write[n].write = (void(*)(void*, const uint8_t*, size_t))format->f.export.body;
-			export_dwsong.multi_write[n].silence = (void(*)(void*, long))format->f.export.silence;
-		}
-	}
-
-	log_appendf(5, " %" PRIu32 " Hz, %" PRIu32 " bit, %s",
-		export_dwsong.mix_frequency, export_dwsong.mix_bits_per_sample,
-		export_dwsong.mix_channels == 1 ? "mono" : "stereo");
-	export_format = format;
 	status.flags |= DISKWRITER_ACTIVE; /* tell main to care about us */
 
-	uint32_t s = (csf_get_length(&export_dwsong) * export_dwsong.mix_frequency);
-	disko_dialog_setup(s ? s : 1);
+	disko_dialog_setup();
 
 	return DW_OK;
 }
 
 
-/* main calls this periodically when the .wav exporter is busy */
+/* main calls this periodically while a song is being exported */
 int disko_sync(void)
 {
-	uint8_t buf[DW_BUFFER_SIZE];
-	size_t frames;
-	int n;
+	int ret;
 
-	if (!export_format) {
+	if (!export_job) {
 		log_appendf(4, "disko_sync: unexplained bacon");
 		return DW_SYNC_ERROR; /* no writer running (why are we here?) */
 	}
 
-	frames = csf_read(&export_dwsong, buf, sizeof(buf));
+	ret = disko_job_poll(export_job, NULL, NULL);
 
-	if (!export_dwsong.multi_write)
-		export_format->f.export.body(export_ds[0], buf, frames * export_bps);
-	/* always check if something died, multi-write or not */
-	for (n = 0; export_ds[n]; n++) {
-		if (export_ds[n]->error) {
-			disko_finish();
-			return DW_SYNC_ERROR;
-		}
-	}
-
-	/* update the progress bar (kind of messy, yes...) */
-	export_ds[0]->length += frames;
+	/* update the progress bar */
 	status.flags |= NEED_UPDATE;
 
-	if (export_dwsong.flags & SONG_ENDREACHED) {
-		disko_finish();
-		return DW_SYNC_DONE;
-	} else {
+	if (ret == DW_SYNC_MORE) {
+		/* the rendering happens on the export thread; don't spin while it works */
+		timer_msleep(10);
 		return DW_SYNC_MORE;
 	}
+
+	return (disko_finish() == DW_OK) ? DW_SYNC_DONE : DW_SYNC_ERROR;
 }
 
 static int disko_finish(void)
 {
-	int ret = DW_OK, n, tmp;
-	int num_files = 0;
-	size_t total_size = 0; // in bytes
-	size_t samples_0;
+	const struct disko_job_result *res;
+	int ret;
 
-	if (!export_format) {
+	if (!export_job) {
 		log_appendf(4, "disko_finish: unexplained eggs");
 		return DW_ERROR; /* no writer running (why are we here?) */
 	}
@@ -812,56 +1545,38 @@ static int disko_finish(void)
 	if (!canceled)
 		dialog_destroy();
 
-	samples_0 = export_ds[0]->length;
-	for (n = 0; export_ds[n]; n++) {
-		if (export_dwsong.multi_write && !export_dwsong.multi_write[n].used) {
-			/* this channel was completely empty - don't bother with it */
-			disko_seterror(export_ds[n], EINVAL); /* kludge */
-			disko_close(export_ds[n], 0);
-		} else {
-			/* there was noise on this channel */
-			num_files++;
-			if (export_format->f.export.tail(export_ds[n]) != DW_OK) {
-				disko_seterror(export_ds[n], errno);
-			} else {
-				disko_seek(export_ds[n], 0, SEEK_END);
-				total_size += disko_tell(export_ds[n]);
-			}
-			tmp = disko_close(export_ds[n], 0);
-			if (ret == DW_OK)
-				ret = tmp;
-		}
-	}
-	memset(export_ds, 0, sizeof(export_ds));
-
-	_export_teardown();
-	free(export_dwsong.multi_write);
-	export_format = NULL;
-
-	status.flags &= ~DISKWRITER_ACTIVE; /* please unsubscribe me from your mailing list */
+	res = disko_job_get_result(export_job);
+	ret = res->result;
 
 	switch (ret) {
-	case DW_OK: {
-		const schism_ticks_t elapsed_ms = (timer_ticks() - export_start_time);
-
+	case DW_OK:
 		log_appendf(5, " %.2f MiB (%zu:%zu) written in %" PRIu64 ".%02" PRIu64 " sec",
-			total_size / 1048576.0,
-			samples_0 / disko_output_rate / 60, (samples_0 / disko_output_rate) % 60,
-			(uint64_t)(elapsed_ms / 1000), (uint64_t)(elapsed_ms / 10 % 100));
+			res->bytes / 1048576.0,
+			res->frames / export_rate / 60, (res->frames / export_rate) % 60,
+			res->elapsed_ms / 1000, res->elapsed_ms / 10 % 100);
 		break;
-	}
 	case DW_ERROR:
 		/* hey, what was the filename? oops */
-		if (canceled)
+		if (canceled) {
 			log_appendf(5, " Canceled");
-		else
+		} else {
+			errno = res->error;
 			log_perror(" Write error");
+		}
 		break;
 	default:
 		log_appendf(5, " Internal error exporting song");
 		break;
 	}
 
+	disko_queue_free(export_queue); /* also frees the job */
+	export_queue = NULL;
+	export_job = NULL;
+	free(export_dwsong);
+	export_dwsong = NULL;
+
+	status.flags &= ~DISKWRITER_ACTIVE; /* please unsubscribe me from your mailing list */
+
 	return ret;
 }
 
@@ -950,3 +1665,5 @@ int _disko_writemidi(SCHISM_UNUSED const void *data, SCHISM_UNUSED unsigned int
 {
 	return DW_ERROR;
 }
+
+#endif /* !SCHISM_HEADLESS */
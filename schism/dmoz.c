@@ -34,6 +34,11 @@
 #include "util.h"
 #include "osdefs.h"
 #include "loadso.h"
+#include "threads.h"
+#include "disko.h"
+#include "bswap.h"
+#include "version.h"
+#include "config.h"
 
 #include "backend/dmoz.h"
 
@@ -131,6 +136,14 @@ static const fmt_read_info_func read_info_funcs[] = {
 	NULL /* This needs to be at the bottom of the list! */
 };
 
+/* names for the signature checks; same order as above */
+#define READ_INFO(t) #t,
+
+static const char *const read_info_types[] = {
+#include "fmt-types.h"
+	NULL
+};
+
 /* --------------------------------------------------------------------------------------------------------- */
 /* sorting stuff */
 
@@ -1260,10 +1273,17 @@ static void free_dir(dmoz_dir_t *dir)
 	free(dir);
 }
 
+static void scan_cancel(dmoz_filelist_t *flist);
+static int scan_collect(void);
+static void scan_quit(void);
+
 void dmoz_free(dmoz_filelist_t *flist, dmoz_dirlist_t *dlist)
 {
 	int n;
 
+	if (flist)
+		scan_cancel(flist);
+
 	if (flist) {
 		for (n = 0; n < flist->num_files; n++)
 			free_file(flist->files[n]);
@@ -1292,9 +1312,15 @@ static void (*dmoz_worker_onmove)(void) = NULL;
 int dmoz_worker(void)
 {
 	dmoz_file_t *nf;
+	int changed;
 
 	if (!current_dmoz_filelist || !current_dmoz_filter)
 		return 0;
+
+	changed = scan_collect();
+	if (changed)
+		status.flags |= NEED_UPDATE;
+
 	if (current_dmoz_file >= current_dmoz_filelist->num_files) {
 		current_dmoz_filelist = NULL;
 		current_dmoz_filter = NULL;
@@ -1303,6 +1329,11 @@ int dmoz_worker(void)
 		return 0;
 	}
 
+	/* wait for the background scan to get to this one, instead of reading it here.
+	if nothing came in, return 0 so the caller doesn't spin on it */
+	if (current_dmoz_filelist->files[ current_dmoz_file ]->scanning)
+		return changed;
+
 	if (!current_dmoz_filter(current_dmoz_filelist->files[ current_dmoz_file ])) {
 		if (current_dmoz_filelist->num_files == current_dmoz_file+1) {
 			current_dmoz_filelist->num_files--;
@@ -1342,6 +1373,8 @@ int dmoz_worker(void)
 so it can't generate error conditions. */
 void dmoz_filter_filelist(dmoz_filelist_t *flist, int (*grep)(dmoz_file_t *f), int *pointer, void (*fn)(void))
 {
+	scan_cancel(NULL);
+
 	current_dmoz_filelist = flist;
 	current_dmoz_filter = grep;
 	current_dmoz_file = 0;
@@ -1477,11 +1510,16 @@ void dmoz_sort(dmoz_filelist_t *flist, dmoz_dirlist_t *dlist)
 		qsort(dlist->dirs, dlist->num_dirs, sizeof(dmoz_dir_t *), qsort_cmp_dir);
 }
 
+static void info_cache_load_cfg(cfg_file_t *cfg);
+static void info_cache_save_cfg(cfg_file_t *cfg);
+
 void cfg_load_dmoz(cfg_file_t *cfg)
 {
 	const char *ptr;
 	int i;
 
+	info_cache_load_cfg(cfg);
+
 	ptr = cfg_get_string(cfg, "Directories", "sort_with", NULL, 0, NULL);
 	if (ptr) {
 		for (i = 0; compare_funcs[i].name; i++) {
@@ -1504,6 +1542,8 @@ void cfg_save_dmoz(cfg_file_t *cfg)
 			break;
 		}
 	}
+
+	info_cache_save_cfg(cfg);
 }
 
 /* --------------------------------------------------------------------------------------------------------- */
@@ -1818,23 +1858,62 @@ enum {
 	FINF_SUCCESS = (0),     /* nothing wrong */
 	FINF_UNSUPPORTED = (1), /* unsupported file type */
 	FINF_EMPTY = (2),       /* zero-byte-long file */
+	FINF_DEFERRED = (3),    /* got to a format that has to be checked on the main thread */
 	FINF_ERRNO = (-1),      /* check errno */
 };
 
-static int file_info_get(dmoz_file_t *file)
+/* these can't be run from the background scanning threads */
+static const fmt_read_info_func main_thread_read_info_funcs[] = {
+	fmt_mid_read_info, /* goes through the loader, which writes to the log */
+	fmt_aiff_read_info, /* complains about weird 8SVX files in the log */
+	fmt_edl_read_info, /* huffman_decompress builds its tables in statics */
+#ifdef USE_FLAC
+	fmt_flac_read_info, /* decoder errors go to the log */
+#endif
+#if USE_MEDIAFOUNDATION
+	fmt_win32mf_read_info, /* COM has to be set up for each thread */
+#endif
+	NULL
+};
+
+static int read_info_needs_main_thread(fmt_read_info_func func)
+{
+	for (const fmt_read_info_func *f = main_thread_read_info_funcs; *f; f++)
+		if (*f == func)
+			return 1;
+	return 0;
+}
+
+/* tries the formats starting at read_info_funcs[*first]. if 'background' is set, this stops
+at a format that has to be checked on the main thread, and sets *first to pick up from there */
+static int file_info_get_ex(dmoz_file_t *file, int *first, int background)
 {
 	slurp_t t;
+	unsigned char hdr[FMT_MAGIC_SIZE];
+	size_t hdrlen;
+
 	if (file->filesize == 0)
 		return FINF_EMPTY;
 
 	if (slurp(&t, file->path, NULL, file->filesize) < 0)
 		return FINF_ERRNO;
 
-	file->artist = NULL;
-	file->title = NULL;
-	file->smp_defvol = 64;
-	file->smp_gblvol = 64;
-	for (const fmt_read_info_func *func = read_info_funcs; *func; func++) {
+	hdrlen = fmt_magic_read(&t, hdr);
+
+	if (!*first) {
+		file->artist = NULL;
+		file->title = NULL;
+		file->smp_defvol = 64;
+		file->smp_gblvol = 64;
+	}
+	for (const fmt_read_info_func *func = read_info_funcs + *first; *func; func++) {
+		if (!fmt_magic_check(read_info_types[func - read_info_funcs], hdr, hdrlen))
+			continue;
+		if (background && read_info_needs_main_thread(*func)) {
+			*first = func - read_info_funcs;
+			unslurp(&t);
+			return FINF_DEFERRED;
+		}
 		slurp_rewind(&t);
 		if ((*func) (file, &t)) {
 			if (file->artist)
@@ -1849,17 +1928,15 @@ static int file_info_get(dmoz_file_t *file)
 	return file->title ? FINF_SUCCESS : FINF_UNSUPPORTED;
 }
 
-/* return: 1 on success, 0 on error. in either case, it fills the data in with *something*. */
-int dmoz_filter_ext_data(dmoz_file_t *file)
+static int file_info_get(dmoz_file_t *file)
 {
-	int ret;
+	int first = 0;
+	return file_info_get_ex(file, &first, 0);
+}
 
-	if ((file->type & TYPE_EXT_DATA_MASK)
-	|| (file->type == TYPE_DIRECTORY)) {
-		/* nothing to do */
-		return 1;
-	}
-	ret = file_info_get(file);
+/* fills in the description for files that couldn't be read. returns 1 on success, 0 on error */
+static int file_info_finish(dmoz_file_t *file, int ret)
+{
 	switch (ret) {
 	case FINF_SUCCESS:
 		return 1;
@@ -1886,6 +1963,480 @@ int dmoz_filter_ext_data(dmoz_file_t *file)
 	return 0;
 }
 
+/* --------------------------------------------------------------------------------------------------------- */
+/* info cache
+
+The ext data for every file is kept in a file in the dot directory, so that going back to a big sample
+library doesn't mean reading all of it again. Entries are keyed on the path, and are only used if the
+file's timestamp and size still match. Everything here happens on the main thread; the background
+scan threads never look at the cache, and scan_collect stores what they found.
+
+The cache file is replaced as a whole (see disko_close), and it's merged with whatever's on disk right
+before writing, so more than one copy of Schism can share it without stepping on each other too badly:
+the worst that can happen is that one of them forgets a few entries the other one added. */
+
+#define INFO_CACHE_MAGIC "SchismIC"
+#define INFO_CACHE_VERSION 1
+#define INFO_CACHE_BUCKETS 4096
+#define INFO_CACHE_DEFAULT_SIZE 20000
+
+struct info_cache_entry {
+	struct info_cache_entry *next;
+	char *path;
+	int64_t timestamp;
+	uint64_t filesize;
+	uint64_t used; /* the last time this was looked up, for throwing out old stuff */
+	int ok; /* what dmoz_filter_ext_data returned */
+	int smp_filename_is_base;
+	dmoz_file_t info; /* only the ext data is used; artist, title, and smp_filename are owned by this */
+};
+
+static struct {
+	char *filename; /* NULL if the cache is turned off */
+	int max_entries;
+	int loaded;
+	int dirty;
+	int num_entries;
+	struct info_cache_entry *buckets[INFO_CACHE_BUCKETS];
+
+	/* descriptions don't get free'd, so the strings read from the cache are kept here */
+	char **descriptions;
+	int num_descriptions;
+} info_cache = {0};
+
+static uint32_t info_cache_hash(const char *path)
+{
+	/* FNV-1a */
+	uint32_t h = UINT32_C(2166136261);
+
+	for (; *path; path++)
+		h = (h ^ (unsigned char)*path) * UINT32_C(16777619);
+
+	return h % INFO_CACHE_BUCKETS;
+}
+
+static const char *info_cache_intern(const char *description)
+{
+	int n;
+
+	for (n = 0; n < info_cache.num_descriptions; n++)
+		if (!strcmp(info_cache.descriptions[n], description))
+			return info_cache.descriptions[n];
+
+	info_cache.descriptions = mem_realloc(info_cache.descriptions,
+		(info_cache.num_descriptions + 1) * sizeof(char *));
+	return info_cache.descriptions[info_cache.num_descriptions++] = str_dup(description);
+}
+
+static void info_cache_entry_free(struct info_cache_entry *e)
+{
+	free(e->path);
+	free(e->info.artist);
+	free(e->info.title);
+	free(e->info.smp_filename);
+	free(e);
+}
+
+static struct info_cache_entry *info_cache_find(const char *path)
+{
+	struct info_cache_entry *e;
+
+	for (e = info_cache.buckets[info_cache_hash(path)]; e; e = e->next)
+		if (!strcmp(e->path, path))
+			return e;
+
+	return NULL;
+}
+
+/* replaces any entry that's already there for the same path */
+static void info_cache_insert(struct info_cache_entry *e)
+{
+	struct info_cache_entry **pe;
+	uint32_t h = info_cache_hash(e->path);
+
+	for (pe = &info_cache.buckets[h]; *pe; pe = &(*pe)->next) {
+		if (!strcmp((*pe)->path, e->path)) {
+			e->next = (*pe)->next;
+			info_cache_entry_free(*pe);
+			*pe = e;
+			return;
+		}
+	}
+
+	e->next = info_cache.buckets[h];
+	info_cache.buckets[h] = e;
+	info_cache.num_entries++;
+}
+
+static void info_cache_clear(void)
+{
+	struct info_cache_entry *e, *next;
+	int n;
+
+	for (n = 0; n < INFO_CACHE_BUCKETS; n++) {
+		for (e = info_cache.buckets[n]; e; e = next) {
+			next = e->next;
+			info_cache_entry_free(e);
+		}
+		info_cache.buckets[n] = NULL;
+	}
+	info_cache.num_entries = 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* reading and writing */
+
+static int info_cache_read_u32(slurp_t *fp, uint32_t *x)
+{
+	if (slurp_read(fp, x, 4) != 4)
+		return 0;
+	*x = bswapLE32(*x);
+	return 1;
+}
+
+static int info_cache_read_u64(slurp_t *fp, uint64_t *x)
+{
+	if (slurp_read(fp, x, 8) != 8)
+		return 0;
+	*x = bswapLE64(*x);
+	return 1;
+}
+
+/* strings are stored with their length in front; a length of 0xFFFFFFFF means NULL */
+static int info_cache_read_string(slurp_t *fp, char **str)
+{
+	uint32_t len;
+
+	*str = NULL;
+	if (!info_cache_read_u32(fp, &len))
+		return 0;
+	if (len == UINT32_MAX)
+		return 1;
+	if (len > slurp_length(fp) - slurp_tell(fp))
+		return 0;
+
+	*str = mem_alloc(len + 1);
+	slurp_read(fp, *str, len);
+	(*str)[len] = '\0';
+	return 1;
+}
+
+static void info_cache_write_u32(disko_t *ds, uint32_t x)
+{
+	x = bswapLE32(x);
+	disko_write(ds, &x, 4);
+}
+
+static void info_cache_write_u64(disko_t *ds, uint64_t x)
+{
+	x = bswapLE64(x);
+	disko_write(ds, &x, 8);
+}
+
+static void info_cache_write_string(disko_t *ds, const char *str)
+{
+	if (!str) {
+		info_cache_write_u32(ds, UINT32_MAX);
+		return;
+	}
+	info_cache_write_u32(ds, strlen(str));
+	disko_write(ds, str, strlen(str));
+}
+
+/* the smp_* fields, in the order they're stored in */
+#define INFO_CACHE_SMP_FIELDS(f) \
+	f(smp_speed) f(smp_loop_start) f(smp_loop_end) f(smp_sustain_start) f(smp_sustain_end) \
+	f(smp_length) f(smp_flags) f(smp_defvol) f(smp_gblvol) \
+	f(smp_vibrato_speed) f(smp_vibrato_depth) f(smp_vibrato_rate)
+
+static struct info_cache_entry *info_cache_read_entry(slurp_t *fp)
+{
+	struct info_cache_entry *e = mem_calloc(1, sizeof(*e));
+	uint64_t timestamp;
+	uint32_t type, flags, x;
+	char *description = NULL;
+
+	if (!info_cache_read_string(fp, &e->path) || !e->path
+		|| !info_cache_read_u64(fp, &timestamp)
+		|| !info_cache_read_u64(fp, &e->filesize)
+		|| !info_cache_read_u64(fp, &e->used)
+		|| !info_cache_read_u32(fp, &type)
+		|| !info_cache_read_u32(fp, &flags)
+		|| !info_cache_read_string(fp, &description) || !description
+		|| !info_cache_read_string(fp, &e->info.artist)
+		|| !info_cache_read_string(fp, &e->info.title) || !e->info.title
+		|| !info_cache_read_string(fp, &e->info.smp_filename))
+		goto fail;
+
+#define READ_FIELD(name) if (!info_cache_read_u32(fp, &x)) goto fail; e->info.name = x;
+	INFO_CACHE_SMP_FIELDS(READ_FIELD)
+#undef READ_FIELD
+
+	/* something that doesn't have the ext data flags set would get read again every time */
+	if (!(type & TYPE_EXT_DATA_MASK) || type == TYPE_DIRECTORY)
+		goto fail;
+
+	e->timestamp = (int64_t)timestamp;
+	e->info.type = type;
+	e->ok = !!(flags & 1);
+	e->smp_filename_is_base = !!(flags & 2);
+	e->info.description = info_cache_intern(description);
+	free(description);
+	return e;
+
+fail:
+	free(description);
+	info_cache_entry_free(e);
+	return NULL;
+}
+
+static void info_cache_write_entry(disko_t *ds, struct info_cache_entry *e)
+{
+	info_cache_write_string(ds, e->path);
+	info_cache_write_u64(ds, (uint64_t)e->timestamp);
+	info_cache_write_u64(ds, e->filesize);
+	info_cache_write_u64(ds, e->used);
+	info_cache_write_u32(ds, e->info.type);
+	info_cache_write_u32(ds, (e->ok ? 1 : 0) | (e->smp_filename_is_base ? 2 : 0));
+	info_cache_write_string(ds, e->info.description);
+	info_cache_write_string(ds, e->info.artist);
+	info_cache_write_string(ds, e->info.title);
+	info_cache_write_string(ds, e->info.smp_filename);
+
+#define WRITE_FIELD(name) info_cache_write_u32(ds, e->info.name);
+	INFO_CACHE_SMP_FIELDS(WRITE_FIELD)
+#undef WRITE_FIELD
+}
+
+/* reads the cache file, keeping whatever's already in memory for paths that are in both.
+a cache that was written by another version (which might read files differently) is ignored. */
+static void info_cache_read(void)
+{
+	struct info_cache_entry *e;
+	char magic[8];
+	uint32_t version, cwtv, reserved, count;
+	slurp_t fp;
+
+	if (slurp(&fp, info_cache.filename, NULL, 0) < 0)
+		return;
+
+	if (slurp_read(&fp, magic, 8) != 8 || memcmp(magic, INFO_CACHE_MAGIC, 8)
+		|| !info_cache_read_u32(&fp, &version) || version != INFO_CACHE_VERSION
+		|| !info_cache_read_u32(&fp, &cwtv) || cwtv != ver_cwtv
+		|| !info_cache_read_u32(&fp, &reserved) || reserved != ver_reserved
+		|| !info_cache_read_u32(&fp, &count)) {
+		unslurp(&fp);
+		return;
+	}
+
+	while (count--) {
+		e = info_cache_read_entry(&fp);
+		if (!e)
+			break; /* truncated? just keep what was read so far */
+		if (info_cache_find(e->path))
+			info_cache_entry_free(e);
+		else
+			info_cache_insert(e);
+	}
+
+	unslurp(&fp);
+}
+
+static int info_cache_cmp_used(const void *a, const void *b)
+{
+	uint64_t ua = (*(struct info_cache_entry *const *)a)->used;
+	uint64_t ub = (*(struct info_cache_entry *const *)b)->used;
+
+	return (ua < ub) ? 1 : (ua > ub) ? -1 : 0;
+}
+
+static void info_cache_save(void)
+{
+	struct info_cache_entry **entries, *e;
+	disko_t ds;
+	int n, count = 0;
+
+	if (!info_cache.filename || !info_cache.dirty)
+		return;
+
+	/* pick up anything another instance wrote in the meantime */
+	info_cache_read();
+
+	/* keep the most recently used entries */
+	entries = mem_alloc(MAX(info_cache.num_entries, 1) * sizeof(*entries));
+	for (n = 0; n < INFO_CACHE_BUCKETS; n++)
+		for (e = info_cache.buckets[n]; e; e = e->next)
+			entries[count++] = e;
+	qsort(entries, count, sizeof(*entries), info_cache_cmp_used);
+	count = MIN(count, info_cache.max_entries);
+
+	if (disko_open(&ds, info_cache.filename) < 0) {
+		free(entries);
+		return;
+	}
+
+	disko_write(&ds, INFO_CACHE_MAGIC, 8);
+	info_cache_write_u32(&ds, INFO_CACHE_VERSION);
+	info_cache_write_u32(&ds, ver_cwtv);
+	info_cache_write_u32(&ds, ver_reserved);
+	info_cache_write_u32(&ds, count);
+	for (n = 0; n < count; n++)
+		info_cache_write_entry(&ds, entries[n]);
+	free(entries);
+
+	/* if this fails, the old file is left alone; nothing to do about it but try again later */
+	if (disko_close(&ds, 0) != DW_OK)
+		return;
+
+	info_cache.dirty = 0;
+
+	/* forget about what got dropped from the file; the rest gets read back in when it's needed */
+	if (info_cache.num_entries > info_cache.max_entries) {
+		info_cache_clear();
+		info_cache.loaded = 0;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* info_cache_size is the most files to remember; 0 turns the cache off */
+static void info_cache_load_cfg(cfg_file_t *cfg)
+{
+	info_cache.max_entries = cfg_get_number(cfg, "Directories", "info_cache_size", INFO_CACHE_DEFAULT_SIZE);
+
+	free(info_cache.filename);
+	info_cache.filename = (info_cache.max_entries > 0 && cfg_dir_dotschism)
+		? dmoz_path_concat(cfg_dir_dotschism, "info-cache")
+		: NULL;
+}
+
+static void info_cache_save_cfg(cfg_file_t *cfg)
+{
+	cfg_set_number(cfg, "Directories", "info_cache_size", info_cache.max_entries);
+}
+
+/* fills in the ext data from the cache. returns -1 if the file isn't in there, otherwise the
+value dmoz_filter_ext_data would've returned */
+static int info_cache_lookup(dmoz_file_t *file)
+{
+	struct info_cache_entry *e;
+	dmoz_file_t tmp;
+	uint64_t now;
+
+	if (!info_cache.filename || !file->timestamp)
+		return -1;
+
+	if (!info_cache.loaded) {
+		info_cache.loaded = 1;
+		info_cache_read();
+	}
+
+	e = info_cache_find(file->path);
+	if (!e || e->timestamp != (int64_t)file->timestamp || e->filesize != (uint64_t)file->filesize)
+		return -1;
+
+	tmp = *file;
+	*file = e->info;
+	file->path = tmp.path;
+	file->base = tmp.base;
+	file->sort_order = tmp.sort_order;
+	file->timestamp = tmp.timestamp;
+	file->filesize = tmp.filesize;
+	file->sample = tmp.sample;
+	file->sampsize = tmp.sampsize;
+	file->instnum = tmp.instnum;
+	file->scanning = 0;
+
+	file->artist = e->info.artist ? str_dup(e->info.artist) : NULL;
+	file->title = str_dup(e->info.title);
+	if (e->smp_filename_is_base)
+		file->smp_filename = file->base;
+	else if (e->info.smp_filename)
+		file->smp_filename = str_dup(e->info.smp_filename);
+
+	/* the save sorts on this to pick what to keep, so it's worth writing out */
+	now = time(NULL);
+	if (e->used != now) {
+		e->used = now;
+		info_cache.dirty = 1;
+	}
+	return e->ok;
+}
+
+static void info_cache_store(dmoz_file_t *file, int ok)
+{
+	struct info_cache_entry *e;
+
+	if (!info_cache.filename || !file->timestamp)
+		return;
+
+	e = mem_calloc(1, sizeof(*e));
+	e->path = str_dup(file->path);
+	e->timestamp = file->timestamp;
+	e->filesize = file->filesize;
+	e->used = time(NULL);
+	e->ok = ok;
+
+	e->info = *file;
+	e->info.path = e->info.base = NULL;
+	e->info.sample = NULL;
+	e->info.artist = file->artist ? str_dup(file->artist) : NULL;
+	e->info.title = str_dup(file->title ? file->title : "");
+	e->smp_filename_is_base = (file->smp_filename && file->smp_filename == file->base);
+	e->info.smp_filename = (file->smp_filename && !e->smp_filename_is_base)
+		? str_dup(file->smp_filename) : NULL;
+	e->info.description = info_cache_intern(file->description ? file->description : "");
+
+	info_cache_insert(e);
+	info_cache.dirty = 1;
+}
+
+static void info_cache_quit(void)
+{
+	int n;
+
+	info_cache_save();
+	info_cache_clear();
+
+	free(info_cache.filename);
+	info_cache.filename = NULL;
+	info_cache.loaded = 0;
+
+	/* anything still pointing at these is about to go away too */
+	for (n = 0; n < info_cache.num_descriptions; n++)
+		free(info_cache.descriptions[n]);
+	free(info_cache.descriptions);
+	info_cache.descriptions = NULL;
+	info_cache.num_descriptions = 0;
+}
+
+/* --------------------------------------------------------------------------------------------------------- */
+
+/* return: 1 on success, 0 on error. in either case, it fills the data in with *something*. */
+int dmoz_filter_ext_data(dmoz_file_t *file)
+{
+	int ret;
+
+	if ((file->type & TYPE_EXT_DATA_MASK)
+	|| (file->type == TYPE_DIRECTORY)) {
+		/* nothing to do */
+		return 1;
+	}
+	file->scanning = 0; /* don't need the background scan anymore */
+
+	ret = info_cache_lookup(file);
+	if (ret >= 0)
+		return ret;
+
+	ret = file_info_get(file);
+	if (ret == FINF_ERRNO)
+		return file_info_finish(file, ret); /* might work next time */
+
+	ret = file_info_finish(file, ret);
+	info_cache_store(file, ret);
+	return ret;
+}
+
 /* same as dmoz_filter_ext_data, except without the filtering effect when used with dmoz_filter_filelist */
 int dmoz_fill_ext_data(dmoz_file_t *file)
 {
@@ -1893,6 +2444,290 @@ int dmoz_fill_ext_data(dmoz_file_t *file)
 	return 1;
 }
 
+/* --------------------------------------------------------------------------------------------------------- */
+/* background scanning
+
+Reading the ext data means opening every file in the directory, which takes forever on a slow
+disk or a network share. dmoz_filter_filelist_ext queues the files up for a few threads, which
+each fill in a private copy of the file's info and put it on the list of finished scans. The main
+thread picks those up in dmoz_worker and copies them into the real files, so nothing the UI is
+looking at ever changes behind its back. */
+
+#define DMOZ_SCAN_THREADS 4
+
+struct dmoz_scan {
+	dmoz_file_t *file; /* the real file; only touched on the main thread */
+	dmoz_file_t info; /* the copy that gets filled in, with its own path and base */
+	unsigned int generation;
+	int first; /* for FINF_DEFERRED */
+	int ret;
+	int err;
+	struct dmoz_scan *next;
+};
+
+static struct {
+	schism_mutex_t *mutex;
+	schism_cond_t *work; /* signaled when there are files to scan, or when quitting */
+	schism_thread_t *threads[DMOZ_SCAN_THREADS];
+	int num_threads;
+	int quit;
+
+	/* guarded by the mutex */
+	struct dmoz_scan *pending, *pending_tail;
+	struct dmoz_scan *done;
+
+	/* these are only used by the main thread */
+	unsigned int generation; /* scans from an earlier generation are thrown away */
+	dmoz_filelist_t *flist; /* the list being scanned, if any */
+	int outstanding; /* scans that haven't been collected yet */
+} scan = {0};
+
+static void scan_free(struct dmoz_scan *sc)
+{
+	dmoz_file_t *info = &sc->info;
+
+	if (info->smp_filename != info->base)
+		free(info->smp_filename);
+	free(info->artist);
+	free(info->title);
+	free(info->path);
+	free(info->base);
+	free(sc);
+}
+
+static int dmoz_scan_thread(SCHISM_UNUSED void *userdata)
+{
+	struct dmoz_scan *sc;
+
+	mt_mutex_lock(scan.mutex);
+	for (;;) {
+		while (!scan.pending && !scan.quit)
+			mt_cond_wait(scan.work, scan.mutex);
+		if (scan.quit)
+			break;
+
+		sc = scan.pending;
+		scan.pending = sc->next;
+		if (!scan.pending)
+			scan.pending_tail = NULL;
+		mt_mutex_unlock(scan.mutex);
+
+		errno = 0;
+		sc->ret = file_info_get_ex(&sc->info, &sc->first, 1);
+		sc->err = errno;
+
+		mt_mutex_lock(scan.mutex);
+		sc->next = scan.done;
+		scan.done = sc;
+	}
+	mt_mutex_unlock(scan.mutex);
+
+	return 0;
+}
+
+static int scan_start_threads(void)
+{
+	if (scan.num_threads)
+		return 1;
+
+	if (!scan.mutex)
+		scan.mutex = mt_mutex_create();
+	if (!scan.work)
+		scan.work = mt_cond_create();
+	if (!scan.mutex || !scan.work)
+		return 0;
+
+	while (scan.num_threads < DMOZ_SCAN_THREADS) {
+		scan.threads[scan.num_threads] = mt_thread_create(dmoz_scan_thread, "File info", NULL);
+		if (!scan.threads[scan.num_threads])
+			break;
+		scan.num_threads++;
+	}
+
+	return scan.num_threads > 0;
+}
+
+/* forget about the list being scanned (it's probably about to be freed).
+if flist isn't NULL, this only does anything if that's the list being scanned */
+static void scan_cancel(dmoz_filelist_t *flist)
+{
+	struct dmoz_scan *sc, *pending, *done;
+	int n;
+
+	if (!scan.flist || (flist && flist != scan.flist))
+		return;
+
+	mt_mutex_lock(scan.mutex);
+	pending = scan.pending;
+	done = scan.done;
+	scan.pending = scan.pending_tail = scan.done = NULL;
+	scan.generation++;
+	mt_mutex_unlock(scan.mutex);
+
+	/* anything still in progress is thrown out when it's collected */
+	for (; pending; pending = sc) {
+		sc = pending->next;
+		scan_free(pending);
+		scan.outstanding--;
+	}
+	for (; done; done = sc) {
+		sc = done->next;
+		scan_free(done);
+		scan.outstanding--;
+	}
+
+	for (n = 0; n < scan.flist->num_files; n++)
+		scan.flist->files[n]->scanning = 0;
+	scan.flist = NULL;
+}
+
+/* copy the finished scans over to the files. returns nonzero if anything changed */
+static int scan_collect(void)
+{
+	struct dmoz_scan *sc, *done;
+	dmoz_file_t *file, tmp;
+	int changed = 0;
+
+	if (!scan.outstanding)
+		return 0;
+
+	mt_mutex_lock(scan.mutex);
+	done = scan.done;
+	scan.done = NULL;
+	mt_mutex_unlock(scan.mutex);
+
+	for (; done; done = sc) {
+		sc = done->next;
+		scan.outstanding--;
+
+		if (done->generation != scan.generation || !done->file->scanning) {
+			/* the list went away, or someone else already got to this file */
+			scan_free(done);
+			continue;
+		}
+
+		file = done->file;
+		errno = done->err;
+		if (done->ret == FINF_DEFERRED)
+			done->ret = file_info_get_ex(&done->info, &done->first, 0);
+
+		if (done->info.smp_filename == done->info.base)
+			done->info.smp_filename = file->base;
+
+		/* everything but the stuff that was already there comes from the scan */
+		tmp = *file;
+		*file = done->info;
+		file->path = tmp.path;
+		file->base = tmp.base;
+		file->sort_order = tmp.sort_order;
+		file->timestamp = tmp.timestamp;
+		file->filesize = tmp.filesize;
+		file->sample = tmp.sample;
+		file->scanning = 0;
+
+		if (done->ret == FINF_ERRNO)
+			file_info_finish(file, done->ret);
+		else
+			info_cache_store(file, file_info_finish(file, done->ret));
+
+		free(done->info.path);
+		free(done->info.base);
+		free(done);
+		changed = 1;
+	}
+
+	/* good time to write the cache out, since that whole directory's in there now */
+	if (!scan.outstanding)
+		info_cache_save();
+
+	return changed;
+}
+
+/* like dmoz_filter_filelist, but all of the files' ext data is read in the background first.
+'grep' is still called for each file in order, once its data is there. */
+void dmoz_filter_filelist_ext(dmoz_filelist_t *flist, int (*grep)(dmoz_file_t *f), int *pointer, void (*fn)(void))
+{
+	struct dmoz_scan *sc, *head = NULL, *tail = NULL;
+	dmoz_file_t *file;
+	int n;
+
+	dmoz_filter_filelist(flist, grep, pointer, fn);
+
+	if (!scan_start_threads())
+		return; /* dmoz_worker will just do it the slow way */
+
+	for (n = 0; n < flist->num_files; n++) {
+		file = flist->files[n];
+		if ((file->type & TYPE_EXT_DATA_MASK) || file->type == TYPE_DIRECTORY
+			|| info_cache_lookup(file) >= 0)
+			continue;
+
+		sc = mem_calloc(1, sizeof(*sc));
+		sc->file = file;
+		sc->info = *file;
+		sc->info.path = str_dup(file->path);
+		sc->info.base = str_dup(file->base);
+		sc->generation = scan.generation;
+		if (tail)
+			tail->next = sc;
+		else
+			head = sc;
+		tail = sc;
+
+		file->scanning = 1;
+		scan.outstanding++;
+	}
+
+	if (!head)
+		return;
+
+	scan.flist = flist;
+
+	mt_mutex_lock(scan.mutex);
+	if (scan.pending_tail)
+		scan.pending_tail->next = head;
+	else
+		scan.pending = head;
+	scan.pending_tail = tail;
+	for (n = 0; n < scan.num_threads; n++)
+		mt_cond_signal(scan.work);
+	mt_mutex_unlock(scan.mutex);
+}
+
+static void scan_quit(void)
+{
+	struct dmoz_scan *sc;
+	int n;
+
+	if (!scan.mutex)
+		return;
+
+	mt_mutex_lock(scan.mutex);
+	scan.quit = 1;
+	for (n = 0; n < scan.num_threads; n++)
+		mt_cond_signal(scan.work);
+	mt_mutex_unlock(scan.mutex);
+
+	for (n = 0; n < scan.num_threads; n++)
+		mt_thread_wait(scan.threads[n], NULL);
+	scan.num_threads = 0;
+
+	while (scan.pending) {
+		sc = scan.pending->next;
+		scan_free(scan.pending);
+		scan.pending = sc;
+	}
+	while (scan.done) {
+		sc = scan.done->next;
+		scan_free(scan.done);
+		scan.done = sc;
+	}
+
+	mt_cond_delete(scan.work);
+	mt_mutex_delete(scan.mutex);
+	memset(&scan, 0, sizeof(scan));
+}
+
 /* ------------------------------------------------------------------------ */
 
 #ifdef SCHISM_WIN32
@@ -1945,6 +2780,10 @@ int dmoz_init(void)
 
 void dmoz_quit(void)
 {
+	scan_cancel(NULL);
+	scan_quit();
+	info_cache_quit();
+
 	if (backend) {
 		backend->quit();
 		backend = NULL;
@@ -433,6 +433,9 @@ extern unsigned int color_set[16];
 
 static void draw_screen(void)
 {
+	/* the glyphs themselves change here, which the row diff can't see */
+	vgamem_invalidate();
+
 	draw_fill_chars(0,0,79,49,DEFAULT_FG,0);
 	draw_frame("Edit Box", EDITBOX_X, EDITBOX_Y, 9, 11, !!(selected_item == EDITBOX));
 	draw_editbox();
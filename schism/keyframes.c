@@ -0,0 +1,386 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Keyframes for seeking.
+
+While nothing else is going on, a private copy of the song is played through
+from the start (without mixing, and without sending anything to MIDI) and the
+playback state is saved every KEYFRAME_ROWS rows, the first time each order is
+reached. Starting playback in the middle of the song then restores the closest
+keyframe and fast-forwards to the row, so envelopes, NNA tails, effect memory
+and the tempo are what they would've been had the song been played from the
+start.
+
+Pattern edits invalidate the keyframes from the point the pattern was first
+played. Everything else (orderlist, samples, instruments, song settings) is
+checked for changes by hashing it. */
+
+#include "headers.h"
+
+#include "it.h"
+#include "song.h"
+#include "mem.h"
+#include "util.h"
+
+#include "player/sndfile.h"
+#include "player/cmixer.h"
+#include "player/snd_fm.h"
+
+#define KEYFRAME_ROWS 16
+
+/* give up on songs that never end, or that need too much memory */
+#define KEYFRAME_MAX_ROWS 65536
+#define KEYFRAME_MAX_BYTES (32 << 20)
+
+/* a row can't take more than this many ticks (speed 255, SEx and SDx) */
+#define KEYFRAME_MAX_FF_TICKS (KEYFRAME_ROWS * 255 * 16)
+
+struct keyframe_entry {
+	uint32_t order, row;
+	uint32_t frames; // sample frames played before this tick
+	uint32_t rows; // rows played so far, this one included
+	song_keyframe_t *kf;
+};
+
+static struct {
+	song_t *sim; // NULL if nothing's been set up yet
+	song_voice_t base[MAX_VOICES]; // voices right after the reset
+	uint32_t hash; // of current_song when sim was copied
+
+	uint32_t frames, rows;
+	int done;
+
+	struct keyframe_entry *entries;
+	size_t num_entries, alloc_entries, bytes;
+
+	// number of entries there were when the pattern was first played, or -1.
+	// every entry from that one on depends on the pattern's contents.
+	int pattern_mark[MAX_PATTERNS];
+
+	// which (row / KEYFRAME_ROWS) of each order have an entry
+	uint16_t have[MAX_ORDERS + 1];
+} kfi = {0};
+
+/* --------------------------------------------------------------------- */
+
+static uint32_t hash_bytes(uint32_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * UINT32_C(16777619);
+
+	return h;
+}
+
+#define HASH(h, x) ((h) = hash_bytes((h), &(x), sizeof(x)))
+
+/* everything the playback state depends on, except for the pattern data */
+static uint32_t keyframes_hash_song(song_t *csf)
+{
+	uint32_t h = UINT32_C(2166136261);
+	uint32_t flags;
+	int n;
+
+	HASH(h, csf);
+	HASH(h, csf->orderlist);
+	HASH(h, csf->patterns);
+	HASH(h, csf->pattern_size);
+	HASH(h, csf->midi_config);
+	HASH(h, csf->initial_speed);
+	HASH(h, csf->initial_tempo);
+	HASH(h, csf->initial_global_volume);
+	HASH(h, csf->mixing_volume);
+	HASH(h, csf->pan_separation);
+	HASH(h, csf->freq_factor);
+	HASH(h, csf->tempo_factor);
+	HASH(h, csf->mix_frequency);
+
+	flags = csf->flags & ~(SONG_PATTERNLOOP | SONG_STEP | SONG_PAUSED | SONG_ENDREACHED | SONG_FIRSTTICK);
+	HASH(h, flags);
+	flags = csf->mix_flags & ~(SNDMIX_DIRECTTODISK | SNDMIX_NOBACKWARDJUMPS | SNDMIX_NOOUTPUT);
+	HASH(h, flags);
+
+	for (n = 0; n < MAX_CHANNELS; n++) {
+		flags = csf->channels[n].flags & ~CHN_MUTE;
+		HASH(h, csf->channels[n].panning);
+		HASH(h, csf->channels[n].volume);
+		HASH(h, flags);
+	}
+
+	for (n = 0; n <= MAX_SAMPLES; n++) {
+		song_sample_t *smp = csf->samples + n;
+
+		HASH(h, smp->data);
+		HASH(h, smp->length);
+		HASH(h, smp->loop_start);
+		HASH(h, smp->loop_end);
+		HASH(h, smp->sustain_start);
+		HASH(h, smp->sustain_end);
+		HASH(h, smp->c5speed);
+		HASH(h, smp->panning);
+		HASH(h, smp->volume);
+		HASH(h, smp->global_volume);
+		HASH(h, smp->flags);
+		HASH(h, smp->vib_type);
+		HASH(h, smp->vib_rate);
+		HASH(h, smp->vib_depth);
+		HASH(h, smp->vib_speed);
+	}
+
+	for (n = 0; n <= MAX_INSTRUMENTS; n++) {
+		song_instrument_t *ins = csf->instruments[n];
+
+		HASH(h, ins);
+		if (ins)
+			h = hash_bytes(h, ins, offsetof(song_instrument_t, played));
+	}
+
+	return h;
+}
+
+/* --------------------------------------------------------------------- */
+
+static void keyframes_truncate(size_t n)
+{
+	size_t i;
+
+	for (i = n; i < kfi.num_entries; i++) {
+		kfi.bytes -= csf_keyframe_size(kfi.entries[i].kf);
+		csf_free_keyframe(kfi.entries[i].kf);
+	}
+	kfi.num_entries = n;
+
+	memset(kfi.have, 0, sizeof(kfi.have));
+	for (i = 0; i < n; i++)
+		kfi.have[kfi.entries[i].order] |= 1 << (kfi.entries[i].row / KEYFRAME_ROWS);
+
+	for (i = 0; i < MAX_PATTERNS; i++)
+		if (kfi.pattern_mark[i] >= (int)n)
+			kfi.pattern_mark[i] = -1;
+}
+
+/* (re)start from the top with a fresh copy of the song */
+static void keyframes_reset(void)
+{
+	song_t *sim;
+	int n;
+
+	keyframes_truncate(0);
+
+	if (!kfi.sim)
+		kfi.sim = mem_alloc(sizeof(song_t));
+	sim = kfi.sim;
+
+	song_lock_audio();
+	memcpy(sim, current_song, sizeof(song_t));
+	song_unlock_audio();
+
+	// the rest is shared with current_song (which owns it), so don't free any of it
+	sim->opl = NULL;
+	sim->multi_write = NULL;
+	sim->length_cache = NULL;
+	sim->history = NULL;
+	sim->histlen = 0;
+
+	sim->mix_flags &= ~(SNDMIX_DIRECTTODISK | SNDMIX_NOBACKWARDJUMPS);
+	sim->mix_flags |= SNDMIX_NOOUTPUT;
+	sim->flags &= ~(SONG_PATTERNLOOP | SONG_STEP | SONG_PAUSED | SONG_ENDREACHED);
+	sim->stop_at_order = -1;
+	sim->stop_at_row = -1;
+
+	csf_set_current_order(sim, 0);
+	sim->repeat_count = -1; // stop at the end instead of looping
+	sim->buffer_count = 0;
+	sim->num_voices = 0;
+	memcpy(kfi.base, sim->voices, sizeof(kfi.base));
+
+	kfi.hash = keyframes_hash_song(current_song);
+	kfi.frames = 0;
+	kfi.rows = 0;
+	kfi.done = 0;
+
+	for (n = 0; n < MAX_PATTERNS; n++)
+		kfi.pattern_mark[n] = -1;
+}
+
+static void keyframes_add(void)
+{
+	song_t *sim = kfi.sim;
+	struct keyframe_entry *e;
+
+	if (kfi.num_entries >= kfi.alloc_entries) {
+		kfi.alloc_entries = kfi.alloc_entries ? (kfi.alloc_entries * 2) : 256;
+		kfi.entries = mem_realloc(kfi.entries, kfi.alloc_entries * sizeof(*kfi.entries));
+	}
+
+	e = kfi.entries + kfi.num_entries++;
+	e->order = sim->current_order;
+	e->row = sim->row;
+	e->frames = kfi.frames;
+	e->rows = kfi.rows;
+	e->kf = csf_save_keyframe(sim, kfi.base);
+
+	kfi.bytes += csf_keyframe_size(e->kf);
+	kfi.have[e->order] |= 1 << (e->row / KEYFRAME_ROWS);
+}
+
+/* play until the next keyframe is saved; returns 0 once there's nothing left to do */
+static int keyframes_step(void)
+{
+	song_t *sim = kfi.sim;
+
+	for (;;) {
+		while (sim->buffer_count) {
+			uint32_t count = MIN(sim->buffer_count, MIXBUFFERSIZE);
+
+			csf_skip_stereo_mix(sim, count);
+			sim->buffer_count -= count;
+			kfi.frames += count;
+		}
+
+		if (!csf_read_note(sim))
+			return 0;
+
+		if (sim->patterns[sim->current_pattern] != current_song->patterns[sim->current_pattern]) {
+			// csf_process_tick made up a pattern that doesn't exist; it's ours to free
+			csf_free_pattern(sim->patterns[sim->current_pattern]);
+			sim->patterns[sim->current_pattern] = current_song->patterns[sim->current_pattern];
+			sim->pattern_size[sim->current_pattern] = current_song->pattern_size[sim->current_pattern];
+			sim->pattern_alloc_size[sim->current_pattern] = current_song->pattern_alloc_size[sim->current_pattern];
+			return 0;
+		}
+
+		if (kfi.pattern_mark[sim->current_pattern] < 0)
+			kfi.pattern_mark[sim->current_pattern] = kfi.num_entries;
+
+		if (!(sim->flags & SONG_FIRSTTICK))
+			continue;
+
+		if (++kfi.rows > KEYFRAME_MAX_ROWS)
+			return 0;
+
+		// every KEYFRAME_ROWS rows, and wherever the order was entered
+		if (kfi.have[sim->current_order]
+		    && ((sim->row % KEYFRAME_ROWS) || (kfi.have[sim->current_order] & (1 << (sim->row / KEYFRAME_ROWS)))))
+			continue;
+
+		keyframes_add();
+		return (kfi.bytes < KEYFRAME_MAX_BYTES);
+	}
+}
+
+/* --------------------------------------------------------------------- */
+
+int song_keyframes_worker(void)
+{
+	if (!current_song)
+		return 0;
+
+	// once everything's built, changes are only looked for when seeking
+	if (kfi.sim && kfi.done)
+		return 0;
+
+	if (!kfi.sim || kfi.hash != keyframes_hash_song(current_song))
+		keyframes_reset();
+
+	if (!keyframes_step())
+		kfi.done = 1;
+
+	return !kfi.done;
+}
+
+void song_keyframes_invalidate(int pattern)
+{
+	size_t n;
+
+	if (!kfi.sim)
+		return;
+
+	if (pattern < 0 || pattern >= MAX_PATTERNS) {
+		n = 0;
+	} else if (kfi.pattern_mark[pattern] < 0) {
+		return; // it hasn't been played (yet)
+	} else {
+		n = kfi.pattern_mark[pattern];
+	}
+
+	if (!n) {
+		kfi.hash = 0; // start over next time
+		kfi.done = 0;
+		keyframes_truncate(0);
+		return;
+	}
+
+	// pick up from the last keyframe that's still good
+	keyframes_truncate(n);
+	memcpy(kfi.sim->voices, kfi.base, sizeof(kfi.base));
+	csf_restore_keyframe(kfi.sim, kfi.entries[n - 1].kf);
+	kfi.sim->repeat_count = -1; // it's zero if the end was reached already
+	kfi.frames = kfi.entries[n - 1].frames;
+	kfi.rows = kfi.entries[n - 1].rows;
+	kfi.done = 0;
+}
+
+int song_keyframes_restore(song_t *csf, int order, int row, uint32_t *frames)
+{
+	const struct keyframe_entry *best = NULL;
+	uint32_t flags;
+	int repeat_count;
+	size_t n;
+
+	if (!kfi.sim || order < 0 || order > MAX_ORDERS || row < 0)
+		return 0;
+
+	if (kfi.hash != keyframes_hash_song(csf)) {
+		kfi.done = 0; // stale; the worker will start over
+		return 0;
+	}
+
+	for (n = 0; n < kfi.num_entries; n++) {
+		const struct keyframe_entry *e = kfi.entries + n;
+
+		if (e->order == (uint32_t)order && e->row <= (uint32_t)row && (!best || e->row > best->row))
+			best = e;
+	}
+
+	if (!best)
+		return 0;
+
+	flags = csf->flags;
+	repeat_count = csf->repeat_count;
+
+	csf_restore_keyframe(csf, best->kf);
+	*frames = best->frames;
+
+	if (csf_fast_forward(csf, order, row, KEYFRAME_MAX_FF_TICKS, frames))
+		return 1;
+
+	// the row wasn't reached after all, so put csf back at the start
+	csf_set_current_order(csf, 0);
+	csf->flags = flags;
+	csf->repeat_count = repeat_count;
+	OPL_Reset(csf);
+
+	return 0;
+}
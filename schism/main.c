@@ -39,12 +39,14 @@
 #include "config.h"
 #include "version.h"
 #include "song.h"
+#include "player/cmixer.h"
 #include "midi.h"
 #include "dmoz.h"
 #include "charset.h"
 #include "keyboard.h"
 #include "palettes.h"
 #include "fonts.h"
+#include "vgamem.h"
 #include "dialog.h"
 #include "widget.h"
 #include "accessibility.h"
@@ -85,6 +87,7 @@ static const char *audio_driver = NULL;
 static const char *audio_device = NULL;
 static int want_fullscreen = -1;
 static int did_classic = 0;
+static int want_mix_threads = 0;
 
 /* --------------------------------------------------------------------- */
 
@@ -166,6 +169,7 @@ enum {
 	O_HOOKS, O_NO_HOOKS,
 #endif
 	O_DISKWRITE,
+	O_MIX_THREADS,
 	O_DEBUG,
 	O_VERSION,
 };
@@ -191,6 +195,7 @@ static void parse_options(int argc, char **argv)
 		{"play", 0, NULL, O_PLAY},
 		{"no-play", 0, NULL, O_NO_PLAY},
 		{"diskwrite", 1, NULL, O_DISKWRITE},
+		{"mix-threads", 1, NULL, O_MIX_THREADS},
 		{"font-editor", 0, NULL, O_FONTEDIT},
 		{"no-font-editor", 0, NULL, O_NO_FONTEDIT},
 #if ENABLE_HOOKS
@@ -248,6 +253,9 @@ static void parse_options(int argc, char **argv)
 		case O_DISKWRITE:
 			diskwrite_to = optarg;
 			break;
+		case O_MIX_THREADS:
+			want_mix_threads = CLAMP(atoi(optarg), 1, MAX_MIX_THREADS);
+			break;
 #if ENABLE_HOOKS
 		case O_HOOKS:
 			startup_flags |= SF_HOOKS;
@@ -270,6 +278,7 @@ static void parse_options(int argc, char **argv)
 				"  -f, --fullscreen (-F, --no-fullscreen)\n"
 				"  -p, --play (-P, --no-play)\n"
 				"      --diskwrite=FILENAME\n"
+				"      --mix-threads=COUNT\n"
 				"      --font-editor (--no-font-editor)\n"
 #if ENABLE_HOOKS
 				"      --hooks (--no-hooks)\n"
@@ -638,6 +647,7 @@ static void event_loop(void)
 				video_resize(se.window.data.resized.width, se.window.data.resized.height);
 				/* fallthrough */
 			case SCHISM_WINDOWEVENT_EXPOSED:
+				vgamem_invalidate();
 				status.flags |= (NEED_UPDATE);
 				break;
 			case SCHISM_DROPFILE:
@@ -677,6 +687,7 @@ static void event_loop(void)
 				midi_send_flush();
 				if (!(status.flags & (DISKWRITER_ACTIVE | DISKWRITER_ACTIVE_PATTERN)))
 					playback_update();
+				song_check_audio_lock_time();
 				break;
 			case SCHISM_EVENT_PASTE:
 				/* handle clipboard events */
@@ -815,6 +826,9 @@ static void event_loop(void)
 		 * as long as there's no user-event going on... */
 		while (!(status.flags & NEED_UPDATE) && dmoz_worker() && !events_have_event());
 
+		/* ...and get the song ready for seeking */
+		while (!(status.flags & NEED_UPDATE) && song_keyframes_worker() && !events_have_event());
+
 		/* delay until there's an event OR 10 ms have passed */
 		int t;
 		for (t = 0; t < 10 && !events_have_event(); t++)
@@ -929,6 +943,8 @@ int schism_main(int argc, char** argv)
 	song_initialise();
 	cfg_load();
 
+	song_set_mix_threads_override(want_mix_threads);
+
 	if (!clippy_init()) {
 		log_nl();
 		log_appendf(4, "Failed to initialize a clipboard backend!");
@@ -38,7 +38,6 @@
 #include "dmoz.h"
 
 #include <ctype.h>
-#include <assert.h>
 
 #ifdef SCHISM_WIN32
 # include <windows.h>
@@ -522,9 +521,6 @@ enum midi_from {
 static int _midi_send_unlocked(const unsigned char *data, unsigned int len, unsigned int delay,
 			enum midi_from from)
 {
-	// we can send only ONE midi message at a time.
-	assert(len <= 3);
-
 	struct midi_port *ptr = NULL;
 	int need_timer = 0;
 #if 0
@@ -586,60 +582,141 @@ void midi_send_now(const unsigned char *seq, unsigned int len)
 
 /*----------------------------------------------------------------------------------*/
 
-/* okay, our local queue is a little confusing,
- * but it works on the premise that the people who need it (oss)
- * also have systems with high-speed context switches.
- *
- * this sucks for freebsd/386 users as they've got a high-latency
- * audio system (oss) and slow context switches (x86). someone should
- * port alsa to freebsd. maybe someone else will solve this problem,
- * or maybe the computers that are slow enough to matter simply won't
- * be bothered.
+/* The queue is for ports that can only send right away. The player stamps
+ * every message with the sample it belongs to on the mixer's clock, and the
+ * audio callback keeps telling us which sample is being heard, so the queue
+ * thread can sleep until each message is actually due instead of ticking
+ * along a millisecond at a time.
  *
- * midi, that is, real midi, is 31250bps. that's ~312 bits per ms,
- * or ~39 bytes per ms. i use a fixed buffer here because access needs
- * to be fast, and attempting to handle more will simply help people
- * using software-only setups.
- *
- * really, software-only midi, without kernel assistance sucks.
- */
-
-// MIDI messages for one millisecond of audio, normalized.
-struct qent {
-	int used; // how many messages do we have?
-	struct {
-		int used; // how long is *this* message?
-		unsigned char message[3];
-	} b[13];
+ * Messages are kept back to back in a byte ring, each behind a small header,
+ * so a SysEx fits as well as anything else. Real MIDI is ~3 bytes per ms;
+ * the ring holds several seconds of that even for software-only setups, and
+ * anything that still doesn't fit is counted, not silently lost. */
+#define MIDI_QUEUE_SIZE 65536 /* must be a power of two */
+
+struct midi_qhead {
+	uint64_t when;
+	uint32_t len;
 };
-static struct qent *qq = NULL;
-static unsigned int midims = 0, qlen = 0;
 
-void midi_queue_alloc(int buffer_length, int sample_size, int samples_per_second)
+/* everything in here is under midi_play_mutex */
+static struct {
+	unsigned char buf[MIDI_QUEUE_SIZE];
+	uint32_t head, tail; // only ever go up
+
+	// `clock` was being heard at `clock_us` (timer_ticks_us)
+	uint64_t clock, clock_us;
+	uint32_t rate;
+
+	uint32_t late, dropped;
+} mq = {0};
+
+static void _mq_put(uint32_t pos, const void *data, uint32_t len)
 {
-	if (qq) {
-		free(qq);
-		qq = NULL;
+	const uint32_t at = pos & (MIDI_QUEUE_SIZE - 1);
+	const uint32_t n = MIN(len, MIDI_QUEUE_SIZE - at);
+
+	memcpy(mq.buf + at, data, n);
+	memcpy(mq.buf, (const unsigned char *)data + n, len - n);
+}
+
+static void _mq_write(const void *data, uint32_t len)
+{
+	_mq_put(mq.tail, data, len);
+	mq.tail += len;
+}
+
+static void _mq_peek(void *data, uint32_t len, uint32_t offset)
+{
+	const uint32_t at = (mq.head + offset) & (MIDI_QUEUE_SIZE - 1);
+	const uint32_t n = MIN(len, MIDI_QUEUE_SIZE - at);
+
+	memcpy(data, mq.buf + at, n);
+	memcpy((unsigned char *)data + n, mq.buf, len - n);
+}
+
+/* when a message stamped with `when` should go out, in timer_ticks_us() time;
+ * zero is "already" */
+static uint64_t _mq_due(uint64_t when)
+{
+	uint64_t d;
+
+	if (when == MIDI_QUEUE_NOW || !mq.rate)
+		return 0;
+
+	if (when >= mq.clock)
+		return mq.clock_us + (when - mq.clock) * 1000000 / mq.rate;
+
+	d = (mq.clock - when) * 1000000 / mq.rate;
+	return (d < mq.clock_us) ? (mq.clock_us - d) : 0;
+}
+
+void midi_queue_clock(uint64_t when, uint32_t rate)
+{
+	if (!midi_play_mutex) return;
+
+	mt_mutex_lock(midi_play_mutex);
+	mq.clock = when;
+	mq.clock_us = timer_ticks_us();
+	mq.rate = rate;
+	mt_mutex_unlock(midi_play_mutex);
+}
+
+void midi_queue_discard(int keep_offs)
+{
+	struct midi_qhead h;
+	unsigned char msg[3];
+	uint32_t r, w, i, size;
+	uint64_t heard;
+
+	if (!midi_play_mutex) return;
+
+	mt_mutex_lock(midi_play_mutex);
+	heard = mq.clock + (timer_ticks_us() - mq.clock_us) * mq.rate / 1000000;
+
+	// squeeze out what's dropped; everything only ever moves back
+	for (r = w = mq.head; r != mq.tail; r += size) {
+		_mq_peek(&h, sizeof(h), r - mq.head);
+		size = sizeof(h) + h.len;
+
+		if (mq.rate && h.when != MIDI_QUEUE_NOW && h.when > heard) {
+			if (!keep_offs)
+				continue;
+
+			// nothing will be mixed again to turn these off, so they
+			// go out now; only the notes themselves are dropped
+			_mq_peek(msg, MIN(h.len, sizeof(msg)), r - mq.head + sizeof(h));
+			if (h.len >= 3 && (msg[0] & 0xf0) == 0x90 && msg[2])
+				continue;
+			h.when = MIDI_QUEUE_NOW;
+		}
+
+		_mq_put(w, &h, sizeof(h));
+		for (i = sizeof(h); i < size; i++)
+			mq.buf[(w + i) & (MIDI_QUEUE_SIZE - 1)] = mq.buf[(r + i) & (MIDI_QUEUE_SIZE - 1)];
+		w += size;
 	}
+	mq.tail = w;
+	mt_mutex_unlock(midi_play_mutex);
+}
 
-	// bytes per msec, rounded up
-	midims = sample_size * samples_per_second;
-	midims += 1000 - (midims % 1000);
-	midims /= 1000;
+void midi_queue_stats(uint32_t *late, uint32_t *dropped)
+{
+	*late = *dropped = 0;
 
-	// number of msec in output buffer, rounded up
-	qlen = buffer_length * sample_size;
-	qlen += midims - (qlen % midims);
-	qlen /= midims;
+	if (!midi_play_mutex) return;
 
-	// ok, now we can allocate one entry for every msec
-	qq = mem_calloc(qlen, sizeof(*qq));
+	mt_mutex_lock(midi_play_mutex);
+	*late = mq.late;
+	*dropped = mq.dropped;
+	mt_mutex_unlock(midi_play_mutex);
 }
 
 static int _midi_queue_run(SCHISM_UNUSED void *xtop)
 {
-	unsigned int i;
-	int j;
+	static unsigned char msg[MIDI_QUEUE_SIZE];
+	struct midi_qhead h;
+	uint64_t due, now;
 
 #ifdef SCHISM_WIN32
 	SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
@@ -649,33 +726,36 @@ static int _midi_queue_run(SCHISM_UNUSED void *xtop)
 
 	mt_mutex_lock(midi_play_mutex);
 	for (;;) {
-		mt_cond_wait(midi_play_cond, midi_play_mutex);
-
-		const schism_ticks_t start = timer_ticks();
+		if (mq.head == mq.tail) {
+			mt_cond_wait(midi_play_cond, midi_play_mutex);
+			continue;
+		}
 
-		for (i = 0; i < qlen; i++) {
-			mt_mutex_lock(midi_record_mutex);
-			for (j = 0; j < qq[i].used; j++) {
-				// empty the buffer
-				_midi_send_unlocked(qq[i].b[j].message, qq[i].b[j].used, 0, MIDI_FROM_NOW);
-				qq[i].b[j].used = 0;
-			}
-			mt_mutex_unlock(midi_record_mutex);
-
-			// Since the sleep function has the possibility of not
-			// *really* being realtime, we have to take into account
-			// that we might not really be on the ms that we want.
-			//
-			// To combat this, we have to check if the current tick
-			// value is greater than or equal to the expected tick
-			// value, and make up for the difference there. It surely
-			// isn't perfect, but it'll get the job done for slow
-			// machines.
-			if (timer_ticks_passed(start + i, timer_ticks()))
-				timer_msleep(1);
-
-			qq[i].used = 0;
+		_mq_peek(&h, sizeof(h), 0);
+
+		due = _mq_due(h.when);
+		now = timer_ticks_us();
+		if (due > now) {
+			// the clock moves with every audio buffer, so don't
+			// sleep for too long on what it said before
+			mt_mutex_unlock(midi_play_mutex);
+			timer_usleep(MIN(due - now, 10000));
+			mt_mutex_lock(midi_play_mutex);
+			continue;
 		}
+
+		if (due && now - due > 1000)
+			mq.late++;
+
+		_mq_peek(msg, h.len, sizeof(h));
+		mq.head += sizeof(h) + h.len;
+		mt_mutex_unlock(midi_play_mutex);
+
+		mt_mutex_lock(midi_record_mutex);
+		_midi_send_unlocked(msg, h.len, 0, MIDI_FROM_NOW);
+		mt_mutex_unlock(midi_record_mutex);
+
+		mt_mutex_lock(midi_play_mutex);
 	}
 
 	return 0; /* never happens */
@@ -685,7 +765,7 @@ int midi_need_flush(void)
 {
 	struct midi_port *ptr;
 	int need_explicit_flush = 0;
-	unsigned int i;
+	int r;
 
 	if (!midi_record_mutex || !midi_play_mutex) return 0;
 
@@ -699,11 +779,11 @@ int midi_need_flush(void)
 	}
 	if (!need_explicit_flush) return 0;
 
-	for (i = 0; i < qlen; i++) {
-		if (qq[i].used) return 1;
-	}
+	mt_mutex_lock(midi_play_mutex);
+	r = (mq.head != mq.tail);
+	mt_mutex_unlock(midi_play_mutex);
 
-	return 0;
+	return r;
 }
 
 void midi_send_flush(void)
@@ -740,9 +820,12 @@ void midi_send_flush(void)
 	mt_mutex_unlock(midi_play_mutex);
 }
 
-void midi_send_buffer(const unsigned char *data, unsigned int len, unsigned int pos)
+void midi_send_buffer(const unsigned char *data, unsigned int len, uint64_t when)
 {
-	if (!midi_record_mutex) return;
+	struct midi_qhead h;
+	uint64_t due, now;
+
+	if (!midi_record_mutex || !midi_play_mutex) return;
 
 	mt_mutex_lock(midi_record_mutex);
 
@@ -760,23 +843,30 @@ void midi_send_buffer(const unsigned char *data, unsigned int len, unsigned int
 		status.flags |= NEED_UPDATE | MIDI_EVENT_CHANGED;
 	}
 
-	if (midims > 0) {
-		pos /= midims;
+	mt_mutex_lock(midi_play_mutex);
+	due = _mq_due(when);
+	mt_mutex_unlock(midi_play_mutex);
 
-		if (_midi_send_unlocked(data, len, pos, MIDI_FROM_LATER)) {
-			// ok, we need a timer.
+	now = timer_ticks_us();
 
-			// find the nearest position in the buffer that has space for another message
-			pos /= midims;
-			while (pos < qlen && qq[pos].used >= ARRAY_SIZE(qq[pos].b))
-				pos++;
+	if (when == MIDI_QUEUE_NOW) {
+		// don't wait behind what's queued for later
+		_midi_send_unlocked(data, len, 0, MIDI_FROM_IMMEDIATE);
+	} else if (_midi_send_unlocked(data, len, (due > now) ? (due - now) / 1000 : 0, MIDI_FROM_LATER)) {
+		// ok, we need a timer.
+		h.when = when;
+		h.len = len;
 
-			if (pos < qlen) {
-				memcpy(&qq[pos].b[qq[pos].used].message, data, len);
-				qq[pos].b[qq[pos].used].used = len;
-				qq[pos].used++;
-			} // else we drop the message (!)
+		mt_mutex_lock(midi_play_mutex);
+		if (sizeof(h) + len > MIDI_QUEUE_SIZE - (mq.tail - mq.head)) {
+			mq.dropped++;
+		} else {
+			if (mq.head == mq.tail)
+				mt_cond_signal(midi_play_cond);
+			_mq_write(&h, sizeof(h));
+			_mq_write(data, len);
 		}
+		mt_mutex_unlock(midi_play_mutex);
 	}
 
 	mt_mutex_unlock(midi_record_mutex);
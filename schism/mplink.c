@@ -41,33 +41,22 @@ song_t *current_song = NULL;
 
 unsigned int song_get_length_to(int order, int row)
 {
-	unsigned int t;
-
-	song_lock_audio();
-	current_song->stop_at_order = order;
-	current_song->stop_at_row = row;
-	t = csf_get_length(current_song);
-	current_song->stop_at_order = current_song->stop_at_row = -1;
-	song_unlock_audio();
-	return t;
+	return csf_get_length_to(current_song, order, row);
 }
 void song_get_at_time(unsigned int seconds, int *order, int *row)
 {
-	if (!seconds) {
-		if (order) *order = 0;
-		if (row) *row = 0;
-	} else {
-		song_lock_audio();
-		current_song->stop_at_order = MAX_ORDERS;
-		current_song->stop_at_row = 255; /* unpossible */
-		current_song->stop_at_time = seconds;
-		csf_get_length(current_song);
-		if (order) *order = current_song->stop_at_order;
-		if (row) *row = current_song->stop_at_row;
-		current_song->stop_at_order = current_song->stop_at_row = -1;
-		current_song->stop_at_time = 0;
-		song_unlock_audio();
-	}
+	int o = 0, r = 0;
+
+	if (seconds)
+		csf_get_position_at(current_song, seconds, &o, &r);
+	if (order) *order = o;
+	if (row) *row = r;
+}
+
+void song_pattern_changed(int pattern)
+{
+	csf_forget_length(current_song, pattern);
+	song_keyframes_invalidate(pattern);
 }
 
 song_sample_t *song_get_sample(int n)
@@ -118,7 +107,7 @@ int song_get_mix_state(uint32_t **channel_list)
 {
 	if (channel_list)
 		*channel_list = current_song->voice_mix;
-	return MIN(current_song->num_voices, max_voices);
+	return MIN(current_song->num_voices, current_song->max_voices);
 }
 
 // ------------------------------------------------------------------------
@@ -521,6 +510,8 @@ void song_exchange_instruments(int a, int b)
 // instrument, sample, whatever.
 static void _swap_instruments_in_patterns(int a, int b)
 {
+	song_pattern_changed(-1);
+
 	for (int pat = 0; pat < MAX_PATTERNS; pat++) {
 		song_note_t *note = current_song->patterns[pat];
 		if (note == NULL)
@@ -579,6 +570,8 @@ static void _adjust_instruments_in_patterns(int start, int delta)
 {
 	int pat, n;
 
+	song_pattern_changed(-1);
+
 	for (pat = 0; pat < MAX_PATTERNS; pat++) {
 		song_note_t *note = current_song->patterns[pat];
 		if (note == NULL)
@@ -806,6 +799,7 @@ void song_replace_sample(int num, int with)
 		}
 	} else {
 		// for each pattern, for each note, replace 'smp' with 'with'
+		song_pattern_changed(-1);
 		for (i = 0; i < MAX_PATTERNS; i++) {
 			note = current_song->patterns[i];
 			if (!note)
@@ -829,6 +823,7 @@ void song_replace_instrument(int num, int with)
 		return;
 
 	// for each pattern, for each note, replace 'ins' with 'with'
+	song_pattern_changed(-1);
 	for (i = 0; i < MAX_PATTERNS; i++) {
 		note = current_song->patterns[i];
 		if (!note)
@@ -1194,7 +1194,7 @@ void handle_key(struct key_event *k)
 		if ((k->mod & SCHISM_KEYMOD_CTRL) && status.current_page != PAGE_PATTERN_EDITOR) {
 			_mp_finish(NULL);
 			if (song_get_mode() == MODE_PLAYING) {
-				song_set_current_order(song_get_current_order() - 1);
+				song_adjust_current_order(-1);
 				a11y_report_order();
 			}
 			return;
@@ -1206,7 +1206,7 @@ void handle_key(struct key_event *k)
 		if ((k->mod & SCHISM_KEYMOD_CTRL) && status.current_page != PAGE_PATTERN_EDITOR) {
 			_mp_finish(NULL);
 			if (song_get_mode() == MODE_PLAYING) {
-				song_set_current_order(song_get_current_order() + 1);
+				song_adjust_current_order(1);
 				a11y_report_order();
 			}
 			return;
@@ -1248,22 +1248,22 @@ void handle_key(struct key_event *k)
 		if (k->state == KEY_RELEASE) break;
 		if (status.flags & DISKWRITER_ACTIVE) return;
 		if (k->mod & SCHISM_KEYMOD_SHIFT) {
-			song_set_current_speed(song_get_current_speed() - 1);
-			status_text_flash("Speed set to %d frames per row", song_get_current_speed());
+			int speed = song_adjust_current_speed(-1);
+			status_text_flash("Speed set to %d frames per row", speed);
 			if (!(song_get_mode() & (MODE_PLAYING | MODE_PATTERN_LOOP))) {
-				song_set_initial_speed(song_get_current_speed());
+				song_set_initial_speed(speed);
 			}
 		} else if ((k->mod & SCHISM_KEYMOD_CTRL) && !(status.flags & CLASSIC_MODE)) {
-			song_set_current_tempo(song_get_current_tempo() - 1);
-			status_text_flash("Tempo set to %d frames per row", song_get_current_tempo());
+			int tempo = song_adjust_current_tempo(-1);
+			status_text_flash("Tempo set to %d frames per row", tempo);
 			if (!(song_get_mode() & (MODE_PLAYING | MODE_PATTERN_LOOP))) {
-				song_set_initial_tempo(song_get_current_tempo());
+				song_set_initial_tempo(tempo);
 			}
 		} else if (NO_MODIFIER(k->mod)) {
-			song_set_current_global_volume(song_get_current_global_volume() - 1);
-			status_text_flash("Global volume set to %d", song_get_current_global_volume());
+			int volume = song_adjust_current_global_volume(-1);
+			status_text_flash("Global volume set to %d", volume);
 			if (!(song_get_mode() & (MODE_PLAYING | MODE_PATTERN_LOOP))) {
-				song_set_initial_global_volume(song_get_current_global_volume());
+				song_set_initial_global_volume(volume);
 			}
 		}
 		return;
@@ -1271,22 +1271,22 @@ void handle_key(struct key_event *k)
 		if (k->state == KEY_RELEASE) break;
 		if (status.flags & DISKWRITER_ACTIVE) return;
 		if (k->mod & SCHISM_KEYMOD_SHIFT) {
-			song_set_current_speed(song_get_current_speed() + 1);
-			status_text_flash("Speed set to %d frames per row", song_get_current_speed());
+			int speed = song_adjust_current_speed(1);
+			status_text_flash("Speed set to %d frames per row", speed);
 			if (!(song_get_mode() & (MODE_PLAYING | MODE_PATTERN_LOOP))) {
-				song_set_initial_speed(song_get_current_speed());
+				song_set_initial_speed(speed);
 			}
 		} else if ((k->mod & SCHISM_KEYMOD_CTRL) && !(status.flags & CLASSIC_MODE)) {
-			song_set_current_tempo(song_get_current_tempo() + 1);
-			status_text_flash("Tempo set to %d frames per row", song_get_current_tempo());
+			int tempo = song_adjust_current_tempo(1);
+			status_text_flash("Tempo set to %d frames per row", tempo);
 			if (!(song_get_mode() & (MODE_PLAYING | MODE_PATTERN_LOOP))) {
-				song_set_initial_tempo(song_get_current_tempo());
+				song_set_initial_tempo(tempo);
 			}
 		} else if (NO_MODIFIER(k->mod)) {
-			song_set_current_global_volume(song_get_current_global_volume() + 1);
-			status_text_flash("Global volume set to %d", song_get_current_global_volume());
+			int volume = song_adjust_current_global_volume(1);
+			status_text_flash("Global volume set to %d", volume);
 			if (!(song_get_mode() & (MODE_PLAYING | MODE_PATTERN_LOOP))) {
-				song_set_initial_global_volume(song_get_current_global_volume());
+				song_set_initial_global_volume(volume);
 			}
 		}
 		return;
@@ -1471,6 +1471,7 @@ static struct vgamem_overlay vis_overlay = {
 
 extern short current_fft_data[2][1024];
 extern short fftlog[256];
+extern int vis_update(void);
 /* convert the fft bands to columns of the vis box
 out and d have a range of 0 to 128 */
 static inline void _get_columns_from_fft(unsigned char *out, short d[2][1024])
@@ -1510,7 +1511,7 @@ static void vis_fft(void)
 		_vis_virgin = 0;
 	}
 	_draw_vis_box();
-	song_lock_audio();
+	vis_update();
 
 	vgamem_ovl_clear(&vis_overlay,0);
 	_get_columns_from_fft(outfft,current_fft_data);
@@ -1524,8 +1525,6 @@ static void vis_fft(void)
 		}
 	}
 	vgamem_ovl_apply(&vis_overlay);
-
-	song_unlock_audio();
 }
 static void vis_oscilloscope(void)
 {
@@ -1119,7 +1119,7 @@ static int info_page_handle_key(struct key_event * k)
 		if (k->state == KEY_RELEASE)
 			return 1;
 		if (song_get_mode() == MODE_PLAYING) {
-			song_set_current_order(song_get_current_order() + 1);
+			song_adjust_current_order(1);
 			a11y_report_order();
 		}
 		return 1;
@@ -1127,7 +1127,7 @@ static int info_page_handle_key(struct key_event * k)
 		if (k->state == KEY_RELEASE)
 			return 1;
 		if (song_get_mode() == MODE_PLAYING) {
-			song_set_current_order(song_get_current_order() - 1);
+			song_adjust_current_order(-1);
 			a11y_report_order();
 }
 		return 1;
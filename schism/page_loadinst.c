@@ -125,7 +125,7 @@ static void read_directory(void)
 	if (dmoz_read(inst_cwd, &flist, NULL, dmoz_read_instrument_library) < 0)
 		log_perror(inst_cwd);
 
-	dmoz_filter_filelist(&flist,instgrep, &current_file, file_list_reposition);
+	dmoz_filter_filelist_ext(&flist,instgrep, &current_file, file_list_reposition);
 	dmoz_cache_lookup(inst_cwd, &flist, NULL);
 	file_list_reposition();
 }
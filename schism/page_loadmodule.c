@@ -383,7 +383,7 @@ static void read_directory(void)
 	while (dmoz_worker()); /* don't do it asynchronously */
 	dmoz_cache_lookup(cfg_dir_modules, &flist, &dlist);
 	// background the title checker
-	dmoz_filter_filelist(&flist, dmoz_fill_ext_data, &current_file, file_list_reposition);
+	dmoz_filter_filelist_ext(&flist, dmoz_fill_ext_data, &current_file, file_list_reposition);
 	file_list_reposition();
 	dir_list_reposition();
 }
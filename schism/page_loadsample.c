@@ -192,7 +192,7 @@ static void read_directory(void)
 	if (dmoz_read(samp_cwd, &flist, NULL, dmoz_read_sample_library) < 0)
 		log_perror(samp_cwd);
 
-	dmoz_filter_filelist(&flist, dmoz_fill_ext_data, &current_file, file_list_reposition);
+	dmoz_filter_filelist_ext(&flist, dmoz_fill_ext_data, &current_file, file_list_reposition);
 	dmoz_cache_lookup(samp_cwd, &flist, NULL);
 	file_list_reposition();
 }
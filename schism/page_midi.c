@@ -31,6 +31,7 @@
 #include "widget.h"
 #include "vgamem.h"
 #include "accessibility.h"
+#include "str.h"
 
 #include "song.h"
 
@@ -41,6 +42,7 @@ static int current_port = 0;
 static struct widget widgets_midi[17];
 static time_t last_midi_poll = 0;
 static int a11y_text_reported = 1;
+static uint32_t shown_late = 0, shown_dropped = 0;
 
 /* --------------------------------------------------------------------- */
 
@@ -248,6 +250,25 @@ static void midi_page_redraw(void)
 
 	draw_text(    "IP MIDI ports", 39, 41, 0, 2);
 	draw_box(52,40,73,42, BOX_THIN|BOX_INNER|BOX_INSET);
+
+	char buf[16];
+
+	midi_queue_stats(&shown_late, &shown_dropped);
+	draw_text(   "Late MIDI events", 36, 44, 0, 2);
+	draw_text("Dropped MIDI events", 33, 45, 0, 2);
+	draw_fill_chars(53, 44, 62, 45, DEFAULT_FG, 0);
+	draw_text(str_from_num(0, shown_late, buf), 53, 44, 2, 0);
+	draw_text(str_from_num(0, shown_dropped, buf), 53, 45, 2, 0);
+	draw_box(52,43,63,46, BOX_THIN|BOX_INNER|BOX_INSET);
+}
+
+static void midi_page_playback_update(void)
+{
+	uint32_t late, dropped;
+
+	midi_queue_stats(&late, &dropped);
+	if (late != shown_late || dropped != shown_dropped)
+		status.flags |= NEED_UPDATE;
 }
 
 static const char* midi_page_a11y_get_value(char *buf)
@@ -340,7 +361,7 @@ void midi_load_page(struct page *page)
 	page->draw_const = midi_page_redraw;
 	page->song_changed_cb = NULL;
 	page->predraw_hook = NULL;
-	page->playback_update = NULL;
+	page->playback_update = midi_page_playback_update;
 	page->handle_key = NULL;
 	page->set_page = get_midi_config;
 	page->total_widgets = 15;
@@ -2077,6 +2077,7 @@ static void pated_history_restore(int n)
 {
 	if (n < 0 || n > 9) return;
 	snap_paste(&undo_history[n], -1, -1, 0);
+	song_pattern_changed(current_pattern);
 
 }
 
@@ -4534,7 +4535,7 @@ static int pattern_editor_handle_key(struct key_event * k)
 			case MODE_PATTERN_LOOP:
 				return 1;
 			case MODE_PLAYING:
-				song_set_current_order(song_get_current_order() - 1);
+				song_adjust_current_order(-1);
 				a11y_report_order();
 				return 1;
 			default:
@@ -4559,7 +4560,7 @@ static int pattern_editor_handle_key(struct key_event * k)
 			case MODE_PATTERN_LOOP:
 				return 1;
 			case MODE_PLAYING:
-				song_set_current_order(song_get_current_order() + 1);
+				song_adjust_current_order(1);
 				a11y_report_order();
 				return 1;
 			default:
@@ -4654,6 +4655,22 @@ static int pattern_editor_handle_key(struct key_event * k)
  * called from the main key handler.
  * pattern_editor_handle_*_key above do the actual work. */
 
+/* for noticing changes to the pattern (see below) */
+static uint32_t pattern_checksum(int pattern)
+{
+	song_note_t *data;
+	int rows = song_get_pattern(pattern, &data);
+	const unsigned char *p = (const unsigned char *) data;
+	size_t len = (size_t) rows * 64 * sizeof(song_note_t);
+	uint32_t h = UINT32_C(2166136261);
+
+	if (!data)
+		return 0;
+	while (len--)
+		h = (h ^ *p++) * UINT32_C(16777619);
+	return h ^ rows;
+}
+
 static int pattern_editor_handle_key_cb(struct key_event * k)
 {
 	int ret;
@@ -4683,6 +4700,11 @@ static int pattern_editor_handle_key_cb(struct key_event * k)
 		};
 	}
 
+	/* there's too many ways to change the pattern to catch them all, so just
+	look at whether it's different afterwards */
+	int prev_pattern = current_pattern;
+	uint32_t prev_checksum = pattern_checksum(prev_pattern);
+
 	if (k->mod & SCHISM_KEYMOD_ALT)
 		ret = pattern_editor_handle_alt_key(k);
 	else if (k->mod & SCHISM_KEYMOD_CTRL)
@@ -4690,6 +4712,9 @@ static int pattern_editor_handle_key_cb(struct key_event * k)
 	else
 		ret = pattern_editor_handle_key(k);
 
+	if (pattern_checksum(prev_pattern) != prev_checksum)
+		song_pattern_changed(prev_pattern);
+
 	if (!a11y_text_reported) {
 		a11y_get_column_value(current_position, buf);
 		if (!*buf)
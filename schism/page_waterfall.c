@@ -29,9 +29,16 @@
 #include "widget.h"
 #include "vgamem.h"
 #include "accessibility.h"
+#include "bshift.h"
+#include "cpu.h"
+#include "threads.h"
 
 #include <math.h>
 
+#ifdef SCHISM_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
 #define NATIVE_SCREEN_WIDTH     640
 #define NATIVE_SCREEN_HEIGHT    400
 #define FUDGE_256_TO_WIDTH      4
@@ -43,6 +50,11 @@
 #define FFT_BUFFER_SIZE         2048 /*(1 << FFT_BUFFER_SIZE_LOG)*/
 #define FFT_OUTPUT_SIZE         1024 /* FFT_BUFFER_SIZE/2 */  /*WARNING: Hardcoded in page.c when declaring current_fft_data*/
 #define FFT_BANDS_SIZE          256    /*WARNING: Hardcoded in page.c when declaring fftlog and when using it in vis_fft*/
+/* the real input is transformed as half as many complex values */
+#define FFT_COMPLEX_SIZE_LOG    (FFT_BUFFER_SIZE_LOG - 1)
+#define FFT_COMPLEX_SIZE        (FFT_BUFFER_SIZE / 2)
+/* frames of audio kept around for the ui; power of two, at least FFT_BUFFER_SIZE */
+#define VIS_RING_SIZE           4096
 #define PI      ((double)3.14159265358979323846)
 /*This value is used internally to scale the power output of the FFT to decibells.*/
 static const float fft_inv_bufsize = 1.0f/(FFT_BUFFER_SIZE>>2);
@@ -54,6 +66,9 @@ short current_fft_data[2][FFT_OUTPUT_SIZE];
 short fftlog[FFT_BANDS_SIZE];
 
 void vis_init(void);
+int vis_update(void);
+void vis_work_32s(int32_t *in, int inlen);
+void vis_work_32m(int32_t *in, int inlen);
 void vis_work_16s(short *in, int inlen);
 void vis_work_16m(short *in, int inlen);
 void vis_work_8s(char *in, int inlen);
@@ -69,19 +84,31 @@ static int noisefloor=72;
 static struct vgamem_overlay ovl = { 0, 0, 79, 49, NULL, 0, 0, 0 };
 
 /* tables */
-static unsigned int bit_reverse[FFT_BUFFER_SIZE];
+static unsigned short bit_reverse[FFT_COMPLEX_SIZE];
+/* includes inv_s_range */
 static float window[FFT_BUFFER_SIZE];
-static float precos[FFT_OUTPUT_SIZE];
-static float presin[FFT_OUTPUT_SIZE];
+/* the butterflies that are half apart use [half..half*2) */
+static float twiddle_real[FFT_COMPLEX_SIZE];
+static float twiddle_imag[FFT_COMPLEX_SIZE];
+/* for taking the real spectrum back apart, [1..FFT_OUTPUT_SIZE] */
+static float split_real[FFT_OUTPUT_SIZE + 1];
+static float split_imag[FFT_OUTPUT_SIZE + 1];
 
 /* fft state */
-static float state_real[FFT_BUFFER_SIZE];
-static float state_imag[FFT_BUFFER_SIZE];
+static float state_real[FFT_COMPLEX_SIZE];
+static float state_imag[FFT_COMPLEX_SIZE];
 
+/* The audio thread only drops its output in here; the transform is done when
+something gets drawn. */
+static short vis_ring[VIS_RING_SIZE][2];
+static mt_atomic_t vis_ring_write; /* frames, only goes up */
+static mt_atomic_t vis_ring_cleared; /* bumped whenever the audio stops */
+static mt_atomic_t vis_ring_mono;
+static int vis_ring_blank = 0; /* audio thread only */
 
 static int _reverse_bits(unsigned int in) {
 	unsigned int r = 0, n;
-	for (n = 0; n < FFT_BUFFER_SIZE_LOG; n++) {
+	for (n = 0; n < FFT_COMPLEX_SIZE_LOG; n++) {
 		r <<= 1;
 		r += (in & 1);
 		in >>= 1;
@@ -90,10 +117,11 @@ static int _reverse_bits(unsigned int in) {
 }
 void vis_init(void)
 {
-	unsigned n;
+	unsigned n, half;
 
-	for (n = 0; n < FFT_BUFFER_SIZE; n++) {
+	for (n = 0; n < FFT_COMPLEX_SIZE; n++)
 		bit_reverse[n] = _reverse_bits(n);
+	for (n = 0; n < FFT_BUFFER_SIZE; n++) {
 #if 0
 		/*Rectangular/none*/
 		window[n] = 1;
@@ -112,11 +140,19 @@ void vis_init(void)
 #endif
 		/*Hann Window*/
 		window[n] = 0.50f - 0.50f * cos(2.0*PI * n / (FFT_BUFFER_SIZE - 1));
+		window[n] *= inv_s_range;
 	}
-	for (n = 0; n < FFT_OUTPUT_SIZE; n++) {
-		float j = (2.0*PI) * n / FFT_BUFFER_SIZE;
-		precos[n] = cos(j);
-		presin[n] = sin(j);
+	for (half = 1; half < FFT_COMPLEX_SIZE; half <<= 1) {
+		for (n = 0; n < half; n++) {
+			double j = PI * n / half;
+			twiddle_real[half + n] = cos(j);
+			twiddle_imag[half + n] = -sin(j);
+		}
+	}
+	for (n = 1; n <= FFT_OUTPUT_SIZE; n++) {
+		double j = (2.0*PI) * n / FFT_BUFFER_SIZE;
+		split_real[n] = cos(j);
+		split_imag[n] = -sin(j);
 	}
 #if 0
 	/*linear*/
@@ -137,68 +173,146 @@ void vis_init(void)
 #endif
 }
 
+/* one radix-2 pass over the whole (bit-reversed) state */
+static void _fft_pass(uint32_t half)
+{
+	const float *wr = twiddle_real + half, *wi = twiddle_imag + half;
+	uint32_t y, k;
+
+	for (y = 0; y < FFT_COMPLEX_SIZE; y += half << 1) {
+		float *ar = state_real + y, *ai = state_imag + y;
+		float *br = ar + half, *bi = ai + half;
+
+		for (k = 0; k < half; k++) {
+			float tr = wr[k] * br[k] - wi[k] * bi[k];
+			float ti = wr[k] * bi[k] + wi[k] * br[k];
+			br[k] = ar[k] - tr;
+			bi[k] = ai[k] - ti;
+			ar[k] += tr;
+			ai[k] += ti;
+		}
+	}
+}
+
+#ifdef SCHISM_HAVE_SSE2
+/* same thing, four butterflies at a time (half must be at least 4) */
+static SCHISM_TARGET_SSE2 void _fft_pass_sse2(uint32_t half)
+{
+	const float *wr = twiddle_real + half, *wi = twiddle_imag + half;
+	uint32_t y, k;
+
+	for (y = 0; y < FFT_COMPLEX_SIZE; y += half << 1) {
+		float *ar = state_real + y, *ai = state_imag + y;
+		float *br = ar + half, *bi = ai + half;
+
+		for (k = 0; k < half; k += 4) {
+			__m128 vwr = _mm_loadu_ps(wr + k), vwi = _mm_loadu_ps(wi + k);
+			__m128 vbr = _mm_loadu_ps(br + k), vbi = _mm_loadu_ps(bi + k);
+			__m128 var = _mm_loadu_ps(ar + k), vai = _mm_loadu_ps(ai + k);
+			__m128 tr = _mm_sub_ps(_mm_mul_ps(vwr, vbr), _mm_mul_ps(vwi, vbi));
+			__m128 ti = _mm_add_ps(_mm_mul_ps(vwr, vbi), _mm_mul_ps(vwi, vbr));
+
+			_mm_storeu_ps(br + k, _mm_sub_ps(var, tr));
+			_mm_storeu_ps(bi + k, _mm_sub_ps(vai, ti));
+			_mm_storeu_ps(ar + k, _mm_add_ps(var, tr));
+			_mm_storeu_ps(ai + k, _mm_add_ps(vai, ti));
+		}
+	}
+}
+#endif
+
 /*
 * Understanding In and Out:
 * input is the samples (so, it is amplitude). The scale is expected to be signed 16bits.
 *    The window function calculated in "window" will automatically be applied.
 * output is a value between 0 and 128 representing 0 = noisefloor variable
 *    and 128 = 0dBFS (deciBell, FullScale) for each band.
+*
+* The even and odd input samples go in as the real and imaginary halves of a
+* transform half the size, which is then split back into the spectrum of the
+* real input.
 */
-static inline void _vis_data_work(short output[FFT_OUTPUT_SIZE],
-			short input[FFT_BUFFER_SIZE])
+static void _vis_data_work(short output[FFT_OUTPUT_SIZE],
+			const short input[FFT_BUFFER_SIZE])
 {
-	unsigned int n, k, y;
-	unsigned int ex, ff;
-	float fr, fi;
-	float tr, ti;
-	float out;
-	int yp;
-
-	/* fft */
-	float *rp = state_real;
-	float *ip = state_imag;
-	for (n = 0; n < FFT_BUFFER_SIZE; n++) {
-		int nr = bit_reverse[n];
-		*rp++ = (float)input[ nr ] * inv_s_range * window[nr];
-		*ip++ = 0;
+	const float fft_dbinv_bufsize = dB(fft_inv_bufsize);
+	unsigned int n, half;
+
+	for (n = 0; n < FFT_COMPLEX_SIZE; n++) {
+		int nr = bit_reverse[n] << 1;
+		state_real[n] = (float)input[nr] * window[nr];
+		state_imag[n] = (float)input[nr + 1] * window[nr + 1];
 	}
-	ex = 1;
-	ff = FFT_OUTPUT_SIZE;
-	for (n = FFT_BUFFER_SIZE_LOG; n != 0; n--) {
-		for (k = 0; k != ex; k++) {
-			fr = precos[k * ff];
-			fi = presin[k * ff];
-			for (y = k; y < FFT_BUFFER_SIZE; y += ex << 1) {
-				yp = y + ex;
-				tr = fr * state_real[yp] - fi * state_imag[yp];
-				ti = fr * state_imag[yp] + fi * state_real[yp];
-				state_real[yp] = state_real[y] - tr;
-				state_imag[yp] = state_imag[y] - ti;
-				state_real[y] += tr;
-				state_imag[y] += ti;
-			}
+
+	for (half = 1; half < FFT_COMPLEX_SIZE; half <<= 1) {
+#ifdef SCHISM_HAVE_SSE2
+		if (half >= 4 && cpu_has_feature(CPU_FEATURE_SSE2)) {
+			_fft_pass_sse2(half);
+			continue;
 		}
-		ex <<= 1;
-		ff >>= 1;
+#endif
+		_fft_pass(half);
 	}
 
-	/* collect fft */
-	rp = state_real; rp++;
-	ip = state_imag; ip++;
-	const float fft_dbinv_bufsize = dB(fft_inv_bufsize);
-	for (n = 0; n < FFT_OUTPUT_SIZE; n++) {
+	/* collect fft, skipping the DC band */
+	for (n = 1; n <= FFT_OUTPUT_SIZE; n++) {
+		unsigned int a = n & (FFT_COMPLEX_SIZE - 1), b = (FFT_COMPLEX_SIZE - n) & (FFT_COMPLEX_SIZE - 1);
+		float er = 0.5f * (state_real[a] + state_real[b]);
+		float ei = 0.5f * (state_imag[a] - state_imag[b]);
+		float or = 0.5f * (state_imag[a] + state_imag[b]);
+		float oi = 0.5f * (state_real[b] - state_real[a]);
+		float xr = er + split_real[n] * or - split_imag[n] * oi;
+		float xi = ei + split_real[n] * oi + split_imag[n] * or;
+
 		/* "out" is the total power for each band.
 		* To get amplitude from "output", use sqrt(out[N])/(sizeBuf>>2)
 		* To get dB from "output", use powerdB(out[N])+db(1/(sizeBuf>>2)).
 		* powerdB is = 10 * log10(in)
 		* dB is = 20 * log10(in)
 		*/
-		out = ((*rp) * (*rp)) + ((*ip) * (*ip));
+		float out = xr * xr + xi * xi;
 		/* +0.0000000001f is -100dB of power. Used to prevent evaluating powerdB(0.0) */
-		output[n] = pdB_s(noisefloor, out+0.0000000001f,fft_dbinv_bufsize);
-		rp++;ip++;
+		output[n - 1] = pdB_s(noisefloor, out+0.0000000001f,fft_dbinv_bufsize);
+	}
+}
+
+/* Brings current_fft_data up to date with whatever the audio thread left in
+the ring. Returns zero if nothing happened since the last time. */
+int vis_update(void)
+{
+	static uint32_t seen_write = 0, seen_cleared = 0;
+	short dl[FFT_BUFFER_SIZE];
+	short dr[FFT_BUFFER_SIZE];
+	uint32_t w = mt_atomic_get(&vis_ring_write);
+	uint32_t c = mt_atomic_get(&vis_ring_cleared);
+	uint32_t i, p;
+
+	if (c != seen_cleared) {
+		seen_cleared = c;
+		seen_write = w;
+		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
+		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
+		return 1;
 	}
+
+	if (w == seen_write)
+		return 0;
+	seen_write = w;
+
+	for (i = 0, p = w - FFT_BUFFER_SIZE; i < FFT_BUFFER_SIZE; i++, p++) {
+		dl[i] = vis_ring[p & (VIS_RING_SIZE - 1)][0];
+		dr[i] = vis_ring[p & (VIS_RING_SIZE - 1)][1];
+	}
+
+	_vis_data_work(current_fft_data[0], dl);
+	if (mt_atomic_get(&vis_ring_mono))
+		memcpy(current_fft_data[1], current_fft_data[0], FFT_OUTPUT_SIZE * 2);
+	else
+		_vis_data_work(current_fft_data[1], dr);
+
+	return 1;
 }
+
 /* convert the fft bands to columns of screen
 out and d have a range of 0 to 128 */
 static inline void _get_columns_from_fft(unsigned char *out,
@@ -264,6 +378,8 @@ static void _vis_process(void)
 	k = NATIVE_SCREEN_WIDTH/2;
 	unsigned char outfft[NATIVE_SCREEN_WIDTH];
 
+	vgamem_ovl_touch(&ovl);
+
 	/* move up by one pixel */
 	memmove(ovl.q, ovl.q+NATIVE_SCREEN_WIDTH,
 			(NATIVE_SCREEN_WIDTH*
@@ -300,138 +416,62 @@ static void _vis_process(void)
 			_drawslice(k+i, outfft[k+i],5);
 		}
 	}
-
-	status.flags |= NEED_UPDATE;
 }
 
-void vis_work_32s(uint32_t *in, int inlen)
-{
-	short dl[FFT_BUFFER_SIZE];
-	short dr[FFT_BUFFER_SIZE];
-	int i, j, k;
+/* ------------------------------------------------------------------------ */
+/* these get called from the audio thread */
 
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = j = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				dl[i] = in[j] / 0x100; j++;
-				dr[i] = in[j] / 0x100; j++;
-			}
-		}
-		_vis_data_work(current_fft_data[0], dl);
-		_vis_data_work(current_fft_data[1], dr);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
-}
-
-void vis_work_32m(uint32_t *in, int inlen)
+static void _vis_cleared(void)
 {
-	short d[FFT_BUFFER_SIZE];
-	int i, k;
-
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				d[i] = in[k] / 0x100;
-			}
-		}
-		_vis_data_work(current_fft_data[0], d);
-		memcpy(current_fft_data[1], current_fft_data[0], FFT_OUTPUT_SIZE * 2);
+	/* keep stale audio out of the next window */
+	if (!vis_ring_blank) {
+		memset(vis_ring, 0, sizeof(vis_ring));
+		vis_ring_blank = 1;
 	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
+	mt_atomic_set(&vis_ring_cleared, mt_atomic_get(&vis_ring_cleared) + 1);
+	if (status.current_page == PAGE_WATERFALL)
+		status.flags |= NEED_UPDATE;
 }
 
-void vis_work_16s(short *in, int inlen)
-{
-	short dl[FFT_BUFFER_SIZE];
-	short dr[FFT_BUFFER_SIZE];
-	int i, j, k;
-
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = j = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				dl[i] = in[j]; j++;
-				dr[i] = in[j]; j++;
-			}
-		}
-		_vis_data_work(current_fft_data[0], dl);
-		_vis_data_work(current_fft_data[1], dr);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
-}
-
-void vis_work_16m(short *in, int inlen)
-{
-	short d[FFT_BUFFER_SIZE];
-	int i, k;
-
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				d[i] = in[k];
-			}
-		}
-		_vis_data_work(current_fft_data[0], d);
-		memcpy(current_fft_data[1], current_fft_data[0], FFT_OUTPUT_SIZE * 2);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
-}
-
-void vis_work_8s(char *in, int inlen)
-{
-	short dl[FFT_BUFFER_SIZE];
-	short dr[FFT_BUFFER_SIZE];
-	int i, j, k;
-
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = j = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				dl[i] = ((short)in[j]) * 0x100; j++;
-				dr[i] = ((short)in[j]) * 0x100; j++;
-			}
-		}
-		_vis_data_work(current_fft_data[0], dl);
-		_vis_data_work(current_fft_data[1], dr);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
-}
-void vis_work_8m(char *in, int inlen)
-{
-	short d[FFT_BUFFER_SIZE];
-	int i, k;
-
-	if (!inlen) {
-		memset(current_fft_data[0], 0, FFT_OUTPUT_SIZE*2);
-		memset(current_fft_data[1], 0, FFT_OUTPUT_SIZE*2);
-	} else {
-		for (i = 0; i < FFT_BUFFER_SIZE;) {
-			for (k = 0; k < inlen && i < FFT_BUFFER_SIZE; k++, i++) {
-				d[i] = ((short)in[k]) * 256;
-			}
-		}
-		_vis_data_work(current_fft_data[0], d);
-		memcpy(current_fft_data[1],
-				 current_fft_data[0], FFT_OUTPUT_SIZE * 2);
-	}
-	if (status.current_page == PAGE_WATERFALL) _vis_process();
-}
+#define VIS_PUSH(in, inlen, channels, conv) do { \
+	uint32_t w_ = mt_atomic_get(&vis_ring_write); \
+	int k_; \
+	if (!(inlen)) { \
+		_vis_cleared(); \
+		return; \
+	} \
+	if ((inlen) > VIS_RING_SIZE) { \
+		(in) += ((inlen) - VIS_RING_SIZE) * (channels); \
+		(inlen) = VIS_RING_SIZE; \
+	} \
+	for (k_ = 0; k_ < (inlen); k_++, w_++) { \
+		short *f_ = vis_ring[w_ & (VIS_RING_SIZE - 1)]; \
+		f_[0] = conv((in)[k_ * (channels)]); \
+		f_[1] = conv((in)[k_ * (channels) + (channels) - 1]); \
+	} \
+	vis_ring_blank = 0; \
+	mt_atomic_set(&vis_ring_mono, (channels) == 1); \
+	mt_atomic_set(&vis_ring_write, w_); \
+	if (status.current_page == PAGE_WATERFALL) \
+		status.flags |= NEED_UPDATE; \
+} while (0)
+
+#define VIS_CONV_32(x) ((short)rshift_signed((x), 16))
+#define VIS_CONV_16(x) (x)
+#define VIS_CONV_8(x) ((short)((signed char)(x) * 256))
+
+void vis_work_32s(int32_t *in, int inlen) { VIS_PUSH(in, inlen, 2, VIS_CONV_32); }
+void vis_work_32m(int32_t *in, int inlen) { VIS_PUSH(in, inlen, 1, VIS_CONV_32); }
+void vis_work_16s(short *in, int inlen) { VIS_PUSH(in, inlen, 2, VIS_CONV_16); }
+void vis_work_16m(short *in, int inlen) { VIS_PUSH(in, inlen, 1, VIS_CONV_16); }
+void vis_work_8s(char *in, int inlen) { VIS_PUSH(in, inlen, 2, VIS_CONV_8); }
+void vis_work_8m(char *in, int inlen) { VIS_PUSH(in, inlen, 1, VIS_CONV_8); }
 
 static void draw_screen(void)
 {
+	if (vis_update())
+		_vis_process();
+
 	/* waterfall uses a single overlay */
 	vgamem_ovl_apply(&ovl);
 }
@@ -542,7 +582,7 @@ static int waterfall_handle_key(struct key_event *k)
 		if (k->state == KEY_RELEASE)
 			return 1;
 		if (song_get_mode() == MODE_PLAYING) {
-			song_set_current_order(song_get_current_order() + 1);
+			song_adjust_current_order(1);
 			a11y_report_order();
 		}
 		return 1;
@@ -552,7 +592,7 @@ static int waterfall_handle_key(struct key_event *k)
 		if (k->state == KEY_RELEASE)
 			return 1;
 		if (song_get_mode() == MODE_PLAYING) {
-			song_set_current_order(song_get_current_order() - 1);
+			song_adjust_current_order(-1);
 			a11y_report_order();
 		}
 		return 1;
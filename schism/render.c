@@ -0,0 +1,612 @@
+/*
+ * Schism Tracker - a cross-platform Impulse Tracker clone
+ * copyright (c) 2003-2005 Storlek <storlek@rigelseven.com>
+ * copyright (c) 2005-2008 Mrs. Brisby <mrs.brisby@nimh.org>
+ * copyright (c) 2009 Storlek & Mrs. Brisby
+ * copyright (c) 2010-2012 Storlek
+ * URL: http://schismtracker.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* schismtracker-render: load modules and write them straight out to audio
+files, with no video, no event loop and no audio device. This is built
+from the player, the loaders, and the diskwriter; the few bits of tracker
+state those expect to exist are provided down below. */
+
+#include "headers.h"
+
+#include "it.h"
+#include "song.h"
+#include "disko.h"
+#include "dmoz.h"
+#include "fmt.h"
+#include "log.h"
+#include "midi.h"
+#include "mem.h"
+#include "slurp.h"
+#include "threads.h"
+#include "timer.h"
+#include "version.h"
+
+#include "player/sndfile.h"
+#include "player/cmixer.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+
+/* --------------------------------------------------------------------- */
+/* tracker state that the player and the loaders reach into */
+
+struct tracker_status status = {0};
+struct audio_settings audio_settings = {0};
+song_t *current_song = NULL;
+
+int midi_flags = MIDI_PITCHBEND;
+int midi_pitch_depth = 12;
+
+/* no config here, so no cache of the file browser's info either */
+char *cfg_dir_dotschism = NULL;
+
+static int quiet = 0;
+
+void log_appendf(int color, const char *format, ...)
+{
+	va_list ap;
+
+	/* the loaders are pretty chatty; only pass on the angry stuff */
+	if (quiet || color != 4)
+		return;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void log_perror(const char *prefix)
+{
+	perror(prefix);
+}
+
+/* no EQ in renders (mix_flags never has SNDMIX_EQ set) */
+void song_init_eq(SCHISM_UNUSED song_t *csf, SCHISM_UNUSED int do_reset, SCHISM_UNUSED uint32_t mix_freq)
+{
+}
+
+/* only instrument loaders use these, and we only ever load whole songs */
+song_instrument_t *instrument_loader_init(SCHISM_UNUSED struct instrumentloader *ii, SCHISM_UNUSED int slot)
+{
+	return NULL;
+}
+
+int instrument_loader_abort(SCHISM_UNUSED struct instrumentloader *ii)
+{
+	return 0;
+}
+
+int instrument_loader_sample(SCHISM_UNUSED struct instrumentloader *ii, SCHISM_UNUSED int slot)
+{
+	return 0;
+}
+
+song_sample_t *song_get_sample(SCHISM_UNUSED int n)
+{
+	return NULL;
+}
+
+static int flac_enabled = 0;
+
+void audio_enable_flac(int enabled)
+{
+	flac_enabled = !!enabled;
+}
+
+#ifdef USE_FLAC
+static int flac_enabled_cb(void)
+{
+	return !!flac_enabled;
+}
+#endif
+
+/* --------------------------------------------------------------------- */
+
+#define LOAD_SONG(x) fmt_##x##_load_song,
+static fmt_load_song_func load_song_funcs[] = {
+#include "fmt-types.h"
+	NULL,
+};
+
+/* names for the signature checks; same order as above */
+#define LOAD_SONG(x) #x,
+static const char *const load_song_types[] = {
+#include "fmt-types.h"
+	NULL,
+};
+
+#define EXPORT_FUNCS(t) \
+	fmt_##t##_export_head, fmt_##t##_export_silence, fmt_##t##_export_body, fmt_##t##_export_tail
+
+/* same as song_export_formats, minus the multi-write ones */
+static const struct save_format render_formats[] = {
+	{"WAV", "WAV", ".wav", {.export = {EXPORT_FUNCS(wav), 0}}, NULL},
+	{"AIFF", "Audio IFF", ".aiff", {.export = {EXPORT_FUNCS(aiff), 0}}, NULL},
+#ifdef USE_FLAC
+	{"FLAC", "Free Lossless Audio Codec", ".flac", {.export = {EXPORT_FUNCS(flac), 0}}, flac_enabled_cb},
+#endif
+	{.label = NULL}
+};
+
+/* ...and the multi-write ones, for --stems. these have to stay in the same order as above */
+static const struct save_format render_stem_formats[] = {
+	{"WAV", "WAV", ".wav", {.export = {EXPORT_FUNCS(wav), 1}}, NULL},
+	{"AIFF", "Audio IFF", ".aiff", {.export = {EXPORT_FUNCS(aiff), 1}}, NULL},
+#ifdef USE_FLAC
+	{"FLAC", "Free Lossless Audio Codec", ".flac", {.export = {EXPORT_FUNCS(flac), 1}}, flac_enabled_cb},
+#endif
+	{.label = NULL}
+};
+
+static const struct save_format *get_render_format(const char *label)
+{
+	int n;
+
+	for (n = 0; render_formats[n].label; n++)
+		if (strcasecmp(render_formats[n].label, label) == 0
+			&& (!render_formats[n].enabled || render_formats[n].enabled()))
+			return render_formats + n;
+
+	return NULL;
+}
+
+/* guess from the filename, e.g. "foo.aif" => AIFF */
+static const struct save_format *get_render_format_from_filename(const char *filename)
+{
+	const char *ext = dmoz_path_get_extension(filename);
+	int n;
+
+	if (!*ext)
+		return NULL;
+
+	for (n = 0; render_formats[n].label; n++)
+		if (strncasecmp(render_formats[n].ext, ext, 4) == 0
+			&& (!render_formats[n].enabled || render_formats[n].enabled()))
+			return render_formats + n;
+
+	return NULL;
+}
+
+/* --------------------------------------------------------------------- */
+
+/* like song_create_load, without any of the current_song business */
+static song_t *render_load(const char *file)
+{
+	fmt_load_song_func *func;
+	song_t *song;
+	slurp_t s;
+	int err = -LOAD_UNSUPPORTED;
+	unsigned char hdr[FMT_MAGIC_SIZE];
+	size_t hdrlen;
+
+	if (slurp(&s, file, NULL, 0) < 0)
+		return NULL;
+
+	hdrlen = fmt_magic_read(&s, hdr);
+
+	song = csf_allocate();
+
+	for (func = load_song_funcs; *func; func++) {
+		if (!fmt_magic_check(load_song_types[func - load_song_funcs], hdr, hdrlen))
+			continue;
+		slurp_rewind(&s);
+		switch ((*func)(song, &s, 0)) {
+		case LOAD_SUCCESS:
+			err = 0;
+			break;
+		case LOAD_UNSUPPORTED:
+			continue;
+		case LOAD_FORMAT_ERROR:
+			err = -LOAD_FORMAT_ERROR;
+			break;
+		case LOAD_FILE_ERROR:
+			err = errno;
+			break;
+		}
+		break;
+	}
+
+	unslurp(&s);
+
+	if (err) {
+		csf_free(song);
+		errno = err;
+		return NULL;
+	}
+
+	return song;
+}
+
+static const char *render_strerror(int n)
+{
+	switch (n) {
+	case -LOAD_UNSUPPORTED:
+		return "Unrecognised file type";
+	case -LOAD_FORMAT_ERROR:
+		return "File format error (corrupt?)";
+	default:
+		return strerror(n);
+	}
+}
+
+/* --------------------------------------------------------------------- */
+
+static struct {
+	const char *output;
+	const char *output_dir;
+	const struct save_format *format;
+	uint32_t rate, bits, channels;
+	int interpolation;
+	uint32_t mix_threads;
+	int jobs;
+	int stems, stem_threads;
+	int no_simd;
+} opts = {
+	.rate = 44100,
+	.bits = 16,
+	.channels = 2,
+	.interpolation = SRCMODE_LINEAR,
+	.mix_threads = 1,
+	.jobs = 1,
+	.stem_threads = 1,
+};
+
+/* songs loaded and waiting for (or being rendered by) the export queue;
+this keeps the main thread from loading everything up front */
+static schism_sem_t *render_slots = NULL;
+
+/* guards the totals and the failure count, which the jobs update as they finish */
+static schism_mutex_t *render_mutex = NULL;
+
+/* frames and bytes written by all renders, for the summary */
+static uint64_t total_frames = 0, total_bytes = 0;
+static int failed = 0;
+
+struct render_job {
+	char *input, *output;
+	song_t *song;
+};
+
+/* foo/bar.it => [output_dir/]bar.wav, or bar-%c.wav with --stems */
+static char *make_output_name(const char *input, const struct save_format *format)
+{
+	const char *base = opts.output_dir ? dmoz_path_get_basename(input) : input;
+	const char *ext = dmoz_path_get_extension(base);
+	char *name, *ret;
+
+	if (asprintf(&name, "%.*s%s%s", (int)(ext - base), base, opts.stems ? "-%c" : "", format->ext) < 0)
+		return NULL;
+
+	if (!opts.output_dir)
+		return name;
+
+	ret = dmoz_path_concat(opts.output_dir, name);
+	free(name);
+	return ret;
+}
+
+/* called on the export thread */
+static void render_done(SCHISM_UNUSED disko_job_t *job, const struct disko_job_result *res, void *userdata)
+{
+	struct render_job *rj = userdata;
+	song_t *song = rj->song;
+	double secs, ms;
+
+	mt_mutex_lock(render_mutex);
+	if (res->result == DW_OK) {
+		total_frames += res->frames;
+		total_bytes += res->bytes;
+	} else {
+		failed++;
+	}
+	mt_mutex_unlock(render_mutex);
+
+	if (res->result != DW_OK) {
+		fprintf(stderr, "%s: %s\n", rj->output, strerror(res->error));
+	} else if (!quiet) {
+		secs = (double)res->frames / song->mix_frequency;
+		ms = MAX(res->elapsed_ms, 1);
+
+		printf("%s -> %s: %d:%02d, %.2f MiB in %" PRIu64 ".%03" PRIu64 " sec (%.1fx realtime, %.1f MiB/s)\n",
+			rj->input, rj->output, (int)secs / 60, (int)secs % 60, res->bytes / 1048576.0,
+			res->elapsed_ms / 1000, res->elapsed_ms % 1000,
+			secs * 1000.0 / ms, res->bytes / 1048576.0 * 1000.0 / ms);
+	}
+
+	csf_free(song);
+	free(rj->input);
+	free(rj->output);
+	free(rj);
+
+	mt_semaphore_post(render_slots);
+}
+
+static void render_one(disko_queue_t *queue, const char *input)
+{
+	const struct save_format *format = opts.format;
+	struct render_job *rj;
+	song_t *song;
+
+	song = render_load(input);
+	if (!song) {
+		fprintf(stderr, "%s: %s\n", input, render_strerror(errno));
+		goto fail;
+	}
+
+	if (!format && opts.output)
+		format = get_render_format_from_filename(opts.output);
+	if (!format)
+		format = get_render_format("WAV");
+	if (opts.stems)
+		format = render_stem_formats + (format - render_formats);
+
+	csf_set_resampling_mode(song, opts.interpolation);
+
+	rj = mem_calloc(1, sizeof(*rj));
+	rj->song = song;
+	rj->input = str_dup(input);
+	rj->output = opts.output ? str_dup(opts.output) : make_output_name(input, format);
+	if (!rj->output) {
+		perror(input);
+		free(rj->input);
+		free(rj);
+		csf_free(song);
+		goto fail;
+	}
+
+	if (!disko_queue_push(queue, song, rj->output, format, opts.rate, opts.bits, opts.channels,
+			NULL, render_done, rj)) {
+		perror(rj->output);
+		free(rj->input);
+		free(rj->output);
+		free(rj);
+		csf_free(song);
+		goto fail;
+	}
+
+	return;
+
+fail:
+	mt_mutex_lock(render_mutex);
+	failed++;
+	mt_mutex_unlock(render_mutex);
+	mt_semaphore_post(render_slots);
+}
+
+/* --------------------------------------------------------------------- */
+
+#define SHORT_OPTIONS "o:d:f:r:b:c:i:j:qh"
+enum {
+	O_OUTPUT = 'o',
+	O_OUTPUT_DIR = 'd',
+	O_FORMAT = 'f',
+	O_RATE = 'r',
+	O_BITS = 'b',
+	O_CHANNELS = 'c',
+	O_INTERPOLATION = 'i',
+	O_JOBS = 'j',
+	O_QUIET = 'q',
+	O_HELP = 'h',
+	// ids for long options with no corresponding short option
+	O_MIX_THREADS = 256,
+	O_STEMS,
+	O_STEM_THREADS,
+	O_VERSION,
+	O_NO_SIMD,
+};
+
+#define USAGE "Usage: %s [OPTIONS] FILE...\n"
+
+// Remember to update docs/building_on_linux.md when changing the command-line options!
+
+static void parse_options(int argc, char **argv)
+{
+	struct option long_options[] = {
+		{"output", 1, NULL, O_OUTPUT},
+		{"output-dir", 1, NULL, O_OUTPUT_DIR},
+		{"format", 1, NULL, O_FORMAT},
+		{"rate", 1, NULL, O_RATE},
+		{"bits", 1, NULL, O_BITS},
+		{"channels", 1, NULL, O_CHANNELS},
+		{"interpolation", 1, NULL, O_INTERPOLATION},
+		{"jobs", 1, NULL, O_JOBS},
+		{"mix-threads", 1, NULL, O_MIX_THREADS},
+		{"stems", 0, NULL, O_STEMS},
+		{"stem-threads", 1, NULL, O_STEM_THREADS},
+		{"no-simd", 0, NULL, O_NO_SIMD},
+		{"quiet", 0, NULL, O_QUIET},
+		{"version", 0, NULL, O_VERSION},
+		{"help", 0, NULL, O_HELP},
+		{NULL, 0, NULL, 0},
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, long_options, NULL)) != -1) {
+		switch (opt) {
+		case O_OUTPUT:
+			opts.output = optarg;
+			break;
+		case O_OUTPUT_DIR:
+			opts.output_dir = optarg;
+			break;
+		case O_FORMAT:
+			opts.format = get_render_format(optarg);
+			if (!opts.format) {
+				fprintf(stderr, "%s: unknown or unavailable format %s\n", argv[0], optarg);
+				exit(2);
+			}
+			break;
+		case O_RATE:
+			opts.rate = CLAMP(atoi(optarg), 4000, 192000);
+			break;
+		case O_BITS:
+			/* float mixes in floating point too, and isn't bit-exact with the others */
+			opts.bits = (strcasecmp(optarg, "float") == 0) ? (32 | DW_FLOAT) : (uint32_t)atoi(optarg);
+			if (opts.bits != 8 && opts.bits != 16 && opts.bits != 24 && opts.bits != 32
+					&& opts.bits != (32 | DW_FLOAT)) {
+				fprintf(stderr, "%s: bits must be 8, 16, 24, 32, or float\n", argv[0]);
+				exit(2);
+			}
+			break;
+		case O_CHANNELS:
+			opts.channels = CLAMP(atoi(optarg), 1, 2);
+			break;
+		case O_INTERPOLATION:
+			opts.interpolation = CLAMP(atoi(optarg), SRCMODE_NEAREST, SRCMODE_POLYPHASE);
+			break;
+		case O_JOBS:
+			opts.jobs = CLAMP(atoi(optarg), 1, DISKO_MAX_THREADS);
+			break;
+		case O_MIX_THREADS:
+			opts.mix_threads = CLAMP(atoi(optarg), 1, MAX_MIX_THREADS);
+			break;
+		case O_STEMS:
+			opts.stems = 1;
+			break;
+		case O_STEM_THREADS:
+			opts.stem_threads = CLAMP(atoi(optarg), 1, DISKO_MAX_THREADS);
+			break;
+		case O_NO_SIMD:
+			opts.no_simd = 1;
+			break;
+		case O_QUIET:
+			quiet = 1;
+			break;
+		case O_VERSION:
+			puts(schism_banner(0));
+			puts(ver_short_copyright);
+			exit(0);
+		case O_HELP:
+			printf(USAGE, argv[0]);
+			printf(
+				"  -o, --output=FILENAME\n"
+				"  -d, --output-dir=DIRECTORY\n"
+				"  -f, --format=WAV|AIFF|FLAC\n"
+				"  -r, --rate=HZ\n"
+				"  -b, --bits=8|16|24|32|float\n"
+				"  -c, --channels=1|2\n"
+				"  -i, --interpolation=0-3\n"
+				"  -j, --jobs=COUNT\n"
+				"      --mix-threads=COUNT\n"
+				"      --stems\n"
+				"      --stem-threads=COUNT\n"
+				"      --no-simd\n"
+				"  -q, --quiet\n"
+				"      --version\n"
+				"  -h, --help\n"
+			);
+			printf("Refer to the documentation for complete usage details.\n");
+			exit(0);
+		case '?': // unknown option
+			fprintf(stderr, USAGE, argv[0]);
+			exit(2);
+		default: // unhandled but known option
+			fprintf(stderr, "how did this get here i am not good with computer\n");
+			exit(2);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, USAGE, argv[0]);
+		exit(2);
+	}
+
+	if (opts.output && argc - optind > 1) {
+		fprintf(stderr, "%s: --output only makes sense with one file; use --output-dir\n", argv[0]);
+		exit(2);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	schism_ticks_t start, elapsed;
+	disko_queue_t *queue;
+	int n;
+
+	ver_init();
+
+	parse_options(argc, argv);
+
+	if (!dmoz_init()) {
+		fprintf(stderr, "Failed to initialize a filesystem backend!\n");
+		return 1;
+	}
+
+	if (!timer_init()) {
+		fprintf(stderr, "Failed to initialize a timers backend!\n");
+		return 1;
+	}
+
+	if (!mt_init()) {
+		fprintf(stderr, "Failed to initialize a multithreading backend!\n");
+		return 1;
+	}
+
+#ifdef USE_FLAC
+	flac_init();
+#endif
+
+	mixer_set_threads(opts.mix_threads);
+	mixer_set_simd(!opts.no_simd);
+	disko_set_stem_threads(opts.stem_threads);
+
+	render_mutex = mt_mutex_create();
+	render_slots = mt_semaphore_create(opts.jobs * 2);
+	queue = disko_queue_create(opts.jobs);
+	if (!render_mutex || !render_slots || !queue) {
+		fprintf(stderr, "Failed to start the export threads!\n");
+		return 1;
+	}
+
+	start = timer_ticks();
+	for (n = optind; n < argc; n++) {
+		mt_semaphore_wait(render_slots);
+		render_one(queue, argv[n]);
+	}
+	disko_queue_wait(queue);
+	elapsed = MAX(timer_ticks() - start, 1);
+
+	if (!quiet && argc - optind > 1) {
+		printf("%d of %d files, %.2f MiB in %" PRIu64 ".%03" PRIu64 " sec (%.1fx realtime, %.1f MiB/s)\n",
+			argc - optind - failed, argc - optind, total_bytes / 1048576.0,
+			(uint64_t)(elapsed / 1000), (uint64_t)(elapsed % 1000),
+			(double)total_frames / opts.rate * 1000.0 / elapsed,
+			total_bytes / 1048576.0 * 1000.0 / elapsed);
+	}
+
+	disko_queue_free(queue);
+	mt_semaphore_delete(render_slots);
+	mt_mutex_delete(render_mutex);
+	mixer_set_threads(1);
+
+#ifdef USE_FLAC
+	flac_quit();
+#endif
+	mt_quit();
+	timer_quit();
+	dmoz_quit();
+
+	return failed ? 1 : 0;
+}
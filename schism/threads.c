@@ -311,6 +311,29 @@ void mt_semaphore_post(schism_sem_t *sem)
 
 // ---------------------------------------------------------------------------
 
+#ifdef SCHISM_ATOMICS_ARE_MUTEXES
+static schism_mutex_t *atomic_mutex = NULL;
+
+uint32_t mt_atomic_get(mt_atomic_t *a)
+{
+	uint32_t v;
+
+	mt_mutex_lock(atomic_mutex);
+	v = a->value;
+	mt_mutex_unlock(atomic_mutex);
+	return v;
+}
+
+void mt_atomic_set(mt_atomic_t *a, uint32_t v)
+{
+	mt_mutex_lock(atomic_mutex);
+	a->value = v;
+	mt_mutex_unlock(atomic_mutex);
+}
+#endif
+
+// ---------------------------------------------------------------------------
+
 int mt_init(void)
 {
 	static const schism_threads_backend_t *backends[] = {
@@ -339,11 +362,23 @@ int mt_init(void)
 	if (!mt_backend)
 		return 0;
 
+#ifdef SCHISM_ATOMICS_ARE_MUTEXES
+	atomic_mutex = mt_mutex_create();
+	if (!atomic_mutex)
+		return 0;
+#endif
+
 	return 1;
 }
 
 void mt_quit(void)
 {
+#ifdef SCHISM_ATOMICS_ARE_MUTEXES
+	if (atomic_mutex) {
+		mt_mutex_delete(atomic_mutex);
+		atomic_mutex = NULL;
+	}
+#endif
 	if (mt_backend) {
 		mt_backend->quit();
 		mt_backend = NULL;
@@ -39,6 +39,14 @@ int timer_ticks_passed(schism_ticks_t a, schism_ticks_t b)
 	return backend->ticks_passed(a, b);
 }
 
+uint64_t timer_ticks_us(void)
+{
+	if (backend->ticks_us)
+		return backend->ticks_us();
+
+	return (uint64_t)backend->ticks() * 1000;
+}
+
 void timer_delay(uint32_t ms)
 {
 	backend->delay(ms);
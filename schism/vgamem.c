@@ -104,6 +104,14 @@ uint32_t* acbuf_get_ptr_to(int x, int y)
 
 static uint8_t ovl[640*400] = {0}; /* 256K */
 
+/* The screen gets redrawn from scratch every time, so which character rows
+ * actually changed is worked out in vgamem_flip by comparing them with what's
+ * being shown. The overlay functions note which rows they scribbled on, and
+ * only those get compared against ovl_read. */
+static uint8_t ovl_read[640*400] = {0};
+static uint8_t ovl_touched[50] = {0};
+static uint8_t dirty_rows[50] = {0};
+
 #define CHECK_INVERT(tl,br,n) \
 do {                                            \
 	if (status.flags & INVERTED_PALETTE) {  \
@@ -115,7 +123,76 @@ do {                                            \
 
 void vgamem_flip(void)
 {
-	memcpy(vgamem_read, vgamem, sizeof(vgamem));
+	int y;
+
+	for (y = 0; y < 50; y++) {
+		if (memcmp(vgamem_read + (y * 80), vgamem + (y * 80), 80 * sizeof(*vgamem))) {
+			memcpy(vgamem_read + (y * 80), vgamem + (y * 80), 80 * sizeof(*vgamem));
+			dirty_rows[y] = 1;
+		}
+
+		if (ovl_touched[y]) {
+			uint8_t *q = ovl + (y * 5120), *r = ovl_read + (y * 5120);
+
+			if (memcmp(r, q, 5120)) {
+				memcpy(r, q, 5120);
+				dirty_rows[y] = 1;
+			}
+			ovl_touched[y] = 0;
+		}
+	}
+}
+
+void vgamem_invalidate(void)
+{
+	memset(dirty_rows, 1, sizeof(dirty_rows));
+}
+
+void vgamem_mark_dirty(uint32_t ys, uint32_t ye)
+{
+	ye = MIN(ye, 399);
+	for (ys >>= 3; ys <= (ye >> 3); ys++)
+		dirty_rows[ys] = 1;
+}
+
+int vgamem_line_dirty(uint32_t y)
+{
+	return dirty_rows[y >> 3];
+}
+
+int vgamem_dirty_run(uint32_t *ys, uint32_t *ye)
+{
+	uint32_t y = (*ys + 7) >> 3;
+
+	while (y < 50 && !dirty_rows[y])
+		y++;
+	if (y >= 50)
+		return 0;
+
+	*ys = y << 3;
+	while (y < 50 && dirty_rows[y])
+		y++;
+	*ye = y << 3;
+
+	return 1;
+}
+
+void vgamem_clean(void)
+{
+	memset(dirty_rows, 0, sizeof(dirty_rows));
+}
+
+static inline void _ovl_touch(struct vgamem_overlay *n, int ys, int ye)
+{
+	ys = CLAMP((int)n->y1 + (ys >> 3), 0, 49);
+	ye = CLAMP((int)n->y1 + (ye >> 3), 0, 49);
+	for (; ys <= ye; ys++)
+		ovl_touched[ys] = 1;
+}
+
+void vgamem_ovl_touch(struct vgamem_overlay *n)
+{
+	_ovl_touch(n, 0, n->height - 1);
 }
 
 void vgamem_clear(void)
@@ -144,6 +221,8 @@ void vgamem_ovl_clear(struct vgamem_overlay *n, int color)
 {
 	int i, j;
 	unsigned char *q = n->q;
+
+	_ovl_touch(n, 0, n->height - 1);
 	for (j = 0; j < n->height; j++) {
 		for (i = 0; i < n->width; i++) {
 			*q = color;
@@ -155,6 +234,7 @@ void vgamem_ovl_clear(struct vgamem_overlay *n, int color)
 
 void vgamem_ovl_drawpixel(struct vgamem_overlay *n, int x, int y, int color)
 {
+	_ovl_touch(n, y, y);
 	n->q[ (640*y) + x ] = color;
 }
 
@@ -164,6 +244,7 @@ static inline void _draw_line_v(struct vgamem_overlay *n, int x,
 	unsigned char *q = n->q + x;
 	int y;
 
+	_ovl_touch(n, MIN(ys, ye), MAX(ys, ye));
 	if (ys < ye) {
 		q += (ys * 640);
 		for (y = ys; y <= ye; y++) {
@@ -184,6 +265,8 @@ static inline void _draw_line_h(struct vgamem_overlay *n, int xs,
 {
 	unsigned char *q = n->q + (y * 640);
 	int x;
+
+	_ovl_touch(n, y, y);
 	if (xs < xe) {
 		q += xs;
 		for (x = xs; x <= xe; x++) {
@@ -259,8 +342,56 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 	}
 }
 
+/* Every row of a glyph is just eight on/off bits, so instead of picking fg or
+ * bg for each pixel, the scanners look up the row's bit pattern in a table of
+ * pixel masks and splat both colors over it, 64 bits at a time. This doesn't
+ * depend on the font or the palette, so it never needs rebuilding. */
+#define VGAMEM_SPLAT(BITS) (UINT64_MAX / UINT##BITS##_MAX)
+
 /* generic scanner; BITS must be one of 8, 16, 32, 64 */
 #define VGAMEM_SCANNER_VARIANT(BITS) \
+	static uint##BITS##_t vgamem_mask##BITS[256][8]; \
+	\
+	static void vgamem_mask##BITS##_init(void) \
+	{ \
+		static int init = 0; \
+		int i, b; \
+	\
+		if (init) \
+			return; \
+	\
+		for (i = 0; i < 256; i++) \
+			for (b = 0; b < 8; b++) \
+				vgamem_mask##BITS[i][b] = (i & (0x80 >> b)) ? UINT##BITS##_MAX : 0; \
+	\
+		init = 1; \
+	} \
+	\
+	/* n is 8 for a full cell, or 4 for half of one (starting at mask + 4) */ \
+	static inline void vgamem_expand##BITS(uint##BITS##_t *out, const uint##BITS##_t *mask, size_t n, uint64_t fg, uint64_t bg) \
+	{ \
+		const size_t len = n * sizeof(*out); \
+		size_t i; \
+	\
+		if (len < 8) { \
+			/* half of an 8-bit cell */ \
+			uint32_t m; \
+	\
+			memcpy(&m, mask, 4); \
+			m = (uint32_t)bg ^ (((uint32_t)fg ^ (uint32_t)bg) & m); \
+			memcpy(out, &m, 4); \
+			return; \
+		} \
+	\
+		for (i = 0; i < len; i += 8) { \
+			uint64_t m; \
+	\
+			memcpy(&m, (const unsigned char *)mask + i, 8); \
+			m = bg ^ ((fg ^ bg) & m); \
+			memcpy((unsigned char *)out + i, &m, 8); \
+		} \
+	} \
+	\
 	void vgamem_scan##BITS(uint32_t ry, uint##BITS##_t *out, uint32_t tc[16], uint32_t mouseline[80], uint32_t mouseline_mask[80]) \
 	{ \
 		struct vgamem_char *bp; \
@@ -268,7 +399,9 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 		uint8_t *q; \
 		uint8_t *itf, *bios, *bioslow, *hf, *hiragana, *extlatin, *greek; \
 		uint32_t x, y; \
-		int fg, bg; \
+		uint64_t fg, bg; \
+	\
+		vgamem_mask##BITS##_init(); \
 	\
 		q = ovl + (ry * 640); \
 		y = ry >> 3; \
@@ -286,8 +419,8 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 			case VGAMEM_FONT_ITF: \
 			case VGAMEM_FONT_BIOS: \
 				/* regular character */ \
-				fg = bp->character.cp437.colors.fg; \
-				bg = bp->character.cp437.colors.bg; \
+				fg = (uint##BITS##_t)tc[bp->character.cp437.colors.fg] * VGAMEM_SPLAT(BITS); \
+				bg = (uint##BITS##_t)tc[bp->character.cp437.colors.bg] * VGAMEM_SPLAT(BITS); \
 				if (bp->font == VGAMEM_FONT_BIOS) { \
 					dg = (bp->character.cp437.c & 0x80) \
 						? bios[(bp->character.cp437.c & 0x7F) << 3] \
@@ -298,14 +431,8 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 				dg |= mouseline[x]; \
 				dg &= ~(mouseline_mask[x] ^ mouseline[x]); \
 			\
-				*out++ = tc[(dg & 0x80) ? fg : bg]; \
-				*out++ = tc[(dg & 0x40) ? fg : bg]; \
-				*out++ = tc[(dg & 0x20) ? fg : bg]; \
-				*out++ = tc[(dg & 0x10) ? fg : bg]; \
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
+				vgamem_expand##BITS(out, vgamem_mask##BITS[dg & 0xFF], 8, fg, bg); \
+				out += 8; \
 				break; \
 			case VGAMEM_FONT_HALFWIDTH: \
 				dg = hf[bp->character.halfwidth.c1.c << 2]; \
@@ -314,13 +441,11 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 				dg |= mouseline[x] >> 4; \
 				dg &= ~(mouseline_mask[x] ^ mouseline[x]) >> 4; \
 			\
-				fg = bp->character.halfwidth.c1.colors.fg; \
-				bg = bp->character.halfwidth.c1.colors.bg; \
+				fg = (uint##BITS##_t)tc[bp->character.halfwidth.c1.colors.fg] * VGAMEM_SPLAT(BITS); \
+				bg = (uint##BITS##_t)tc[bp->character.halfwidth.c1.colors.bg] * VGAMEM_SPLAT(BITS); \
 			\
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
+				vgamem_expand##BITS(out, vgamem_mask##BITS[dg & 0xF] + 4, 4, fg, bg); \
+				out += 4; \
 			\
 				dg = hf[bp->character.halfwidth.c2.c << 2]; \
 				if (!(ry & 1)) \
@@ -328,13 +453,11 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 				dg |= mouseline[x]; \
 				dg &= ~(mouseline_mask[x] ^ mouseline[x]); \
 			\
-				fg = bp->character.halfwidth.c2.colors.fg; \
-				bg = bp->character.halfwidth.c2.colors.bg; \
+				fg = (uint##BITS##_t)tc[bp->character.halfwidth.c2.colors.fg] * VGAMEM_SPLAT(BITS); \
+				bg = (uint##BITS##_t)tc[bp->character.halfwidth.c2.colors.bg] * VGAMEM_SPLAT(BITS); \
 			\
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
+				vgamem_expand##BITS(out, vgamem_mask##BITS[dg & 0xF] + 4, 4, fg, bg); \
+				out += 4; \
 				break; \
 			case VGAMEM_FONT_OVERLAY: \
 				*out++ = tc[ (q[0]|((mouseline[x] & 0x80)?15:0)) & 255]; \
@@ -367,21 +490,14 @@ void vgamem_ovl_drawline(struct vgamem_overlay *n, int xs,
 					dg = itf[cp437 << 3]; \
 				} \
 	\
-				fg = bp->character.unicode.colors.fg; \
-				bg = bp->character.unicode.colors.bg; \
+				fg = (uint##BITS##_t)tc[bp->character.unicode.colors.fg] * VGAMEM_SPLAT(BITS); \
+				bg = (uint##BITS##_t)tc[bp->character.unicode.colors.bg] * VGAMEM_SPLAT(BITS); \
 	\
 				dg |= mouseline[x]; \
 				dg &= ~(mouseline_mask[x] ^ mouseline[x]); \
 	\
-	\
-				*out++ = tc[(dg & 0x80) ? fg : bg]; \
-				*out++ = tc[(dg & 0x40) ? fg : bg]; \
-				*out++ = tc[(dg & 0x20) ? fg : bg]; \
-				*out++ = tc[(dg & 0x10) ? fg : bg]; \
-				*out++ = tc[(dg & 0x8) ? fg : bg]; \
-				*out++ = tc[(dg & 0x4) ? fg : bg]; \
-				*out++ = tc[(dg & 0x2) ? fg : bg]; \
-				*out++ = tc[(dg & 0x1) ? fg : bg]; \
+				vgamem_expand##BITS(out, vgamem_mask##BITS[dg & 0xFF], 8, fg, bg); \
+				out += 8; \
 	\
 				break; /* unused chars */ \
 			} \
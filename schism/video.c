@@ -33,6 +33,8 @@
 #include "video.h"
 #include "osdefs.h"
 #include "vgamem.h"
+#include "cpu.h"
+#include "mem.h"
 
 #include "backend/video.h"
 
@@ -40,6 +42,10 @@
 
 #include <inttypes.h>
 
+#ifdef SCHISM_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
 #ifndef SCHISM_MACOSX
 #include "auto/schismico_hires.h"
 #endif
@@ -281,113 +287,214 @@ static inline void make_mouseline(unsigned int x, unsigned int v, unsigned int y
 #define FIXED2INT(x) ((x) >> FIXED_BITS)
 #define FRAC(x) ((x) & FIXED_MASK)
 
-void video_blitLN(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t pal[256], int width, int height, schism_map_rgb_func_t map_rgb, void *map_rgb_data)
+/* The scalers keep which source column (and for linear, how much of the next
+ * one) goes into each output column, and only redo it when the width changes.
+ * The linear one also keeps the two source lines it's between, already scaled
+ * horizontally, so that every output line is just a blend of the two. */
+static struct {
+	int width;
+	uint16_t *x;
+	uint8_t *ex;
+	uint32_t *lines;
+} blit_ln = {0};
+
+static struct {
+	int width;
+	unsigned int bpp;
+	uint16_t *x;
+	unsigned char *line;
+} blit_nn = {0};
+
+/* mixes two 0x00RRGGBB colors, w/256 of the way from c0 to c1 */
+static inline uint32_t ln_mix(uint32_t c0, uint32_t c1, uint32_t w)
 {
-	unsigned char cv32backing[NATIVE_SCREEN_WIDTH * 8];
+	const uint32_t w0 = INT2FIXED(1) - w;
+
+	return ((((c0 & 0xFF00FF) * w0 + (c1 & 0xFF00FF) * w) >> FIXED_BITS) & 0xFF00FF)
+		| ((((c0 & 0x00FF00) * w0 + (c1 & 0x00FF00) * w) >> FIXED_BITS) & 0x00FF00);
+}
+
+static void ln_setup(int width)
+{
+	int x, fixedx, scalex;
+
+	if (blit_ln.width == width)
+		return;
+
+	blit_ln.x = mem_realloc(blit_ln.x, width * sizeof(*blit_ln.x));
+	blit_ln.ex = mem_realloc(blit_ln.ex, width * sizeof(*blit_ln.ex));
+	blit_ln.lines = mem_realloc(blit_ln.lines, 2 * width * sizeof(*blit_ln.lines));
 
-	uint32_t *csp, *esp, *dp;
-	unsigned int c00, c01, c10, c11;
-	unsigned int outr, outg, outb;
-	unsigned int pad;
-	int fixedx, fixedy, scalex, scaley;
-	unsigned int y, x,ey,ex,t1,t2;
+	scalex = INT2FIXED(NATIVE_SCREEN_WIDTH-1) / width;
+	for (x = 0, fixedx = 0; x < width; x++, fixedx += scalex) {
+		blit_ln.x[x] = FIXED2INT(fixedx);
+		blit_ln.ex[x] = FRAC(fixedx);
+	}
+
+	blit_ln.width = width;
+}
+
+static void ln_scan(unsigned int y, uint32_t *out, uint32_t pal[256], unsigned int mouse_x, unsigned int mouse_y)
+{
+	uint32_t cv32backing[NATIVE_SCREEN_WIDTH];
 	uint32_t mouseline[80];
 	uint32_t mouseline_mask[80];
-	unsigned int mouseline_x, mouseline_v;
-	int iny, lasty;
+	int x;
+
+	make_mouseline(mouse_x / 8, mouse_x % 8, y, mouseline, mouseline_mask, mouse_y);
+	vgamem_scan32(y, cv32backing, pal, mouseline, mouseline_mask);
+
+	for (x = 0; x < blit_ln.width; x++)
+		out[x] = ln_mix(cv32backing[blit_ln.x[x]], cv32backing[blit_ln.x[x] + 1], blit_ln.ex[x]);
+}
+
+/* If map_rgb only ever puts each channel into its own byte, the output pixels
+ * can be put together here instead of calling it for every single one. */
+static int ln_byte_format(unsigned int bpp, schism_map_rgb_func_t map_rgb, void *map_rgb_data, uint32_t *base, unsigned int shift[3])
+{
+	static const uint8_t probe[3][3] = {{0xFF, 0, 0}, {0, 0xFF, 0}, {0, 0, 0xFF}};
+	int i;
+
+	if (bpp != 4)
+		return 0;
+
+	*base = map_rgb(map_rgb_data, 0, 0, 0);
+	for (i = 0; i < 3; i++) {
+		const uint32_t m = map_rgb(map_rgb_data, probe[i][0], probe[i][1], probe[i][2]) ^ *base;
+
+		for (shift[i] = 0; shift[i] <= 24 && m != (UINT32_C(0xFF) << shift[i]); shift[i]++);
+		if (shift[i] > 24)
+			return 0;
+	}
+
+	return map_rgb(map_rgb_data, 0x12, 0x34, 0x56)
+		== (*base | (UINT32_C(0x12) << shift[0]) | (UINT32_C(0x34) << shift[1]) | (UINT32_C(0x56) << shift[2]));
+}
+
+#ifdef SCHISM_HAVE_SSE2
+static SCHISM_TARGET_SSE2 void ln_mix_line_sse2(const uint32_t *l0, const uint32_t *l1, unsigned char *pixels, int width, uint32_t ey, uint32_t base, const unsigned int shift[3])
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w0 = _mm_set1_epi16(INT2FIXED(1) - ey);
+	const __m128i w1 = _mm_set1_epi16(ey);
+	const __m128i b = _mm_set1_epi32(base);
+	const __m128i ff = _mm_set1_epi32(0xFF);
+	const __m128i sr = _mm_cvtsi32_si128(shift[0]);
+	const __m128i sg = _mm_cvtsi32_si128(shift[1]);
+	const __m128i sb = _mm_cvtsi32_si128(shift[2]);
+	int x;
+
+	for (x = 0; x + 4 <= width; x += 4) {
+		const __m128i c0 = _mm_loadu_si128((const __m128i *)(l0 + x));
+		const __m128i c1 = _mm_loadu_si128((const __m128i *)(l1 + x));
+
+		/* 255 * 256 still fits in an unsigned 16-bit lane */
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c0, zero), w0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(c1, zero), w1));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c0, zero), w0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(c1, zero), w1));
+
+		lo = _mm_srli_epi16(lo, FIXED_BITS);
+		hi = _mm_srli_epi16(hi, FIXED_BITS);
+
+		const __m128i rgb = _mm_packus_epi16(lo, hi);
+		__m128i c = _mm_or_si128(b, _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(rgb, 16), ff), sr));
+		c = _mm_or_si128(c, _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(rgb, 8), ff), sg));
+		c = _mm_or_si128(c, _mm_sll_epi32(_mm_and_si128(rgb, ff), sb));
+
+		_mm_storeu_si128((__m128i *)(pixels + (x * 4)), c);
+	}
+
+	for (; x < width; x++) {
+		const uint32_t rgb = ln_mix(l0[x], l1[x], ey);
+		const uint32_t c = base | (((rgb >> 16) & 0xFF) << shift[0])
+			| (((rgb >> 8) & 0xFF) << shift[1]) | ((rgb & 0xFF) << shift[2]);
+		memcpy(pixels + (x * 4), &c, 4);
+	}
+}
+#endif
+
+void video_blitLN(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t pal[256], int width, int height, schism_map_rgb_func_t map_rgb, void *map_rgb_data)
+{
+	uint32_t *l0, *l1, *lt;
+	uint32_t base;
+	unsigned int shift[3];
+	int fixedy, scaley;
+	int y, x, ey, iny, lasty, bytes;
 
 	unsigned int mouse_x, mouse_y;
 	video_get_mouse_coordinates(&mouse_x, &mouse_y);
 
-	mouseline_x = (mouse_x / 8);
-	mouseline_v = (mouse_x % 8);
+	ln_setup(width);
+	bytes = ln_byte_format(bpp, map_rgb, map_rgb_data, &base, shift);
 
-	csp = (uint32_t *)cv32backing;
-	esp = csp + NATIVE_SCREEN_WIDTH;
+	l0 = blit_ln.lines;
+	l1 = blit_ln.lines + width;
 	lasty = -2;
-	iny = 0;
-	pad = pitch - (width * bpp);
-	scalex = INT2FIXED(NATIVE_SCREEN_WIDTH-1) / width;
 	scaley = INT2FIXED(NATIVE_SCREEN_HEIGHT-1) / height;
-	for (y = 0, fixedy = 0; (y < height); y++, fixedy += scaley) {
+	for (y = 0, fixedy = 0; y < height; y++, fixedy += scaley) {
 		iny = FIXED2INT(fixedy);
 		if (iny != lasty) {
-			make_mouseline(mouseline_x, mouseline_v, iny, mouseline, mouseline_mask, mouse_y);
-
-			/* we'll downblit the colors later */
 			if (iny == lasty + 1) {
 				/* move up one line */
-				vgamem_scan32(iny+1, csp, pal, mouseline, mouseline_mask);
-				dp = esp; esp = csp; csp=dp;
+				lt = l0; l0 = l1; l1 = lt;
+				ln_scan(iny + 1, l1, pal, mouse_x, mouse_y);
 			} else {
-				vgamem_scan32(iny, (csp = (uint32_t *)cv32backing), pal, mouseline, mouseline_mask);
-				vgamem_scan32(iny+1, (esp = (csp + NATIVE_SCREEN_WIDTH)), pal, mouseline, mouseline_mask);
+				ln_scan(iny, l0, pal, mouse_x, mouse_y);
+				ln_scan(iny + 1, l1, pal, mouse_x, mouse_y);
 			}
 			lasty = iny;
 		}
-		for (x = 0, fixedx = 0; x < width; x++, fixedx += scalex) {
-			ex = FRAC(fixedx);
-			ey = FRAC(fixedy);
-
-			c00 = csp[FIXED2INT(fixedx)];
-			c01 = csp[FIXED2INT(fixedx) + 1];
-			c10 = esp[FIXED2INT(fixedx)];
-			c11 = esp[FIXED2INT(fixedx) + 1];
-
-#if FIXED_BITS <= 8
-			/* When there are enough bits between blue and
-			 * red, do the RB channels together
-			 * See http://www.virtualdub.org/blog/pivot/entry.php?id=117
-			 * for a quick explanation */
-#define REDBLUE(Q) ((Q) & 0x00FF00FF)
-#define GREEN(Q) ((Q) & 0x0000FF00)
-			t1 = REDBLUE((((REDBLUE(c01)-REDBLUE(c00))*ex) >> FIXED_BITS)+REDBLUE(c00));
-			t2 = REDBLUE((((REDBLUE(c11)-REDBLUE(c10))*ex) >> FIXED_BITS)+REDBLUE(c10));
-			outb = ((((t2-t1)*ey) >> FIXED_BITS) + t1);
-
-			t1 = GREEN((((GREEN(c01)-GREEN(c00))*ex) >> FIXED_BITS)+GREEN(c00));
-			t2 = GREEN((((GREEN(c11)-GREEN(c10))*ex) >> FIXED_BITS)+GREEN(c10));
-			outg = (((((t2-t1)*ey) >> FIXED_BITS) + t1) >> 8) & 0xFF;
-
-			outr = (outb >> 16) & 0xFF;
-			outb &= 0xFF;
-#undef REDBLUE
-#undef GREEN
-#else
-#define BLUE(Q) (Q & 255)
-#define GREEN(Q) ((Q >> 8) & 255)
-#define RED(Q) ((Q >> 16) & 255)
-			t1 = ((((BLUE(c01)-BLUE(c00))*ex) >> FIXED_BITS)+BLUE(c00)) & 0xFF;
-			t2 = ((((BLUE(c11)-BLUE(c10))*ex) >> FIXED_BITS)+BLUE(c10)) & 0xFF;
-			outb = ((((t2-t1)*ey) >> FIXED_BITS) + t1);
-
-			t1 = ((((GREEN(c01)-GREEN(c00))*ex) >> FIXED_BITS)+GREEN(c00)) & 0xFF;
-			t2 = ((((GREEN(c11)-GREEN(c10))*ex) >> FIXED_BITS)+GREEN(c10)) & 0xFF;
-			outg = ((((t2-t1)*ey) >> FIXED_BITS) + t1);
-
-			t1 = ((((RED(c01)-RED(c00))*ex) >> FIXED_BITS)+RED(c00)) & 0xFF;
-			t2 = ((((RED(c11)-RED(c10))*ex) >> FIXED_BITS)+RED(c10)) & 0xFF;
-			outr = ((((t2-t1)*ey) >> FIXED_BITS) + t1);
-#undef RED
-#undef GREEN
-#undef BLUE
+
+		ey = FRAC(fixedy);
+
+#ifdef SCHISM_HAVE_SSE2
+		if (bytes && cpu_has_feature(CPU_FEATURE_SSE2)) {
+			ln_mix_line_sse2(l0, l1, pixels, width, ey, base, shift);
+			pixels += pitch;
+			continue;
+		}
 #endif
 
-			uint32_t c = map_rgb(map_rgb_data, outr, outg, outb);
+		for (x = 0; x < width; x++) {
+			const uint32_t rgb = ln_mix(l0[x], l1[x], ey);
+			const uint8_t outr = (rgb >> 16) & 0xFF, outg = (rgb >> 8) & 0xFF, outb = rgb & 0xFF;
+			uint32_t c;
+
+			c = (bytes)
+				? (base | ((uint32_t)outr << shift[0]) | ((uint32_t)outg << shift[1]) | ((uint32_t)outb << shift[2]))
+				: map_rgb(map_rgb_data, outr, outg, outb);
 
 			/* write the output pixel */
 #if WORDS_BIGENDIAN
-			memcpy(pixels, ((unsigned char *)&c) + (4 - bpp), bpp);
+			memcpy(pixels + (x * bpp), ((unsigned char *)&c) + (4 - bpp), bpp);
 #else
-			memcpy(pixels, &c, bpp);
+			memcpy(pixels + (x * bpp), &c, bpp);
 #endif
-			pixels += bpp;
 		}
-		pixels += pad;
+
+		pixels += pitch;
 	}
 }
 
 /* Nearest neighbor blitter */
+static void nn_setup(unsigned int bpp, int width)
+{
+	int x;
+
+	if (blit_nn.width == width && blit_nn.bpp == bpp)
+		return;
+
+	blit_nn.x = mem_realloc(blit_nn.x, width * sizeof(*blit_nn.x));
+	blit_nn.line = mem_realloc(blit_nn.line, width * bpp);
+
+	for (x = 0; x < width; x++)
+		blit_nn.x[x] = x * NATIVE_SCREEN_WIDTH / width;
+
+	blit_nn.width = width;
+	blit_nn.bpp = bpp;
+}
+
 void video_blitNN(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256], int width, int height)
 {
 	// at most 32-bits...
@@ -400,51 +507,60 @@ void video_blitNN(unsigned int bpp, unsigned char *pixels, unsigned int pitch, u
 	unsigned int mouseline_v = (mouse_x % 8);
 	uint32_t mouseline[80];
 	uint32_t mouseline_mask[80];
-	int x, a, y, last_scaled_y;
-	int pad = pitch - (width * bpp);
+	int x, y, last_scaled_y;
+
+	nn_setup(bpp, width);
 
 	for (y = 0; y < height; y++) {
 		int scaled_y = (y * NATIVE_SCREEN_HEIGHT / height);
 
-		// only scan again if we have to or if this the first scan
+		// only scale again if we have to or if this the first scan;
+		// otherwise the line is the same as the one before it
 		if (scaled_y != last_scaled_y || y == 0) {
 			make_mouseline(mouseline_x, mouseline_v, scaled_y, mouseline, mouseline_mask, mouse_y);
 			switch (bpp) {
 			case 1:
 				vgamem_scan8(scaled_y, (uint8_t *)pixels_u, tpal, mouseline, mouseline_mask);
+				for (x = 0; x < width; x++)
+					blit_nn.line[x] = pixels_u[blit_nn.x[x]];
 				break;
-			case 2:
+			case 2: {
+				uint16_t *line = (uint16_t *)blit_nn.line;
+
 				vgamem_scan16(scaled_y, (uint16_t *)pixels_u, tpal, mouseline, mouseline_mask);
+				for (x = 0; x < width; x++)
+					line[x] = ((uint16_t *)pixels_u)[blit_nn.x[x]];
 				break;
+			}
 			case 3:
 				vgamem_scan32(scaled_y, (uint32_t *)pixels_u, tpal, mouseline, mouseline_mask);
-				for (x = 0; x < NATIVE_SCREEN_WIDTH; x++) {
-					/* move these into place */
+				for (x = 0; x < width; x++) {
 #if WORDS_BIGENDIAN
-					memmove(pixels_u + (x * 3), (pixels_u + (x * 4)) + 1, 3);
+					memcpy(blit_nn.line + (x * 3), (pixels_u + (blit_nn.x[x] * 4)) + 1, 3);
 #else
-					memmove(pixels_u + (x * 3), pixels_u + (x * 4), 3);
+					memcpy(blit_nn.line + (x * 3), pixels_u + (blit_nn.x[x] * 4), 3);
 #endif
 				}
 				break;
-			case 4:
+			case 4: {
+				uint32_t *line = (uint32_t *)blit_nn.line;
+
 				vgamem_scan32(scaled_y, (uint32_t *)pixels_u, tpal, mouseline, mouseline_mask);
+				for (x = 0; x < width; x++)
+					line[x] = ((uint32_t *)pixels_u)[blit_nn.x[x]];
 				break;
+			}
 			default:
 				// should never happen
 				break;
 			}
 		}
 
-		for (x = 0; x < width; x++) {
-			memcpy(pixels, pixels_u + ((x * NATIVE_SCREEN_WIDTH / width) * bpp), bpp);
-
-			pixels += bpp;
-		}
+		memcpy(pixels, blit_nn.line, width * bpp);
 
 		last_scaled_y = scaled_y;
 
-		pixels += pad;
+		pixels += pitch;
 	}
 }
 
@@ -491,6 +607,25 @@ void video_blitUV(unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
 	}
 }
 
+#ifdef SCHISM_HAVE_SSE2
+/* packs 16 pixels at a time into 8 bytes, same as the loop in video_blitTV */
+static SCHISM_TARGET_SSE2 unsigned int tv_pack_sse2(const unsigned char *in, unsigned char *out, unsigned int len)
+{
+	const __m128i lomask = _mm_set1_epi16(0x00FF);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= len; x += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(in + x));
+		const __m128i p = _mm_and_si128(_mm_or_si128(_mm_srli_epi16(v, 8),
+			_mm_slli_epi16(_mm_and_si128(v, lomask), 4)), lomask);
+
+		_mm_storel_epi64((__m128i *)(out + (x / 2)), _mm_packus_epi16(p, p));
+	}
+
+	return x;
+}
+#endif
+
 void video_blitTV(unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
 {
 	unsigned int mouse_x, mouse_y;
@@ -506,12 +641,19 @@ void video_blitTV(unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
 	for (y = 0; y < NATIVE_SCREEN_HEIGHT; y += 2) {
 		make_mouseline(mouseline_x, mouseline_v, y, mouseline, mouseline_mask, mouse_y);
 		vgamem_scan8(y, cv8backing, tpal, mouseline, mouseline_mask);
-		for (x = 0; x < pitch; x += 2)
+		x = 0;
+#ifdef SCHISM_HAVE_SSE2
+		if (cpu_has_feature(CPU_FEATURE_SSE2)) {
+			x = tv_pack_sse2(cv8backing, pixels, pitch);
+			pixels += x / 2;
+		}
+#endif
+		for (; x < pitch; x += 2)
 			*pixels++ = cv8backing[x+1] | (cv8backing[x] << 4);
 	}
 }
 
-void video_blit11(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
+static void _blit11(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256], int dirty_only)
 {
 	uint32_t cv32backing[NATIVE_SCREEN_WIDTH];
 
@@ -534,6 +676,11 @@ void video_blit11(unsigned int bpp, unsigned char *pixels, unsigned int pitch, u
 	}
 
 	for (y = 0; y < NATIVE_SCREEN_HEIGHT; y++) {
+		if (dirty_only && !vgamem_line_dirty(y)) {
+			pixels += pitch;
+			continue;
+		}
+
 		make_mouseline(mouseline_x, mouseline_v, y, mouseline, mouseline_mask, mouse_y);
 		switch (bpp) {
 		case 1:
@@ -564,6 +711,18 @@ void video_blit11(unsigned int bpp, unsigned char *pixels, unsigned int pitch, u
 	}
 }
 
+void video_blit11(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
+{
+	_blit11(bpp, pixels, pitch, tpal, 0);
+}
+
+/* only rewrites the lines that changed since the last video_blit, so the
+ * pixels have to still be there from last time */
+void video_blit11_dirty(unsigned int bpp, unsigned char *pixels, unsigned int pitch, uint32_t tpal[256])
+{
+	_blit11(bpp, pixels, pitch, tpal, 1);
+}
+
 // ----------------------------------------------------------------------------------
 
 int video_is_fullscreen(void)
@@ -598,6 +757,7 @@ void video_report(void)
 
 void video_set_hardware(int hardware)
 {
+	vgamem_invalidate();
 	backend->set_hardware(hardware);
 }
 
@@ -612,6 +772,7 @@ void video_shutdown(void)
 
 void video_setup(const char *quality)
 {
+	vgamem_invalidate();
 	backend->setup(quality);
 }
 
@@ -649,16 +810,19 @@ int video_startup(void)
 
 void video_fullscreen(int new_fs_flag)
 {
+	vgamem_invalidate();
 	backend->fullscreen(new_fs_flag);
 }
 
 void video_resize(unsigned int width, unsigned int height)
 {
+	vgamem_invalidate();
 	backend->resize(width, height);
 }
 
 void video_colors(unsigned char palette[16][3])
 {
+	vgamem_invalidate();
 	backend->colors(palette);
 }
 
@@ -748,9 +912,43 @@ void video_toggle_menu(int on)
 
 /* ------------------------------------------------------------ */
 
+/* the software cursor isn't in vgamem, so the lines it's on (and was on) are
+ * dirty whenever it moves */
+static void video_mouse_dirty(void)
+{
+	static struct {
+		int visible;
+		unsigned int x, y, shape;
+	} last = {0};
+	struct mouse_cursor *cursor = &cursors[video.mouse.shape];
+	unsigned int mouse_x, mouse_y;
+	int visible;
+
+	video_get_mouse_coordinates(&mouse_x, &mouse_y);
+	visible = (video_mousecursor_visible() == MOUSE_EMULATED && video_is_focused());
+
+	if (visible == last.visible && (!visible || (mouse_x == last.x
+			&& mouse_y == last.y && video.mouse.shape == last.shape)))
+		return;
+
+	if (last.visible) {
+		struct mouse_cursor *was = &cursors[last.shape];
+		vgamem_mark_dirty(last.y - MIN(last.y, was->center_y), last.y + was->height);
+	}
+	if (visible)
+		vgamem_mark_dirty(mouse_y - MIN(mouse_y, cursor->center_y), mouse_y + cursor->height);
+
+	last.visible = visible;
+	last.x = mouse_x;
+	last.y = mouse_y;
+	last.shape = video.mouse.shape;
+}
+
 void video_blit(void)
 {
+	video_mouse_dirty();
 	backend->blit();
+	vgamem_clean();
 }
 
 /* ------------------------------------------------------------ */
@@ -236,7 +236,7 @@ static int sdl2_controller_sdlevent(SDL_Event *event)
 				sym = SDLK_ESCAPE;
 				break;
 			} else if (event->cbutton.state == SDL_PRESSED && song_get_mode() == MODE_PLAYING) {
-				song_set_current_order(song_get_current_order() - 1);
+				song_adjust_current_order(-1);
 			}
 			return 0;
 		case SDL_CONTROLLER_BUTTON_START:
@@ -245,7 +245,7 @@ static int sdl2_controller_sdlevent(SDL_Event *event)
 				sym = SDLK_RETURN;
 				break;
 			} else if (event->cbutton.state == SDL_PRESSED && song_get_mode() == MODE_PLAYING) {
-				song_set_current_order(song_get_current_order() + 1);
+				song_adjust_current_order(1);
 			}
 			return 0;
 		case SDL_CONTROLLER_BUTTON_GUIDE:
@@ -32,6 +32,9 @@ static void (SDLCALL *sdl2_QuitSubSystem)(Uint32 flags) = NULL;
 static void (SDLCALL *sdl2_Delay)(uint32_t ms) = NULL;
 static uint32_t (SDLCALL *sdl2_GetTicks)(void) = NULL;
 
+static uint64_t (SDLCALL *sdl2_GetPerformanceCounter)(void) = NULL;
+static uint64_t (SDLCALL *sdl2_GetPerformanceFrequency)(void) = NULL;
+
 // Introduced in SDL 2.0.18
 static uint64_t (SDLCALL *sdl2_GetTicks64)(void) = NULL;
 
@@ -57,6 +60,18 @@ static int sdl2_timer_ticks_passed(schism_ticks_t a, schism_ticks_t b)
 	return ((int32_t)(b - a) <= 0);
 }
 
+static uint64_t sdl2_timer_ticks_us(void)
+{
+	static uint64_t freq = 0;
+	uint64_t t = sdl2_GetPerformanceCounter();
+
+	if (!freq)
+		freq = sdl2_GetPerformanceFrequency();
+
+	// split it up so that this doesn't overflow
+	return (t / freq) * 1000000 + (t % freq) * 1000000 / freq;
+}
+
 static void sdl2_timer_delay(uint32_t ms)
 {
 	sdl2_Delay(ms);
@@ -71,6 +86,8 @@ static int sdl2_timer_load_syms(void)
 
 	SCHISM_SDL2_SYM(GetTicks);
 	SCHISM_SDL2_SYM(Delay);
+	SCHISM_SDL2_SYM(GetPerformanceCounter);
+	SCHISM_SDL2_SYM(GetPerformanceFrequency);
 
 	return 0;
 }
@@ -119,4 +136,5 @@ const schism_timer_backend_t schism_timer_backend_sdl2 = {
 	.ticks = sdl2_timer_ticks,
 	.ticks_passed = sdl2_timer_ticks_passed,
 	.delay = sdl2_timer_delay,
+	.ticks_us = sdl2_timer_ticks_us,
 };
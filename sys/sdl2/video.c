@@ -82,6 +82,7 @@ static void (SDLCALL *sdl2_GetWindowSize)(SDL_Window * window, int *w, int *h);
 static void (SDLCALL *sdl2_SetWindowSize)(SDL_Window * window, int w, int h);
 static int (SDLCALL *sdl2_RenderClear)(SDL_Renderer * renderer);
 static int (SDLCALL *sdl2_LockTexture)(SDL_Texture * texture, const SDL_Rect * rect, void **pixels, int *pitch);
+static int (SDLCALL *sdl2_UpdateTexture)(SDL_Texture * texture, const SDL_Rect * rect, const void *pixels, int pitch);
 static void (SDLCALL *sdl2_UnlockTexture)(SDL_Texture * texture);
 static int (SDLCALL *sdl2_RenderCopy)(SDL_Renderer * renderer, SDL_Texture * texture, const SDL_Rect * srcrect, const SDL_Rect * dstrect);
 static void (SDLCALL *sdl2_RenderPresent)(SDL_Renderer * renderer);
@@ -133,6 +134,9 @@ static struct {
 	} yuv;
 
 	uint32_t pal[256];
+
+	/* what's in the texture, so only the lines that changed need redoing */
+	unsigned char framebuf[NATIVE_SCREEN_WIDTH * NATIVE_SCREEN_HEIGHT * 4];
 } video = {0};
 
 // Native formats, in order of preference.
@@ -304,6 +308,8 @@ got_format:
 
 	default: video.bpp = video.pixel_format->BytesPerPixel; break;
 	}
+
+	vgamem_invalidate();
 }
 
 static void sdl2_video_set_hardware(int hardware)
@@ -627,37 +633,57 @@ static void sdl2_video_blit(void)
 		};
 	}
 
-	sdl2_RenderClear(video.renderer);
-
-	// regular format blitter
 	unsigned char *pixels;
 	int pitch;
 
-	sdl2_LockTexture(video.texture, NULL, (void **)&pixels, &pitch);
-
 	switch (video.format) {
 	case SDL_PIXELFORMAT_IYUV: {
+		sdl2_LockTexture(video.texture, NULL, (void **)&pixels, &pitch);
 		video_blitUV(pixels, pitch, video.yuv.pal_y);
 		pixels += (NATIVE_SCREEN_HEIGHT * pitch);
 		video_blitTV(pixels, pitch, video.yuv.pal_u);
 		pixels += (NATIVE_SCREEN_HEIGHT * pitch) / 4;
 		video_blitTV(pixels, pitch, video.yuv.pal_v);
+		sdl2_UnlockTexture(video.texture);
 		break;
 	}
 	case SDL_PIXELFORMAT_YV12: {
+		sdl2_LockTexture(video.texture, NULL, (void **)&pixels, &pitch);
 		video_blitUV(pixels, pitch, video.yuv.pal_y);
 		pixels += (NATIVE_SCREEN_HEIGHT * pitch);
 		video_blitTV(pixels, pitch, video.yuv.pal_v);
 		pixels += (NATIVE_SCREEN_HEIGHT * pitch) / 4;
 		video_blitTV(pixels, pitch, video.yuv.pal_u);
+		sdl2_UnlockTexture(video.texture);
 		break;
 	}
 	default: {
-		video_blit11(video.bpp, pixels, pitch, video.pal);
+		// regular format blitter; only send what changed
+		uint32_t y = 0, ye;
+		int any = 0;
+
+		pitch = NATIVE_SCREEN_WIDTH * video.bpp;
+		video_blit11_dirty(video.bpp, video.framebuf, pitch, video.pal);
+		for (; vgamem_dirty_run(&y, &ye); y = ye) {
+			SDL_Rect rect = {
+				.x = 0,
+				.y = y,
+				.w = NATIVE_SCREEN_WIDTH,
+				.h = ye - y,
+			};
+
+			sdl2_UpdateTexture(video.texture, &rect, video.framebuf + (y * pitch), pitch);
+			any = 1;
+		}
+
+		// nothing moved, so what's on the screen is still good
+		if (!any)
+			return;
 		break;
 	}
 	}
-	sdl2_UnlockTexture(video.texture);
+
+	sdl2_RenderClear(video.renderer);
 	sdl2_RenderCopy(video.renderer, video.texture, NULL, (cfg_video_want_fixed) ? &dstrect : NULL);
 	sdl2_RenderPresent(video.renderer);
 }
@@ -749,6 +775,7 @@ static int sdl2_video_load_syms(void)
 	SCHISM_SDL2_SYM(SetWindowSize);
 	SCHISM_SDL2_SYM(RenderClear);
 	SCHISM_SDL2_SYM(LockTexture);
+	SCHISM_SDL2_SYM(UpdateTexture);
 	SCHISM_SDL2_SYM(UnlockTexture);
 	SCHISM_SDL2_SYM(RenderCopy);
 	SCHISM_SDL2_SYM(RenderPresent);